@@ -0,0 +1,38 @@
+# This file is used with the GYP meta build system.
+# http://code.google.com/p/gyp/
+{
+  'targets': [
+    {
+      'target_name': 'libdrizzle',
+      'type': 'static_library',
+      'include_dirs': [ '.' ],
+      'direct_dependent_settings': {
+        'include_dirs': [ '.' ],
+      },
+      'sources': [
+        'libdrizzle/drizzle.c',
+        'libdrizzle/conn.c',
+        'libdrizzle/conn_uds.c',
+        'libdrizzle/handshake.c',
+        'libdrizzle/command.c',
+        'libdrizzle/query.c',
+        'libdrizzle/result.c',
+        'libdrizzle/column.c',
+        'libdrizzle/row.c',
+        'libdrizzle/field.c',
+        'libdrizzle/pack.c',
+        'libdrizzle/state.c',
+        'libdrizzle/sha1.c',
+      ],
+      'conditions': [
+        ['OS=="win"', {
+          'include_dirs': [ 'win32' ],
+          'sources': [ 'win32/poll.c' ],
+        }, {
+          'include_dirs': [ 'unix' ],
+          'cflags': [ '-std=gnu99', '-fPIC' ],
+        }],
+      ],
+    },
+  ],
+}
@@ -156,7 +156,9 @@ drizzle_return_t drizzle_state_handshake_server_read(drizzle_con_st *con)
     return DRIZZLE_RETURN_PROTOCOL_NOT_SUPPORTED;
   }
 
-  con->charset= con->buffer_ptr[0];
+  /* Keep a charset the client asked for before connecting. */
+  if (con->charset == 0)
+    con->charset= con->buffer_ptr[0];
   con->buffer_ptr+= 1;
 
   con->status= drizzle_get_byte2(con->buffer_ptr);
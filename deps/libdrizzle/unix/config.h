@@ -0,0 +1,22 @@
+#ifndef __DRIZZLE_UNIX_CONFIG_H
+#define __DRIZZLE_UNIX_CONFIG_H
+
+/* Hand-written stand-in for the autoconf result, used by the gyp build. */
+
+#define HAVE_ASSERT_H 1
+#define HAVE_ERRNO_H 1
+#define HAVE_FCNTL_H 1
+#define HAVE_NETINET_TCP_H 1
+#define HAVE_STDARG_H 1
+#define HAVE_STDIO_H 1
+#define HAVE_STDLIB_H 1
+#define HAVE_STRING_H 1
+#define HAVE_SYS_UIO_H 1
+#define HAVE_UNISTD_H 1
+
+#define PACKAGE_VERSION "0.8"
+#define PACKAGE_BUGREPORT "https://launchpad.net/libdrizzle"
+
+#include <stdbool.h>
+
+#endif /* __DRIZZLE_UNIX_CONFIG_H */
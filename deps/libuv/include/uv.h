@@ -432,6 +432,11 @@ int uv_tcp_bind6(uv_tcp_t* handle, struct sockaddr_in6);
 int uv_tcp_getsockname(uv_tcp_t* handle, struct sockaddr* name, int* namelen);
 int uv_tcp_getpeername(uv_tcp_t* handle, struct sockaddr* name, int* namelen);
 
+/*
+ * Opens an existing, connected socket as a TCP stream.
+ */
+int uv_tcp_open(uv_tcp_t* handle, uv_file sock);
+
 /*
  * uv_tcp_connect, uv_tcp_connect6
  * These functions establish IPv4 and IPv6 TCP connections. Provide an
@@ -102,6 +102,11 @@ int uv_tcp_bind6(uv_tcp_t* tcp, struct sockaddr_in6 addr) {
 }
 
 
+int uv_tcp_open(uv_tcp_t* tcp, uv_file sock) {
+  return uv__stream_open((uv_stream_t*)tcp, sock, UV_READABLE | UV_WRITABLE);
+}
+
+
 int uv_tcp_getsockname(uv_tcp_t* handle, struct sockaddr* name,
     int* namelen) {
   socklen_t socklen;
@@ -230,6 +230,12 @@ int uv_tcp_bind6(uv_tcp_t* handle, struct sockaddr_in6 addr) {
 }
 
 
+int uv_tcp_open(uv_tcp_t* handle, uv_file sock) {
+  uv_set_error(handle->loop, UV_ENOTSUP, 0);
+  return -1;
+}
+
+
 static void uv_tcp_queue_accept(uv_tcp_t* handle, uv_tcp_accept_t* req) {
   uv_loop_t* loop = handle->loop;
   BOOL success;
@@ -1 +0,0 @@
-call tools\gyp\gyp.bat phode.gyp -I common.gypi -Dlibrary=static_library --depth=.
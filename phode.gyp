@@ -19,6 +19,7 @@
       'dependencies': [
         'deps/http_parser/http_parser.gyp:http_parser',
         'deps/libuv/uv.gyp:uv',
+        'deps/libdrizzle/libdrizzle.gyp:libdrizzle',
       ],
 
       'include_dirs': [
@@ -31,24 +32,18 @@
       ],
 
       'sources': [
+        'src/dns.c',
         'src/ext.c',
+        'src/http.c',
+        'src/ipc.c',
+        'src/mysql.c',
+        'src/mysql_server.c',
+        'src/pgsql.c',
+        'src/phode.h',
         'test.php',
-        'gen.bat',
       ],
 
       'conditions': [
-        [ 'OS=="win"', {
-            'defines': [ 
-              'ZEND_WIN32=1',
-              'PHP_WIN32=1',
-              'ZEND_WIN32=1',
-              'PHP_WIN32=1',
-            ],
-            'libraries': [ 
-              # TODO: move to local.gypi
-              '-l../php/Debug_TS/php5ts_debug.lib' 
-            ]
-        }],
         [ 'OS=="linux" or OS=="freebsd" or OS=="openbsd" or OS=="solaris"', {
           'cflags': [
             '-std=c99',
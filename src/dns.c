@@ -0,0 +1,596 @@
+/*
+ * Copyright (c) 2011, Ben Noordhuis <info@bnoordhuis.nl>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/* Host name lookups through c-ares on the loop, so nothing blocks in */
+/* getaddrinfo(). Answers are kept per loop for as long as their TTL */
+/* says; names that don't exist are remembered for as long as their */
+/* zone's SOA record allows. Lookups for a name that is already being */
+/* looked up wait for that. */
+
+#include "phode.h"
+
+#include <arpa/inet.h>
+#include <arpa/nameser.h> /* C_IN, T_A, T_AAAA, T_SOA */
+#include <netdb.h>
+#include <string.h>
+
+
+/* TTLs are kept within these bounds, in seconds */
+#define DNS_MIN_TTL 1
+#define DNS_MAX_TTL 3600
+
+/* Names that don't exist, when the answer has no SOA to go by. */
+/* Failures like timeouts aren't remembered. */
+#define DNS_NEGATIVE_TTL 10
+
+/* /etc/hosts has no TTL; it's read again after this long */
+#define DNS_HOSTS_TTL 60
+
+#define DNS_CACHE_MAX 4096
+
+/* Addresses looked at per answer */
+#define DNS_MAX_ADDRS 16
+
+#define DNS_GET16(p) (((unsigned) (p)[0] << 8) | (p)[1])
+#define DNS_GET32(p) ((DNS_GET16(p) << 16) | DNS_GET16((p) + 2))
+
+
+typedef struct dns_waiter_s {
+  struct dns_waiter_s* next;
+  dns_cb cb;
+  void* data;
+  /* For cache hits, the answer to deliver */
+  dns_addr_t addr;
+  int status;
+} dns_waiter_t;
+
+
+typedef struct dns_entry_s {
+  struct dns_cache_s* cache;
+  /* Most recently used first */
+  struct dns_entry_s* prev;
+  struct dns_entry_s* next;
+  char* host;
+  uint host_len;
+  dns_addr_t addr;
+  /* ARES_SUCCESS, or why there is no address */
+  int status;
+  ev_tstamp expires;
+  /* Waiting for the lookup in progress */
+  dns_waiter_t* waiters;
+  unsigned pending:1;
+  /* No A records; on to AAAA */
+  unsigned aaaa:1;
+} dns_entry_t;
+
+
+struct dns_cache_s {
+  loop_wrap_t* loop;
+  ares_channel channel;
+  unsigned channel_init:1;
+  /* Host name to dns_entry_t* */
+  HashTable entries;
+  dns_entry_t* head;
+  dns_entry_t* tail;
+  /* Hits are called back from the loop, like any other answer. */
+  ev_timer timer;
+  dns_waiter_t* hits_head;
+  dns_waiter_t* hits_tail;
+};
+
+
+static void dns_timer_cb(struct ev_loop* ev, ev_timer* timer, int revents);
+
+
+static void dns_entry_free(void* p) {
+  dns_entry_t* entry = *(dns_entry_t**) p;
+
+  assert(entry->waiters == NULL);
+
+  efree(entry->host);
+  efree(entry);
+}
+
+
+static dns_cache_t* dns_cache_get(uv_loop_t* loop TSRMLS_DC) {
+  loop_wrap_t* wrap = loop_wrap_get(loop TSRMLS_CC);
+  dns_cache_t* cache = wrap->dns_cache;
+
+  if (cache == NULL) {
+    cache = (dns_cache_t*) ecalloc(1, sizeof *cache);
+    cache->loop = wrap;
+    zend_hash_init(&cache->entries, 64, NULL, dns_entry_free, 0);
+    ev_init(&cache->timer, dns_timer_cb);
+    wrap->dns_cache = cache;
+  }
+
+  return cache;
+}
+
+
+/* Parses an IPv4 or IPv6 address, the latter with or without [ ]. */
+int dns_parse_ip(const char* host, dns_addr_t* addr) {
+  char buf[INET6_ADDRSTRLEN + 2];
+  size_t len = strlen(host);
+
+  if (inet_pton(AF_INET, host, &addr->v4) == 1) {
+    addr->family = AF_INET;
+    return 0;
+  }
+
+  if (len >= 2 && host[0] == '[' && host[len - 1] == ']' && len - 2 < sizeof(buf)) {
+    memcpy(buf, host + 1, len - 2);
+    buf[len - 2] = '\0';
+    host = buf;
+  }
+
+  if (inet_pton(AF_INET6, host, &addr->v6) == 1) {
+    addr->family = AF_INET6;
+    return 0;
+  }
+
+  return -1;
+}
+
+
+static void dns_hit_push(dns_cache_t* cache, dns_waiter_t* hit) {
+  hit->next = NULL;
+
+  if (cache->hits_tail) {
+    cache->hits_tail->next = hit;
+  } else {
+    cache->hits_head = hit;
+  }
+  cache->hits_tail = hit;
+
+  if (!ev_is_active(&cache->timer)) {
+    ev_timer_set(&cache->timer, 0, 0);
+    ev_timer_start(cache->loop->loop->ev, &cache->timer);
+  }
+}
+
+
+/* Passes the entry's answer on to everyone waiting for it. Answers */
+/* always arrive from the loop, even the ones c-ares or the hosts file */
+/* come up with right away. ARES_EDESTRUCTION means the loop is going */
+/* away: waiters free their data without calling into php. */
+static void dns_entry_done(dns_entry_t* entry) {
+  dns_waiter_t* waiter;
+  dns_waiter_t* next;
+  TSRMLS_D_GET(entry->cache->loop);
+
+  waiter = entry->waiters;
+  entry->waiters = NULL;
+  entry->pending = 0;
+
+  for (; waiter; waiter = next) {
+    next = waiter->next;
+
+    if (entry->status == ARES_EDESTRUCTION) {
+      waiter->cb(waiter->data, NULL, NULL TSRMLS_CC);
+      efree(waiter);
+      continue;
+    }
+
+    waiter->addr = entry->addr;
+    waiter->status = entry->status;
+    dns_hit_push(entry->cache, waiter);
+  }
+}
+
+
+/* ttl is -1 for a negative answer without an SOA record */
+static void dns_entry_answer(dns_entry_t* entry, int status, int ttl) {
+  ev_tstamp now = ev_now(entry->cache->loop->loop->ev);
+
+  entry->status = status;
+
+  if (status == ARES_SUCCESS || status == ARES_ENOTFOUND || status == ARES_ENODATA) {
+    if (status != ARES_SUCCESS && ttl < 0) {
+      ttl = DNS_NEGATIVE_TTL;
+    } else if (ttl < DNS_MIN_TTL) {
+      ttl = DNS_MIN_TTL;
+    } else if (ttl > DNS_MAX_TTL) {
+      ttl = DNS_MAX_TTL;
+    }
+    entry->expires = now + ttl;
+  } else {
+    /* Ask again next time */
+    entry->expires = 0;
+  }
+
+  dns_entry_done(entry);
+}
+
+
+static int dns_skip_name(const unsigned char* abuf, int alen, const unsigned char** p) {
+  char* name;
+  long len;
+
+  if (*p >= abuf + alen ||
+      ares_expand_name(*p, abuf, alen, &name, &len) != ARES_SUCCESS) {
+    return -1;
+  }
+
+  ares_free_string(name);
+  *p += len;
+  return 0;
+}
+
+
+/* How long a negative answer holds: the lesser of the SOA record's own */
+/* TTL and its MINIMUM field (RFC 2308). The SOA comes in the authority */
+/* section; -1 if there isn't one. */
+static int dns_negative_ttl(const unsigned char* abuf, int alen) {
+  const unsigned char* end = abuf + alen;
+  const unsigned char* p;
+  const unsigned char* rdata;
+  unsigned long ttl;
+  unsigned long minimum;
+  unsigned rdlen;
+  unsigned count;
+  unsigned i;
+
+  if (abuf == NULL || alen < HFIXEDSZ) {
+    return -1;
+  }
+
+  p = abuf + HFIXEDSZ;
+
+  for (i = DNS_GET16(abuf + 4); i > 0; i--) {
+    if (dns_skip_name(abuf, alen, &p) || end - p < QFIXEDSZ) {
+      return -1;
+    }
+    p += QFIXEDSZ;
+  }
+
+  /* Answers, then authority records */
+  count = DNS_GET16(abuf + 6) + DNS_GET16(abuf + 8);
+
+  for (i = 0; i < count; i++) {
+    if (dns_skip_name(abuf, alen, &p) || end - p < RRFIXEDSZ) {
+      return -1;
+    }
+
+    ttl = DNS_GET32(p + 4);
+    rdlen = DNS_GET16(p + 8);
+    rdata = p + RRFIXEDSZ;
+
+    if ((unsigned) (end - rdata) < rdlen) {
+      return -1;
+    }
+
+    if (DNS_GET16(p) == T_SOA) {
+      /* MNAME and RNAME, then five 32-bit fields; MINIMUM is last */
+      p = rdata;
+      if (dns_skip_name(abuf, alen, &p) || dns_skip_name(abuf, alen, &p) ||
+          p + 20 > rdata + rdlen) {
+        return -1;
+      }
+      minimum = DNS_GET32(p + 16);
+      if (minimum < ttl) {
+        ttl = minimum;
+      }
+      return ttl > DNS_MAX_TTL ? DNS_MAX_TTL : (int) ttl;
+    }
+
+    p = rdata + rdlen;
+  }
+
+  return -1;
+}
+
+
+static void dns_query(dns_entry_t* entry, int type);
+
+
+static void dns_query_cb(void* arg, int status, int timeouts, unsigned char* abuf, int alen) {
+  dns_entry_t* entry = (dns_entry_t*) arg;
+  struct ares_addrttl ttls[DNS_MAX_ADDRS];
+  struct ares_addr6ttl ttls6[DNS_MAX_ADDRS];
+  int count = DNS_MAX_ADDRS;
+  int ttl = 0;
+  int i;
+
+  if (status == ARES_SUCCESS && !entry->aaaa) {
+    status = ares_parse_a_reply(abuf, alen, NULL, ttls, &count);
+    if (status == ARES_SUCCESS && count > 0) {
+      entry->addr.family = AF_INET;
+      entry->addr.v4 = ttls[0].ipaddr;
+      ttl = ttls[0].ttl;
+      for (i = 1; i < count; i++) {
+        if (ttls[i].ttl < ttl) {
+          ttl = ttls[i].ttl;
+        }
+      }
+    } else if (status == ARES_SUCCESS) {
+      status = ARES_ENODATA;
+    }
+  } else if (status == ARES_SUCCESS) {
+    status = ares_parse_aaaa_reply(abuf, alen, NULL, ttls6, &count);
+    if (status == ARES_SUCCESS && count > 0) {
+      entry->addr.family = AF_INET6;
+      memcpy(&entry->addr.v6, &ttls6[0].ip6addr, sizeof(entry->addr.v6));
+      ttl = ttls6[0].ttl;
+      for (i = 1; i < count; i++) {
+        if (ttls6[i].ttl < ttl) {
+          ttl = ttls6[i].ttl;
+        }
+      }
+    } else if (status == ARES_SUCCESS) {
+      status = ARES_ENODATA;
+    }
+  }
+
+  /* IPv4 first, then IPv6 for names that only have that */
+  if (status == ARES_ENODATA && !entry->aaaa) {
+    entry->aaaa = 1;
+    dns_query(entry, T_AAAA);
+    return;
+  }
+
+  if (status == ARES_ENOTFOUND || status == ARES_ENODATA) {
+    ttl = dns_negative_ttl(abuf, alen);
+  }
+
+  dns_entry_answer(entry, status, ttl);
+}
+
+
+/* Names with a dot in them are asked for as they are, which is what */
+/* the resolver tries first anyway; that way negative answers come */
+/* with their SOA. ares_search() drops it, but goes through the search */
+/* domains that a bare name like "db" needs. */
+static void dns_query(dns_entry_t* entry, int type) {
+  if (strchr(entry->host, '.') != NULL) {
+    ares_query(entry->cache->channel, entry->host, C_IN, type, dns_query_cb, entry);
+  } else {
+    ares_search(entry->cache->channel, entry->host, C_IN, type, dns_query_cb, entry);
+  }
+}
+
+
+static int dns_channel_init(dns_cache_t* cache) {
+  struct ares_options options;
+
+  if (!cache->channel_init) {
+    memset(&options, 0, sizeof(options));
+    if (uv_ares_init_options(cache->loop->loop, &cache->channel, &options, 0) != ARES_SUCCESS) {
+      return -1;
+    }
+    cache->channel_init = 1;
+  }
+
+  return 0;
+}
+
+
+/* Names in /etc/hosts, such as localhost, never go to a server. */
+static int dns_hosts_file(dns_cache_t* cache, const char* host, dns_addr_t* addr) {
+  struct hostent* hostent;
+  int family;
+
+  for (family = AF_INET; ; family = AF_INET6) {
+    if (ares_gethostbyname_file(cache->channel, host, family, &hostent) == ARES_SUCCESS) {
+      addr->family = family;
+      if (family == AF_INET) {
+        memcpy(&addr->v4, hostent->h_addr_list[0], sizeof(addr->v4));
+      } else {
+        memcpy(&addr->v6, hostent->h_addr_list[0], sizeof(addr->v6));
+      }
+      ares_free_hostent(hostent);
+      return 0;
+    }
+
+    if (family == AF_INET6) {
+      return -1;
+    }
+  }
+}
+
+
+static void dns_lookup(dns_entry_t* entry) {
+  dns_cache_t* cache = entry->cache;
+
+  entry->pending = 1;
+  entry->aaaa = 0;
+
+  if (dns_channel_init(cache) != 0) {
+    dns_entry_answer(entry, ARES_ENOTINITIALIZED, 0);
+    return;
+  }
+
+  if (dns_hosts_file(cache, entry->host, &entry->addr) == 0) {
+    dns_entry_answer(entry, ARES_SUCCESS, DNS_HOSTS_TTL);
+    return;
+  }
+
+  dns_query(entry, T_A);
+}
+
+
+static void dns_cache_unlink(dns_cache_t* cache, dns_entry_t* entry) {
+  if (entry->prev) {
+    entry->prev->next = entry->next;
+  } else {
+    cache->head = entry->next;
+  }
+
+  if (entry->next) {
+    entry->next->prev = entry->prev;
+  } else {
+    cache->tail = entry->prev;
+  }
+
+  entry->prev = NULL;
+  entry->next = NULL;
+}
+
+
+static void dns_cache_link(dns_cache_t* cache, dns_entry_t* entry) {
+  entry->next = cache->head;
+  if (cache->head) {
+    cache->head->prev = entry;
+  } else {
+    cache->tail = entry;
+  }
+  cache->head = entry;
+}
+
+
+/* Makes room by dropping the least recently used answer, live or */
+/* not. Lookups in flight have callers waiting and stay. */
+static void dns_cache_evict(dns_cache_t* cache) {
+  dns_entry_t* entry;
+
+  for (entry = cache->tail; entry != NULL; entry = entry->prev) {
+    if (!entry->pending) {
+      dns_cache_unlink(cache, entry);
+      zend_hash_del(&cache->entries, entry->host, entry->host_len);
+      return;
+    }
+  }
+}
+
+
+static void dns_hit(dns_cache_t* cache, dns_entry_t* entry, dns_cb cb, void* data) {
+  dns_waiter_t* hit;
+
+  hit = (dns_waiter_t*) emalloc(sizeof *hit);
+  hit->cb = cb;
+  hit->data = data;
+  hit->addr = entry->addr;
+  hit->status = entry->status;
+
+  dns_hit_push(cache, hit);
+}
+
+
+static void dns_timer_cb(struct ev_loop* ev, ev_timer* timer, int revents) {
+  dns_cache_t* cache = container_of(timer, dns_cache_t, timer);
+  dns_waiter_t* hit = cache->hits_head;
+  dns_waiter_t* next;
+  TSRMLS_D_GET(cache->loop);
+
+  /* Hits the callbacks cause wait for the next round. */
+  cache->hits_head = NULL;
+  cache->hits_tail = NULL;
+
+  for (; hit; hit = next) {
+    next = hit->next;
+
+    if (hit->status == ARES_SUCCESS) {
+      hit->cb(hit->data, &hit->addr, NULL TSRMLS_CC);
+    } else {
+      hit->cb(hit->data, NULL, ares_strerror(hit->status) TSRMLS_CC);
+    }
+
+    efree(hit);
+  }
+}
+
+
+/* Calls cb(data, addr, error) from the loop once host is resolved, */
+/* with addr NULL and error set on failure. */
+void dns_resolve(uv_loop_t* loop, const char* host, dns_cb cb, void* data TSRMLS_DC) {
+  dns_cache_t* cache = dns_cache_get(loop TSRMLS_CC);
+  dns_entry_t** found;
+  dns_entry_t* entry;
+  dns_waiter_t* waiter;
+  uint host_len = strlen(host) + 1;
+
+  if (zend_hash_find(&cache->entries, host, host_len, (void**) &found) == SUCCESS) {
+    entry = *found;
+
+    dns_cache_unlink(cache, entry);
+    dns_cache_link(cache, entry);
+
+    if (!entry->pending && entry->expires > ev_now(loop->ev)) {
+      dns_hit(cache, entry, cb, data);
+      return;
+    }
+  } else {
+    if (zend_hash_num_elements(&cache->entries) >= DNS_CACHE_MAX) {
+      dns_cache_evict(cache);
+    }
+
+    entry = (dns_entry_t*) ecalloc(1, sizeof *entry);
+    entry->cache = cache;
+    entry->host = estrndup(host, host_len - 1);
+    entry->host_len = host_len;
+    zend_hash_update(&cache->entries, entry->host, host_len, &entry, sizeof(entry), NULL);
+    dns_cache_link(cache, entry);
+  }
+
+  /* c-ares may answer before ares_search() returns, so the waiter */
+  /* goes on the list first. */
+  waiter = (dns_waiter_t*) ecalloc(1, sizeof *waiter);
+  waiter->cb = cb;
+  waiter->data = data;
+  waiter->next = entry->waiters;
+  entry->waiters = waiter;
+
+  if (!entry->pending) {
+    dns_lookup(entry);
+  }
+}
+
+
+/* Resolves what can be without asking a server, right away: addresses */
+/* and names in /etc/hosts. Returns -1 for anything else. */
+int dns_resolve_local(uv_loop_t* loop, const char* host, dns_addr_t* addr TSRMLS_DC) {
+  dns_cache_t* cache;
+
+  if (dns_parse_ip(host, addr) == 0) {
+    return 0;
+  }
+
+  cache = dns_cache_get(loop TSRMLS_CC);
+
+  if (dns_channel_init(cache) != 0) {
+    return -1;
+  }
+
+  return dns_hosts_file(cache, host, addr);
+}
+
+
+void dns_cache_free(loop_wrap_t* loop) {
+  dns_cache_t* cache = loop->dns_cache;
+  dns_waiter_t* hit;
+  TSRMLS_D_GET(loop);
+
+  if (cache == NULL) {
+    return;
+  }
+
+  ev_timer_stop(loop->loop->ev, &cache->timer);
+
+  while ((hit = cache->hits_head) != NULL) {
+    cache->hits_head = hit->next;
+    hit->cb(hit->data, NULL, NULL TSRMLS_CC);
+    efree(hit);
+  }
+
+  /* Lookups in flight come back with ARES_EDESTRUCTION */
+  if (cache->channel_init) {
+    uv_ares_destroy(loop->loop, cache->channel);
+  }
+
+  zend_hash_destroy(&cache->entries);
+  efree(cache);
+  loop->dns_cache = NULL;
+}
@@ -14,118 +14,239 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
-#include "php.h"
-#include "php_ini.h"
-#include "ext/standard/info.h"
-#include "Zend/zend_exceptions.h"
-
-#include "uv.h"
-
-#include <stddef.h> /* offsetof */
+#include "phode.h"
+#include "main/SAPI.h"
+#include "main/php_main.h"
+
+#include <arpa/inet.h> /* htons */
+#include <errno.h>
+#include <fcntl.h> /* O_RDONLY */
+#include <limits.h> /* INT_MAX */
+#include <netinet/in.h>
+#include <netinet/tcp.h> /* TCP_NODELAY */
+#include <signal.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h> /* dup, fork */
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#ifdef __linux__
+# include <sched.h> /* sched_setaffinity */
+#endif
 
-#define container_of(ptr, type, member) \
-  ((type *) ((char *) (ptr) - offsetof(type, member)))
+#ifdef ZTS
+# include <pthread.h>
+#endif
 
+/* The same socket options by their names on each system, -1 where */
+/* there is no such thing. */
+#if defined(TCP_KEEPIDLE)
+# define PHODE_TCP_KEEPIDLE TCP_KEEPIDLE
+#elif defined(TCP_KEEPALIVE)
+# define PHODE_TCP_KEEPIDLE TCP_KEEPALIVE
+#else
+# define PHODE_TCP_KEEPIDLE -1
+#endif
 
-#ifdef __GNUC__
-# define MAYBE_UNUSED __attribute__ ((unused))
+#if defined(TCP_CORK)
+# define PHODE_TCP_CORK TCP_CORK
+#elif defined(TCP_NOPUSH)
+# define PHODE_TCP_CORK TCP_NOPUSH
 #else
-# define MAYBE_UNUSED /* TODO */
+# define PHODE_TCP_CORK -1
 #endif
 
+#if defined(TCP_DEFER_ACCEPT)
+# define PHODE_TCP_DEFER_ACCEPT TCP_DEFER_ACCEPT
+#else
+# define PHODE_TCP_DEFER_ACCEPT -1
+#endif
 
-/* Oh man! we're fucked. We have to do the same bullshit as php does! */
-#ifdef ZTS
-# define TSRMLS_SET(o)    (o)->TSRMLS_C = TSRMLS_C
-# define TSRMLS_GET(o)    TSRMLS_C = (o)->TSRMLS_C
-# define TSRMLS_D_GET(o)  TSRMLS_D = (o)->TSRMLS_C
+/* Only Linux, and FreeBSD with SO_REUSEPORT_LB, spread connections */
+/* over the sockets sharing a port; elsewhere the last one to bind */
+/* gets them all, so uv_cluster() shares a single socket instead. */
+#if defined(__linux__) && defined(SO_REUSEPORT)
+# define PHODE_SO_REUSEPORT SO_REUSEPORT
+#elif defined(SO_REUSEPORT_LB)
+# define PHODE_SO_REUSEPORT SO_REUSEPORT_LB
+#endif
 
-#else /* ZTS not defined */
-# define TSRMLS_SET(o)    /* empty */
-# define TSRMLS_GET(o)    /* empty */
-# define TSRMLS_D_GET(o)  /* empty */
+zend_class_entry* tcp_ce;
+zend_class_entry* pipe_ce;
 
-#endif /* ZTS not defined */
+ZEND_DECLARE_MODULE_GLOBALS(phode)
 
 
-typedef struct {
-  /* obj must be the first member, because it must be safe to cast */
-  /* tcp_wrap* to zend_object */
-  zend_object obj;
-  uv_tcp_t handle;
-  zval* close_cb;
-  zval* connection_cb;
-  unsigned dead:1;
-  unsigned listening:1;
-  TSRMLS_D;
-} tcp_wrap_t;
+/* A listening socket, by address */
+typedef struct shared_listener_s {
+  struct shared_listener_s* next;
+  tcp_addr_t addr;
+  int fd;
+  /* For cluster_rebind(), which makes a new socket */
+  int backlog;
+  int defer_accept;
+} shared_listener_t;
 
 
+/* A process forked by uv_cluster() */
 typedef struct {
-  uv_connect_t req;
-  zval* callback;
-  TSRMLS_D;
-} connect_wrap_t;
+  pid_t pid;
+  time_t started;
+  /* When to start a worker that died young again, 0 if not waiting */
+  time_t restart_at;
+} cluster_worker_t;
+
+/* Sockets listened on before uv_cluster(); fd is the handle's own */
+static shared_listener_t* cluster_listeners;
+static cluster_worker_t* cluster_workers;
+static long cluster_count;
+/* The worker's index, -1 in the master or without a cluster */
+static long cluster_index = -1;
+static int cluster_pin;
+static int cluster_reuseport;
+/* Workers write to this once they have sockets of their own */
+static int cluster_ready[2] = { -1, -1 };
+static volatile sig_atomic_t cluster_stopping;
 
 
+#ifdef ZTS
+
+/* A thread started by uv_threads(). Shared between threads, so it */
+/* lives on the C heap rather than on a request's. */
 typedef struct {
-  uv_write_t req;
-  zval* callback;
-  zval* string;
-  TSRMLS_D;
-} write_wrap_t;
+  pthread_t thread;
+  long index;
+  char* script;
+  /* The CLI's, which outlive every request */
+  int argc;
+  char** argv;
+} phode_thread_t;
+
+static phode_thread_t* phode_threads;
+static long phode_thread_count;
+
+/* The threads wait for this to leave PHODE_THREADS_WAIT before they */
+/* run the script, so they can be called off if one fails to start. */
+enum {
+  PHODE_THREADS_WAIT,
+  PHODE_THREADS_RUN,
+  PHODE_THREADS_ABORT
+};
 
-zend_class_entry* tcp_ce;
+static int phode_threads_go;
+static pthread_mutex_t phode_threads_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t phode_threads_cond = PTHREAD_COND_INITIALIZER;
 
+/* Sockets that the threads listen on together. Each thread's TCP */
+/* gets a dup() of the first one's. */
+static shared_listener_t* shared_listeners;
+static pthread_mutex_t shared_listeners_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Set before the threads start; only cleared if they couldn't be */
+static int phode_threads_active;
 
-/* Shamelessly nicked from mongo-php-driver */
-#if ZEND_MODULE_API_NO >= 20100525
-#define init_properties(obj, class_type) \
-  object_properties_init((obj), class_type)
-#else
-#define init_properties(obj, class_type)                      \
-  do {                                                        \
-    zval *tmp;                                                \
-    zend_hash_copy((obj)->properties,                         \
-                   &class_type->default_properties,           \
-                   (copy_ctor_func_t) zval_add_ref,           \
-                   (void *) &tmp,                             \
-                   sizeof(zval*));                            \
-  }                                                           \
-  while (0)
 #endif
 
 
-#define HEALTHCHECK(handle)                                       \
-  if ((handle)->dead) {                                           \
-    zend_throw_exception(zend_exception_get_default(TSRMLS_C),    \
-                         "cannot call methods on a dead handle",  \
-                         0                                        \
-                         TSRMLS_CC);                              \
-    RETURN_NULL();                                                \
+static void write_wrap_free(write_wrap_t* wrap TSRMLS_DC);
+static void tcp_cork_unlink(tcp_wrap_t* self TSRMLS_DC);
+static void sendfile_resume(sendfile_wrap_t* wrap);
+static void sendfile_writable_cb(struct ev_loop* ev, ev_io* watcher, int revents);
+static void sendfile_finish(sendfile_wrap_t* wrap, int status);
+
+
+uv_loop_t* phode_loop(TSRMLS_D) {
+  return PHODE_G(loop) ? PHODE_G(loop) : uv_default_loop();
+}
+
+
+loop_wrap_t* loop_wrap_get(uv_loop_t* loop TSRMLS_DC) {
+  loop_wrap_t* wrap = (loop_wrap_t*) loop->data;
+
+  if (wrap == NULL) {
+    wrap = (loop_wrap_t*) ecalloc(1, sizeof *wrap);
+    wrap->loop = loop;
+    TSRMLS_SET(wrap);
+
+    uv_prepare_init(loop, &wrap->cork_prepare);
+    wrap->cork_prepare.data = (void*) wrap;
+    /* Handles ref the loop; this one must not keep it alive. */
+    uv_unref(loop);
+
+    loop->data = (void*) wrap;
+  }
+
+  return wrap;
+}
+
+
+static void loop_wrap_free(uv_loop_t* loop) {
+  loop_wrap_t* wrap = (loop_wrap_t*) loop->data;
+
+  if (wrap == NULL) {
+    return;
+  }
+
+  while (wrap->read_bufs_count > 0) {
+    efree(wrap->read_bufs[--wrap->read_bufs_count]);
+  }
+
+  uv_prepare_stop(&wrap->cork_prepare);
+  mysql_cache_free(wrap);
+  dns_cache_free(wrap);
+
+  loop->data = NULL;
+  efree(wrap);
+}
+
+
+static char* read_buf_get(loop_wrap_t* loop) {
+  if (loop->read_bufs_count > 0) {
+    return loop->read_bufs[--loop->read_bufs_count];
+  }
+
+  return (char*) emalloc(READ_BUF_SIZE);
+}
+
+
+void read_buf_put(loop_wrap_t* loop, char* base) {
+  if (base == NULL) {
+    return;
   }
 
-#define THROW_ERROR(message)                                      \
-  zend_throw_exception(zend_exception_get_default(TSRMLS_C),      \
-                       message,                                   \
-                       0                                          \
-                       TSRMLS_CC);                                \
+  if (loop->read_bufs_count < READ_BUF_POOL_SIZE) {
+    loop->read_bufs[loop->read_bufs_count++] = base;
+  } else {
+    efree(base);
+  }
+}
 
 
 static void tcp_wrap_free(void *object TSRMLS_DC) {
   tcp_wrap_t *wrap = (tcp_wrap_t*) object;
+
+  if (wrap->corked_write) {
+    tcp_cork_unlink(wrap TSRMLS_CC);
+    write_wrap_free(wrap->corked_write TSRMLS_CC);
+  }
+
   zend_object_std_dtor(&wrap->obj TSRMLS_CC);
   efree(wrap);
 }
 
 
-static zend_object_value tcp_new(zend_class_entry *class_type TSRMLS_DC) {
+static zend_object_value stream_new(zend_class_entry *class_type, int pipe TSRMLS_DC) {
   zend_object_value instance;
   tcp_wrap_t *wrap;
 
   wrap = (tcp_wrap_t*) emalloc(sizeof *wrap);
 
-  uv_tcp_init(uv_default_loop(), &wrap->handle);
+  if (pipe) {
+    uv_pipe_init(phode_loop(TSRMLS_C), &wrap->pipe);
+  } else {
+    uv_tcp_init(phode_loop(TSRMLS_C), &wrap->handle);
+  }
 
   zend_object_std_init(&wrap->obj, class_type TSRMLS_CC);
   init_properties(&wrap->obj, class_type);
@@ -133,8 +254,37 @@ static zend_object_value tcp_new(zend_class_entry *class_type TSRMLS_DC) {
   TSRMLS_SET(wrap);
 
   wrap->handle.data = (void*) wrap;
+  wrap->dead = 0;
   wrap->listening = 0;
+  wrap->close_cb = NULL;
   wrap->connection_cb = NULL;
+  wrap->read_cb = NULL;
+  wrap->read_ref = NULL;
+  wrap->drain_cb = NULL;
+  wrap->high_water = DEFAULT_HIGH_WATER;
+  wrap->low_water = DEFAULT_LOW_WATER;
+  wrap->corked_write = NULL;
+  wrap->next_corked = NULL;
+  wrap->auto_cork = 0;
+  wrap->cork_queued = 0;
+  wrap->need_drain = 0;
+  wrap->native_connection_cb = NULL;
+  wrap->native_close_cb = NULL;
+  wrap->native = NULL;
+  wrap->native_drain_cb = NULL;
+  wrap->native_drain_data = NULL;
+  wrap->sendfile = NULL;
+  wrap->backlog = 512;
+  wrap->opt_nodelay = -1;
+  wrap->opt_keepalive = -1;
+  wrap->opt_keepalive_idle = -1;
+  wrap->opt_sndbuf = -1;
+  wrap->opt_rcvbuf = -1;
+  wrap->opt_defer_accept = -1;
+  wrap->opt_cork = -1;
+  wrap->opt_reuseport = -1;
+  wrap->end_pending = 0;
+  wrap->close_pending = 0;
 
   instance.handle = zend_objects_store_put((void*) wrap,
                                            (zend_objects_store_dtor_t) zend_objects_destroy_object,
@@ -147,288 +297,2520 @@ static zend_object_value tcp_new(zend_class_entry *class_type TSRMLS_DC) {
 }
 
 
-static void call_callback(zval* callback, int argc, zval* argv[] TSRMLS_DC) {
+zend_object_value tcp_new(zend_class_entry *class_type TSRMLS_DC) {
+  return stream_new(class_type, 0 TSRMLS_CC);
+}
+
+
+zend_object_value pipe_new(zend_class_entry *class_type TSRMLS_DC) {
+  return stream_new(class_type, 1 TSRMLS_CC);
+}
+
+
+/* There is no PHP frame above a loop callback to catch what it */
+/* throws, so that becomes a warning; left pending, it would stop */
+/* every later callback from running. Returns -1 if it threw. */
+int call_callback(zval* callback, int argc, zval* argv[] TSRMLS_DC) {
    zend_fcall_info fci = empty_fcall_info;
    zend_fcall_info_cache fci_cache = empty_fcall_info_cache;
    char *is_callable_error = NULL;
-   zval* result;
+   zval** params[CALLBACK_MAX_ARGS];
+   zval* result = NULL;
+   int status = 0;
+   int i;
+
+   assert(argc <= CALLBACK_MAX_ARGS);
+
+   /* zend_call_function wants an array of zval**, one per argument */
+   for (i = 0; i < argc; i++) {
+     params[i] = &argv[i];
+   }
 
    if (zend_fcall_info_init(callback, 0, &fci, &fci_cache, NULL, &is_callable_error TSRMLS_CC) == SUCCESS) {
      fci.retval_ptr_ptr = &result;
      fci.param_count = argc;
-     fci.params = &argv;
+     fci.params = params;
      zend_call_function(&fci, &fci_cache TSRMLS_CC);
    }
-}
 
+   if (result) {
+     zval_ptr_dtor(&result);
+   }
 
-static void tcp_connect_cb(uv_connect_t* req, int status) {
-  connect_wrap_t* wrap = container_of(req, connect_wrap_t, req);
-  TSRMLS_D_GET(wrap);
+   if (is_callable_error) {
+     efree(is_callable_error);
+   }
 
-  printf("status: %d\n", status);
+   if (EG(exception)) {
+     zend_exception_error(EG(exception), E_WARNING TSRMLS_CC);
+     zend_clear_exception(TSRMLS_C);
+     status = -1;
+   }
 
-  call_callback(wrap->callback, 0, NULL TSRMLS_CC);
-  Z_DELREF_P(wrap->callback);
+   return status;
 }
 
 
-PHP_METHOD(TCP, connect) {
-  char* ip;
-  int ip_length;
-  int port;
-  zval* callback;
-  connect_wrap_t* connect_wrap;
-  tcp_wrap_t* tcp_wrap;
-  int r;
-
-  if (zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "slz", &ip, &ip_length, &port, &callback) == FAILURE) {
-    return;
+static int tcp_option_set(int fd, int level, int name, int value) {
+  if (name < 0 || value < 0) {
+    return 0;
   }
 
-  tcp_wrap = (tcp_wrap_t*) zend_object_store_get_object(getThis() TSRMLS_CC);
-  HEALTHCHECK(tcp_wrap);
-
-  connect_wrap = (connect_wrap_t*) emalloc(sizeof *connect_wrap);
+  return setsockopt(fd, level, name, &value, sizeof(value));
+}
 
-  r = uv_tcp_connect(&connect_wrap->req, &tcp_wrap->handle, uv_ip4_addr(ip, port), tcp_connect_cb);
-  printf("== %d\n", r);
 
-  connect_wrap->callback = callback;
-  Z_ADDREF_P(callback);
-  TSRMLS_SET(connect_wrap);
+/* Puts the options from setOptions() named in mask on the socket, if */
+/* there is one yet. Returns NULL on success, or the error message. */
+static const char* tcp_options_apply(tcp_wrap_t* self, int mask) {
+  int fd = self->handle.fd;
 
-  RETURN_NULL();
-}
+  if (fd < 0) {
+    return NULL;
+  }
 
+  if (((mask & TCP_OPT_SNDBUF) &&
+       tcp_option_set(fd, SOL_SOCKET, SO_SNDBUF, self->opt_sndbuf)) ||
+      ((mask & TCP_OPT_RCVBUF) &&
+       tcp_option_set(fd, SOL_SOCKET, SO_RCVBUF, self->opt_rcvbuf))) {
+    return strerror(errno);
+  }
 
-static void tcp_write_cb(uv_write_t* req, int status) {
-  write_wrap_t* wrap = container_of(req, write_wrap_t, req);
-  TSRMLS_D_GET(wrap);
+  /* The rest only mean something to TCP */
+  if (self->handle.type != UV_TCP) {
+    return NULL;
+  }
 
-  printf("write status: %d\n", status);
+  if (((mask & TCP_OPT_NODELAY) &&
+       tcp_option_set(fd, IPPROTO_TCP, TCP_NODELAY, self->opt_nodelay)) ||
+      ((mask & TCP_OPT_KEEPALIVE) &&
+       tcp_option_set(fd, SOL_SOCKET, SO_KEEPALIVE, self->opt_keepalive)) ||
+      ((mask & TCP_OPT_KEEPALIVE_IDLE) &&
+       tcp_option_set(fd, IPPROTO_TCP, PHODE_TCP_KEEPIDLE, self->opt_keepalive_idle)) ||
+      ((mask & TCP_OPT_DEFER_ACCEPT) &&
+       tcp_option_set(fd, IPPROTO_TCP, PHODE_TCP_DEFER_ACCEPT, self->opt_defer_accept)) ||
+      ((mask & TCP_OPT_CORK) &&
+       tcp_option_set(fd, IPPROTO_TCP, PHODE_TCP_CORK, self->opt_cork))) {
+    return strerror(errno);
+  }
 
-  call_callback(wrap->callback, 0, NULL TSRMLS_CC);
-  Z_DELREF_P(wrap->callback);
-  Z_DELREF_P(wrap->string);
+  return NULL;
 }
 
 
-PHP_METHOD(TCP, write) {
-  zval* string;
-  zval* callback;
-  write_wrap_t* write_wrap;
-  tcp_wrap_t* tcp_wrap;
-  uv_buf_t buf;
-  int r;
+/* Makes the socket ahead of connect() so that the options are in */
+/* place before the handshake; the receive buffer size decides the */
+/* window scale offered in the SYN. */
+static const char* tcp_socket_open(tcp_wrap_t* tcp, int family) {
+  int fd;
 
-  if (zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "zz", &string, &callback) == FAILURE) {
-    return;
+  fd = socket(family, SOCK_STREAM, 0);
+  if (fd < 0) {
+    return strerror(errno);
   }
 
-  tcp_wrap = (tcp_wrap_t*) zend_object_store_get_object(getThis() TSRMLS_CC);
-  HEALTHCHECK(tcp_wrap);
+  fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+  fcntl(fd, F_SETFD, FD_CLOEXEC);
 
-  write_wrap = (write_wrap_t*) emalloc(sizeof *write_wrap);
-
-  /* Todo: leverage php's COW feaure */
-  buf.base = Z_STRVAL_P(string);
-  buf.len = Z_STRLEN_P(string);
+  if (uv_tcp_open(&tcp->handle, fd)) {
+    close(fd);
+    tcp->handle.fd = -1;
+    return uv_strerror(uv_last_error(tcp->handle.loop));
+  }
 
-  r = uv_write(&write_wrap->req, (uv_stream_t*) &tcp_wrap->handle, &buf, 1, tcp_write_cb);
-  printf("== %d\n", r);
+  return NULL;
+}
 
-  write_wrap->callback = callback;
-  Z_ADDREF_P(callback);
-  write_wrap->string = string;
-  Z_ADDREF_P(string);
-  TSRMLS_SET(write_wrap);
 
-  RETURN_NULL();
+static void connect_wrap_free(connect_wrap_t* wrap TSRMLS_DC) {
+  zval_ptr_dtor(&wrap->callback);
+  zval_ptr_dtor(&wrap->socket);
+  efree(wrap);
 }
 
 
-static void tcp_close_cb(uv_handle_t* handle) {
-  tcp_wrap_t* self = container_of(handle, tcp_wrap_t, handle);
-  TSRMLS_D_GET(self);
-  call_callback(self->close_cb, 0, NULL TSRMLS_CC);
-
-  Z_DELREF_P(self->close_cb);
+/* Calls back with ($error), null once connected. */
+static void connect_wrap_notify(connect_wrap_t* wrap, const char* error TSRMLS_DC) {
+  zval* args[1];
 
-  if (self->connection_cb) {
-    Z_DELREF_P(self->connection_cb);
+  MAKE_STD_ZVAL(args[0]);
+  if (error) {
+    ZVAL_STRING(args[0], (char*) error, 1);
+  } else {
+    ZVAL_NULL(args[0]);
   }
+
+  call_callback(wrap->callback, 1, args TSRMLS_CC);
+
+  zval_ptr_dtor(&args[0]);
+  connect_wrap_free(wrap TSRMLS_CC);
 }
 
 
-PHP_METHOD(TCP, close) {
-  tcp_wrap_t* self;
-  zval* callback;
+static void tcp_connect_cb(uv_connect_t* req, int status) {
+  connect_wrap_t* wrap = container_of(req, connect_wrap_t, req);
+  TSRMLS_D_GET(wrap);
 
-  if (zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "z", &callback) == FAILURE) {
-    return;
-  }
+  connect_wrap_notify(wrap,
+                      status ? uv_strerror(uv_last_error(req->handle->loop)) : NULL
+                      TSRMLS_CC);
+}
 
-  self = (tcp_wrap_t*) zend_object_store_get_object(getThis() TSRMLS_CC);
-  HEALTHCHECK(self);
 
-  self->close_cb = callback;
-  Z_ADDREF_P(callback);
+static const char* tcp_connect_addr(tcp_wrap_t* tcp, connect_wrap_t* wrap, dns_addr_t* addr) {
+  struct sockaddr_in in;
+  struct sockaddr_in6 in6;
+  const char* error;
+  int r;
 
-  uv_close((uv_handle_t*)&self->handle, tcp_close_cb);
-  self->dead = 1;
+  if (tcp->handle.fd < 0) {
+    if ((error = tcp_socket_open(tcp, addr->family)) != NULL ||
+        (error = tcp_options_apply(tcp, TCP_OPT_ALL)) != NULL) {
+      return error;
+    }
+  }
 
-  RETURN_NULL();
+  if (addr->family == AF_INET6) {
+    memset(&in6, 0, sizeof(in6));
+    in6.sin6_family = AF_INET6;
+    in6.sin6_port = htons(wrap->port);
+    in6.sin6_addr = addr->v6;
+    r = uv_tcp_connect6(&wrap->req, &tcp->handle, in6, tcp_connect_cb);
+  } else {
+    memset(&in, 0, sizeof(in));
+    in.sin_family = AF_INET;
+    in.sin_port = htons(wrap->port);
+    in.sin_addr = addr->v4;
+    r = uv_tcp_connect(&wrap->req, &tcp->handle, in, tcp_connect_cb);
+  }
+
+  return r ? uv_strerror(uv_last_error(tcp->handle.loop)) : NULL;
 }
 
 
-void tcp_connection_cb(uv_stream_t* server_handle, int status) {
-  tcp_wrap_t* self = (tcp_wrap_t*) server_handle->data;
-  tcp_wrap_t* client_wrap;
-  zval* client_zval;
-  int r;
-  TSRMLS_D_GET(self);
+static void tcp_resolve_cb(void* data, dns_addr_t* addr, const char* error TSRMLS_DC) {
+  connect_wrap_t* wrap = (connect_wrap_t*) data;
+  tcp_wrap_t* tcp;
 
-  if (status != 0) {
-    /* TODO: do something sensible */
-    THROW_ERROR("Fuckup");
+  /* The loop is going away */
+  if (addr == NULL && error == NULL) {
+    connect_wrap_free(wrap TSRMLS_CC);
     return;
   }
 
-  /* Create container for new object */
-  MAKE_STD_ZVAL(client_zval);
-  Z_TYPE_P(client_zval) = IS_OBJECT;
-  Z_OBJVAL_P(client_zval) = tcp_new(tcp_ce TSRMLS_CC);
-  client_wrap = (tcp_wrap_t*) zend_object_store_get_object(client_zval TSRMLS_CC);
+  tcp = (tcp_wrap_t*) zend_object_store_get_object(wrap->socket TSRMLS_CC);
 
-  /* Accept connection */
-  r = uv_accept(server_handle, (uv_stream_t*) &client_wrap->handle);
-  if (r != 0) {
-    /* This should not happen */
-    THROW_ERROR("Mishap");
-    return;
+  if (addr != NULL) {
+    error = tcp->dead ? "Socket closed" : tcp_connect_addr(tcp, wrap, addr);
   }
 
-  /* Call the connection callback */
-  if (self->connection_cb) {
-    zval* args[1];
-    args[0] = client_zval;
-    call_callback(self->connection_cb, 1, args TSRMLS_CC);
+  if (error != NULL) {
+    connect_wrap_notify(wrap, error TSRMLS_CC);
   }
-};
+}
 
 
-PHP_METHOD(TCP, listen) {
-  tcp_wrap_t* self;
-  zval* arg1, *arg2, *arg3;
-  zval* port, *host, *callback;
-  struct sockaddr_in addr;
-  int r;
+static connect_wrap_t* connect_wrap_new(zval* socket, zval* callback, long port TSRMLS_DC) {
+  connect_wrap_t* wrap;
 
-  self = (tcp_wrap_t*) zend_object_store_get_object(getThis() TSRMLS_CC);
-  HEALTHCHECK(self);
+  wrap = (connect_wrap_t*) emalloc(sizeof *wrap);
+  wrap->callback = callback;
+  Z_ADDREF_P(callback);
+  wrap->socket = socket;
+  Z_ADDREF_P(socket);
+  wrap->port = port;
+  TSRMLS_SET(wrap);
 
-  if (self->listening) {
-    THROW_ERROR("Already listening");
-  }
+  return wrap;
+}
+
+
+/* connect($host, $port, $cb) calls $cb($error) once connected. $host is */
+/* an IPv4 or IPv6 address, or a name to look up without blocking. */
+PHP_METHOD(TCP, connect) {
+  char* host;
+  int host_length;
+  long port;
+  zval* callback;
+  connect_wrap_t* connect_wrap;
+  tcp_wrap_t* tcp_wrap;
+  dns_addr_t addr;
+  const char* error;
 
-  if (zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "z|z!z!", &arg1, &arg2, &arg3) == FAILURE) {
+  if (zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "slz", &host, &host_length, &port, &callback) == FAILURE) {
     return;
   }
 
-  if (Z_TYPE_P(arg1) == IS_LONG) {
-    port = arg1;
-  } else {
-    /* No unix socket support yet */
-    THROW_ERROR("Unix sockets are not supported yet");
-    RETURN_NULL();
-  }
+  tcp_wrap = (tcp_wrap_t*) zend_object_store_get_object(getThis() TSRMLS_CC);
+  HEALTHCHECK(tcp_wrap);
 
-  if (ZEND_NUM_ARGS() == 3) {
-    host = arg2;
-    callback = arg3;
-  } else if (ZEND_NUM_ARGS() == 2) {
-    if (Z_TYPE_P(arg2) == IS_STRING) {
-      host = arg2;
-      callback = NULL;
-    } else {
-      host = NULL;
-      callback = arg2;
+  connect_wrap = connect_wrap_new(getThis(), callback, port TSRMLS_CC);
+
+  if (dns_parse_ip(host, &addr) == 0) {
+    error = tcp_connect_addr(tcp_wrap, connect_wrap, &addr);
+    if (error != NULL) {
+      connect_wrap_free(connect_wrap TSRMLS_CC);
+      THROW_ERROR((char*) error);
+      RETURN_NULL();
     }
   } else {
-    callback = NULL;
-    host = NULL;
+    dns_resolve(tcp_wrap->handle.loop, host, tcp_resolve_cb, connect_wrap TSRMLS_CC);
   }
 
-  if (host != NULL) {
-    /* TODO: are php strings always null-terminated? */
-    addr = uv_ip4_addr(Z_STRVAL_P(host), Z_LVAL_P(port));
-  } else {
-    addr = uv_ip4_addr("0.0.0.0", Z_LVAL_P(port));
-  }
+  RETURN_NULL();
+}
 
-  r = uv_tcp_bind(&self->handle, addr);
-  if (r != 0) {
-    THROW_ERROR(uv_strerror(uv_last_error(self->handle.loop)));
-    RETURN_NULL();
-  }
 
-  r = uv_listen((uv_stream_t*) &self->handle, 512, tcp_connection_cb);
-  if (r != 0) {
-    THROW_ERROR(uv_strerror(uv_last_error(self->handle.loop)));
-    RETURN_NULL();
-  }
+static write_wrap_t* write_wrap_new(TSRMLS_D) {
+  write_wrap_t* wrap = (write_wrap_t*) emalloc(sizeof *wrap);
 
-  self->listening = 1;
-  if (callback) {
-    self->connection_cb = callback;
-    Z_ADDREF_P(callback);
-  }
+  wrap->strings = wrap->strings_sml;
+  wrap->strings_count = 0;
+  wrap->strings_size = WRITE_WRAP_SML_SIZE;
+  wrap->callbacks = wrap->callbacks_sml;
+  wrap->callbacks_count = 0;
+  wrap->callbacks_size = WRITE_WRAP_SML_SIZE;
+  wrap->bytes = 0;
+  TSRMLS_SET(wrap);
 
-  RETURN_NULL();
+  return wrap;
 }
 
 
-static zend_function_entry tcp_methods[] = {
-  PHP_ME(TCP, connect, NULL, ZEND_ACC_PUBLIC)
-  PHP_ME(TCP, write, NULL, ZEND_ACC_PUBLIC)
-  PHP_ME(TCP, close, NULL, ZEND_ACC_PUBLIC)
-  PHP_ME(TCP, listen, NULL, ZEND_ACC_PUBLIC)
-  { NULL }
-};
+static void write_wrap_free(write_wrap_t* wrap TSRMLS_DC) {
+  int i;
 
+  for (i = 0; i < wrap->strings_count; i++) {
+    zval_ptr_dtor(&wrap->strings[i]);
+  }
 
-PHP_MINIT_FUNCTION(phode) {
-  zend_class_entry ce;
+  for (i = 0; i < wrap->callbacks_count; i++) {
+    zval_ptr_dtor(&wrap->callbacks[i]);
+  }
 
-  INIT_CLASS_ENTRY(ce, "TCP", tcp_methods);
-  ce.create_object = tcp_new;
-  tcp_ce = zend_register_internal_class(&ce TSRMLS_CC);
+  if (wrap->strings != wrap->strings_sml) {
+    efree(wrap->strings);
+  }
 
-  return SUCCESS;
+  if (wrap->callbacks != wrap->callbacks_sml) {
+    efree(wrap->callbacks);
+  }
+
+  efree(wrap);
 }
 
 
-PHP_MSHUTDOWN_FUNCTION(phode) {
-  return SUCCESS;
+/* Appends to a growable zval* array. sml is the list's inline storage, */
+/* or NULL if it starts out empty. */
+void zval_list_push(zval*** list, int* count, int* size, zval** sml, zval* value) {
+  if (*count == *size) {
+    *size = *size ? *size * 2 : 4;
+    if (*list == sml) {
+      *list = (zval**) safe_emalloc(*size, sizeof(zval*), 0);
+      memcpy(*list, sml, *count * sizeof(zval*));
+    } else {
+      *list = (zval**) erealloc(*list, *size * sizeof(zval*));
+    }
+  }
+
+  (*list)[(*count)++] = value;
 }
 
 
-PHP_MINFO_FUNCTION(phode) {
-  php_info_print_table_start();
-  php_info_print_table_header(2, "phode", "enabled");
-  php_info_print_table_end();
-}
+/* Strings are pinned by reference, not copied. Anything else is */
+/* converted to a private string that lives as long as the write. */
+void write_wrap_push_string(write_wrap_t* wrap, zval* value) {
+  zval* string;
 
+  if (Z_TYPE_P(value) == IS_STRING) {
+    string = value;
+    Z_ADDREF_P(string);
+  } else {
+    MAKE_STD_ZVAL(string);
+    *string = *value;
+    zval_copy_ctor(string);
+    INIT_PZVAL(string);
+    convert_to_string(string);
+  }
 
-PHP_FUNCTION(uv_run) {
-  uv_run(uv_default_loop());
-  RETURN_NULL();
+  wrap->bytes += Z_STRLEN_P(string);
+  zval_list_push(&wrap->strings,
+                 &wrap->strings_count,
+                 &wrap->strings_size,
+                 wrap->strings_sml,
+                 string);
 }
 
 
-static zend_function_entry functions[] = {
+void write_wrap_push_callback(write_wrap_t* wrap, zval* callback) {
+  if (callback == NULL) {
+    return;
+  }
+
+  Z_ADDREF_P(callback);
+  zval_list_push(&wrap->callbacks,
+                 &wrap->callbacks_count,
+                 &wrap->callbacks_size,
+                 wrap->callbacks_sml,
+                 callback);
+}
+
+
+/* Bytes accepted by write() but not yet handed to the kernel. */
+static size_t tcp_queued_bytes(tcp_wrap_t* self) {
+  size_t size = self->handle.write_queue_size;
+
+  if (self->corked_write) {
+    size += self->corked_write->bytes;
+  }
+
+  return size;
+}
+
+
+static void tcp_native_drain(tcp_wrap_t* self TSRMLS_DC) {
+  void (*cb)(tcp_wrap_t* self, void* data TSRMLS_DC) = self->native_drain_cb;
+
+  if (cb == NULL) {
+    return;
+  }
+
+  self->native_drain_cb = NULL;
+  cb(self, self->native_drain_data TSRMLS_CC);
+}
+
+
+/* Calls the write's callbacks with error, or null if it went out, */
+/* and frees it. */
+static void write_wrap_done(write_wrap_t* wrap, const char* error TSRMLS_DC) {
+  zval* args[1];
+  int i;
+
+  if (wrap->callbacks_count > 0) {
+    MAKE_STD_ZVAL(args[0]);
+    if (error) {
+      ZVAL_STRING(args[0], (char*) error, 1);
+    } else {
+      ZVAL_NULL(args[0]);
+    }
+
+    for (i = 0; i < wrap->callbacks_count; i++) {
+      call_callback(wrap->callbacks[i], 1, args TSRMLS_CC);
+    }
+
+    zval_ptr_dtor(&args[0]);
+  }
+
+  write_wrap_free(wrap TSRMLS_CC);
+}
+
+
+static void tcp_drain_check(tcp_wrap_t* self TSRMLS_DC) {
+  if (self->need_drain && !self->dead && tcp_queued_bytes(self) <= self->low_water) {
+    self->need_drain = 0;
+    tcp_native_drain(self TSRMLS_CC);
+    if (self->drain_cb) {
+      call_callback(self->drain_cb, 0, NULL TSRMLS_CC);
+    }
+  }
+}
+
+
+static void tcp_write_cb(uv_write_t* req, int status) {
+  write_wrap_t* wrap = container_of(req, write_wrap_t, req);
+  tcp_wrap_t* self = (tcp_wrap_t*) req->handle->data;
+  const char* error = NULL;
+  TSRMLS_D_GET(wrap);
+
+  if (status != 0) {
+    error = uv_strerror(uv_last_error(req->handle->loop));
+  }
+
+  write_wrap_done(wrap, error TSRMLS_CC);
+
+  if (self->sendfile && self->sendfile->waiting && self->handle.write_queue_size == 0) {
+    sendfile_resume(self->sendfile);
+  }
+
+  tcp_drain_check(self TSRMLS_CC);
+}
+
+
+/* Hands every pinned string to a single uv_write. On failure the */
+/* caller still owns the wrap. */
+static int write_wrap_submit(write_wrap_t* wrap, uv_stream_t* stream) {
+  uv_buf_t bufs_sml[WRITE_WRAP_SML_SIZE];
+  uv_buf_t* bufs;
+  int i;
+  int r;
+
+  if (wrap->strings_count <= WRITE_WRAP_SML_SIZE) {
+    bufs = bufs_sml;
+  } else {
+    bufs = (uv_buf_t*) safe_emalloc(wrap->strings_count, sizeof(uv_buf_t), 0);
+  }
+
+  for (i = 0; i < wrap->strings_count; i++) {
+    bufs[i] = uv_buf_init(Z_STRVAL_P(wrap->strings[i]),
+                          Z_STRLEN_P(wrap->strings[i]));
+  }
+
+  /* libuv copies the buffer array; one request, one writev() */
+  r = uv_write(&wrap->req, stream, bufs, wrap->strings_count, tcp_write_cb);
+
+  if (bufs != bufs_sml) {
+    efree(bufs);
+  }
+
+  return r;
+}
+
+
+static void tcp_cork_unlink(tcp_wrap_t* self TSRMLS_DC) {
+  loop_wrap_t* loop;
+  tcp_wrap_t** p;
+
+  if (!self->cork_queued) {
+    return;
+  }
+
+  loop = loop_wrap_get(self->handle.loop TSRMLS_CC);
+  for (p = &loop->corked_head; *p != NULL; p = &(*p)->next_corked) {
+    if (*p == self) {
+      *p = self->next_corked;
+      break;
+    }
+  }
+
+  self->next_corked = NULL;
+  self->cork_queued = 0;
+}
+
+
+static int tcp_cork_flush(tcp_wrap_t* self TSRMLS_DC) {
+  write_wrap_t* wrap = self->corked_write;
+  uv_err_t err;
+  int r;
+
+  tcp_cork_unlink(self TSRMLS_CC);
+
+  /* Held back until the file is out. */
+  if (wrap == NULL || self->sendfile) {
+    return 0;
+  }
+
+  self->corked_write = NULL;
+
+  /* Whoever is waiting on these writes hears that they failed. The */
+  /* error stays put for our caller, whatever the callbacks do. */
+  r = write_wrap_submit(wrap, (uv_stream_t*) &self->handle);
+  if (r != 0) {
+    err = uv_last_error(self->handle.loop);
+    write_wrap_done(wrap, uv_strerror(err) TSRMLS_CC);
+    tcp_drain_check(self TSRMLS_CC);
+    self->handle.loop->last_err = err;
+  }
+
+  return r;
+}
+
+
+static void cork_prepare_cb(uv_prepare_t* handle, int status) {
+  loop_wrap_t* loop = (loop_wrap_t*) handle->data;
+  TSRMLS_D_GET(loop);
+
+  while (loop->corked_head != NULL) {
+    tcp_cork_flush(loop->corked_head TSRMLS_CC);
+  }
+
+  uv_prepare_stop(handle);
+}
+
+
+/* Returns the wrap that the next write should be added to: a fresh one, */
+/* or the handle's pending one when it is in auto-cork mode. */
+write_wrap_t* tcp_write_begin(tcp_wrap_t* self TSRMLS_DC) {
+  loop_wrap_t* loop;
+
+  if (!self->auto_cork && !self->sendfile) {
+    return write_wrap_new(TSRMLS_C);
+  }
+
+  if (self->corked_write == NULL) {
+    self->corked_write = write_wrap_new(TSRMLS_C);
+  }
+
+  if (!self->cork_queued && !self->sendfile) {
+    loop = loop_wrap_get(self->handle.loop TSRMLS_CC);
+    self->next_corked = loop->corked_head;
+    self->cork_queued = 1;
+    loop->corked_head = self;
+    uv_prepare_start(&loop->cork_prepare, cork_prepare_cb);
+  }
+
+  return self->corked_write;
+}
+
+
+/* Returns 1 if the caller may keep writing, 0 if it should wait for */
+/* the drain callback. */
+int tcp_write_end(tcp_wrap_t* self, write_wrap_t* wrap TSRMLS_DC) {
+  /* Corked writes are flushed by cork_prepare_cb. */
+  if (wrap != self->corked_write) {
+    if (write_wrap_submit(wrap, (uv_stream_t*) &self->handle) != 0) {
+      write_wrap_free(wrap TSRMLS_CC);
+      THROW_ERROR(uv_strerror(uv_last_error(self->handle.loop)));
+      return 0;
+    }
+  }
+
+  if (tcp_queued_bytes(self) < self->high_water) {
+    return 1;
+  }
+
+  self->need_drain = 1;
+  return 0;
+}
+
+
+PHP_METHOD(TCP, write) {
+  zval* string;
+  zval* callback = NULL;
+  write_wrap_t* write_wrap;
+  tcp_wrap_t* tcp_wrap;
+
+  if (zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "z|z!", &string, &callback) == FAILURE) {
+    return;
+  }
+
+  tcp_wrap = (tcp_wrap_t*) zend_object_store_get_object(getThis() TSRMLS_CC);
+  HEALTHCHECK(tcp_wrap);
+
+  write_wrap = tcp_write_begin(tcp_wrap TSRMLS_CC);
+  write_wrap_push_string(write_wrap, string);
+  write_wrap_push_callback(write_wrap, callback);
+
+  RETURN_BOOL(tcp_write_end(tcp_wrap, write_wrap TSRMLS_CC));
+}
+
+
+PHP_METHOD(TCP, writev) {
+  zval* chunks;
+  zval* callback = NULL;
+  zval** entry;
+  write_wrap_t* write_wrap;
+  tcp_wrap_t* tcp_wrap;
+  HashPosition pos;
+
+  if (zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "a|z!", &chunks, &callback) == FAILURE) {
+    return;
+  }
+
+  tcp_wrap = (tcp_wrap_t*) zend_object_store_get_object(getThis() TSRMLS_CC);
+  HEALTHCHECK(tcp_wrap);
+
+  if (zend_hash_num_elements(Z_ARRVAL_P(chunks)) == 0) {
+    THROW_ERROR("writev() needs at least one chunk");
+    RETURN_NULL();
+  }
+
+  write_wrap = tcp_write_begin(tcp_wrap TSRMLS_CC);
+
+  for (zend_hash_internal_pointer_reset_ex(Z_ARRVAL_P(chunks), &pos);
+       zend_hash_get_current_data_ex(Z_ARRVAL_P(chunks), (void**) &entry, &pos) == SUCCESS;
+       zend_hash_move_forward_ex(Z_ARRVAL_P(chunks), &pos)) {
+    write_wrap_push_string(write_wrap, *entry);
+  }
+
+  write_wrap_push_callback(write_wrap, callback);
+
+  RETURN_BOOL(tcp_write_end(tcp_wrap, write_wrap TSRMLS_CC));
+}
+
+
+PHP_METHOD(TCP, writeQueueSize) {
+  tcp_wrap_t* self;
+
+  self = (tcp_wrap_t*) zend_object_store_get_object(getThis() TSRMLS_CC);
+  HEALTHCHECK(self);
+
+  RETURN_LONG((long) tcp_queued_bytes(self));
+}
+
+
+PHP_METHOD(TCP, setWatermarks) {
+  tcp_wrap_t* self;
+  long high;
+  long low = -1;
+
+  if (zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "l|l", &high, &low) == FAILURE) {
+    return;
+  }
+
+  self = (tcp_wrap_t*) zend_object_store_get_object(getThis() TSRMLS_CC);
+  HEALTHCHECK(self);
+
+  if (low == -1) {
+    low = high / 4;
+  }
+
+  if (high <= 0 || low < 0 || low > high) {
+    THROW_ERROR("Watermarks must satisfy 0 <= low <= high and high > 0");
+    RETURN_NULL();
+  }
+
+  self->high_water = (size_t) high;
+  self->low_water = (size_t) low;
+
+  RETURN_NULL();
+}
+
+
+PHP_METHOD(TCP, onDrain) {
+  tcp_wrap_t* self;
+  zval* callback;
+
+  if (zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "z!", &callback) == FAILURE) {
+    return;
+  }
+
+  self = (tcp_wrap_t*) zend_object_store_get_object(getThis() TSRMLS_CC);
+  HEALTHCHECK(self);
+
+  if (self->drain_cb) {
+    zval_ptr_dtor(&self->drain_cb);
+  }
+
+  self->drain_cb = callback;
+  if (callback) {
+    Z_ADDREF_P(callback);
+  }
+
+  RETURN_NULL();
+}
+
+
+PHP_METHOD(TCP, autoCork) {
+  tcp_wrap_t* self;
+  zend_bool enable = 1;
+
+  if (zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "|b", &enable) == FAILURE) {
+    return;
+  }
+
+  self = (tcp_wrap_t*) zend_object_store_get_object(getThis() TSRMLS_CC);
+  HEALTHCHECK(self);
+
+  self->auto_cork = enable ? 1 : 0;
+
+  if (!enable && tcp_cork_flush(self TSRMLS_CC) != 0) {
+    THROW_ERROR(uv_strerror(uv_last_error(self->handle.loop)));
+  }
+
+  RETURN_NULL();
+}
+
+
+static void cluster_listener_update(tcp_wrap_t* self);
+
+
+static const struct {
+  const char* name;
+  int flag;
+  /* Takes true or false rather than a number */
+  unsigned boolean:1;
+  /* A Pipe can't have it */
+  unsigned tcp_only:1;
+} tcp_option_names[] = {
+  { "nodelay", TCP_OPT_NODELAY, 1, 1 },
+  { "keepalive", TCP_OPT_KEEPALIVE, 1, 1 },
+  { "keepalive_idle", TCP_OPT_KEEPALIVE_IDLE, 0, 1 },
+  { "sndbuf", TCP_OPT_SNDBUF, 0, 0 },
+  { "rcvbuf", TCP_OPT_RCVBUF, 0, 0 },
+  { "backlog", TCP_OPT_BACKLOG, 0, 0 },
+  { "defer_accept", TCP_OPT_DEFER_ACCEPT, 0, 1 },
+  { "cork", TCP_OPT_CORK, 1, 1 },
+  { "reuseport", TCP_OPT_REUSEPORT, 1, 1 },
+  { NULL }
+};
+
+
+/* The guts of setOptions(). Nothing is stored unless all of options */
+/* checks out, and only what it names goes to the socket. Returns NULL */
+/* on success, or the error message. */
+const char* tcp_set_options(tcp_wrap_t* self, zval* options TSRMLS_DC) {
+  zval** entry;
+  HashPosition pos;
+  char* key;
+  uint key_length;
+  ulong index;
+  zval value;
+  long values[sizeof(tcp_option_names) / sizeof(tcp_option_names[0])];
+  int mask = 0;
+  int i;
+  const char* error;
+
+  for (zend_hash_internal_pointer_reset_ex(Z_ARRVAL_P(options), &pos);
+       zend_hash_get_current_data_ex(Z_ARRVAL_P(options), (void**) &entry, &pos) == SUCCESS;
+       zend_hash_move_forward_ex(Z_ARRVAL_P(options), &pos)) {
+    if (zend_hash_get_current_key_ex(Z_ARRVAL_P(options), &key, &key_length, &index, 0, &pos) != HASH_KEY_IS_STRING) {
+      return "Unknown socket option";
+    }
+
+    for (i = 0; tcp_option_names[i].name != NULL; i++) {
+      if (strcmp(key, tcp_option_names[i].name) == 0) {
+        break;
+      }
+    }
+
+    if (tcp_option_names[i].name == NULL) {
+      return "Unknown socket option";
+    }
+
+    if (tcp_option_names[i].tcp_only && self->handle.type != UV_TCP) {
+      return "Not a socket option for a Pipe";
+    }
+
+    value = **entry;
+    zval_copy_ctor(&value);
+    convert_to_long(&value);
+    values[i] = Z_LVAL_P(&value);
+
+    if (tcp_option_names[i].boolean) {
+      values[i] = values[i] != 0;
+    } else if (values[i] < 0 || values[i] > INT_MAX ||
+               (values[i] == 0 && (tcp_option_names[i].flag & (TCP_OPT_BACKLOG | TCP_OPT_KEEPALIVE_IDLE)))) {
+      return "Invalid socket option value";
+    }
+
+    mask |= tcp_option_names[i].flag;
+  }
+
+  for (i = 0; tcp_option_names[i].name != NULL; i++) {
+    if (!(mask & tcp_option_names[i].flag)) {
+      continue;
+    }
+
+    switch (tcp_option_names[i].flag) {
+      case TCP_OPT_NODELAY: self->opt_nodelay = (int) values[i]; break;
+      case TCP_OPT_KEEPALIVE: self->opt_keepalive = (int) values[i]; break;
+      case TCP_OPT_KEEPALIVE_IDLE: self->opt_keepalive_idle = (int) values[i]; break;
+      case TCP_OPT_SNDBUF: self->opt_sndbuf = (int) values[i]; break;
+      case TCP_OPT_RCVBUF: self->opt_rcvbuf = (int) values[i]; break;
+      case TCP_OPT_BACKLOG: self->backlog = (int) values[i]; break;
+      case TCP_OPT_DEFER_ACCEPT: self->opt_defer_accept = (int) values[i]; break;
+      case TCP_OPT_CORK: self->opt_cork = (int) values[i]; break;
+      case TCP_OPT_REUSEPORT: self->opt_reuseport = (int) values[i]; break;
+    }
+  }
+
+  /* What's still queued in here goes out ahead of the uncork */
+  if ((mask & TCP_OPT_CORK) && self->opt_cork == 0 &&
+      tcp_cork_flush(self TSRMLS_CC) != 0) {
+    return uv_strerror(uv_last_error(self->handle.loop));
+  }
+
+  if ((error = tcp_options_apply(self, mask)) != NULL) {
+    return error;
+  }
+
+  if (self->listening && (mask & (TCP_OPT_BACKLOG | TCP_OPT_DEFER_ACCEPT))) {
+    /* listen() again takes the new backlog */
+    if ((mask & TCP_OPT_BACKLOG) && self->handle.fd >= 0 &&
+        listen(self->handle.fd, self->backlog)) {
+      return strerror(errno);
+    }
+    cluster_listener_update(self);
+  }
+
+  return NULL;
+}
+
+
+/* setOptions($options) tunes the socket; what isn't named stays as it */
+/* was. "nodelay" turns off Nagle's algorithm, "keepalive" turns on */
+/* probes of idle connections, "keepalive_idle" is the seconds before */
+/* the first, "sndbuf" and "rcvbuf" are the kernel's buffer sizes in */
+/* bytes. A listener takes "backlog", the length of its accept queue */
+/* (512), and "defer_accept", the seconds a connection may wait for */
+/* its first data before it's accepted anyway (Linux only), and */
+/* "reuseport", which has uv_cluster() give every worker a socket of */
+/* its own (Linux and FreeBSD; it has to come before listen()). "cork" */
+/* holds back partial frames until it's turned off again, which sends */
+/* them. */
+PHP_METHOD(TCP, setOptions) {
+  tcp_wrap_t* self;
+  zval* options;
+  const char* error;
+
+  if (zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "a", &options) == FAILURE) {
+    return;
+  }
+
+  self = (tcp_wrap_t*) zend_object_store_get_object(getThis() TSRMLS_CC);
+  HEALTHCHECK(self);
+
+  error = tcp_set_options(self, options TSRMLS_CC);
+  if (error != NULL) {
+    THROW_ERROR((char*) error);
+    RETURN_NULL();
+  }
+
+  RETURN_NULL();
+}
+
+
+uv_buf_t tcp_alloc_cb(uv_handle_t* handle, size_t suggested_size) {
+  tcp_wrap_t* self = (tcp_wrap_t*) handle->data;
+  loop_wrap_t* loop;
+  TSRMLS_D_GET(self);
+
+  loop = loop_wrap_get(handle->loop TSRMLS_CC);
+
+  /* Keep one byte spare so a chunk can be NUL-terminated in place. */
+  return uv_buf_init(read_buf_get(loop), READ_BUF_SIZE - 1);
+}
+
+
+/* Drops read_cb and the reference that came with it; the object may */
+/* go with it. */
+static void tcp_read_release(tcp_wrap_t* self TSRMLS_DC) {
+  zval* ref = self->read_ref;
+
+  if (self->read_cb) {
+    zval_ptr_dtor(&self->read_cb);
+    self->read_cb = NULL;
+  }
+
+  if (ref) {
+    self->read_ref = NULL;
+    zval_ptr_dtor(&ref);
+  }
+}
+
+
+static void tcp_read_cb(uv_stream_t* handle, ssize_t nread, uv_buf_t buf) {
+  tcp_wrap_t* self = (tcp_wrap_t*) handle->data;
+  loop_wrap_t* loop;
+  zval* data;
+  zval* args[1];
+  zval* ref;
+  TSRMLS_D_GET(self);
+
+  loop = loop_wrap_get(handle->loop TSRMLS_CC);
+
+  if (nread == 0) {
+    /* libuv didn't need the buffer after all */
+    read_buf_put(loop, buf.base);
+    return;
+  }
+
+  MAKE_STD_ZVAL(data);
+
+  if (nread < 0) {
+    /* EOF or error, signalled to php land as a NULL chunk. libuv */
+    /* insists that reading has stopped by the time we return. */
+    read_buf_put(loop, buf.base);
+    uv_read_stop(handle);
+    ZVAL_NULL(data);
+  } else if (nread >= READ_BUF_SIZE / 2) {
+    /* Mostly full: hand the buffer itself over to the php string. */
+    buf.base = (char*) erealloc(buf.base, nread + 1);
+    buf.base[nread] = '\0';
+    ZVAL_STRINGL(data, buf.base, nread, 0);
+  } else {
+    /* Small chunk: copying it is cheaper than pinning 64 kB per string. */
+    ZVAL_STRINGL(data, buf.base, nread, 1);
+    read_buf_put(loop, buf.base);
+  }
+
+  /* The callback may let go of the object. */
+  ref = self->read_ref;
+  if (ref) {
+    Z_ADDREF_P(ref);
+  }
+
+  if (self->read_cb) {
+    args[0] = data;
+    call_callback(self->read_cb, 1, args TSRMLS_CC);
+  }
+
+  /* Nothing more to read */
+  if (nread < 0) {
+    tcp_read_release(self TSRMLS_CC);
+  }
+
+  zval_ptr_dtor(&data);
+  if (ref) {
+    zval_ptr_dtor(&ref);
+  }
+}
+
+
+PHP_METHOD(TCP, read) {
+  tcp_wrap_t* self;
+  zval* callback;
+  int r;
+
+  if (zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "z", &callback) == FAILURE) {
+    return;
+  }
+
+  self = (tcp_wrap_t*) zend_object_store_get_object(getThis() TSRMLS_CC);
+  HEALTHCHECK(self);
+
+  r = uv_read_start((uv_stream_t*) &self->handle, tcp_alloc_cb, tcp_read_cb);
+  if (r != 0) {
+    THROW_ERROR(uv_strerror(uv_last_error(self->handle.loop)));
+    RETURN_NULL();
+  }
+
+  if (self->read_cb) {
+    zval_ptr_dtor(&self->read_cb);
+  }
+  self->read_cb = callback;
+  Z_ADDREF_P(callback);
+
+  if (self->read_ref == NULL) {
+    self->read_ref = getThis();
+    Z_ADDREF_P(self->read_ref);
+  }
+
+  RETURN_NULL();
+}
+
+
+PHP_METHOD(TCP, readStop) {
+  tcp_wrap_t* self;
+
+  self = (tcp_wrap_t*) zend_object_store_get_object(getThis() TSRMLS_CC);
+  HEALTHCHECK(self);
+
+  uv_read_stop((uv_stream_t*) &self->handle);
+  tcp_read_release(self TSRMLS_CC);
+
+  RETURN_NULL();
+}
+
+
+static void tcp_close_cb(uv_handle_t* handle) {
+  tcp_wrap_t* self = container_of(handle, tcp_wrap_t, handle);
+  zval* ref = self->read_ref;
+  TSRMLS_D_GET(self);
+
+  self->read_ref = NULL;
+
+  if (self->close_cb) {
+    call_callback(self->close_cb, 0, NULL TSRMLS_CC);
+    zval_ptr_dtor(&self->close_cb);
+    self->close_cb = NULL;
+  }
+
+  if (self->connection_cb) {
+    zval_ptr_dtor(&self->connection_cb);
+    self->connection_cb = NULL;
+  }
+
+  if (self->read_cb) {
+    zval_ptr_dtor(&self->read_cb);
+    self->read_cb = NULL;
+  }
+
+  if (self->drain_cb) {
+    zval_ptr_dtor(&self->drain_cb);
+    self->drain_cb = NULL;
+  }
+
+  tcp_native_drain(self TSRMLS_CC);
+
+  /* Last, they may drop the final reference to this object. */
+  if (self->native_close_cb) {
+    self->native_close_cb(self TSRMLS_CC);
+  }
+
+  if (ref) {
+    zval_ptr_dtor(&ref);
+  }
+}
+
+
+static void tcp_shutdown_cb(uv_shutdown_t* req, int status) {
+  tcp_wrap_t* self = (tcp_wrap_t*) req->data;
+  TSRMLS_D_GET(self);
+
+  efree(req);
+  tcp_close(self TSRMLS_CC);
+}
+
+
+/* Closes the handle once everything written so far has been flushed. */
+void tcp_end(tcp_wrap_t* self TSRMLS_DC) {
+  uv_shutdown_t* req;
+
+  if (self->dead) {
+    return;
+  }
+
+  /* The shutdown has to wait for the file, too. */
+  if (self->sendfile) {
+    self->end_pending = 1;
+    return;
+  }
+
+  /* uv_shutdown() only waits for writes that libuv knows about. */
+  tcp_cork_flush(self TSRMLS_CC);
+
+  req = (uv_shutdown_t*) emalloc(sizeof *req);
+  req->data = (void*) self;
+
+  if (uv_shutdown(req, (uv_stream_t*) &self->handle, tcp_shutdown_cb) != 0) {
+    efree(req);
+    tcp_close(self TSRMLS_CC);
+  }
+}
+
+
+void tcp_close(tcp_wrap_t* self TSRMLS_DC) {
+  if (self->dead) {
+    return;
+  }
+
+  if (self->sendfile) {
+    self->end_pending = 0;
+
+    /* The thread pool may be using the fd right now; close once it's */
+    /* done with it. */
+    if (self->sendfile->busy) {
+      self->close_pending = 1;
+      self->dead = 1;
+      return;
+    }
+
+    sendfile_finish(self->sendfile, -1);
+  }
+
+  /* Give corked writes their chance before the fd goes away. */
+  tcp_cork_flush(self TSRMLS_CC);
+
+  uv_close((uv_handle_t*)&self->handle, tcp_close_cb);
+  self->dead = 1;
+}
+
+
+sendfile_wrap_t* sendfile_wrap_new(zval* socket TSRMLS_DC) {
+  sendfile_wrap_t* wrap;
+
+  wrap = (sendfile_wrap_t*) ecalloc(1, sizeof *wrap);
+  wrap->tcp = (tcp_wrap_t*) zend_object_store_get_object(socket TSRMLS_CC);
+  wrap->socket = socket;
+  wrap->fd = -1;
+  ev_init(&wrap->writable, sendfile_writable_cb);
+  Z_ADDREF_P(socket);
+  TSRMLS_SET(wrap);
+
+  return wrap;
+}
+
+
+void sendfile_wrap_free(sendfile_wrap_t* wrap) {
+  uv_loop_t* loop = wrap->tcp->handle.loop;
+
+  ev_io_stop(loop->ev, &wrap->writable);
+
+  if (wrap->fd >= 0) {
+    uv_fs_close(loop, &wrap->req, wrap->fd, NULL);
+    uv_fs_req_cleanup(&wrap->req);
+  }
+
+  if (wrap->callback) {
+    zval_ptr_dtor(&wrap->callback);
+  }
+
+  if (wrap->owner) {
+    zval_ptr_dtor(&wrap->owner);
+  }
+
+  /* May free the tcp handle's object, touch it before this. */
+  zval_ptr_dtor(&wrap->socket);
+
+  efree(wrap);
+}
+
+
+static void sendfile_fstat_cb(uv_fs_t* req) {
+  sendfile_wrap_t* wrap = container_of(req, sendfile_wrap_t, req);
+  struct stat st;
+  TSRMLS_D_GET(wrap);
+
+  /* libeio frees the stat buffer once we return. */
+  if (req->result < 0) {
+    wrap->error = req->errorno;
+    uv_fs_req_cleanup(req);
+    wrap->stat_cb(wrap, NULL TSRMLS_CC);
+    return;
+  }
+
+  st = *(struct stat*) req->ptr;
+  uv_fs_req_cleanup(req);
+  wrap->stat_cb(wrap, &st TSRMLS_CC);
+}
+
+
+static void sendfile_open_cb(uv_fs_t* req) {
+  sendfile_wrap_t* wrap = container_of(req, sendfile_wrap_t, req);
+  uv_loop_t* loop = req->loop;
+  TSRMLS_D_GET(wrap);
+
+  if (req->result < 0) {
+    wrap->error = req->errorno;
+    uv_fs_req_cleanup(req);
+    wrap->stat_cb(wrap, NULL TSRMLS_CC);
+    return;
+  }
+
+  wrap->fd = req->result;
+  uv_fs_req_cleanup(req);
+
+  if (uv_fs_fstat(loop, req, wrap->fd, sendfile_fstat_cb) != 0) {
+    wrap->error = uv_last_error(loop).code;
+    wrap->stat_cb(wrap, NULL TSRMLS_CC);
+  }
+}
+
+
+/* Opens path and fstat()s it on the thread pool; wrap->stat_cb gets */
+/* the result. Returns -1 if the request couldn't be submitted, or */
+/* SENDFILE_NOT_MAIN_THREAD: libuv's thread pool only reports back to */
+/* the default loop. */
+int sendfile_open(sendfile_wrap_t* wrap, const char* path) {
+  assert(wrap->stat_cb != NULL);
+
+  if (wrap->tcp->handle.loop != uv_default_loop()) {
+    return SENDFILE_NOT_MAIN_THREAD;
+  }
+
+  return uv_fs_open(wrap->tcp->handle.loop,
+                    &wrap->req,
+                    path,
+                    O_RDONLY,
+                    0,
+                    sendfile_open_cb);
+}
+
+
+static void sendfile_finish(sendfile_wrap_t* wrap, int status) {
+  tcp_wrap_t* tcp = wrap->tcp;
+  zval* args[1];
+  TSRMLS_D_GET(wrap);
+
+  tcp->sendfile = NULL;
+  wrap->waiting = 0;
+
+  ev_io_stop(tcp->handle.loop->ev, &wrap->writable);
+
+  if (tcp->close_pending) {
+    tcp->close_pending = 0;
+    uv_close((uv_handle_t*) &tcp->handle, tcp_close_cb);
+  } else if (!tcp->dead) {
+    /* Writes that queued up behind the file */
+    tcp_cork_flush(tcp TSRMLS_CC);
+
+    if (tcp->end_pending) {
+      tcp->end_pending = 0;
+      tcp_end(tcp TSRMLS_CC);
+    }
+  }
+
+  if (wrap->done_cb) {
+    wrap->done_cb(wrap, status TSRMLS_CC);
+  } else if (wrap->callback) {
+    MAKE_STD_ZVAL(args[0]);
+    ZVAL_BOOL(args[0], status == 0);
+    call_callback(wrap->callback, 1, args TSRMLS_CC);
+    zval_ptr_dtor(&args[0]);
+  }
+
+  sendfile_wrap_free(wrap);
+}
+
+
+static void sendfile_cb(uv_fs_t* req);
+
+
+static void sendfile_resume(sendfile_wrap_t* wrap) {
+  tcp_wrap_t* tcp = wrap->tcp;
+
+  wrap->waiting = 0;
+  wrap->busy = 1;
+
+  if (uv_fs_sendfile(tcp->handle.loop,
+                     &wrap->req,
+                     tcp->handle.fd,
+                     wrap->fd,
+                     wrap->offset,
+                     wrap->length,
+                     sendfile_cb) != 0) {
+    wrap->busy = 0;
+    sendfile_finish(wrap, -1);
+  }
+}
+
+
+static void sendfile_writable_cb(struct ev_loop* ev, ev_io* watcher, int revents) {
+  ev_io_stop(ev, watcher);
+  sendfile_resume(container_of(watcher, sendfile_wrap_t, writable));
+}
+
+
+static void sendfile_cb(uv_fs_t* req) {
+  sendfile_wrap_t* wrap = container_of(req, sendfile_wrap_t, req);
+  ssize_t result = req->result;
+  uv_err_code error = req->errorno;
+
+  uv_fs_req_cleanup(req);
+  wrap->busy = 0;
+
+  if (wrap->tcp->dead) {
+    sendfile_finish(wrap, -1);
+    return;
+  }
+
+  if (result > 0) {
+    wrap->offset += result;
+    wrap->length -= result;
+
+    if (wrap->length == 0) {
+      sendfile_finish(wrap, 0);
+    } else {
+      sendfile_resume(wrap);
+    }
+    return;
+  }
+
+  /* The socket is non-blocking; a full send buffer shows up as EAGAIN. */
+  /* Carry on once the loop sees it writable again. */
+  if (result < 0 && error == UV_EAGAIN) {
+    ev_io_set(&wrap->writable, wrap->tcp->handle.fd, EV_WRITE);
+    ev_io_start(wrap->tcp->handle.loop->ev, &wrap->writable);
+    return;
+  }
+
+  /* An error, or the file shrank under us */
+  sendfile_finish(wrap, -1);
+}
+
+
+/* Sends length bytes of the open file from offset once everything */
+/* written to the socket before has gone out. Takes ownership of wrap. */
+void sendfile_start(sendfile_wrap_t* wrap, off_t offset, size_t length) {
+  tcp_wrap_t* tcp = wrap->tcp;
+  TSRMLS_D_GET(wrap);
+
+  wrap->offset = offset;
+  wrap->length = length;
+
+  if (tcp->dead || tcp->sendfile) {
+    if (wrap->done_cb) {
+      wrap->done_cb(wrap, -1 TSRMLS_CC);
+    }
+    sendfile_wrap_free(wrap);
+    return;
+  }
+
+  tcp_cork_flush(tcp TSRMLS_CC);
+  tcp->sendfile = wrap;
+
+  if (length == 0) {
+    sendfile_finish(wrap, 0);
+  } else if (tcp->handle.write_queue_size == 0) {
+    sendfile_resume(wrap);
+  } else {
+    wrap->waiting = 1;
+  }
+}
+
+
+static void tcp_sendfile_stat_cb(sendfile_wrap_t* wrap, struct stat* st TSRMLS_DC) {
+  zval* args[1];
+
+  if (st == NULL || !S_ISREG(st->st_mode) || wrap->offset > st->st_size) {
+    if (wrap->callback) {
+      MAKE_STD_ZVAL(args[0]);
+      ZVAL_BOOL(args[0], 0);
+      call_callback(wrap->callback, 1, args TSRMLS_CC);
+      zval_ptr_dtor(&args[0]);
+    }
+    sendfile_wrap_free(wrap);
+    return;
+  }
+
+  if (wrap->length > (size_t) (st->st_size - wrap->offset)) {
+    wrap->length = st->st_size - wrap->offset;
+  }
+
+  sendfile_start(wrap, wrap->offset, wrap->length);
+}
+
+
+PHP_METHOD(TCP, sendFile) {
+  tcp_wrap_t* self;
+  sendfile_wrap_t* wrap;
+  char* path;
+  int path_length;
+  long offset = 0;
+  long length = -1;
+  zval* callback = NULL;
+  int r;
+
+  if (zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "s|llz!", &path, &path_length, &offset, &length, &callback) == FAILURE) {
+    return;
+  }
+
+  self = (tcp_wrap_t*) zend_object_store_get_object(getThis() TSRMLS_CC);
+  HEALTHCHECK(self);
+
+  if (offset < 0) {
+    THROW_ERROR("Offset must not be negative");
+    RETURN_NULL();
+  }
+
+  wrap = sendfile_wrap_new(getThis() TSRMLS_CC);
+  wrap->stat_cb = tcp_sendfile_stat_cb;
+  wrap->offset = offset;
+  /* -1 means up to the end of the file */
+  wrap->length = length < 0 ? (size_t) -1 : (size_t) length;
+
+  if (callback) {
+    wrap->callback = callback;
+    Z_ADDREF_P(callback);
+  }
+
+  r = sendfile_open(wrap, path);
+  if (r != 0) {
+    sendfile_wrap_free(wrap);
+    if (r == SENDFILE_NOT_MAIN_THREAD) {
+      THROW_ERROR("sendFile needs the main thread");
+      RETURN_NULL();
+    }
+    RETURN_FALSE;
+  }
+
+  RETURN_TRUE;
+}
+
+
+PHP_METHOD(TCP, close) {
+  tcp_wrap_t* self;
+  zval* callback;
+
+  if (zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "z", &callback) == FAILURE) {
+    return;
+  }
+
+  self = (tcp_wrap_t*) zend_object_store_get_object(getThis() TSRMLS_CC);
+  HEALTHCHECK(self);
+
+  self->close_cb = callback;
+  Z_ADDREF_P(callback);
+
+  tcp_close(self TSRMLS_CC);
+
+  RETURN_NULL();
+}
+
+
+void tcp_connection_cb(uv_stream_t* server_handle, int status) {
+  tcp_wrap_t* self = (tcp_wrap_t*) server_handle->data;
+  tcp_wrap_t* client_wrap;
+  zval* client_zval;
+  int r;
+  TSRMLS_D_GET(self);
+
+  /* Nobody to tell from inside the loop; the next connection may */
+  /* fare better, e.g. once fds free up after EMFILE. */
+  if (status != 0) {
+    return;
+  }
+
+  /* Create container for new object, a Pipe for a Pipe server */
+  MAKE_STD_ZVAL(client_zval);
+  Z_TYPE_P(client_zval) = IS_OBJECT;
+  if (server_handle->type == UV_NAMED_PIPE) {
+    Z_OBJVAL_P(client_zval) = pipe_new(pipe_ce TSRMLS_CC);
+  } else {
+    Z_OBJVAL_P(client_zval) = tcp_new(tcp_ce TSRMLS_CC);
+  }
+  client_wrap = (tcp_wrap_t*) zend_object_store_get_object(client_zval TSRMLS_CC);
+
+  /* Accept connection */
+  /* The handle never got going, so the object can go right away */
+  r = uv_accept(server_handle, (uv_stream_t*) &client_wrap->handle);
+  if (r != 0) {
+    zval_ptr_dtor(&client_zval);
+    return;
+  }
+
+  /* The listener's per-connection options; a failure to set them */
+  /* is no reason to drop the connection. */
+  client_wrap->opt_nodelay = self->opt_nodelay;
+  client_wrap->opt_keepalive = self->opt_keepalive;
+  client_wrap->opt_keepalive_idle = self->opt_keepalive_idle;
+  client_wrap->opt_sndbuf = self->opt_sndbuf;
+  client_wrap->opt_rcvbuf = self->opt_rcvbuf;
+  tcp_options_apply(client_wrap, TCP_OPT_ALL);
+
+  /* Native protocols take ownership of the client */
+  if (self->native_connection_cb) {
+    self->native_connection_cb(self, client_zval TSRMLS_CC);
+    return;
+  }
+
+  /* Call the connection callback */
+  if (self->connection_cb) {
+    zval* args[1];
+    args[0] = client_zval;
+    call_callback(self->connection_cb, 1, args TSRMLS_CC);
+  }
+};
+
+
+static socklen_t tcp_addr_len(tcp_addr_t* addr) {
+  return addr->sa.sa_family == AF_INET6 ? sizeof(addr->in6) : sizeof(addr->in);
+}
+
+
+static int tcp_addr_equal(tcp_addr_t* a, tcp_addr_t* b) {
+  if (a->sa.sa_family != b->sa.sa_family) {
+    return 0;
+  }
+
+  if (a->sa.sa_family == AF_INET6) {
+    return a->in6.sin6_port == b->in6.sin6_port &&
+           memcmp(&a->in6.sin6_addr, &b->in6.sin6_addr, sizeof(a->in6.sin6_addr)) == 0;
+  }
+
+  return a->in.sin_port == b->in.sin_port &&
+         a->in.sin_addr.s_addr == b->in.sin_addr.s_addr;
+}
+
+
+void tcp_addr_set(tcp_addr_t* addr, dns_addr_t* ip, int port) {
+  memset(addr, 0, sizeof(*addr));
+
+  if (ip->family == AF_INET6) {
+    addr->in6.sin6_family = AF_INET6;
+    addr->in6.sin6_port = htons(port);
+    addr->in6.sin6_addr = ip->v6;
+  } else {
+    addr->in.sin_family = AF_INET;
+    addr->in.sin_port = htons(port);
+    addr->in.sin_addr = ip->v4;
+  }
+}
+
+
+#ifdef ZTS
+static shared_listener_t* shared_listener_find(tcp_addr_t* addr) {
+  shared_listener_t* l;
+
+  for (l = shared_listeners; l != NULL; l = l->next) {
+    if (tcp_addr_equal(&l->addr, addr)) {
+      return l;
+    }
+  }
+
+  return NULL;
+}
+#endif
+
+
+/* Remembers a listener for the workers of a later uv_cluster() */
+static void cluster_listener_add(tcp_wrap_t* self) {
+  shared_listener_t* l;
+  socklen_t len;
+
+  l = malloc(sizeof(*l));
+  len = sizeof(l->addr);
+
+  /* The address actually bound, so port 0 works too */
+  if (getsockname(self->handle.fd, &l->addr.sa, &len)) {
+    free(l);
+    return;
+  }
+
+  l->fd = self->handle.fd;
+  l->backlog = self->backlog;
+  l->defer_accept = self->opt_defer_accept;
+  l->next = cluster_listeners;
+  cluster_listeners = l;
+}
+
+
+/* Keeps the record of a listener in step with setOptions() */
+static void cluster_listener_update(tcp_wrap_t* self) {
+  shared_listener_t* l;
+
+  if (cluster_index >= 0) {
+    return;
+  }
+
+  for (l = cluster_listeners; l != NULL; l = l->next) {
+    if (l->fd == self->handle.fd) {
+      l->backlog = self->backlog;
+      l->defer_accept = self->opt_defer_accept;
+    }
+  }
+}
+
+
+/* Returns NULL on success, or the error message. */
+static const char* tcp_bind_listen(tcp_wrap_t* self, tcp_addr_t* addr) {
+  uv_loop_t* loop = self->handle.loop;
+  const char* error = NULL;
+  int r;
+#ifdef ZTS
+  shared_listener_t* l;
+  int fd;
+
+  if (phode_threads_active) {
+    pthread_mutex_lock(&shared_listeners_lock);
+
+    /* Another thread got there first, accept from its socket too */
+    l = shared_listener_find(addr);
+    if (l != NULL) {
+      fd = dup(l->fd);
+      pthread_mutex_unlock(&shared_listeners_lock);
+
+      if (fd < 0) {
+        return strerror(errno);
+      }
+      fcntl(fd, F_SETFD, FD_CLOEXEC);
+
+      self->handle.fd = fd;
+      if ((error = tcp_options_apply(self, TCP_OPT_ALL)) != NULL) {
+        return error;
+      }
+      if (uv_listen((uv_stream_t*) &self->handle, self->backlog, tcp_connection_cb)) {
+        return uv_strerror(uv_last_error(loop));
+      }
+      return NULL;
+    }
+  }
+#endif
+
+#ifdef PHODE_SO_REUSEPORT
+  /* So that uv_cluster() workers can bind sockets of their own next */
+  /* to this one */
+  if (self->opt_reuseport > 0) {
+    int yes = 1;
+
+    if (self->handle.fd < 0 &&
+        (error = tcp_socket_open(self, addr->sa.sa_family)) != NULL) {
+      return error;
+    }
+    if (setsockopt(self->handle.fd, SOL_SOCKET, PHODE_SO_REUSEPORT, &yes, sizeof(yes))) {
+      return strerror(errno);
+    }
+  }
+#endif
+
+  r = addr->sa.sa_family == AF_INET6
+    ? uv_tcp_bind6(&self->handle, addr->in6)
+    : uv_tcp_bind(&self->handle, addr->in);
+
+  /* Options go on between bind() and listen(), so that accepted */
+  /* sockets inherit the buffer sizes from the start */
+  if (r) {
+    error = uv_strerror(uv_last_error(loop));
+  } else if ((error = tcp_options_apply(self, TCP_OPT_ALL)) == NULL &&
+             uv_listen((uv_stream_t*) &self->handle, self->backlog, tcp_connection_cb)) {
+    error = uv_strerror(uv_last_error(loop));
+  }
+
+#ifdef ZTS
+  if (phode_threads_active) {
+    if (error == NULL) {
+      l = malloc(sizeof(*l));
+      l->addr = *addr;
+      l->fd = dup(self->handle.fd);
+      if (l->fd < 0) {
+        free(l);
+      } else {
+        fcntl(l->fd, F_SETFD, FD_CLOEXEC);
+        l->next = shared_listeners;
+        shared_listeners = l;
+      }
+    }
+    pthread_mutex_unlock(&shared_listeners_lock);
+  }
+#endif
+
+  if (error == NULL && cluster_index < 0 && loop == uv_default_loop()) {
+    cluster_listener_add(self);
+  }
+
+  return error;
+}
+
+
+/* A listen() waiting for its host name */
+typedef struct {
+  zval* socket;
+  char* host;
+  long port;
+  /* Told if it doesn't come off; may be NULL */
+  zval* error_cb;
+} listen_wrap_t;
+
+
+static void listen_wrap_free(listen_wrap_t* wrap TSRMLS_DC) {
+  zval_ptr_dtor(&wrap->socket);
+  if (wrap->error_cb) {
+    zval_ptr_dtor(&wrap->error_cb);
+  }
+  efree(wrap->host);
+  efree(wrap);
+}
+
+
+static void tcp_listen_resolve_cb(void* data, dns_addr_t* ip, const char* error TSRMLS_DC) {
+  listen_wrap_t* wrap = (listen_wrap_t*) data;
+  tcp_wrap_t* self;
+  tcp_addr_t addr;
+  zval* args[1];
+
+  /* The loop is going away */
+  if (ip == NULL && error == NULL) {
+    listen_wrap_free(wrap TSRMLS_CC);
+    return;
+  }
+
+  self = (tcp_wrap_t*) zend_object_store_get_object(wrap->socket TSRMLS_CC);
+
+  if (self->dead) {
+    listen_wrap_free(wrap TSRMLS_CC);
+    return;
+  }
+
+  if (ip != NULL) {
+    tcp_addr_set(&addr, ip, wrap->port);
+    error = tcp_bind_listen(self, &addr);
+  }
+
+  if (error != NULL) {
+    self->listening = 0;
+
+    if (wrap->error_cb) {
+      MAKE_STD_ZVAL(args[0]);
+      ZVAL_STRING(args[0], (char*) error, 1);
+      call_callback(wrap->error_cb, 1, args TSRMLS_CC);
+      zval_ptr_dtor(&args[0]);
+    } else {
+      php_error_docref(NULL TSRMLS_CC, E_WARNING, "Can't listen on %s:%ld: %s",
+                       wrap->host, wrap->port, error);
+    }
+  }
+
+  listen_wrap_free(wrap TSRMLS_CC);
+}
+
+
+/* Listens on host:port, or on any address when host is NULL. Addresses */
+/* and names in /etc/hosts are bound right away; other names are looked */
+/* up on the loop first, and a failure after that goes to error_cb, or */
+/* is a warning without one. Returns NULL on success, or the error */
+/* message. */
+const char* tcp_listen(zval* socket, const char* host, long port, zval* error_cb TSRMLS_DC) {
+  tcp_wrap_t* self = (tcp_wrap_t*) zend_object_store_get_object(socket TSRMLS_CC);
+  listen_wrap_t* wrap;
+  dns_addr_t ip;
+  tcp_addr_t addr;
+  const char* error;
+
+  if (self->listening) {
+    return "Already listening";
+  }
+
+  if (host == NULL) {
+    ip.family = AF_INET;
+    ip.v4.s_addr = htonl(INADDR_ANY);
+  } else if (dns_resolve_local(self->handle.loop, host, &ip TSRMLS_CC) != 0) {
+    wrap = (listen_wrap_t*) emalloc(sizeof *wrap);
+    wrap->socket = socket;
+    Z_ADDREF_P(socket);
+    wrap->host = estrdup(host);
+    wrap->port = port;
+    wrap->error_cb = error_cb;
+    if (error_cb) {
+      Z_ADDREF_P(error_cb);
+    }
+
+    self->listening = 1;
+    dns_resolve(self->handle.loop, host, tcp_listen_resolve_cb, wrap TSRMLS_CC);
+    return NULL;
+  }
+
+  tcp_addr_set(&addr, &ip, port);
+
+  error = tcp_bind_listen(self, &addr);
+  if (error == NULL) {
+    self->listening = 1;
+  }
+
+  return error;
+}
+
+
+/* listen($port, $host, $cb, $onError) calls $cb($client) for every */
+/* connection. A $host that has to be looked up is bound once it has */
+/* been, and $onError($error) hears about it if that fails. */
+PHP_METHOD(TCP, listen) {
+  tcp_wrap_t* self;
+  zval* arg1, *arg2, *arg3;
+  zval* port, *host, *callback;
+  zval* error_cb = NULL;
+  const char* error;
+
+  self = (tcp_wrap_t*) zend_object_store_get_object(getThis() TSRMLS_CC);
+  HEALTHCHECK(self);
+
+  if (zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "z|z!z!z!", &arg1, &arg2, &arg3, &error_cb) == FAILURE) {
+    return;
+  }
+
+  if (Z_TYPE_P(arg1) == IS_LONG) {
+    port = arg1;
+  } else {
+    /* Unix sockets need a handle of their own kind */
+    THROW_ERROR("Use a Pipe for unix sockets");
+    RETURN_NULL();
+  }
+
+  if (ZEND_NUM_ARGS() >= 3) {
+    host = arg2;
+    callback = arg3;
+  } else if (ZEND_NUM_ARGS() == 2) {
+    if (arg2 && Z_TYPE_P(arg2) == IS_STRING) {
+      host = arg2;
+      callback = NULL;
+    } else {
+      host = NULL;
+      callback = arg2;
+    }
+  } else {
+    callback = NULL;
+    host = NULL;
+  }
+
+  if (host && Z_TYPE_P(host) != IS_STRING) {
+    THROW_ERROR("Host must be a string or null");
+    RETURN_NULL();
+  }
+
+  /* An HttpServer's connection_cb is its request handler */
+  if (callback && self->native_connection_cb) {
+    THROW_ERROR("This server takes no connection callback");
+    RETURN_NULL();
+  }
+
+  error = tcp_listen(getThis(), host ? Z_STRVAL_P(host) : NULL, Z_LVAL_P(port), error_cb TSRMLS_CC);
+  if (error != NULL) {
+    THROW_ERROR((char*) error);
+    RETURN_NULL();
+  }
+
+  if (callback) {
+    if (self->connection_cb) {
+      zval_ptr_dtor(&self->connection_cb);
+    }
+    self->connection_cb = callback;
+    Z_ADDREF_P(callback);
+  }
+
+  RETURN_NULL();
+}
+
+
+static zend_function_entry tcp_methods[] = {
+  PHP_ME(TCP, connect, NULL, ZEND_ACC_PUBLIC)
+  PHP_ME(TCP, write, NULL, ZEND_ACC_PUBLIC)
+  PHP_ME(TCP, writev, NULL, ZEND_ACC_PUBLIC)
+  PHP_ME(TCP, writeQueueSize, NULL, ZEND_ACC_PUBLIC)
+  PHP_ME(TCP, setWatermarks, NULL, ZEND_ACC_PUBLIC)
+  PHP_ME(TCP, onDrain, NULL, ZEND_ACC_PUBLIC)
+  PHP_ME(TCP, autoCork, NULL, ZEND_ACC_PUBLIC)
+  PHP_ME(TCP, setOptions, NULL, ZEND_ACC_PUBLIC)
+  PHP_ME(TCP, read, NULL, ZEND_ACC_PUBLIC)
+  PHP_ME(TCP, readStop, NULL, ZEND_ACC_PUBLIC)
+  PHP_ME(TCP, sendFile, NULL, ZEND_ACC_PUBLIC)
+  PHP_ME(TCP, close, NULL, ZEND_ACC_PUBLIC)
+  PHP_ME(TCP, listen, NULL, ZEND_ACC_PUBLIC)
+  { NULL }
+};
+
+
+/* connect($path, $cb) calls $cb($error) once connected to the unix */
+/* socket at $path, or failed to. */
+PHP_METHOD(Pipe, connect) {
+  char* path;
+  int path_length;
+  zval* callback;
+  connect_wrap_t* connect_wrap;
+  tcp_wrap_t* self;
+
+  if (zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "sz", &path, &path_length, &callback) == FAILURE) {
+    return;
+  }
+
+  self = (tcp_wrap_t*) zend_object_store_get_object(getThis() TSRMLS_CC);
+  HEALTHCHECK(self);
+
+  connect_wrap = connect_wrap_new(getThis(), callback, 0 TSRMLS_CC);
+
+  /* Errors, too, come through the callback */
+  uv_pipe_connect(&connect_wrap->req, &self->pipe, path, tcp_connect_cb);
+
+  RETURN_NULL();
+}
+
+
+/* listen($path, $cb) calls $cb($client) with a Pipe for every */
+/* connection to the unix socket at $path. A stale socket file is */
+/* replaced; the file goes away again on close(). */
+PHP_METHOD(Pipe, listen) {
+  tcp_wrap_t* self;
+  char* path;
+  int path_length;
+  zval* callback = NULL;
+  const char* error;
+
+  if (zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "s|z!", &path, &path_length, &callback) == FAILURE) {
+    return;
+  }
+
+  self = (tcp_wrap_t*) zend_object_store_get_object(getThis() TSRMLS_CC);
+  HEALTHCHECK(self);
+
+  if (self->listening) {
+    THROW_ERROR("Already listening");
+    RETURN_NULL();
+  }
+
+  if (uv_pipe_bind(&self->pipe, path)) {
+    THROW_ERROR(uv_strerror(uv_last_error(self->pipe.loop)));
+    RETURN_NULL();
+  }
+
+  error = tcp_options_apply(self, TCP_OPT_ALL);
+  if (error == NULL &&
+      uv_listen((uv_stream_t*) &self->pipe, self->backlog, tcp_connection_cb)) {
+    error = uv_strerror(uv_last_error(self->pipe.loop));
+  }
+
+  if (error != NULL) {
+    THROW_ERROR((char*) error);
+    RETURN_NULL();
+  }
+
+  self->listening = 1;
+  if (callback) {
+    if (self->connection_cb) {
+      zval_ptr_dtor(&self->connection_cb);
+    }
+    self->connection_cb = callback;
+    Z_ADDREF_P(callback);
+  }
+
+  RETURN_NULL();
+}
+
+
+/* The rest is inherited from TCP */
+static zend_function_entry pipe_methods[] = {
+  PHP_ME(Pipe, connect, NULL, ZEND_ACC_PUBLIC)
+  PHP_ME(Pipe, listen, NULL, ZEND_ACC_PUBLIC)
+  { NULL }
+};
+
+
+PHP_MINIT_FUNCTION(phode) {
+  zend_class_entry ce;
+
+  INIT_CLASS_ENTRY(ce, "TCP", tcp_methods);
+  ce.create_object = tcp_new;
+  tcp_ce = zend_register_internal_class(&ce TSRMLS_CC);
+
+  INIT_CLASS_ENTRY(ce, "Pipe", pipe_methods);
+  ce.create_object = pipe_new;
+  pipe_ce = zend_register_internal_class_ex(&ce, tcp_ce, NULL TSRMLS_CC);
+
+  http_init(TSRMLS_C);
+  mysql_init(TSRMLS_C);
+  mysql_server_init(TSRMLS_C);
+  pgsql_init(TSRMLS_C);
+  ipc_init(TSRMLS_C);
+
+  return SUCCESS;
+}
+
+
+PHP_MSHUTDOWN_FUNCTION(phode) {
+  return SUCCESS;
+}
+
+
+PHP_RSHUTDOWN_FUNCTION(phode) {
+  shared_listener_t* l;
+#ifdef ZTS
+  long i;
+
+  /* The main thread waits for the others before its request ends */
+  if (PHODE_G(thread_index) == 0 && phode_threads != NULL) {
+    for (i = 0; i < phode_thread_count; i++) {
+      pthread_join(phode_threads[i].thread, NULL);
+      free(phode_threads[i].script);
+    }
+    free(phode_threads);
+    phode_threads = NULL;
+    phode_thread_count = 0;
+
+    while ((l = shared_listeners) != NULL) {
+      shared_listeners = l->next;
+      close(l->fd);
+      free(l);
+    }
+  }
+#endif
+
+  if (phode_loop(TSRMLS_C) == uv_default_loop()) {
+    /* The sockets themselves belong to their TCP handles */
+    while ((l = cluster_listeners) != NULL) {
+      cluster_listeners = l->next;
+      free(l);
+    }
+  }
+
+  loop_wrap_free(phode_loop(TSRMLS_C));
+  return SUCCESS;
+}
+
+
+static PHP_GINIT_FUNCTION(phode) {
+  phode_globals->loop = NULL;
+  phode_globals->thread_index = 0;
+}
+
+
+PHP_MINFO_FUNCTION(phode) {
+  php_info_print_table_start();
+  php_info_print_table_header(2, "phode", "enabled");
+  php_info_print_table_end();
+}
+
+
+PHP_FUNCTION(uv_run) {
+  uv_run(phode_loop(TSRMLS_C));
+  RETURN_NULL();
+}
+
+
+#ifdef ZTS
+static void phode_threads_signal(int go) {
+  pthread_mutex_lock(&phode_threads_lock);
+  phode_threads_go = go;
+  pthread_cond_broadcast(&phode_threads_cond);
+  pthread_mutex_unlock(&phode_threads_lock);
+}
+
+
+/* A request of the CLI SAPI's, set up the way php_cli.c does for the */
+/* main thread: same script and argv, no headers, no chdir(), no */
+/* shebang line. What the CLI does outside the request isn't there: */
+/* the STDIN, STDOUT and STDERR constants are not defined, and the */
+/* interactive shell, -r and stdin scripts can't be threaded. */
+static void* phode_thread_main(void* arg) {
+  phode_thread_t* t = (phode_thread_t*) arg;
+  zend_file_handle file;
+  uv_loop_t* loop;
+  int go;
+  TSRMLS_FETCH();
+
+  pthread_mutex_lock(&phode_threads_lock);
+  while ((go = phode_threads_go) == PHODE_THREADS_WAIT) {
+    pthread_cond_wait(&phode_threads_cond, &phode_threads_lock);
+  }
+  pthread_mutex_unlock(&phode_threads_lock);
+
+  if (go == PHODE_THREADS_ABORT) {
+    ts_free_thread();
+    return NULL;
+  }
+
+  loop = uv_loop_new();
+  PHODE_G(loop) = loop;
+  PHODE_G(thread_index) = t->index;
+
+  SG(options) |= SAPI_OPTION_NO_CHDIR;
+  SG(headers_sent) = 1;
+  SG(request_info).no_headers = 1;
+  SG(request_info).path_translated = t->script;
+  SG(request_info).argc = t->argc;
+  SG(request_info).argv = t->argv;
+  CG(skip_shebang) = 1;
+
+  if (php_request_startup(TSRMLS_C) == SUCCESS) {
+    memset(&file, 0, sizeof(file));
+    file.type = ZEND_HANDLE_FILENAME;
+    file.filename = t->script;
+    php_execute_script(&file TSRMLS_CC);
+  }
+  php_request_shutdown(NULL);
+
+  SG(request_info).path_translated = NULL;
+  SG(request_info).argc = 0;
+  SG(request_info).argv = NULL;
+  PHODE_G(loop) = NULL;
+  uv_loop_delete(loop);
+  ts_free_thread();
+
+  return NULL;
+}
+#endif
+
+
+/* Runs the current script on `count` threads, each with its own loop. */
+/* Returns the thread's index, 0 being the one that called it first. */
+/* Only under the CLI, see phode_thread_main() for what the threads */
+/* don't get. sendFile() throws on all but the first. */
+PHP_FUNCTION(uv_threads) {
+  long count;
+#ifdef ZTS
+  const char* script;
+  long i;
+#endif
+
+  if (zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "l", &count) == FAILURE) {
+    return;
+  }
+
+#ifdef ZTS
+  /* Started by an earlier uv_threads(), just tell it who it is */
+  if (PHODE_G(thread_index) != 0) {
+    RETURN_LONG(PHODE_G(thread_index));
+  }
+
+  if (phode_threads_active) {
+    THROW_ERROR("Threads already started");
+    RETURN_NULL();
+  }
+
+  if (count < 1 || count > 256) {
+    THROW_ERROR("Thread count out of range");
+    RETURN_NULL();
+  }
+
+  /* Other SAPIs tie requests to a connection of their own */
+  if (strcmp(sapi_module.name, "cli") != 0) {
+    THROW_ERROR("Threads need the CLI");
+    RETURN_NULL();
+  }
+
+  script = SG(request_info).path_translated;
+  if (script == NULL) {
+    THROW_ERROR("Can't find the script to run");
+    RETURN_NULL();
+  }
+
+  phode_threads_active = 1;
+  phode_threads_go = PHODE_THREADS_WAIT;
+  phode_threads = calloc(count - 1, sizeof(phode_thread_t));
+
+  for (i = 0; i < count - 1; i++) {
+    phode_threads[i].index = i + 1;
+    phode_threads[i].script = strdup(script);
+    phode_threads[i].argc = SG(request_info).argc;
+    phode_threads[i].argv = SG(request_info).argv;
+    if (pthread_create(&phode_threads[i].thread,
+                       NULL,
+                       phode_thread_main,
+                       &phode_threads[i])) {
+      free(phode_threads[i].script);
+      break;
+    }
+  }
+  phode_thread_count = i;
+
+  if (phode_thread_count != count - 1) {
+    /* Call off the ones that did start; none has run any PHP yet. */
+    phode_threads_signal(PHODE_THREADS_ABORT);
+    for (i = 0; i < phode_thread_count; i++) {
+      pthread_join(phode_threads[i].thread, NULL);
+      free(phode_threads[i].script);
+    }
+    free(phode_threads);
+    phode_threads = NULL;
+    phode_thread_count = 0;
+    phode_threads_active = 0;
+
+    THROW_ERROR("Failed to start all threads");
+    RETURN_NULL();
+  }
+
+  phode_threads_signal(PHODE_THREADS_RUN);
+
+  RETURN_LONG(0);
+#else
+  THROW_ERROR("Threads need a ZTS build of PHP");
+  RETURN_NULL();
+#endif
+}
+
+
+static void cluster_signal_cb(int signum) {
+  cluster_stopping = 1;
+}
+
+
+/* Only there to interrupt waitpid() when a restart is due */
+static void cluster_alarm_cb(int signum) {
+}
+
+
+/* Whether l's socket is still open and listening on its address */
+static int cluster_listener_alive(shared_listener_t* l) {
+  tcp_addr_t addr;
+  socklen_t len = sizeof(addr);
+  int listening = 0;
+  socklen_t optlen = sizeof(listening);
+
+  if (getsockname(l->fd, &addr.sa, &len) ||
+      getsockopt(l->fd, SOL_SOCKET, SO_ACCEPTCONN, &listening, &optlen)) {
+    return 0;
+  }
+
+  return listening && tcp_addr_equal(&addr, &l->addr);
+}
+
+
+#ifdef PHODE_SO_REUSEPORT
+/* Puts a socket of this process's own on l's address in the place of */
+/* the one its TCP handle was listening on. */
+static int cluster_rebind(shared_listener_t* l) {
+  int fd;
+  int yes = 1;
+
+  fd = socket(l->addr.sa.sa_family, SOCK_STREAM, 0);
+  if (fd < 0) {
+    return -1;
+  }
+
+  if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes)) ||
+      setsockopt(fd, SOL_SOCKET, PHODE_SO_REUSEPORT, &yes, sizeof(yes)) ||
+      bind(fd, &l->addr.sa, tcp_addr_len(&l->addr)) ||
+      tcp_option_set(fd, IPPROTO_TCP, PHODE_TCP_DEFER_ACCEPT, l->defer_accept) ||
+      listen(fd, l->backlog) ||
+      fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK)) {
+    close(fd);
+    return -1;
+  }
+
+  /* A worker started again after the master let go of its sockets */
+  /* may well get the same number back. */
+  if (fd != l->fd) {
+    if (dup2(fd, l->fd) < 0) {
+      close(fd);
+      return -1;
+    }
+    close(fd);
+  }
+
+  fcntl(l->fd, F_SETFD, FD_CLOEXEC);
+  return 0;
+}
+#endif
+
+
+/* Runs in a worker right after fork() */
+static void cluster_worker_init(long index TSRMLS_DC) {
+  shared_listener_t* l MAYBE_UNUSED;
+#ifdef __linux__
+  cpu_set_t set;
+  long cpus;
+#endif
+
+  signal(SIGTERM, SIG_DFL);
+  signal(SIGINT, SIG_DFL);
+  signal(SIGALRM, SIG_DFL);
+  alarm(0);
+
+  cluster_index = index;
+
+  /* The epoll/kqueue fd is still the master's */
+  ev_loop_fork(uv_default_loop()->ev);
+
+#ifdef __linux__
+  cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  if (cluster_pin && cpus > 0) {
+    CPU_ZERO(&set);
+    CPU_SET(index % cpus, &set);
+    sched_setaffinity(0, sizeof(set), &set);
+  }
+#endif
+
+#ifdef PHODE_SO_REUSEPORT
+  /* The first worker keeps the master's sockets, and whatever is */
+  /* already queued on them; one started again later has to bind, */
+  /* the master has let go of them by then. */
+  if (cluster_reuseport && !(index == 0 && cluster_ready[1] >= 0)) {
+    for (l = cluster_listeners; l != NULL; l = l->next) {
+      if (cluster_rebind(l)) {
+        /* Nothing to serve; the master tries again in a bit */
+        _exit(1);
+      }
+    }
+  }
+#endif
+
+  if (cluster_ready[1] >= 0) {
+    /* Unable to report in; go the way of a failed rebind */
+    if (write(cluster_ready[1], "", 1) != 1) {
+      _exit(1);
+    }
+    close(cluster_ready[1]);
+    close(cluster_ready[0]);
+    cluster_ready[0] = cluster_ready[1] = -1;
+  }
+}
+
+
+/* Returns 1 in the new worker, 0 in the master */
+static int cluster_spawn(long index TSRMLS_DC) {
+  pid_t pid;
+
+  pid = fork();
+  if (pid == 0) {
+    cluster_worker_init(index TSRMLS_CC);
+    return 1;
+  }
+
+  /* A failed fork leaves the slot empty */
+  cluster_workers[index].pid = pid > 0 ? pid : 0;
+  cluster_workers[index].started = time(NULL);
+  return 0;
+}
+
+
+/* The master's side: restarts workers that crash until SIGTERM or */
+/* SIGINT. Returns the index in a restarted worker, -1 in the master */
+/* once all workers are gone. */
+static long cluster_supervise(TSRMLS_D) {
+  int status;
+  int killed = 0;
+  int waiting;
+  pid_t pid;
+  time_t now;
+  time_t next;
+  long i;
+
+  for (;;) {
+    if (cluster_stopping && !killed) {
+      for (i = 0; i < cluster_count; i++) {
+        if (cluster_workers[i].pid > 0) {
+          kill(cluster_workers[i].pid, SIGTERM);
+        }
+      }
+      killed = 1;
+    }
+
+    /* Start the workers whose time has come, and have an alarm wake */
+    /* us for the next one. */
+    now = time(NULL);
+    next = 0;
+    for (i = 0; i < cluster_count; i++) {
+      if (cluster_workers[i].restart_at == 0) {
+        continue;
+      }
+      if (cluster_stopping) {
+        cluster_workers[i].restart_at = 0;
+      } else if (cluster_workers[i].restart_at <= now) {
+        cluster_workers[i].restart_at = 0;
+        if (cluster_spawn(i TSRMLS_CC)) {
+          return i;
+        }
+      } else if (next == 0 || cluster_workers[i].restart_at < next) {
+        next = cluster_workers[i].restart_at;
+      }
+    }
+    waiting = next != 0;
+    alarm(waiting ? (unsigned) (next - now) : 0);
+
+    pid = waitpid(-1, &status, 0);
+    if (pid < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      /* No worker left, but some are due back */
+      if (errno == ECHILD && waiting) {
+        pause();
+        continue;
+      }
+      return -1;
+    }
+
+    for (i = 0; i < cluster_count; i++) {
+      if (cluster_workers[i].pid == pid) {
+        break;
+      }
+    }
+    if (i == cluster_count) {
+      continue;
+    }
+    cluster_workers[i].pid = 0;
+
+    /* Stopping, or the worker finished on its own accord */
+    if (cluster_stopping || (WIFEXITED(status) && WEXITSTATUS(status) == 0)) {
+      continue;
+    }
+
+    /* Don't spin on a worker that dies while starting up; the others */
+    /* are still looked after meanwhile. */
+    if (time(NULL) - cluster_workers[i].started < 1) {
+      cluster_workers[i].restart_at = time(NULL) + 1;
+      continue;
+    }
+
+    if (cluster_spawn(i TSRMLS_CC)) {
+      return i;
+    }
+  }
+}
+
+
+/* Forks `count` workers that carry on with the script from here, */
+/* accepting on the sockets listened on so far. Returns the worker's */
+/* index. The master stays in here, restarting workers that crash, and */
+/* returns -1 once they have all gone; the script should end then. */
+/* Call it before connecting anywhere. A listen() on a host name that */
+/* has to be looked up only counts once it's bound. Listeners with the */
+/* "reuseport" option get a socket per worker, the rest are shared. */
+PHP_FUNCTION(uv_cluster) {
+  long count;
+  zend_bool pin = 1;
+  shared_listener_t* l, **lp;
+  struct sigaction sa;
+  long i;
+  char c;
+  ssize_t n;
+#ifdef PHODE_SO_REUSEPORT
+  int on;
+  socklen_t len;
+#endif
+
+  if (zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "l|b", &count, &pin) == FAILURE) {
+    return;
+  }
+
+  if (cluster_index >= 0) {
+    RETURN_LONG(cluster_index);
+  }
+
+#ifdef ZTS
+  if (phode_threads_active) {
+    THROW_ERROR("Can't fork once threads are running");
+    RETURN_NULL();
+  }
+#endif
+
+  if (count < 1 || count > 1024) {
+    THROW_ERROR("Worker count out of range");
+    RETURN_NULL();
+  }
+
+  /* Forget the listeners that have been closed since */
+  lp = &cluster_listeners;
+  while ((l = *lp) != NULL) {
+    if (cluster_listener_alive(l)) {
+      lp = &l->next;
+    } else {
+      *lp = l->next;
+      free(l);
+    }
+  }
+
+  cluster_pin = pin;
+  cluster_reuseport = 0;
+
+#ifdef PHODE_SO_REUSEPORT
+  /* Where the listeners were bound with "reuseport", the kernel can */
+  /* spread connections over one socket per worker. The first worker */
+  /* takes over the master's, the others bind their own, and the */
+  /* master holds on to its sockets until they have, so that nobody */
+  /* gets turned away in between. */
+  cluster_reuseport = cluster_listeners != NULL;
+  for (l = cluster_listeners; l != NULL; l = l->next) {
+    on = 0;
+    len = sizeof(on);
+    if (getsockopt(l->fd, SOL_SOCKET, PHODE_SO_REUSEPORT, &on, &len) || !on) {
+      cluster_reuseport = 0;
+    }
+  }
+
+  if (cluster_reuseport && pipe(cluster_ready)) {
+    cluster_reuseport = 0;
+  }
+#endif
+
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = cluster_signal_cb;
+  sigemptyset(&sa.sa_mask);
+  sigaction(SIGTERM, &sa, NULL);
+  sigaction(SIGINT, &sa, NULL);
+  sa.sa_handler = cluster_alarm_cb;
+  sigaction(SIGALRM, &sa, NULL);
+
+  cluster_workers = calloc(count, sizeof(cluster_worker_t));
+  cluster_count = count;
+
+  for (i = 0; i < count; i++) {
+    if (cluster_spawn(i TSRMLS_CC)) {
+      RETURN_LONG(i);
+    }
+  }
+
+  if (cluster_ready[0] >= 0) {
+    /* EOF once every worker has rebound, or died trying */
+    close(cluster_ready[1]);
+    do {
+      n = read(cluster_ready[0], &c, 1);
+    } while (n > 0 || (n < 0 && errno == EINTR));
+    close(cluster_ready[0]);
+    cluster_ready[0] = cluster_ready[1] = -1;
+
+    for (l = cluster_listeners; l != NULL; l = l->next) {
+      close(l->fd);
+    }
+  }
+
+  i = cluster_supervise(TSRMLS_C);
+  if (i >= 0) {
+    RETURN_LONG(i);
+  }
+
+  free(cluster_workers);
+  cluster_workers = NULL;
+
+  signal(SIGTERM, SIG_DFL);
+  signal(SIGINT, SIG_DFL);
+  signal(SIGALRM, SIG_DFL);
+
+  RETURN_LONG(-1);
+}
+
+
+static zend_function_entry functions[] = {
   PHP_FE(uv_run, NULL)
+  PHP_FE(uv_threads, NULL)
+  PHP_FE(uv_cluster, NULL)
   { NULL, NULL, NULL }
 };
 
@@ -442,12 +2824,16 @@ zend_module_entry phode_module_entry = {
   PHP_MINIT(phode),
   PHP_MSHUTDOWN(phode),
   NULL,
-  NULL,
+  PHP_RSHUTDOWN(phode),
   PHP_MINFO(phode),
 #if ZEND_MODULE_API_NO >= 20010901
   "0.0.1",
 #endif
-  STANDARD_MODULE_PROPERTIES
+  PHP_MODULE_GLOBALS(phode),
+  PHP_GINIT(phode),
+  NULL,
+  NULL,
+  STANDARD_MODULE_PROPERTIES_EX
 };
 
 
@@ -0,0 +1,2033 @@
+/*
+ * Copyright (c) 2011, Ben Noordhuis <info@bnoordhuis.nl>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "phode.h"
+#include "http_parser.h"
+
+#include <ctype.h> /* tolower */
+#include <strings.h> /* strncasecmp */
+#include <sys/stat.h> /* S_ISREG */
+#include <sys/time.h> /* gettimeofday */
+#include <time.h> /* gmtime_r */
+
+
+/* Bodies are buffered whole; bigger ones get a 413 */
+#define HTTP_MAX_BODY (8 * 1024 * 1024)
+
+/* Pipelined requests stop being read once this many responses are */
+/* waiting, and start again when half of them have gone out. Requests */
+/* already in the last read still get parsed, so that's the bound. */
+#define HTTP_MAX_QUEUED 16
+
+
+typedef struct {
+  char* base;
+  size_t len;
+  size_t size;
+} http_buf_t;
+
+
+/* A receive buffer shared by the connection that read it and the */
+/* requests whose headers point into it. */
+typedef struct {
+  char* base;
+  uv_loop_t* loop;
+  int refs;
+} http_rbuf_t;
+
+
+/* Name and value are slices of a receive buffer, or of memory we own */
+/* when they arrived in more than one piece. */
+typedef struct {
+  char* name;
+  size_t name_len;
+  char* value;
+  size_t value_len;
+  int id;
+  unsigned name_owned:1;
+  unsigned value_owned:1;
+} http_header_t;
+
+
+/* Header names that handlers (and we) look up all the time. Matching */
+/* them once at parse time turns later lookups into an int compare. */
+#define HTTP_KNOWN_HEADERS(XX)                          \
+  XX(ACCEPT, "accept")                                  \
+  XX(ACCEPT_ENCODING, "accept-encoding")                \
+  XX(ACCEPT_LANGUAGE, "accept-language")                \
+  XX(AUTHORIZATION, "authorization")                    \
+  XX(CACHE_CONTROL, "cache-control")                    \
+  XX(CONNECTION, "connection")                          \
+  XX(CONTENT_LENGTH, "content-length")                  \
+  XX(CONTENT_TYPE, "content-type")                      \
+  XX(COOKIE, "cookie")                                  \
+  XX(EXPECT, "expect")                                  \
+  XX(HOST, "host")                                      \
+  XX(IF_MODIFIED_SINCE, "if-modified-since")            \
+  XX(IF_NONE_MATCH, "if-none-match")                    \
+  XX(IF_RANGE, "if-range")                              \
+  XX(ORIGIN, "origin")                                  \
+  XX(PRAGMA, "pragma")                                  \
+  XX(RANGE, "range")                                    \
+  XX(REFERER, "referer")                                \
+  XX(TRANSFER_ENCODING, "transfer-encoding")            \
+  XX(UPGRADE, "upgrade")                                \
+  XX(USER_AGENT, "user-agent")                          \
+  XX(X_FORWARDED_FOR, "x-forwarded-for")                \
+  XX(X_FORWARDED_PROTO, "x-forwarded-proto")            \
+  XX(X_REAL_IP, "x-real-ip")                            \
+  XX(X_REQUESTED_WITH, "x-requested-with")
+
+#define HTTP_HEADER_GEN(id, name) HTTP_H_##id,
+enum {
+  HTTP_KNOWN_HEADERS(HTTP_HEADER_GEN)
+  HTTP_H_MAX
+};
+#undef HTTP_HEADER_GEN
+
+#define HTTP_H_UNKNOWN (-1)
+
+
+typedef struct http_response_s http_response_t;
+
+
+typedef struct {
+  http_parser parser;
+  /* The accepted TCP object. We own the only reference. */
+  zval* client;
+  tcp_wrap_t* tcp;
+  zval* request_cb;
+  /* Request currently being parsed and the buffer it's parsed from */
+  zval* request;
+  http_rbuf_t* rbuf;
+  unsigned header_value_seen:1;
+  /* Responses in request order. Only the head may write to the socket, */
+  /* the others buffer until it's their turn. */
+  http_response_t* head;
+  http_response_t* tail;
+  int queued;
+  /* Status to turn a request away with when the parser is stopped */
+  int reject;
+  /* One reference for the open socket, one per live response object */
+  /* and temporary ones while we're calling into php land. */
+  int refs;
+  unsigned eof:1;
+  unsigned closing:1;
+  /* Not reading because too many responses are queued */
+  unsigned paused:1;
+  TSRMLS_D;
+} http_conn_t;
+
+
+typedef struct {
+  /* obj must be the first member, because it must be safe to cast */
+  /* http_request_t* to zend_object */
+  zend_object obj;
+  int method;
+  unsigned short http_major;
+  unsigned short http_minor;
+  http_buf_t url;
+  http_buf_t body;
+  /* Headers stay in the receive buffers until somebody asks for them. */
+  http_header_t* headers;
+  int headers_count;
+  int headers_size;
+  /* Index + 1 of the first header with a given HTTP_H_* id, or 0 */
+  int known[HTTP_H_MAX];
+  http_rbuf_t** rbufs;
+  int rbufs_count;
+  int rbufs_size;
+  /* getHeaders() result, built on first use */
+  zval* headers_array;
+} http_request_t;
+
+
+struct http_response_s {
+  /* obj must be the first member, because it must be safe to cast */
+  /* http_response_t* to zend_object */
+  zend_object obj;
+  http_conn_t* conn;
+  http_response_t* next;
+  /* The connection's reference to us while we're queued */
+  zval* self;
+  /* Output held back while an earlier response is still in flight */
+  zval** chunks;
+  int chunks_count;
+  int chunks_size;
+  /* Header lines set from php land, already rendered */
+  int status;
+  http_buf_t headers;
+  /* For sendFile(): the request it answers and the file on its way */
+  zval* request;
+  sendfile_wrap_t* file;
+  unsigned file_ready:1;
+  unsigned keep_alive:1;
+  unsigned finished:1;
+  unsigned http_1_1:1;
+  unsigned head_request:1;
+  unsigned headers_sent:1;
+  unsigned no_body:1;
+  unsigned chunked:1;
+  unsigned has_length:1;
+  unsigned has_connection:1;
+  unsigned has_date:1;
+  TSRMLS_D;
+};
+
+
+zend_class_entry* http_server_ce;
+zend_class_entry* http_request_ce;
+zend_class_entry* http_response_ce;
+
+static http_parser_settings http_settings;
+
+#define HTTP_HEADER_GEN(id, name) { name, sizeof(name) - 1 },
+static const struct {
+  const char* name;
+  size_t len;
+} http_known_headers[] = {
+  HTTP_KNOWN_HEADERS(HTTP_HEADER_GEN)
+};
+#undef HTTP_HEADER_GEN
+
+
+#define HTTP_STATUS_GEN(code, reason)                           \
+  [code] = { "HTTP/1.1 " #code " " reason "\r\n",              \
+             sizeof("HTTP/1.1 " #code " " reason "\r\n") - 1 },
+static const struct {
+  const char* line;
+  size_t len;
+} http_status_lines[600] = {
+  HTTP_STATUS_GEN(100, "Continue")
+  HTTP_STATUS_GEN(101, "Switching Protocols")
+  HTTP_STATUS_GEN(200, "OK")
+  HTTP_STATUS_GEN(201, "Created")
+  HTTP_STATUS_GEN(202, "Accepted")
+  HTTP_STATUS_GEN(203, "Non-Authoritative Information")
+  HTTP_STATUS_GEN(204, "No Content")
+  HTTP_STATUS_GEN(205, "Reset Content")
+  HTTP_STATUS_GEN(206, "Partial Content")
+  HTTP_STATUS_GEN(300, "Multiple Choices")
+  HTTP_STATUS_GEN(301, "Moved Permanently")
+  HTTP_STATUS_GEN(302, "Found")
+  HTTP_STATUS_GEN(303, "See Other")
+  HTTP_STATUS_GEN(304, "Not Modified")
+  HTTP_STATUS_GEN(307, "Temporary Redirect")
+  HTTP_STATUS_GEN(308, "Permanent Redirect")
+  HTTP_STATUS_GEN(400, "Bad Request")
+  HTTP_STATUS_GEN(401, "Unauthorized")
+  HTTP_STATUS_GEN(402, "Payment Required")
+  HTTP_STATUS_GEN(403, "Forbidden")
+  HTTP_STATUS_GEN(404, "Not Found")
+  HTTP_STATUS_GEN(405, "Method Not Allowed")
+  HTTP_STATUS_GEN(406, "Not Acceptable")
+  HTTP_STATUS_GEN(408, "Request Timeout")
+  HTTP_STATUS_GEN(409, "Conflict")
+  HTTP_STATUS_GEN(410, "Gone")
+  HTTP_STATUS_GEN(411, "Length Required")
+  HTTP_STATUS_GEN(412, "Precondition Failed")
+  HTTP_STATUS_GEN(413, "Request Entity Too Large")
+  HTTP_STATUS_GEN(414, "Request-URI Too Long")
+  HTTP_STATUS_GEN(415, "Unsupported Media Type")
+  HTTP_STATUS_GEN(416, "Requested Range Not Satisfiable")
+  HTTP_STATUS_GEN(417, "Expectation Failed")
+  HTTP_STATUS_GEN(426, "Upgrade Required")
+  HTTP_STATUS_GEN(429, "Too Many Requests")
+  HTTP_STATUS_GEN(500, "Internal Server Error")
+  HTTP_STATUS_GEN(501, "Not Implemented")
+  HTTP_STATUS_GEN(502, "Bad Gateway")
+  HTTP_STATUS_GEN(503, "Service Unavailable")
+  HTTP_STATUS_GEN(504, "Gateway Timeout")
+  HTTP_STATUS_GEN(505, "HTTP Version Not Supported")
+};
+#undef HTTP_STATUS_GEN
+
+static const char http_day_names[7][4] = {
+  "Sun", "Mon", "Tue", "Wed", "Thu", "Fri", "Sat"
+};
+
+static const char http_month_names[12][4] = {
+  "Jan", "Feb", "Mar", "Apr", "May", "Jun",
+  "Jul", "Aug", "Sep", "Oct", "Nov", "Dec"
+};
+
+
+static void http_buf_append(http_buf_t* buf, const char* data, size_t len) {
+  /* Always leave room for a NUL terminator. */
+  if (buf->len + len + 1 > buf->size) {
+    buf->size = 2 * (buf->len + len + 1);
+    buf->base = (char*) erealloc(buf->base, buf->size);
+  }
+
+  memcpy(buf->base + buf->len, data, len);
+  buf->len += len;
+  buf->base[buf->len] = '\0';
+}
+
+
+static void http_buf_free(http_buf_t* buf) {
+  if (buf->base) {
+    efree(buf->base);
+  }
+
+  buf->base = NULL;
+  buf->len = 0;
+  buf->size = 0;
+}
+
+
+static int http_header_id(const char* name, size_t len) {
+  int c = tolower((unsigned char) name[0]);
+  int i;
+
+  for (i = 0; i < HTTP_H_MAX; i++) {
+    if (http_known_headers[i].len == len &&
+        http_known_headers[i].name[0] == c &&
+        strncasecmp(http_known_headers[i].name, name, len) == 0) {
+      return i;
+    }
+  }
+
+  return HTTP_H_UNKNOWN;
+}
+
+
+static void http_rbuf_unref(http_rbuf_t* rbuf) {
+  if (--rbuf->refs > 0) {
+    return;
+  }
+
+  /* The loop's buffer pool is gone during request shutdown. */
+  if (rbuf->loop->data) {
+    read_buf_put((loop_wrap_t*) rbuf->loop->data, rbuf->base);
+  } else {
+    efree(rbuf->base);
+  }
+
+  efree(rbuf);
+}
+
+
+static void http_request_hold(http_request_t* req, http_rbuf_t* rbuf) {
+  if (req->rbufs_count > 0 && req->rbufs[req->rbufs_count - 1] == rbuf) {
+    return;
+  }
+
+  if (req->rbufs_count == req->rbufs_size) {
+    req->rbufs_size = req->rbufs_size ? 2 * req->rbufs_size : 2;
+    req->rbufs = (http_rbuf_t**) erealloc(req->rbufs, req->rbufs_size * sizeof(http_rbuf_t*));
+  }
+
+  rbuf->refs++;
+  req->rbufs[req->rbufs_count++] = rbuf;
+}
+
+
+/* Grows a slice by a piece that the parser handed us separately. Pieces */
+/* that are adjacent in the receive buffer are simply joined, anything */
+/* else gets copied into memory that we own. */
+static void http_slice_append(char** base,
+                              size_t* len,
+                              unsigned* owned,
+                              const char* at,
+                              size_t length) {
+  char* joined;
+
+  if (*base == NULL) {
+    *base = (char*) at;
+    *len = length;
+    return;
+  }
+
+  if (!*owned && *base + *len == at) {
+    *len += length;
+    return;
+  }
+
+  joined = (char*) emalloc(*len + length);
+  memcpy(joined, *base, *len);
+  memcpy(joined + *len, at, length);
+
+  if (*owned) {
+    efree(*base);
+  }
+
+  *base = joined;
+  *len += length;
+  *owned = 1;
+}
+
+
+/* Finds the header with the given id (or name when it's not a known */
+/* one). Returns its index or -1; start searching at index start. */
+static int http_request_find_header(http_request_t* req,
+                                    int id,
+                                    const char* name,
+                                    size_t len,
+                                    int start) {
+  int i;
+
+  if (id != HTTP_H_UNKNOWN && start < req->known[id] - 1) {
+    start = req->known[id] - 1;
+  }
+
+  if (id != HTTP_H_UNKNOWN && req->known[id] == 0) {
+    return -1;
+  }
+
+  for (i = start; i < req->headers_count; i++) {
+    http_header_t* h = &req->headers[i];
+
+    if (id != HTTP_H_UNKNOWN) {
+      if (h->id == id) {
+        return i;
+      }
+    } else if (h->id == HTTP_H_UNKNOWN &&
+               h->name_len == len &&
+               strncasecmp(h->name, name, len) == 0) {
+      return i;
+    }
+  }
+
+  return -1;
+}
+
+
+/* Materializes a header value. Repeated headers are folded into one */
+/* comma separated value. Returns 0 if the header isn't there. */
+static int http_request_header_zval(http_request_t* req,
+                                    int id,
+                                    const char* name,
+                                    size_t len,
+                                    zval* result) {
+  http_header_t* h;
+  char* folded;
+  size_t folded_len;
+  int first;
+  int i;
+
+  first = http_request_find_header(req, id, name, len, 0);
+  if (first == -1) {
+    return 0;
+  }
+
+  i = http_request_find_header(req, id, name, len, first + 1);
+  if (i == -1) {
+    h = &req->headers[first];
+    ZVAL_STRINGL(result, h->value, h->value_len, 1);
+    return 1;
+  }
+
+  folded_len = req->headers[first].value_len;
+  for (; i != -1; i = http_request_find_header(req, id, name, len, i + 1)) {
+    folded_len += 2 + req->headers[i].value_len;
+  }
+
+  folded = (char*) emalloc(folded_len + 1);
+  h = &req->headers[first];
+  memcpy(folded, h->value, h->value_len);
+  folded_len = h->value_len;
+
+  for (i = http_request_find_header(req, id, name, len, first + 1);
+       i != -1;
+       i = http_request_find_header(req, id, name, len, i + 1)) {
+    h = &req->headers[i];
+    memcpy(folded + folded_len, ", ", 2);
+    memcpy(folded + folded_len + 2, h->value, h->value_len);
+    folded_len += 2 + h->value_len;
+  }
+
+  folded[folded_len] = '\0';
+  ZVAL_STRINGL(result, folded, folded_len, 0);
+
+  return 1;
+}
+
+
+/* Formats an IMF-fixdate without going through the C locale. */
+static size_t http_format_date(char* out, size_t size, time_t t) {
+  struct tm tm;
+
+  gmtime_r(&t, &tm);
+
+  return snprintf(out,
+                  size,
+                  "%s, %02d %s %04d %02d:%02d:%02d GMT",
+                  http_day_names[tm.tm_wday],
+                  tm.tm_mday,
+                  http_month_names[tm.tm_mon],
+                  tm.tm_year + 1900,
+                  tm.tm_hour,
+                  tm.tm_min,
+                  tm.tm_sec);
+}
+
+
+/* The Date header only changes once a second, so every response */
+/* rendered on a loop within that second shares one string. */
+static void http_date_refresh(loop_wrap_t* loop) {
+  struct timeval tv;
+  int64_t now = uv_now(loop->loop);
+  size_t len;
+
+  if (now < loop->http_date_expires && loop->http_date_len > 0) {
+    return;
+  }
+
+  gettimeofday(&tv, NULL);
+
+  memcpy(loop->http_date, "Date: ", 6);
+  len = 6 + http_format_date(loop->http_date + 6,
+                             sizeof(loop->http_date) - 8,
+                             tv.tv_sec);
+  memcpy(loop->http_date + len, "\r\n", 2);
+
+  loop->http_date_len = len + 2;
+  loop->http_date_expires = now + 1000 - tv.tv_usec / 1000;
+}
+
+
+static void http_conn_unref(http_conn_t* conn) {
+  assert(conn->refs > 0);
+  if (--conn->refs > 0) {
+    return;
+  }
+
+  assert(conn->head == NULL);
+
+  if (conn->request) {
+    zval_ptr_dtor(&conn->request);
+  }
+
+  zval_ptr_dtor(&conn->request_cb);
+  zval_ptr_dtor(&conn->client);
+  efree(conn);
+}
+
+
+static void http_conn_close(http_conn_t* conn) {
+  TSRMLS_D_GET(conn);
+
+  if (conn->closing || conn->tcp == NULL) {
+    return;
+  }
+
+  conn->closing = 1;
+  uv_read_stop((uv_stream_t*) &conn->tcp->handle);
+  tcp_end(conn->tcp TSRMLS_CC);
+}
+
+
+static void http_sendfile_complete(sendfile_wrap_t* wrap, int ok);
+
+
+/* Drops the connection's references to queued responses. */
+static void http_conn_drop_responses(http_conn_t* conn) {
+  http_response_t* res;
+
+  while ((res = conn->head) != NULL) {
+    conn->head = res->next;
+    res->next = NULL;
+
+    /* A file still waiting for its turn won't get one. */
+    if (res->file && res->file_ready) {
+      http_sendfile_complete(res->file, 0);
+    }
+
+    zval_ptr_dtor(&res->self);
+  }
+
+  conn->tail = NULL;
+  conn->queued = 0;
+}
+
+
+static void http_conn_close_cb(tcp_wrap_t* tcp TSRMLS_DC) {
+  http_conn_t* conn = (http_conn_t*) tcp->native;
+
+  tcp->native = NULL;
+  tcp->native_close_cb = NULL;
+  conn->tcp = NULL;
+  conn->closing = 1;
+
+  conn->refs++;
+  http_conn_drop_responses(conn);
+  http_conn_unref(conn);
+
+  /* the socket's reference */
+  http_conn_unref(conn);
+}
+
+
+static int http_conn_write(http_conn_t* conn, zval** chunks, int count) {
+  write_wrap_t* wrap;
+  int i;
+  TSRMLS_D_GET(conn);
+
+  wrap = tcp_write_begin(conn->tcp TSRMLS_CC);
+  for (i = 0; i < count; i++) {
+    write_wrap_push_string(wrap, chunks[i]);
+  }
+
+  return tcp_write_end(conn->tcp, wrap TSRMLS_CC);
+}
+
+
+static void http_response_start_file(http_response_t* res) {
+  sendfile_wrap_t* wrap = res->file;
+
+  if (wrap == NULL || !res->file_ready || res->conn->head != res) {
+    return;
+  }
+
+  res->file_ready = 0;
+  sendfile_start(wrap, wrap->offset, wrap->length);
+}
+
+
+static void http_response_flush(http_response_t* res) {
+  int i;
+
+  if (res->chunks_count > 0) {
+    http_conn_write(res->conn, res->chunks, res->chunks_count);
+  }
+
+  for (i = 0; i < res->chunks_count; i++) {
+    zval_ptr_dtor(&res->chunks[i]);
+  }
+
+  res->chunks_count = 0;
+
+  /* The head went out above, the body may follow. */
+  http_response_start_file(res);
+}
+
+
+static void http_read_cb(uv_stream_t* stream, ssize_t nread, uv_buf_t buf);
+static void http_reply_error(http_conn_t* conn, int status);
+
+
+/* Retires finished responses from the head of the queue and lets the */
+/* next one in line write its buffered output. */
+static void http_conn_advance(http_conn_t* conn) {
+  http_response_t* res;
+  int keep_alive;
+
+  conn->refs++;
+
+  while ((res = conn->head) != NULL && res->finished) {
+    conn->head = res->next;
+    if (conn->head == NULL) {
+      conn->tail = NULL;
+    }
+    conn->queued--;
+
+    keep_alive = res->keep_alive;
+    res->next = NULL;
+    zval_ptr_dtor(&res->self);
+
+    if (!keep_alive) {
+      http_conn_drop_responses(conn);
+      http_conn_close(conn);
+      break;
+    }
+
+    if (conn->head) {
+      http_response_flush(conn->head);
+    }
+  }
+
+  if (conn->head == NULL && conn->eof) {
+    /* A request turned away behind the ones that were answered */
+    if (conn->reject && conn->tcp && !conn->closing) {
+      http_reply_error(conn, conn->reject);
+    }
+    http_conn_close(conn);
+  } else if (conn->paused && !conn->closing && conn->tcp &&
+             conn->queued <= HTTP_MAX_QUEUED / 2) {
+    conn->paused = 0;
+    if (uv_read_start((uv_stream_t*) &conn->tcp->handle, tcp_alloc_cb, http_read_cb) != 0) {
+      conn->eof = 1;
+      if (conn->head == NULL) {
+        http_conn_close(conn);
+      }
+    }
+  }
+
+  http_conn_unref(conn);
+}
+
+
+static int http_on_message_begin(http_parser* parser) {
+  http_conn_t* conn = (http_conn_t*) parser->data;
+  TSRMLS_D_GET(conn);
+
+  if (conn->request) {
+    zval_ptr_dtor(&conn->request);
+  }
+
+  MAKE_STD_ZVAL(conn->request);
+  object_init_ex(conn->request, http_request_ce);
+
+  conn->header_value_seen = 0;
+
+  return 0;
+}
+
+
+static int http_on_url(http_parser* parser, const char* at, size_t length) {
+  http_conn_t* conn = (http_conn_t*) parser->data;
+  http_request_t* req;
+  TSRMLS_D_GET(conn);
+
+  req = (http_request_t*) zend_object_store_get_object(conn->request TSRMLS_CC);
+  http_buf_append(&req->url, at, length);
+
+  return 0;
+}
+
+
+static int http_on_header_field(http_parser* parser, const char* at, size_t length) {
+  http_conn_t* conn = (http_conn_t*) parser->data;
+  http_request_t* req;
+  http_header_t* h;
+  unsigned owned;
+  TSRMLS_D_GET(conn);
+
+  req = (http_request_t*) zend_object_store_get_object(conn->request TSRMLS_CC);
+  http_request_hold(req, conn->rbuf);
+
+  /* A field after a value (or the very first one) starts a new header. */
+  if (conn->header_value_seen || req->headers_count == 0) {
+    if (req->headers_count == req->headers_size) {
+      req->headers_size = req->headers_size ? 2 * req->headers_size : 16;
+      req->headers = (http_header_t*) erealloc(req->headers, req->headers_size * sizeof(http_header_t));
+    }
+
+    h = &req->headers[req->headers_count++];
+    memset(h, 0, sizeof *h);
+    h->id = HTTP_H_UNKNOWN;
+    conn->header_value_seen = 0;
+  }
+
+  h = &req->headers[req->headers_count - 1];
+  owned = h->name_owned;
+  http_slice_append(&h->name, &h->name_len, &owned, at, length);
+  h->name_owned = owned;
+
+  return 0;
+}
+
+
+static int http_on_header_value(http_parser* parser, const char* at, size_t length) {
+  http_conn_t* conn = (http_conn_t*) parser->data;
+  http_request_t* req;
+  http_header_t* h;
+  unsigned owned;
+  TSRMLS_D_GET(conn);
+
+  req = (http_request_t*) zend_object_store_get_object(conn->request TSRMLS_CC);
+  http_request_hold(req, conn->rbuf);
+
+  h = &req->headers[req->headers_count - 1];
+  owned = h->value_owned;
+  http_slice_append(&h->value, &h->value_len, &owned, at, length);
+  h->value_owned = owned;
+  conn->header_value_seen = 1;
+
+  return 0;
+}
+
+
+/* Interim response to Expect: 100-continue */
+static void http_reply_continue(http_conn_t* conn) {
+  static const char reply[] = "HTTP/1.1 100 Continue\r\n\r\n";
+  zval* chunk;
+
+  MAKE_STD_ZVAL(chunk);
+  ZVAL_STRINGL(chunk, reply, sizeof(reply) - 1, 1);
+  http_conn_write(conn, &chunk, 1);
+  zval_ptr_dtor(&chunk);
+}
+
+
+static int http_on_headers_complete(http_parser* parser) {
+  http_conn_t* conn = (http_conn_t*) parser->data;
+  http_request_t* req;
+  http_header_t* h;
+  int i;
+  TSRMLS_D_GET(conn);
+
+  req = (http_request_t*) zend_object_store_get_object(conn->request TSRMLS_CC);
+  req->method = parser->method;
+  req->http_major = parser->http_major;
+  req->http_minor = parser->http_minor;
+
+  for (i = 0; i < req->headers_count; i++) {
+    h = &req->headers[i];
+
+    if (h->value == NULL) {
+      h->value = "";
+    }
+
+    h->id = http_header_id(h->name, h->name_len);
+    if (h->id != HTTP_H_UNKNOWN && req->known[h->id] == 0) {
+      req->known[h->id] = i + 1;
+    }
+  }
+
+  if (parser->content_length > HTTP_MAX_BODY) {
+    conn->reject = 413;
+    return -1;
+  }
+
+  if (req->known[HTTP_H_EXPECT]) {
+    h = &req->headers[req->known[HTTP_H_EXPECT] - 1];
+    if (h->value_len != 12 || strncasecmp(h->value, "100-continue", 12) != 0) {
+      conn->reject = 417;
+      return -1;
+    }
+
+    /* The go-ahead for the body. It can't cut into a response that's */
+    /* on its way; the client sends the body after a while anyway. */
+    if (conn->head == NULL && !conn->closing && conn->tcp &&
+        (parser->http_major > 1 || parser->http_minor >= 1)) {
+      http_reply_continue(conn);
+    }
+  }
+
+  return 0;
+}
+
+
+static int http_on_body(http_parser* parser, const char* at, size_t length) {
+  http_conn_t* conn = (http_conn_t*) parser->data;
+  http_request_t* req;
+  TSRMLS_D_GET(conn);
+
+  req = (http_request_t*) zend_object_store_get_object(conn->request TSRMLS_CC);
+
+  /* Chunked bodies don't say how big they are up front */
+  if (req->body.len + length > HTTP_MAX_BODY) {
+    conn->reject = 413;
+    return -1;
+  }
+
+  http_buf_append(&req->body, at, length);
+
+  return 0;
+}
+
+
+static int http_on_message_complete(http_parser* parser) {
+  http_conn_t* conn = (http_conn_t*) parser->data;
+  http_response_t* res;
+  zval* request;
+  zval* args[2];
+  TSRMLS_D_GET(conn);
+
+  request = conn->request;
+  conn->request = NULL;
+
+  if (conn->closing) {
+    /* Pipelined request after a Connection: close, drop it. */
+    zval_ptr_dtor(&request);
+    return 0;
+  }
+
+  /* The queue holds the reference that we hand to php land. */
+  MAKE_STD_ZVAL(args[1]);
+  object_init_ex(args[1], http_response_ce);
+  res = (http_response_t*) zend_object_store_get_object(args[1] TSRMLS_CC);
+  res->self = args[1];
+  res->conn = conn;
+  res->keep_alive = http_should_keep_alive(parser) ? 1 : 0;
+  res->http_1_1 = parser->http_major > 1 ||
+                  (parser->http_major == 1 && parser->http_minor >= 1);
+  res->head_request = parser->method == HTTP_HEAD;
+  res->status = 200;
+  res->request = request;
+  Z_ADDREF_P(request);
+  conn->refs++;
+  conn->queued++;
+
+  if (conn->tail) {
+    conn->tail->next = res;
+  } else {
+    conn->head = res;
+  }
+  conn->tail = res;
+
+  args[0] = request;
+  /* A handler that threw leaves nobody to answer; later pipelined */
+  /* requests go unanswered too. */
+  if (call_callback(conn->request_cb, 2, args TSRMLS_CC) != 0) {
+    http_conn_close(conn);
+  }
+  zval_ptr_dtor(&request);
+
+  return 0;
+}
+
+
+/* Turns the request away and tells the client that we're hanging up */
+static void http_reply_error(http_conn_t* conn, int status) {
+  static const char tail[] =
+      "Connection: close\r\n"
+      "Content-Length: 0\r\n"
+      "\r\n";
+  zval* chunks[2];
+
+  MAKE_STD_ZVAL(chunks[0]);
+  ZVAL_STRINGL(chunks[0], http_status_lines[status].line, http_status_lines[status].len, 1);
+  MAKE_STD_ZVAL(chunks[1]);
+  ZVAL_STRINGL(chunks[1], tail, sizeof(tail) - 1, 1);
+  http_conn_write(conn, chunks, 2);
+  zval_ptr_dtor(&chunks[0]);
+  zval_ptr_dtor(&chunks[1]);
+}
+
+
+static void http_read_cb(uv_stream_t* stream, ssize_t nread, uv_buf_t buf) {
+  tcp_wrap_t* tcp = (tcp_wrap_t*) stream->data;
+  http_conn_t* conn = (http_conn_t*) tcp->native;
+  loop_wrap_t* loop;
+  size_t parsed;
+  TSRMLS_D_GET(tcp);
+
+  loop = loop_wrap_get(stream->loop TSRMLS_CC);
+
+  if (nread == 0 || conn == NULL || conn->closing) {
+    read_buf_put(loop, buf.base);
+    return;
+  }
+
+  conn->refs++;
+
+  if (nread < 0) {
+    read_buf_put(loop, buf.base);
+    uv_read_stop(stream);
+    conn->eof = 1;
+
+    /* Lets the parser finish a body that is delimited by EOF. */
+    http_parser_execute(&conn->parser, &http_settings, NULL, 0);
+  } else {
+    /* Requests keep the buffer alive for as long as their headers */
+    /* point into it. */
+    conn->rbuf = (http_rbuf_t*) emalloc(sizeof *conn->rbuf);
+    conn->rbuf->base = buf.base;
+    conn->rbuf->loop = stream->loop;
+    conn->rbuf->refs = 1;
+
+    parsed = http_parser_execute(&conn->parser, &http_settings, buf.base, nread);
+
+    http_rbuf_unref(conn->rbuf);
+    conn->rbuf = NULL;
+
+    /* Upgrades (websockets et al.) aren't supported. */
+    if (!conn->closing && (conn->parser.upgrade || parsed != (size_t) nread)) {
+      uv_read_stop(stream);
+      conn->eof = 1;
+      if (conn->head == NULL && conn->tcp) {
+        http_reply_error(conn, conn->reject ? conn->reject : 400);
+      }
+    } else if (!conn->closing && !conn->eof && conn->queued >= HTTP_MAX_QUEUED) {
+      uv_read_stop(stream);
+      conn->paused = 1;
+    }
+  }
+
+  if (conn->eof && conn->head == NULL) {
+    http_conn_close(conn);
+  }
+
+  http_conn_unref(conn);
+}
+
+
+static void http_connection_cb(tcp_wrap_t* server, zval* client TSRMLS_DC) {
+  http_conn_t* conn;
+  tcp_wrap_t* tcp;
+
+  tcp = (tcp_wrap_t*) zend_object_store_get_object(client TSRMLS_CC);
+
+  conn = (http_conn_t*) ecalloc(1, sizeof *conn);
+  conn->client = client;
+  conn->tcp = tcp;
+  conn->request_cb = server->connection_cb;
+  Z_ADDREF_P(conn->request_cb);
+  conn->refs = 1;
+  TSRMLS_SET(conn);
+
+  http_parser_init(&conn->parser, HTTP_REQUEST);
+  conn->parser.data = (void*) conn;
+
+  tcp->native = (void*) conn;
+  tcp->native_close_cb = http_conn_close_cb;
+
+  if (uv_read_start((uv_stream_t*) &tcp->handle, tcp_alloc_cb, http_read_cb) != 0) {
+    tcp_close(tcp TSRMLS_CC);
+  }
+}
+
+
+PHP_METHOD(HttpServer, __construct) {
+  tcp_wrap_t* self;
+  zval* callback;
+
+  if (zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "z", &callback) == FAILURE) {
+    return;
+  }
+
+  self = (tcp_wrap_t*) zend_object_store_get_object(getThis() TSRMLS_CC);
+  HEALTHCHECK(self);
+
+  if (self->connection_cb) {
+    zval_ptr_dtor(&self->connection_cb);
+  }
+
+  self->connection_cb = callback;
+  Z_ADDREF_P(callback);
+  self->native_connection_cb = http_connection_cb;
+}
+
+
+static void http_request_free(void* object TSRMLS_DC) {
+  http_request_t* req = (http_request_t*) object;
+
+  int i;
+
+  for (i = 0; i < req->headers_count; i++) {
+    if (req->headers[i].name_owned) {
+      efree(req->headers[i].name);
+    }
+    if (req->headers[i].value_owned) {
+      efree(req->headers[i].value);
+    }
+  }
+
+  for (i = 0; i < req->rbufs_count; i++) {
+    http_rbuf_unref(req->rbufs[i]);
+  }
+
+  if (req->headers) {
+    efree(req->headers);
+  }
+
+  if (req->rbufs) {
+    efree(req->rbufs);
+  }
+
+  if (req->headers_array) {
+    zval_ptr_dtor(&req->headers_array);
+  }
+
+  http_buf_free(&req->url);
+  http_buf_free(&req->body);
+
+  zend_object_std_dtor(&req->obj TSRMLS_CC);
+  efree(req);
+}
+
+
+static zend_object_value http_request_new(zend_class_entry* class_type TSRMLS_DC) {
+  zend_object_value instance;
+  http_request_t* req;
+
+  req = (http_request_t*) ecalloc(1, sizeof *req);
+
+  zend_object_std_init(&req->obj, class_type TSRMLS_CC);
+  init_properties(&req->obj, class_type);
+
+  instance.handle = zend_objects_store_put((void*) req,
+                                           (zend_objects_store_dtor_t) zend_objects_destroy_object,
+                                           http_request_free,
+                                           NULL
+                                           TSRMLS_CC);
+  instance.handlers = zend_get_std_object_handlers();
+
+  return instance;
+}
+
+
+PHP_METHOD(HttpRequest, getMethod) {
+  http_request_t* self;
+
+  self = (http_request_t*) zend_object_store_get_object(getThis() TSRMLS_CC);
+
+  RETURN_STRING((char*) http_method_str((enum http_method) self->method), 1);
+}
+
+
+PHP_METHOD(HttpRequest, getUrl) {
+  http_request_t* self;
+
+  self = (http_request_t*) zend_object_store_get_object(getThis() TSRMLS_CC);
+
+  if (self->url.base == NULL) {
+    RETURN_EMPTY_STRING();
+  }
+
+  RETURN_STRINGL(self->url.base, self->url.len, 1);
+}
+
+
+PHP_METHOD(HttpRequest, getHttpVersion) {
+  http_request_t* self;
+  char version[16];
+  int len;
+
+  self = (http_request_t*) zend_object_store_get_object(getThis() TSRMLS_CC);
+
+  len = snprintf(version, sizeof version, "%u.%u", self->http_major, self->http_minor);
+
+  RETURN_STRINGL(version, len, 1);
+}
+
+
+PHP_METHOD(HttpRequest, getHeader) {
+  http_request_t* self;
+  char* name;
+  int name_length;
+
+  if (zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "s", &name, &name_length) == FAILURE) {
+    return;
+  }
+
+  self = (http_request_t*) zend_object_store_get_object(getThis() TSRMLS_CC);
+
+  if (name_length == 0 ||
+      !http_request_header_zval(self,
+                                http_header_id(name, name_length),
+                                name,
+                                name_length,
+                                return_value)) {
+    RETURN_NULL();
+  }
+}
+
+
+PHP_METHOD(HttpRequest, getHeaders) {
+  http_request_t* self;
+  http_header_t* h;
+  zval* value;
+  char* key;
+  int i;
+
+  self = (http_request_t*) zend_object_store_get_object(getThis() TSRMLS_CC);
+
+  if (self->headers_array == NULL) {
+    MAKE_STD_ZVAL(self->headers_array);
+    array_init(self->headers_array);
+
+    /* Lower-cased names; repeated headers are folded. */
+    for (i = 0; i < self->headers_count; i++) {
+      h = &self->headers[i];
+
+      if (http_request_find_header(self, h->id, h->name, h->name_len, 0) != i) {
+        continue;
+      }
+
+      key = (char*) emalloc(h->name_len + 1);
+      zend_str_tolower_copy(key, h->name, h->name_len);
+      key[h->name_len] = '\0';
+
+      MAKE_STD_ZVAL(value);
+      http_request_header_zval(self, h->id, h->name, h->name_len, value);
+      add_assoc_zval_ex(self->headers_array, key, h->name_len + 1, value);
+
+      efree(key);
+    }
+  }
+
+  RETURN_ZVAL(self->headers_array, 1, 0);
+}
+
+
+PHP_METHOD(HttpRequest, getBody) {
+  http_request_t* self;
+
+  self = (http_request_t*) zend_object_store_get_object(getThis() TSRMLS_CC);
+
+  if (self->body.base == NULL) {
+    RETURN_EMPTY_STRING();
+  }
+
+  RETURN_STRINGL(self->body.base, self->body.len, 1);
+}
+
+
+static void http_response_free(void* object TSRMLS_DC) {
+  http_response_t* res = (http_response_t*) object;
+  int i;
+
+  for (i = 0; i < res->chunks_count; i++) {
+    zval_ptr_dtor(&res->chunks[i]);
+  }
+
+  if (res->chunks) {
+    efree(res->chunks);
+  }
+
+  http_buf_free(&res->headers);
+
+  if (res->request) {
+    zval_ptr_dtor(&res->request);
+  }
+
+  if (res->conn) {
+    http_conn_unref(res->conn);
+  }
+
+  zend_object_std_dtor(&res->obj TSRMLS_CC);
+  efree(res);
+}
+
+
+static zend_object_value http_response_new(zend_class_entry* class_type TSRMLS_DC) {
+  zend_object_value instance;
+  http_response_t* res;
+
+  res = (http_response_t*) ecalloc(1, sizeof *res);
+
+  zend_object_std_init(&res->obj, class_type TSRMLS_CC);
+  init_properties(&res->obj, class_type);
+
+  TSRMLS_SET(res);
+
+  instance.handle = zend_objects_store_put((void*) res,
+                                           (zend_objects_store_dtor_t) zend_objects_destroy_object,
+                                           http_response_free,
+                                           NULL
+                                           TSRMLS_CC);
+  instance.handlers = zend_get_std_object_handlers();
+
+  return instance;
+}
+
+
+/* Returns 1 if the caller may keep writing, 0 if it should back off. */
+static int http_response_send(http_response_t* res, zval** parts, int count) {
+  http_conn_t* conn = res->conn;
+  int i;
+
+  if (count == 0) {
+    return 1;
+  }
+
+  if (conn->head == res) {
+    return http_conn_write(conn, parts, count);
+  }
+
+  /* Not our turn yet. */
+  for (i = 0; i < count; i++) {
+    Z_ADDREF_P(parts[i]);
+    zval_list_push(&res->chunks, &res->chunks_count, &res->chunks_size, NULL, parts[i]);
+  }
+
+  return 1;
+}
+
+
+/* Picks the framing for the body and renders the status line and */
+/* headers. length is the full body length if this is the last write. */
+static zval* http_response_render_head(http_response_t* res, size_t length, int last) {
+  http_buf_t head = { NULL, 0, 0 };
+  loop_wrap_t* loop;
+  zval* result;
+  char line[64];
+  int n;
+  TSRMLS_D_GET(res);
+
+  res->headers_sent = 1;
+  res->no_body = res->head_request ||
+                 (res->status >= 100 && res->status < 200) ||
+                 res->status == 204 ||
+                 res->status == 304;
+
+  if (res->status < 600 && http_status_lines[res->status].line) {
+    http_buf_append(&head,
+                    http_status_lines[res->status].line,
+                    http_status_lines[res->status].len);
+  } else {
+    n = snprintf(line, sizeof line, "HTTP/1.1 %d Unknown\r\n", res->status);
+    http_buf_append(&head, line, n);
+  }
+
+  if (!res->has_date) {
+    loop = loop_wrap_get(res->conn->tcp->handle.loop TSRMLS_CC);
+    http_date_refresh(loop);
+    http_buf_append(&head, loop->http_date, loop->http_date_len);
+  }
+
+  if (res->headers.len > 0) {
+    http_buf_append(&head, res->headers.base, res->headers.len);
+  }
+
+  if (res->status == 204 || res->status == 304 ||
+      (res->status >= 100 && res->status < 200)) {
+    /* These never have a body nor framing headers. */
+  } else if (res->has_length || res->chunked) {
+    /* Framed by php land. */
+  } else if (last) {
+    n = snprintf(line, sizeof line, "Content-Length: %lu\r\n", (unsigned long) length);
+    http_buf_append(&head, line, n);
+  } else if (res->http_1_1) {
+    res->chunked = 1;
+    http_buf_append(&head, "Transfer-Encoding: chunked\r\n", 28);
+  } else {
+    /* An HTTP/1.0 client can only tell the body ended by EOF. */
+    res->keep_alive = 0;
+  }
+
+  if (!res->has_connection) {
+    if (!res->keep_alive) {
+      http_buf_append(&head, "Connection: close\r\n", 19);
+    } else if (!res->http_1_1) {
+      http_buf_append(&head, "Connection: keep-alive\r\n", 24);
+    }
+  }
+
+  http_buf_append(&head, "\r\n", 2);
+
+  MAKE_STD_ZVAL(result);
+  ZVAL_STRINGL(result, head.base, head.len, 0);
+
+  return result;
+}
+
+
+/* Renders the head if needed and frames data, then hands it all to */
+/* the connection as a single vectored write. */
+static int http_response_output(http_response_t* res, zval* data, int last) {
+  zval* parts[4];
+  zval* body = NULL;
+  char* frame;
+  size_t length = 0;
+  int count = 0;
+  int result;
+  int n;
+
+  if (res->conn == NULL || res->conn->tcp == NULL || res->conn->closing) {
+    return 0;
+  }
+
+  if (data) {
+    if (Z_TYPE_P(data) == IS_STRING) {
+      body = data;
+      Z_ADDREF_P(body);
+    } else {
+      MAKE_STD_ZVAL(body);
+      *body = *data;
+      zval_copy_ctor(body);
+      INIT_PZVAL(body);
+      convert_to_string(body);
+    }
+    length = Z_STRLEN_P(body);
+  }
+
+  if (!res->headers_sent) {
+    parts[count++] = http_response_render_head(res, length, last);
+  }
+
+  if (res->no_body) {
+    /* HEAD request or a status that can't have a body */
+  } else if (res->chunked) {
+    if (length > 0) {
+      frame = (char*) emalloc(24);
+      n = snprintf(frame, 24, "%lx\r\n", (unsigned long) length);
+      MAKE_STD_ZVAL(parts[count]);
+      ZVAL_STRINGL(parts[count], frame, n, 0);
+      count++;
+
+      Z_ADDREF_P(body);
+      parts[count++] = body;
+    }
+
+    if (length > 0 || last) {
+      MAKE_STD_ZVAL(parts[count]);
+      if (length > 0 && last) {
+        ZVAL_STRINGL(parts[count], "\r\n0\r\n\r\n", 7, 1);
+      } else if (last) {
+        ZVAL_STRINGL(parts[count], "0\r\n\r\n", 5, 1);
+      } else {
+        ZVAL_STRINGL(parts[count], "\r\n", 2, 1);
+      }
+      count++;
+    }
+  } else if (length > 0) {
+    Z_ADDREF_P(body);
+    parts[count++] = body;
+  }
+
+  result = http_response_send(res, parts, count);
+
+  while (count > 0) {
+    zval_ptr_dtor(&parts[--count]);
+  }
+
+  if (body) {
+    zval_ptr_dtor(&body);
+  }
+
+  return result;
+}
+
+
+/* Checks a header name or value for characters that would let it */
+/* break out of its line. */
+static int http_header_safe(const char* s, int len, int is_name) {
+  int i;
+
+  for (i = 0; i < len; i++) {
+    if (s[i] == '\r' || s[i] == '\n' || s[i] == '\0' || (is_name && s[i] == ':')) {
+      return 0;
+    }
+  }
+
+  return !is_name || len > 0;
+}
+
+
+static int http_response_add_header(http_response_t* res,
+                                    const char* name,
+                                    int name_len,
+                                    const char* value,
+                                    int value_len) {
+  int id;
+
+  if (!http_header_safe(name, name_len, 1) || !http_header_safe(value, value_len, 0)) {
+    return 0;
+  }
+
+  id = http_header_id(name, name_len);
+
+  if (id == HTTP_H_CONTENT_LENGTH) {
+    res->has_length = 1;
+  } else if (id == HTTP_H_TRANSFER_ENCODING) {
+    res->chunked = 1;
+  } else if (id == HTTP_H_CONNECTION) {
+    res->has_connection = 1;
+    if (value_len == 5 && strncasecmp(value, "close", 5) == 0) {
+      res->keep_alive = 0;
+    }
+  } else if (name_len == 4 && strncasecmp(name, "date", 4) == 0) {
+    res->has_date = 1;
+  }
+
+  http_buf_append(&res->headers, name, name_len);
+  http_buf_append(&res->headers, ": ", 2);
+  http_buf_append(&res->headers, value, value_len);
+  http_buf_append(&res->headers, "\r\n", 2);
+
+  return 1;
+}
+
+
+static void http_response_finish(http_response_t* res) {
+  res->finished = 1;
+
+  if (res->conn && res->conn->head == res) {
+    http_conn_advance(res->conn);
+  }
+}
+
+
+PHP_METHOD(HttpResponse, setStatus) {
+  http_response_t* self;
+  long status;
+
+  if (zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "l", &status) == FAILURE) {
+    return;
+  }
+
+  self = (http_response_t*) zend_object_store_get_object(getThis() TSRMLS_CC);
+
+  if (self->headers_sent) {
+    THROW_ERROR("Headers already sent");
+    RETURN_NULL();
+  }
+
+  if (status < 100 || status > 999) {
+    THROW_ERROR("Invalid status code");
+    RETURN_NULL();
+  }
+
+  self->status = (int) status;
+
+  RETURN_NULL();
+}
+
+
+PHP_METHOD(HttpResponse, setHeader) {
+  http_response_t* self;
+  char* name;
+  int name_length;
+  char* value;
+  int value_length;
+
+  if (zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "ss", &name, &name_length, &value, &value_length) == FAILURE) {
+    return;
+  }
+
+  self = (http_response_t*) zend_object_store_get_object(getThis() TSRMLS_CC);
+
+  if (self->headers_sent) {
+    THROW_ERROR("Headers already sent");
+    RETURN_NULL();
+  }
+
+  if (!http_response_add_header(self, name, name_length, value, value_length)) {
+    THROW_ERROR("Invalid header");
+    RETURN_NULL();
+  }
+
+  RETURN_NULL();
+}
+
+
+PHP_METHOD(HttpResponse, writeHead) {
+  http_response_t* self;
+  long status;
+  zval* headers = NULL;
+  zval** entry;
+  HashPosition pos;
+  char* key;
+  uint key_length;
+  ulong index;
+  zval value;
+
+  if (zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "l|a!", &status, &headers) == FAILURE) {
+    return;
+  }
+
+  self = (http_response_t*) zend_object_store_get_object(getThis() TSRMLS_CC);
+
+  if (self->headers_sent) {
+    THROW_ERROR("Headers already sent");
+    RETURN_NULL();
+  }
+
+  if (status < 100 || status > 999) {
+    THROW_ERROR("Invalid status code");
+    RETURN_NULL();
+  }
+
+  self->status = (int) status;
+
+  if (headers == NULL) {
+    RETURN_NULL();
+  }
+
+  for (zend_hash_internal_pointer_reset_ex(Z_ARRVAL_P(headers), &pos);
+       zend_hash_get_current_data_ex(Z_ARRVAL_P(headers), (void**) &entry, &pos) == SUCCESS;
+       zend_hash_move_forward_ex(Z_ARRVAL_P(headers), &pos)) {
+    if (zend_hash_get_current_key_ex(Z_ARRVAL_P(headers), &key, &key_length, &index, 0, &pos) != HASH_KEY_IS_STRING) {
+      THROW_ERROR("Header names must be strings");
+      RETURN_NULL();
+    }
+
+    value = **entry;
+    zval_copy_ctor(&value);
+    convert_to_string(&value);
+
+    if (!http_response_add_header(self, key, key_length - 1, Z_STRVAL(value), Z_STRLEN(value))) {
+      zval_dtor(&value);
+      THROW_ERROR("Invalid header");
+      RETURN_NULL();
+    }
+
+    zval_dtor(&value);
+  }
+
+  RETURN_NULL();
+}
+
+
+PHP_METHOD(HttpResponse, write) {
+  http_response_t* self;
+  zval* data;
+
+  if (zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "z", &data) == FAILURE) {
+    return;
+  }
+
+  self = (http_response_t*) zend_object_store_get_object(getThis() TSRMLS_CC);
+
+  if (self->finished) {
+    THROW_ERROR("Response already ended");
+    RETURN_NULL();
+  }
+
+  if (self->file) {
+    THROW_ERROR("A file is being sent");
+    RETURN_NULL();
+  }
+
+  RETURN_BOOL(http_response_output(self, data, 0));
+}
+
+
+PHP_METHOD(HttpResponse, end) {
+  http_response_t* self;
+  zval* data = NULL;
+
+  if (zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "|z!", &data) == FAILURE) {
+    return;
+  }
+
+  self = (http_response_t*) zend_object_store_get_object(getThis() TSRMLS_CC);
+
+  if (self->finished) {
+    THROW_ERROR("Response already ended");
+    RETURN_NULL();
+  }
+
+  if (self->file) {
+    THROW_ERROR("A file is being sent");
+    RETURN_NULL();
+  }
+
+  http_response_output(self, data, 1);
+  http_response_finish(self);
+
+  RETURN_NULL();
+}
+
+
+/* write() and end() for writers in C. Returns 1 to keep writing, 0 to */
+/* wait for the socket to drain and -1 if the response is gone. */
+int http_response_write_native(zval* response, zval* data, int last TSRMLS_DC) {
+  http_response_t* res = (http_response_t*) zend_object_store_get_object(response TSRMLS_CC);
+  int result;
+
+  if (res->finished || res->file ||
+      res->conn == NULL || res->conn->tcp == NULL || res->conn->closing) {
+    return -1;
+  }
+
+  result = http_response_output(res, data, last);
+
+  if (last) {
+    http_response_finish(res);
+  }
+
+  return result;
+}
+
+
+/* The TCP object a response goes out on, or NULL if it's closed. */
+zval* http_response_socket(zval* response TSRMLS_DC) {
+  http_response_t* res = (http_response_t*) zend_object_store_get_object(response TSRMLS_CC);
+
+  if (res->conn == NULL || res->conn->tcp == NULL || res->conn->closing) {
+    return NULL;
+  }
+
+  return res->conn->client;
+}
+
+
+static int http_header_get(http_request_t* req, int id, const char** value, size_t* len) {
+  int i = http_request_find_header(req, id, NULL, 0, 0);
+
+  if (i == -1) {
+    return 0;
+  }
+
+  *value = req->headers[i].value;
+  *len = req->headers[i].value_len;
+
+  return 1;
+}
+
+
+/* Weak comparison of our ETag against an If-None-Match list. */
+static int http_etag_match(const char* list, size_t len, const char* etag, size_t etag_len) {
+  const char* end = list + len;
+  const char* p = list;
+  const char* token;
+
+  while (p < end) {
+    while (p < end && (*p == ' ' || *p == '\t' || *p == ',')) {
+      p++;
+    }
+
+    token = p;
+    while (p < end && *p != ',') {
+      p++;
+    }
+
+    len = p - token;
+    while (len > 0 && (token[len - 1] == ' ' || token[len - 1] == '\t')) {
+      len--;
+    }
+
+    if (len == 1 && token[0] == '*') {
+      return 1;
+    }
+
+    if (len > 2 && token[0] == 'W' && token[1] == '/') {
+      token += 2;
+      len -= 2;
+    }
+
+    if (len == etag_len && memcmp(token, etag, len) == 0) {
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
+
+static int http_parse_offset(const char** p, const char* end, off_t* result) {
+  const char* start = *p;
+  off_t value = 0;
+
+  while (*p < end && **p >= '0' && **p <= '9') {
+    if (value > (((off_t) 1 << (sizeof(off_t) * 8 - 2)) / 10)) {
+      return 0;
+    }
+    value = value * 10 + (**p - '0');
+    (*p)++;
+  }
+
+  *result = value;
+
+  return *p > start;
+}
+
+
+/* Parses a single byte range. Returns 1 and the inclusive range if */
+/* it's satisfiable, -1 if it isn't, 0 if the header should be ignored */
+/* (malformed, or several ranges, which we don't do). */
+static int http_parse_range(const char* value, size_t len, off_t size, off_t* first, off_t* last) {
+  const char* end = value + len;
+  const char* p = value;
+  off_t suffix;
+
+  if (len < 6 || strncasecmp(value, "bytes=", 6) != 0 || memchr(value, ',', len)) {
+    return 0;
+  }
+
+  p += 6;
+
+  if (p < end && *p == '-') {
+    p++;
+    if (!http_parse_offset(&p, end, &suffix) || p != end) {
+      return 0;
+    }
+    if (suffix == 0 || size == 0) {
+      return -1;
+    }
+    *first = suffix < size ? size - suffix : 0;
+    *last = size - 1;
+    return 1;
+  }
+
+  if (!http_parse_offset(&p, end, first) || p == end || *p++ != '-') {
+    return 0;
+  }
+
+  if (p == end) {
+    *last = size - 1;
+  } else if (!http_parse_offset(&p, end, last) || p != end || *last < *first) {
+    return 0;
+  }
+
+  if (*first >= size) {
+    return -1;
+  }
+
+  if (*last >= size) {
+    *last = size - 1;
+  }
+
+  return 1;
+}
+
+
+/* Ends a sendFile() response that won't send (more of) the file. */
+static void http_sendfile_complete(sendfile_wrap_t* wrap, int ok) {
+  http_response_t* res = (http_response_t*) wrap->data;
+  zval* args[1];
+  TSRMLS_D_GET(wrap);
+
+  res->file = NULL;
+  res->file_ready = 0;
+  http_response_finish(res);
+
+  if (wrap->callback) {
+    MAKE_STD_ZVAL(args[0]);
+    ZVAL_BOOL(args[0], ok);
+    call_callback(wrap->callback, 1, args TSRMLS_CC);
+    zval_ptr_dtor(&args[0]);
+  }
+
+  sendfile_wrap_free(wrap);
+}
+
+
+static void http_sendfile_done_cb(sendfile_wrap_t* wrap, int status TSRMLS_DC) {
+  http_response_t* res = (http_response_t*) wrap->data;
+  zval* args[1];
+
+  res->file = NULL;
+
+  /* The head promised more bytes than we sent. */
+  if (status != 0) {
+    http_conn_close(res->conn);
+  }
+
+  http_response_finish(res);
+
+  if (wrap->callback) {
+    MAKE_STD_ZVAL(args[0]);
+    ZVAL_BOOL(args[0], status == 0);
+    call_callback(wrap->callback, 1, args TSRMLS_CC);
+    zval_ptr_dtor(&args[0]);
+  }
+
+  /* sendfile_finish() frees the wrap. */
+}
+
+
+/* Turns the fstat() data into a status and headers: 304 for a */
+/* matching conditional request, 206 or 416 for a Range, else 200. */
+static void http_sendfile_stat_cb(sendfile_wrap_t* wrap, struct stat* st TSRMLS_DC) {
+  http_response_t* res = (http_response_t*) wrap->data;
+  http_request_t* req;
+  char etag[64];
+  char modified[40];
+  char line[96];
+  size_t etag_len;
+  size_t modified_len;
+  const char* value;
+  size_t value_len;
+  off_t first = 0;
+  off_t last = 0;
+  int range = 0;
+  int n;
+
+  if (res->conn->tcp == NULL || res->conn->closing) {
+    http_sendfile_complete(wrap, 0);
+    return;
+  }
+
+  if (st == NULL || !S_ISREG(st->st_mode)) {
+    if (st == NULL && wrap->error == UV_EACCESS) {
+      res->status = 403;
+    } else if (st == NULL && wrap->error != UV_ENOENT) {
+      res->status = 500;
+    } else {
+      res->status = 404;
+    }
+
+    http_response_output(res, NULL, 1);
+    http_sendfile_complete(wrap, 0);
+    return;
+  }
+
+  req = (http_request_t*) zend_object_store_get_object(res->request TSRMLS_CC);
+
+  etag_len = snprintf(etag, sizeof etag, "\"%lx-%lx\"",
+                      (unsigned long) st->st_mtime,
+                      (unsigned long) st->st_size);
+  modified_len = http_format_date(modified, sizeof modified, st->st_mtime);
+
+  http_response_add_header(res, "ETag", 4, etag, etag_len);
+  http_response_add_header(res, "Last-Modified", 13, modified, modified_len);
+
+  if (http_header_get(req, HTTP_H_IF_NONE_MATCH, &value, &value_len)) {
+    if (http_etag_match(value, value_len, etag, etag_len)) {
+      res->status = 304;
+    }
+  } else if (http_header_get(req, HTTP_H_IF_MODIFIED_SINCE, &value, &value_len)) {
+    /* Exact match, like most servers; clients echo what we sent. */
+    if (value_len == modified_len && memcmp(value, modified, value_len) == 0) {
+      res->status = 304;
+    }
+  }
+
+  if (res->status == 304) {
+    http_response_output(res, NULL, 1);
+    http_sendfile_complete(wrap, 1);
+    return;
+  }
+
+  http_response_add_header(res, "Accept-Ranges", 13, "bytes", 5);
+
+  if (res->status == 200 &&
+      http_header_get(req, HTTP_H_RANGE, &value, &value_len)) {
+    range = http_parse_range(value, value_len, st->st_size, &first, &last);
+
+    /* If-Range: only send part of the file if it hasn't changed */
+    if (http_header_get(req, HTTP_H_IF_RANGE, &value, &value_len) &&
+        !(value_len == etag_len && memcmp(value, etag, etag_len) == 0) &&
+        !(value_len == modified_len && memcmp(value, modified, modified_len) == 0)) {
+      range = 0;
+    }
+  }
+
+  if (range == -1) {
+    res->status = 416;
+    n = snprintf(line, sizeof line, "bytes */%lu", (unsigned long) st->st_size);
+    http_response_add_header(res, "Content-Range", 13, line, n);
+    http_response_output(res, NULL, 1);
+    http_sendfile_complete(wrap, 0);
+    return;
+  }
+
+  if (range == 1) {
+    res->status = 206;
+    n = snprintf(line, sizeof line, "bytes %lu-%lu/%lu",
+                 (unsigned long) first,
+                 (unsigned long) last,
+                 (unsigned long) st->st_size);
+    http_response_add_header(res, "Content-Range", 13, line, n);
+  } else {
+    first = 0;
+    last = st->st_size - 1;
+  }
+
+  wrap->offset = first;
+  wrap->length = last - first + 1;
+
+  n = snprintf(line, sizeof line, "%lu", (unsigned long) wrap->length);
+  http_response_add_header(res, "Content-Length", 14, line, n);
+
+  if (res->head_request || wrap->length == 0) {
+    http_response_output(res, NULL, 1);
+    http_sendfile_complete(wrap, 1);
+    return;
+  }
+
+  /* The head goes out (or gets queued) now; the body follows as soon */
+  /* as this response is at the front of the pipeline. */
+  http_response_output(res, NULL, 0);
+  res->file_ready = 1;
+  http_response_start_file(res);
+}
+
+
+PHP_METHOD(HttpResponse, sendFile) {
+  http_response_t* self;
+  sendfile_wrap_t* wrap;
+  char* path;
+  int path_length;
+  zval* callback = NULL;
+  int r;
+
+  if (zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "s|z!", &path, &path_length, &callback) == FAILURE) {
+    return;
+  }
+
+  self = (http_response_t*) zend_object_store_get_object(getThis() TSRMLS_CC);
+
+  if (self->finished || self->file) {
+    THROW_ERROR("Response already ended");
+    RETURN_NULL();
+  }
+
+  if (self->headers_sent) {
+    THROW_ERROR("Headers already sent");
+    RETURN_NULL();
+  }
+
+  if (self->conn == NULL || self->conn->tcp == NULL || self->conn->closing) {
+    RETURN_FALSE;
+  }
+
+  wrap = sendfile_wrap_new(self->conn->client TSRMLS_CC);
+  wrap->stat_cb = http_sendfile_stat_cb;
+  wrap->done_cb = http_sendfile_done_cb;
+  wrap->data = (void*) self;
+  wrap->owner = getThis();
+  Z_ADDREF_P(wrap->owner);
+
+  if (callback) {
+    wrap->callback = callback;
+    Z_ADDREF_P(callback);
+  }
+
+  r = sendfile_open(wrap, path);
+  if (r != 0) {
+    sendfile_wrap_free(wrap);
+    if (r == SENDFILE_NOT_MAIN_THREAD) {
+      THROW_ERROR("sendFile needs the main thread");
+      RETURN_NULL();
+    }
+    RETURN_FALSE;
+  }
+
+  self->file = wrap;
+
+  RETURN_TRUE;
+}
+
+
+static zend_function_entry http_server_methods[] = {
+  PHP_ME(HttpServer, __construct, NULL, ZEND_ACC_PUBLIC)
+  { NULL }
+};
+
+
+static zend_function_entry http_request_methods[] = {
+  PHP_ME(HttpRequest, getMethod, NULL, ZEND_ACC_PUBLIC)
+  PHP_ME(HttpRequest, getUrl, NULL, ZEND_ACC_PUBLIC)
+  PHP_ME(HttpRequest, getHttpVersion, NULL, ZEND_ACC_PUBLIC)
+  PHP_ME(HttpRequest, getHeader, NULL, ZEND_ACC_PUBLIC)
+  PHP_ME(HttpRequest, getHeaders, NULL, ZEND_ACC_PUBLIC)
+  PHP_ME(HttpRequest, getBody, NULL, ZEND_ACC_PUBLIC)
+  { NULL }
+};
+
+
+static zend_function_entry http_response_methods[] = {
+  PHP_ME(HttpResponse, setStatus, NULL, ZEND_ACC_PUBLIC)
+  PHP_ME(HttpResponse, setHeader, NULL, ZEND_ACC_PUBLIC)
+  PHP_ME(HttpResponse, writeHead, NULL, ZEND_ACC_PUBLIC)
+  PHP_ME(HttpResponse, write, NULL, ZEND_ACC_PUBLIC)
+  PHP_ME(HttpResponse, end, NULL, ZEND_ACC_PUBLIC)
+  PHP_ME(HttpResponse, sendFile, NULL, ZEND_ACC_PUBLIC)
+  { NULL }
+};
+
+
+void http_init(TSRMLS_D) {
+  zend_class_entry ce;
+
+  http_settings.on_message_begin = http_on_message_begin;
+  http_settings.on_url = http_on_url;
+  http_settings.on_header_field = http_on_header_field;
+  http_settings.on_header_value = http_on_header_value;
+  http_settings.on_headers_complete = http_on_headers_complete;
+  http_settings.on_body = http_on_body;
+  http_settings.on_message_complete = http_on_message_complete;
+
+  INIT_CLASS_ENTRY(ce, "HttpServer", http_server_methods);
+  ce.create_object = tcp_new;
+  http_server_ce = zend_register_internal_class_ex(&ce, tcp_ce, NULL TSRMLS_CC);
+
+  INIT_CLASS_ENTRY(ce, "HttpRequest", http_request_methods);
+  ce.create_object = http_request_new;
+  http_request_ce = zend_register_internal_class(&ce TSRMLS_CC);
+
+  INIT_CLASS_ENTRY(ce, "HttpResponse", http_response_methods);
+  ce.create_object = http_response_new;
+  http_response_ce = zend_register_internal_class(&ce TSRMLS_CC);
+}
@@ -0,0 +1,687 @@
+/*
+ * Copyright (c) 2011, Ben Noordhuis <info@bnoordhuis.nl>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/* Hands TCP connections to another process. Each message is one unix */
+/* datagram: a tag byte and the payload, with the socket riding along */
+/* as SCM_RIGHTS. Datagrams keep every socket with its own payload, */
+/* which a stream socket wouldn't. */
+
+#include "phode.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+
+/* The only kind of message so far */
+#define IPC_TAG_TCP 'T'
+
+#define IPC_MAX_PAYLOAD 65536
+
+/* Messages read per wakeup, so a busy sender can't starve the loop */
+#define IPC_READ_BATCH 64
+/* We send one fd a message; room for a few more lets us close what a */
+/* misbehaving peer sends along instead of losing them to MSG_CTRUNC. */
+#define IPC_MAX_FDS 8
+
+
+typedef struct ipc_msg_s {
+  struct ipc_msg_s* next;
+  /* Our own dup() of the socket; closed once it has been sent */
+  int fd;
+  char* data;
+  size_t len;
+  zval* callback;
+} ipc_msg_t;
+
+
+typedef struct {
+  /* obj must be the first member, because it must be safe to cast */
+  /* ipc_t* to zend_object */
+  zend_object obj;
+  uv_loop_t* loop;
+  ev_io watcher;
+  int fd;
+  /* Where listen() bound, removed again on close */
+  char* path;
+  zval* callback;
+  /* send()s waiting for room at the other end */
+  ipc_msg_t* head;
+  ipc_msg_t* tail;
+  char* buf;
+  /* Keeps us alive while listening or while messages are queued */
+  zval* self;
+  unsigned listening:1;
+  unsigned connected:1;
+  TSRMLS_D;
+} ipc_t;
+
+
+static zend_class_entry* ipc_ce;
+
+
+static void ipc_io_cb(struct ev_loop* ev, ev_io* watcher, int revents);
+
+
+static int ipc_socket(void) {
+  int fd;
+
+  fd = socket(AF_UNIX, SOCK_DGRAM, 0);
+  if (fd < 0) {
+    return -1;
+  }
+
+  fcntl(fd, F_SETFD, FD_CLOEXEC);
+  fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+  return fd;
+}
+
+
+static int ipc_addr(struct sockaddr_un* addr, const char* path, int path_len) {
+  if (path_len <= 0 || (size_t) path_len >= sizeof(addr->sun_path)) {
+    return -1;
+  }
+
+  memset(addr, 0, sizeof(*addr));
+  addr->sun_family = AF_UNIX;
+  memcpy(addr->sun_path, path, path_len);
+
+  return 0;
+}
+
+
+static void ipc_watch(ipc_t* ipc, int events) {
+  struct ev_loop* ev = ipc->loop->ev;
+
+  if (ev_is_active(&ipc->watcher)) {
+    if (ipc->watcher.events == events) {
+      return;
+    }
+    ev_io_stop(ev, &ipc->watcher);
+  }
+
+  if (events) {
+    ev_io_set(&ipc->watcher, ipc->fd, events);
+    ev_io_start(ev, &ipc->watcher);
+  }
+}
+
+
+static void ipc_hold(ipc_t* ipc, zval* this_ptr) {
+  if (ipc->self == NULL) {
+    ipc->self = this_ptr;
+    Z_ADDREF_P(ipc->self);
+  }
+}
+
+
+/* Drops our self reference once we are neither listening nor sending. */
+static void ipc_release(ipc_t* ipc) {
+  zval* self = ipc->self;
+
+  if (ipc->listening || ipc->head || self == NULL) {
+    return;
+  }
+
+  ipc->self = NULL;
+  zval_ptr_dtor(&self);
+}
+
+
+/* Calls back with ($error) and frees the message. */
+static void ipc_msg_done(ipc_t* ipc, ipc_msg_t* m, const char* error) {
+  zval* args[1];
+  TSRMLS_D_GET(ipc);
+
+  close(m->fd);
+
+  if (m->callback) {
+    MAKE_STD_ZVAL(args[0]);
+    if (error) {
+      ZVAL_STRING(args[0], (char*) error, 1);
+    } else {
+      ZVAL_NULL(args[0]);
+    }
+
+    call_callback(m->callback, 1, args TSRMLS_CC);
+
+    zval_ptr_dtor(&args[0]);
+    zval_ptr_dtor(&m->callback);
+  }
+
+  efree(m->data);
+  efree(m);
+}
+
+
+static int ipc_sendmsg(int fd, ipc_msg_t* m) {
+  struct msghdr msg;
+  struct iovec iov;
+  struct cmsghdr* cmsg;
+  union {
+    struct cmsghdr align;
+    char buf[CMSG_SPACE(sizeof(int))];
+  } control;
+
+  iov.iov_base = m->data;
+  iov.iov_len = m->len;
+
+  memset(&msg, 0, sizeof(msg));
+  memset(&control, 0, sizeof(control));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control.buf;
+  msg.msg_controllen = sizeof(control.buf);
+
+  cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+  memcpy(CMSG_DATA(cmsg), &m->fd, sizeof(int));
+
+  return sendmsg(fd, &msg, 0);
+}
+
+
+/* Sends what it can; waits for the receiver to make room otherwise. */
+static void ipc_flush(ipc_t* ipc) {
+  ipc_msg_t* m;
+  const char* error;
+
+  while ((m = ipc->head) != NULL) {
+    error = NULL;
+
+    if (ipc_sendmsg(ipc->fd, m) < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        ipc_watch(ipc, EV_WRITE);
+        return;
+      }
+
+      error = strerror(errno);
+    }
+
+    ipc->head = m->next;
+    if (ipc->head == NULL) {
+      ipc->tail = NULL;
+    }
+
+    /* The callback may send more or close, hence the fresh look at */
+    /* the queue every time around. */
+    ipc_msg_done(ipc, m, error);
+  }
+
+  if (!ipc->listening) {
+    ipc_watch(ipc, 0);
+  }
+
+  ipc_release(ipc);
+}
+
+
+/* Wraps a received socket in a TCP object and hands it to the */
+/* listen() callback, along with the payload. */
+static void ipc_deliver(ipc_t* ipc, int fd, const char* payload, size_t len) {
+  tcp_wrap_t* tcp;
+  zval* args[2];
+  int type = 0;
+  socklen_t type_len = sizeof(type);
+  TSRMLS_D_GET(ipc);
+
+  /* Anything but a stream socket is of no use to a TCP object */
+  if (getsockopt(fd, SOL_SOCKET, SO_TYPE, &type, &type_len) || type != SOCK_STREAM) {
+    close(fd);
+    return;
+  }
+
+  fcntl(fd, F_SETFD, FD_CLOEXEC);
+  fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+  /* Like an accepted connection, the object lives as long as its handle */
+  MAKE_STD_ZVAL(args[0]);
+  Z_TYPE_P(args[0]) = IS_OBJECT;
+  Z_OBJVAL_P(args[0]) = tcp_new(tcp_ce TSRMLS_CC);
+  tcp = (tcp_wrap_t*) zend_object_store_get_object(args[0] TSRMLS_CC);
+
+  /* The handle never got going, so the object can go right away */
+  if (uv_tcp_open(&tcp->handle, fd)) {
+    tcp->handle.fd = -1;
+    close(fd);
+    zval_ptr_dtor(&args[0]);
+    return;
+  }
+
+  MAKE_STD_ZVAL(args[1]);
+  ZVAL_STRINGL(args[1], (char*) payload, len, 1);
+
+  if (ipc->callback) {
+    call_callback(ipc->callback, 2, args TSRMLS_CC);
+  }
+
+  zval_ptr_dtor(&args[1]);
+}
+
+
+static void ipc_receive(ipc_t* ipc) {
+  struct msghdr msg;
+  struct iovec iov;
+  struct cmsghdr* cmsg;
+  union {
+    struct cmsghdr align;
+    char buf[CMSG_SPACE(sizeof(int) * IPC_MAX_FDS)];
+  } control;
+  int fds[IPC_MAX_FDS];
+  int nfds;
+  int count;
+  ssize_t n;
+  int i;
+  int j;
+
+  for (i = 0; i < IPC_READ_BATCH && ipc->listening; i++) {
+    iov.iov_base = ipc->buf;
+    iov.iov_len = 1 + IPC_MAX_PAYLOAD;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+
+    n = recvmsg(ipc->fd, &msg, 0);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return;
+    }
+
+    nfds = 0;
+    for (cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+      if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+        continue;
+      }
+      count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+      if (count > IPC_MAX_FDS - nfds) {
+        count = IPC_MAX_FDS - nfds;
+      }
+      memcpy(fds + nfds, CMSG_DATA(cmsg), count * sizeof(int));
+      nfds += count;
+    }
+
+    /* Only the first fd is ours to keep */
+    for (j = 1; j < nfds; j++) {
+      close(fds[j]);
+    }
+
+    if (nfds == 0) {
+      continue;
+    }
+
+    /* Dropped if cut short; with MSG_CTRUNC the fds that didn't fit */
+    /* never arrived at all. */
+    if (n < 1 || ipc->buf[0] != IPC_TAG_TCP ||
+        (msg.msg_flags & (MSG_TRUNC | MSG_CTRUNC))) {
+      close(fds[0]);
+      continue;
+    }
+
+    ipc_deliver(ipc, fds[0], ipc->buf + 1, n - 1);
+  }
+}
+
+
+static void ipc_io_cb(struct ev_loop* ev, ev_io* watcher, int revents) {
+  ipc_t* ipc = container_of(watcher, ipc_t, watcher);
+  zval* self = ipc->self;
+
+  /* Callbacks may drop the last reference. */
+  if (self) {
+    Z_ADDREF_P(self);
+  }
+
+  if (revents & EV_READ) {
+    ipc_receive(ipc);
+  }
+
+  if ((revents & EV_WRITE) && ipc->connected) {
+    ipc_flush(ipc);
+  }
+
+  if (self) {
+    zval_ptr_dtor(&self);
+  }
+}
+
+
+/* Stops listening and sending. Queued messages fail with error, or */
+/* go without a word when it is NULL. */
+static void ipc_shutdown(ipc_t* ipc, const char* error) {
+  ipc_msg_t* m;
+
+  ipc_watch(ipc, 0);
+
+  if (ipc->fd >= 0) {
+    close(ipc->fd);
+    ipc->fd = -1;
+  }
+
+  if (ipc->path) {
+    unlink(ipc->path);
+    efree(ipc->path);
+    ipc->path = NULL;
+  }
+
+  if (ipc->callback) {
+    zval_ptr_dtor(&ipc->callback);
+    ipc->callback = NULL;
+  }
+
+  ipc->listening = 0;
+  ipc->connected = 0;
+
+  while ((m = ipc->head) != NULL) {
+    ipc->head = m->next;
+    if (ipc->head == NULL) {
+      ipc->tail = NULL;
+    }
+
+    if (error == NULL && m->callback) {
+      zval_ptr_dtor(&m->callback);
+      m->callback = NULL;
+    }
+
+    ipc_msg_done(ipc, m, error);
+  }
+}
+
+
+static void ipc_free(void* object TSRMLS_DC) {
+  ipc_t* ipc = (ipc_t*) object;
+
+  /* Nobody is left to call back. */
+  ipc_shutdown(ipc, NULL);
+
+  if (ipc->buf) {
+    efree(ipc->buf);
+  }
+
+  zend_object_std_dtor(&ipc->obj TSRMLS_CC);
+  efree(ipc);
+}
+
+
+static zend_object_value ipc_new(zend_class_entry* class_type TSRMLS_DC) {
+  zend_object_value instance;
+  ipc_t* ipc;
+
+  ipc = (ipc_t*) ecalloc(1, sizeof *ipc);
+
+  zend_object_std_init(&ipc->obj, class_type TSRMLS_CC);
+  init_properties(&ipc->obj, class_type);
+
+  TSRMLS_SET(ipc);
+
+  ipc->loop = phode_loop(TSRMLS_C);
+  ipc->fd = -1;
+  ev_init(&ipc->watcher, ipc_io_cb);
+
+  instance.handle = zend_objects_store_put((void*) ipc,
+                                           (zend_objects_store_dtor_t) zend_objects_destroy_object,
+                                           ipc_free,
+                                           NULL
+                                           TSRMLS_CC);
+  instance.handlers = zend_get_std_object_handlers();
+
+  return instance;
+}
+
+
+/* listen($path, $cb) takes connections that other processes send to */
+/* $path, calling $cb($socket, $payload) with a TCP object for each. */
+PHP_METHOD(IPC, listen) {
+  ipc_t* self;
+  struct sockaddr_un addr;
+  char* path;
+  int path_length;
+  zval* callback;
+  int fd;
+  int probe;
+
+  if (zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "sz", &path, &path_length, &callback) == FAILURE) {
+    return;
+  }
+
+  self = (ipc_t*) zend_object_store_get_object(getThis() TSRMLS_CC);
+
+  if (self->fd >= 0) {
+    THROW_ERROR("Already in use");
+    RETURN_NULL();
+  }
+
+  if (ipc_addr(&addr, path, path_length)) {
+    THROW_ERROR("Invalid path");
+    RETURN_NULL();
+  }
+
+  fd = ipc_socket();
+  if (fd < 0) {
+    THROW_ERROR(strerror(errno));
+    RETURN_NULL();
+  }
+
+  if (bind(fd, (struct sockaddr*) &addr, sizeof(addr))) {
+    if (errno != EADDRINUSE) {
+      close(fd);
+      THROW_ERROR(strerror(errno));
+      RETURN_NULL();
+    }
+
+    /* Left behind by a process that is gone, unless someone answers */
+    probe = ipc_socket();
+    if (probe >= 0) {
+      if (connect(probe, (struct sockaddr*) &addr, sizeof(addr)) &&
+          errno == ECONNREFUSED) {
+        unlink(addr.sun_path);
+      }
+      close(probe);
+    }
+
+    if (bind(fd, (struct sockaddr*) &addr, sizeof(addr))) {
+      close(fd);
+      THROW_ERROR(strerror(errno));
+      RETURN_NULL();
+    }
+  }
+
+  if (self->buf == NULL) {
+    self->buf = (char*) emalloc(1 + IPC_MAX_PAYLOAD);
+  }
+
+  self->fd = fd;
+  self->path = estrndup(path, path_length);
+  self->callback = callback;
+  Z_ADDREF_P(callback);
+  self->listening = 1;
+
+  ipc_watch(self, EV_READ);
+  ipc_hold(self, getThis());
+
+  RETURN_NULL();
+}
+
+
+/* connect($path) makes send() go to the process listening on $path. */
+PHP_METHOD(IPC, connect) {
+  ipc_t* self;
+  struct sockaddr_un addr;
+  char* path;
+  int path_length;
+  int fd;
+
+  if (zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "s", &path, &path_length) == FAILURE) {
+    return;
+  }
+
+  self = (ipc_t*) zend_object_store_get_object(getThis() TSRMLS_CC);
+
+  if (self->fd >= 0) {
+    THROW_ERROR("Already in use");
+    RETURN_NULL();
+  }
+
+  if (ipc_addr(&addr, path, path_length)) {
+    THROW_ERROR("Invalid path");
+    RETURN_NULL();
+  }
+
+  fd = ipc_socket();
+  if (fd < 0) {
+    THROW_ERROR(strerror(errno));
+    RETURN_NULL();
+  }
+
+  /* Connected, a datagram socket tells us when the receiver has room */
+  if (connect(fd, (struct sockaddr*) &addr, sizeof(addr))) {
+    close(fd);
+    THROW_ERROR(strerror(errno));
+    RETURN_NULL();
+  }
+
+  self->fd = fd;
+  self->connected = 1;
+
+  RETURN_NULL();
+}
+
+
+/* send($socket, $payload, $cb) hands $socket over to the other process, */
+/* together with $payload, e.g. the bytes already read from it. Here */
+/* the socket is closed right away. $cb($error) is called once the */
+/* message is out. */
+PHP_METHOD(IPC, send) {
+  ipc_t* self;
+  tcp_wrap_t* tcp;
+  ipc_msg_t* m;
+  zval* socket;
+  char* payload = "";
+  int payload_length = 0;
+  zval* callback = NULL;
+  int fd;
+
+  if (zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "O|sz!", &socket, tcp_ce, &payload, &payload_length, &callback) == FAILURE) {
+    return;
+  }
+
+  self = (ipc_t*) zend_object_store_get_object(getThis() TSRMLS_CC);
+  tcp = (tcp_wrap_t*) zend_object_store_get_object(socket TSRMLS_CC);
+
+  if (!self->connected) {
+    THROW_ERROR("Not connected");
+    RETURN_NULL();
+  }
+
+  if (payload_length > IPC_MAX_PAYLOAD) {
+    THROW_ERROR("Payload too large");
+    RETURN_NULL();
+  }
+
+  if (tcp->dead || tcp->listening) {
+    THROW_ERROR("Socket can't be handed over");
+    RETURN_NULL();
+  }
+
+  /* Bytes on their way out would end up on neither side */
+  if (tcp->handle.write_queue_size > 0 || tcp->corked_write || tcp->sendfile) {
+    THROW_ERROR("Socket has writes pending");
+    RETURN_NULL();
+  }
+
+  fd = dup(tcp->handle.fd);
+  if (fd < 0) {
+    THROW_ERROR(strerror(errno));
+    RETURN_NULL();
+  }
+  fcntl(fd, F_SETFD, FD_CLOEXEC);
+
+  tcp_close(tcp TSRMLS_CC);
+
+  m = (ipc_msg_t*) emalloc(sizeof *m);
+  m->next = NULL;
+  m->fd = fd;
+  m->len = 1 + payload_length;
+  m->data = (char*) emalloc(m->len);
+  m->data[0] = IPC_TAG_TCP;
+  memcpy(m->data + 1, payload, payload_length);
+  m->callback = callback;
+  if (callback) {
+    Z_ADDREF_P(callback);
+  }
+
+  if (self->tail) {
+    self->tail->next = m;
+  } else {
+    self->head = m;
+  }
+  self->tail = m;
+
+  ipc_hold(self, getThis());
+
+  /* Behind others still waiting for room */
+  if (!ev_is_active(&self->watcher)) {
+    ipc_flush(self);
+  }
+
+  RETURN_TRUE;
+}
+
+
+/* Stops listening; sockets not sent yet fail with "IPC closed". */
+PHP_METHOD(IPC, close) {
+  ipc_t* self;
+
+  self = (ipc_t*) zend_object_store_get_object(getThis() TSRMLS_CC);
+
+  ipc_shutdown(self, "IPC closed");
+  ipc_release(self);
+
+  RETURN_NULL();
+}
+
+
+static zend_function_entry ipc_methods[] = {
+  PHP_ME(IPC, listen, NULL, ZEND_ACC_PUBLIC)
+  PHP_ME(IPC, connect, NULL, ZEND_ACC_PUBLIC)
+  PHP_ME(IPC, send, NULL, ZEND_ACC_PUBLIC)
+  PHP_ME(IPC, close, NULL, ZEND_ACC_PUBLIC)
+  { NULL }
+};
+
+
+void ipc_init(TSRMLS_D) {
+  zend_class_entry ce;
+
+  INIT_CLASS_ENTRY(ce, "IPC", ipc_methods);
+  ce.create_object = ipc_new;
+  ipc_ce = zend_register_internal_class(&ce TSRMLS_CC);
+}
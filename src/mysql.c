@@ -0,0 +1,3495 @@
+/*
+ * Copyright (c) 2011, Ben Noordhuis <info@bnoordhuis.nl>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "phode.h"
+
+#include <libdrizzle/drizzle_client.h>
+#include <libdrizzle/conn_server.h> /* drizzle_con_set_charset */
+
+#include <arpa/inet.h> /* inet_ntop */
+#include <ctype.h>
+#include <errno.h>
+#include <math.h>
+#include <stdlib.h>
+
+
+/* utf8_general_ci */
+#define MYSQL_CHARSET_UTF8 33
+
+
+typedef struct mysql_query_s mysql_query_t;
+typedef struct mysql_wrap_s mysql_wrap_t;
+typedef struct mysql_con_s mysql_con_t;
+typedef struct mysql_json_s mysql_json_t;
+typedef struct mysql_cache_s mysql_cache_t;
+typedef struct mysql_cache_fill_s mysql_cache_fill_t;
+typedef struct mysql_resolve_s mysql_resolve_t;
+
+
+/* queryAll(): results collected in input order until the last query */
+/* is done. */
+typedef struct {
+  zval* callback;
+  zval* errors;
+  zval* results;
+  zval* infos;
+  long pending;
+} mysql_batch_t;
+
+
+enum {
+  MYSQL_STRING,
+  MYSQL_LONG,
+  MYSQL_DOUBLE
+};
+
+
+/* Column names with their hashes and the PHP type their values decode */
+/* to, worked out once per result instead of once per row. */
+typedef struct {
+  const char* name;
+  uint name_len;
+  ulong hash;
+  int type;
+  /* Columnar results: the column's values, in row order */
+  zval* values;
+} mysql_column_t;
+
+
+struct mysql_query_s {
+  mysql_query_t* next;
+  char* sql;
+  size_t sql_len;
+  zval* callback;
+  /* Give up waiting for a connection at this time; 0 waits forever */
+  ev_tstamp deadline;
+  /* Seconds the query may run once it's sent; 0 means no limit */
+  ev_tstamp timeout;
+  drizzle_result_st result;
+  mysql_column_t* columns;
+  uint16_t column_count;
+  zval* rows;
+  /* Streaming queries hand each row to row_cb instead of collecting */
+  /* them in rows; stream is the MySQLStream that controls the flow. */
+  zval* row_cb;
+  zval* stream;
+  mysql_con_t* con;
+  /* Set for queries that are part of a queryAll() */
+  mysql_batch_t* batch;
+  /* queryJSON() writes the rows out instead of collecting them */
+  mysql_json_t* json;
+  /* queryCached() misses */
+  mysql_cache_fill_t* fill;
+  ulong index;
+  /* Queries issued from C report back here instead */
+  void (*done_cb)(mysql_query_t* query, const char* error);
+  void* data;
+  unsigned result_init:1;
+  unsigned paused:1;
+  unsigned columnar:1;
+  /* The caller got a timeout error; what's left is draining the */
+  /* connection. */
+  unsigned timed_out:1;
+};
+
+
+/* Lets PHP pause and resume a streaming query. */
+typedef struct {
+  /* obj must be the first member, because it must be safe to cast */
+  /* mysql_stream_t* to zend_object */
+  zend_object obj;
+  /* NULL once the query is done */
+  mysql_query_t* query;
+} mysql_stream_t;
+
+
+enum {
+  MYSQL_IDLE,
+  MYSQL_CONNECT,
+  MYSQL_SEND,
+  MYSQL_COLUMNS,
+  MYSQL_ROWS
+};
+
+
+/* A libdrizzle connection whose socket is watched by the uv loop. */
+struct mysql_con_s {
+  drizzle_con_st con;
+  ev_io watcher;
+  /* Fires when the running query is past its timeout */
+  ev_timer timer;
+  mysql_wrap_t* owner;
+  mysql_query_t* query;
+  int state;
+  /* Queries run so far; the pool routes to the least-loaded one */
+  unsigned long served;
+  /* The side connection runs its own queue instead of the pool's. */
+  mysql_query_t* head;
+  mysql_query_t* tail;
+  /* The host name lookup ahead of a new connection */
+  mysql_resolve_t* resolve;
+  unsigned resolved:1;
+  unsigned side:1;
+  unsigned running:1;
+};
+
+
+/* Outlives its connection if that goes first; con is NULL then. */
+struct mysql_resolve_s {
+  mysql_con_t* con;
+};
+
+
+struct mysql_wrap_s {
+  /* obj must be the first member, because it must be safe to cast */
+  /* mysql_wrap_t* to zend_object */
+  zend_object obj;
+  drizzle_st drizzle;
+  mysql_con_t* cons;
+  int con_count;
+  uv_loop_t* loop;
+  /* Looked up on the loop; libdrizzle only gets the address */
+  char* host;
+  in_port_t port;
+  /* Queries waiting for a connection, oldest first */
+  mysql_query_t* head;
+  mysql_query_t* tail;
+  long queue_length;
+  /* 0 means unbounded */
+  long max_queue;
+  ev_tstamp queue_timeout;
+  ev_timer queue_timer;
+  /* Default for queries that don't pass their own timeout */
+  ev_tstamp query_timeout;
+  /* Sends KILL QUERY for queries that ran out of time; connects on */
+  /* first use. */
+  mysql_con_t side;
+  unsigned side_init:1;
+  /* Keeps us alive while there is work in flight */
+  zval* self;
+  unsigned closed:1;
+  TSRMLS_D;
+};
+
+
+typedef struct {
+  char* base;
+  size_t len;
+  size_t size;
+} mysql_buf_t;
+
+
+/* queryJSON(): rows go from libdrizzle's buffers to the socket as a */
+/* JSON array, without becoming PHP values on the way. */
+struct mysql_json_s {
+  /* The TCP or HttpResponse written to, and the TCP object the bytes */
+  /* end up on; both pinned until the query is freed. */
+  zval* out;
+  zval* socket;
+  mysql_buf_t buf;
+  /* '"name":' for every column, encoded once */
+  mysql_buf_t* keys;
+  uint16_t key_count;
+  long rows;
+  unsigned response:1;
+  unsigned started:1;
+  unsigned ended:1;
+  /* The output went away; the rest of the result is thrown away. */
+  unsigned failed:1;
+};
+
+
+/* Written out whenever this much JSON has piled up */
+#define MYSQL_JSON_CHUNK (16 * 1024)
+
+
+/* queryCached() results live in the loop, encoded as a column list */
+/* plus one buffer that holds each field as a 32-bit length, the bytes */
+/* and a NUL (no bytes for NULL). PHP values are only made on a hit. */
+typedef struct mysql_cache_entry_s {
+  /* Most recently used first */
+  struct mysql_cache_entry_s* prev;
+  struct mysql_cache_entry_s* next;
+  char* key;
+  uint key_len;
+  /* Table names, each NUL-terminated */
+  char* tags;
+  size_t tags_len;
+  ev_tstamp expires;
+  mysql_column_t* columns;
+  uint16_t column_count;
+  char* names;
+  char* data;
+  long row_count;
+  long affected_rows;
+  long insert_id;
+  long warning_count;
+  /* What the entry counts against MYSQL_CACHE_MAX_BYTES */
+  size_t size;
+  /* One for the cache, one per hit waiting to be delivered */
+  int refs;
+} mysql_cache_entry_t;
+
+
+typedef struct mysql_cache_hit_s {
+  struct mysql_cache_hit_s* next;
+  mysql_cache_entry_t* entry;
+  zval* callback;
+} mysql_cache_hit_t;
+
+
+struct mysql_cache_s {
+  loop_wrap_t* loop;
+  /* Key to mysql_cache_entry_t* */
+  HashTable entries;
+  mysql_cache_entry_t* head;
+  mysql_cache_entry_t* tail;
+  size_t size;
+  /* Bumped by invalidate(). Queries that were already running by */
+  /* then may have read stale rows; their results aren't stored. */
+  unsigned long generation;
+  /* Hits are called back from the loop, like any other result. */
+  ev_timer timer;
+  mysql_cache_hit_t* hits_head;
+  mysql_cache_hit_t* hits_tail;
+};
+
+
+/* A queryCached() miss, encoding its rows for the cache as they go by */
+struct mysql_cache_fill_s {
+  char* key;
+  uint key_len;
+  mysql_buf_t tags;
+  ev_tstamp ttl;
+  unsigned long generation;
+  mysql_buf_t data;
+  long row_count;
+  /* Too big to keep */
+  unsigned skip:1;
+};
+
+
+/* Per loop; least recently used entries go first when it's full. */
+#define MYSQL_CACHE_MAX_BYTES (64 * 1024 * 1024)
+/* Bigger results aren't cached at all. */
+#define MYSQL_CACHE_MAX_ENTRY (MYSQL_CACHE_MAX_BYTES / 16)
+#define MYSQL_CACHE_NULL ((uint32_t) -1)
+
+
+/* Rows buffered for one table, already rendered as a multi-row INSERT */
+typedef struct mysql_table_s {
+  struct mysql_table_s* next;
+  char* name;
+  /* Taken from the first row's keys */
+  char** columns;
+  uint* column_lens;
+  int column_count;
+  mysql_buf_t sql;
+  long rows;
+} mysql_table_t;
+
+
+typedef struct {
+  /* obj must be the first member, because it must be safe to cast */
+  /* mysql_inserter_t* to zend_object */
+  zend_object obj;
+  zval* db;
+  mysql_wrap_t* wrap;
+  mysql_table_t* tables;
+  long max_rows;
+  size_t max_bytes;
+  /* insert() reports backpressure while this many flushes are running */
+  long max_flushes;
+  long flushes;
+  ev_timer timer;
+  zval* drain_cb;
+  zval* error_cb;
+  /* flush() callbacks waiting for the running flushes */
+  zval* waiters;
+  /* Keeps us alive while rows are buffered or flushes are running */
+  zval* self;
+  unsigned need_drain:1;
+  TSRMLS_D;
+} mysql_inserter_t;
+
+
+typedef struct {
+  mysql_inserter_t* inserter;
+  char* table;
+  long rows;
+} mysql_flush_t;
+
+
+#define MYSQL_INSERTER_MAX_ROWS 1000
+#define MYSQL_INSERTER_MAX_BYTES (1024 * 1024)
+#define MYSQL_INSERTER_INTERVAL 100
+#define MYSQL_INSERTER_MAX_FLUSHES 4
+
+
+/* How long a killed query gets to wind down before its connection is */
+/* dropped instead. */
+#define MYSQL_KILL_GRACE 1.0
+
+
+zend_class_entry* mysql_ce;
+zend_class_entry* mysql_pool_ce;
+zend_class_entry* mysql_stream_ce;
+zend_class_entry* mysql_inserter_ce;
+
+
+static void mysql_buf_append(mysql_buf_t* buf, const char* data, size_t len) {
+  /* Always leave room for a NUL terminator. */
+  if (buf->len + len + 1 > buf->size) {
+    buf->size = 2 * (buf->len + len + 1);
+    buf->base = (char*) erealloc(buf->base, buf->size);
+  }
+
+  memcpy(buf->base + buf->len, data, len);
+  buf->len += len;
+  buf->base[buf->len] = '\0';
+}
+
+
+static void mysql_buf_free(mysql_buf_t* buf) {
+  if (buf->base) {
+    efree(buf->base);
+  }
+
+  buf->base = NULL;
+  buf->len = 0;
+  buf->size = 0;
+}
+
+
+/* Length of the UTF-8 sequence at s, or 0 if it isn't one: truncated, */
+/* overlong, a surrogate or past U+10FFFF. */
+static size_t mysql_utf8_len(const unsigned char* s, size_t len) {
+  size_t n;
+  size_t i;
+  unsigned long cp;
+
+  if (s[0] < 0xc2 || s[0] > 0xf4) {
+    return 0;
+  } else if (s[0] < 0xe0) {
+    n = 2;
+    cp = s[0] & 0x1f;
+  } else if (s[0] < 0xf0) {
+    n = 3;
+    cp = s[0] & 0x0f;
+  } else {
+    n = 4;
+    cp = s[0] & 0x07;
+  }
+
+  if (n > len) {
+    return 0;
+  }
+
+  for (i = 1; i < n; i++) {
+    if ((s[i] & 0xc0) != 0x80) {
+      return 0;
+    }
+    cp = (cp << 6) | (s[i] & 0x3f);
+  }
+
+  if ((n == 3 && cp < 0x800) || (n == 4 && cp < 0x10000) ||
+      (cp >= 0xd800 && cp <= 0xdfff) || cp > 0x10ffff) {
+    return 0;
+  }
+
+  return n;
+}
+
+
+/* Bytes that aren't UTF-8, like BLOB data, come out as U+FFFD. */
+static void mysql_json_append_string(mysql_buf_t* buf, const char* s, size_t len) {
+  static const char hex[] = "0123456789abcdef";
+  char escape[6] = { '\\', 'u', '0', '0', 0, 0 };
+  size_t start = 0;
+  size_t i;
+  size_t n;
+  unsigned char ch;
+
+  mysql_buf_append(buf, "\"", 1);
+
+  for (i = 0; i < len; i++) {
+    ch = (unsigned char) s[i];
+    if (ch >= 0x80) {
+      n = mysql_utf8_len((const unsigned char*) s + i, len - i);
+      if (n > 0) {
+        i += n - 1;
+        continue;
+      }
+
+      mysql_buf_append(buf, s + start, i - start);
+      start = i + 1;
+      mysql_buf_append(buf, "\\ufffd", 6);
+      continue;
+    }
+
+    if (ch >= 0x20 && ch != '"' && ch != '\\') {
+      continue;
+    }
+
+    mysql_buf_append(buf, s + start, i - start);
+    start = i + 1;
+
+    switch (ch) {
+      case '"':  mysql_buf_append(buf, "\\\"", 2); break;
+      case '\\': mysql_buf_append(buf, "\\\\", 2); break;
+      case '\n': mysql_buf_append(buf, "\\n", 2); break;
+      case '\r': mysql_buf_append(buf, "\\r", 2); break;
+      case '\t': mysql_buf_append(buf, "\\t", 2); break;
+      default:
+        escape[4] = hex[ch >> 4];
+        escape[5] = hex[ch & 15];
+        mysql_buf_append(buf, escape, 6);
+        break;
+    }
+  }
+
+  mysql_buf_append(buf, s + start, len - start);
+  mysql_buf_append(buf, "\"", 1);
+}
+
+
+/* MySQL prints numbers the way JSON wants them; this catches the odd */
+/* one that isn't, like "inf". */
+static int mysql_json_is_number(const char* s, size_t len) {
+  size_t i = 0;
+
+  if (i < len && s[i] == '-') {
+    i++;
+  }
+
+  if (i == len || !isdigit((unsigned char) s[i])) {
+    return 0;
+  }
+
+  /* No leading zeros */
+  if (s[i] == '0' && i + 1 < len && isdigit((unsigned char) s[i + 1])) {
+    return 0;
+  }
+
+  while (i < len && isdigit((unsigned char) s[i])) {
+    i++;
+  }
+
+  if (i < len && s[i] == '.') {
+    if (++i == len || !isdigit((unsigned char) s[i])) {
+      return 0;
+    }
+    while (i < len && isdigit((unsigned char) s[i])) {
+      i++;
+    }
+  }
+
+  if (i < len && (s[i] == 'e' || s[i] == 'E')) {
+    if (++i < len && (s[i] == '+' || s[i] == '-')) {
+      i++;
+    }
+    if (i == len || !isdigit((unsigned char) s[i])) {
+      return 0;
+    }
+    while (i < len && isdigit((unsigned char) s[i])) {
+      i++;
+    }
+  }
+
+  return i == len;
+}
+
+
+/* Same rules as mysql_value_zval(): numbers stay numbers unless an */
+/* integer wouldn't fit a long, everything else is a string. */
+static void mysql_json_append_value(mysql_buf_t* buf, mysql_column_t* c, const char* data, size_t size) {
+  if (data == NULL) {
+    mysql_buf_append(buf, "null", 4);
+    return;
+  }
+
+  switch (c->type) {
+    case MYSQL_LONG:
+      errno = 0;
+      strtol(data, NULL, 10);
+      if (errno == 0 && mysql_json_is_number(data, size)) {
+        mysql_buf_append(buf, data, size);
+        return;
+      }
+      break;
+
+    case MYSQL_DOUBLE:
+      if (mysql_json_is_number(data, size)) {
+        mysql_buf_append(buf, data, size);
+        return;
+      }
+      break;
+  }
+
+  mysql_json_append_string(buf, data, size);
+}
+
+
+static void mysql_json_drain_cb(tcp_wrap_t* tcp, void* data TSRMLS_DC) {
+  mysql_query_t* query = (mysql_query_t*) data;
+  mysql_con_t* c = query->con;
+
+  if (tcp->dead) {
+    query->json->failed = 1;
+  }
+
+  query->paused = 0;
+
+  /* Carry on from the loop rather than from inside the socket's */
+  /* callbacks; the query may well finish and unpin the socket. */
+  if (c && c->query == query && c->state == MYSQL_ROWS) {
+    ev_feed_event(c->owner->loop->ev, &c->watcher, EV_READ);
+  }
+}
+
+
+/* Hands the JSON collected so far to the output. If that reports */
+/* backpressure, the query stops reading rows until the socket drains. */
+static void mysql_json_flush(mysql_query_t* query, int last TSRMLS_DC) {
+  mysql_json_t* json = query->json;
+  tcp_wrap_t* tcp = (tcp_wrap_t*) zend_object_store_get_object(json->socket TSRMLS_CC);
+  write_wrap_t* wrap;
+  zval* chunk;
+  int result;
+
+  if (json->buf.len == 0 && !last) {
+    return;
+  }
+
+  MAKE_STD_ZVAL(chunk);
+  if (json->buf.base) {
+    ZVAL_STRINGL(chunk, json->buf.base, json->buf.len, 0);
+  } else {
+    ZVAL_EMPTY_STRING(chunk);
+  }
+
+  json->buf.base = NULL;
+  json->buf.len = 0;
+  json->buf.size = 0;
+  json->started = 1;
+
+  if (json->response) {
+    result = http_response_write_native(json->out, chunk, last TSRMLS_CC);
+  } else if (tcp->dead) {
+    result = -1;
+  } else {
+    wrap = tcp_write_begin(tcp TSRMLS_CC);
+    write_wrap_push_string(wrap, chunk);
+    result = tcp_write_end(tcp, wrap TSRMLS_CC);
+  }
+
+  zval_ptr_dtor(&chunk);
+
+  if (result < 0) {
+    json->failed = 1;
+  } else if (result == 0 && !last) {
+    query->paused = 1;
+    tcp->native_drain_cb = mysql_json_drain_cb;
+    tcp->native_drain_data = query;
+  }
+}
+
+
+/* Finishes the output once the query is over and returns the error */
+/* to report. Errors before the first byte leave the output alone, so */
+/* the caller can still answer with an error page; later ones close */
+/* the socket, since the JSON can't be completed. */
+static const char* mysql_json_end(mysql_query_t* query, const char* error TSRMLS_DC) {
+  mysql_json_t* json = query->json;
+
+  if (json->ended) {
+    return error;
+  }
+
+  json->ended = 1;
+
+  if (json->failed) {
+    return error ? error : "Output closed";
+  }
+
+  if (error) {
+    if (json->started) {
+      tcp_close((tcp_wrap_t*) zend_object_store_get_object(json->socket TSRMLS_CC) TSRMLS_CC);
+    }
+    json->failed = 1;
+    return error;
+  }
+
+  mysql_buf_append(&json->buf, json->rows ? "]" : "[]", json->rows ? 1 : 2);
+  mysql_json_flush(query, 1 TSRMLS_CC);
+
+  return json->failed ? "Output closed" : NULL;
+}
+
+
+static void mysql_json_columns(mysql_query_t* query) {
+  mysql_json_t* json = query->json;
+  uint16_t i;
+
+  json->keys = (mysql_buf_t*) ecalloc(query->column_count, sizeof(mysql_buf_t));
+  json->key_count = query->column_count;
+
+  for (i = 0; i < query->column_count; i++) {
+    mysql_json_append_string(&json->keys[i], query->columns[i].name, query->columns[i].name_len - 1);
+    mysql_buf_append(&json->keys[i], ":", 1);
+  }
+}
+
+
+static void mysql_json_row(mysql_query_t* query, drizzle_row_t row TSRMLS_DC) {
+  mysql_json_t* json = query->json;
+  size_t* sizes = drizzle_row_field_sizes(&query->result);
+  mysql_buf_t* buf = &json->buf;
+  uint16_t i;
+
+  if (json->failed) {
+    return;
+  }
+
+  mysql_buf_append(buf, json->rows++ ? ",{" : "[{", 2);
+
+  for (i = 0; i < query->column_count; i++) {
+    if (i > 0) {
+      mysql_buf_append(buf, ",", 1);
+    }
+    mysql_buf_append(buf, json->keys[i].base, json->keys[i].len);
+    mysql_json_append_value(buf, &query->columns[i], row[i], sizes[i]);
+  }
+
+  mysql_buf_append(buf, "}", 1);
+
+  if (buf->len >= MYSQL_JSON_CHUNK) {
+    mysql_json_flush(query, 0 TSRMLS_CC);
+  }
+}
+
+
+static void mysql_json_free(mysql_query_t* query TSRMLS_DC) {
+  mysql_json_t* json = query->json;
+  tcp_wrap_t* tcp = (tcp_wrap_t*) zend_object_store_get_object(json->socket TSRMLS_CC);
+  uint16_t i;
+
+  if (tcp->native_drain_cb == mysql_json_drain_cb && tcp->native_drain_data == query) {
+    tcp->native_drain_cb = NULL;
+    tcp->native_drain_data = NULL;
+  }
+
+  for (i = 0; i < json->key_count; i++) {
+    mysql_buf_free(&json->keys[i]);
+  }
+
+  if (json->keys) {
+    efree(json->keys);
+  }
+
+  mysql_buf_free(&json->buf);
+  zval_ptr_dtor(&json->out);
+  zval_ptr_dtor(&json->socket);
+  efree(json);
+}
+
+
+static void mysql_cache_timer_cb(struct ev_loop* ev, ev_timer* timer, int revents);
+
+
+static mysql_cache_t* mysql_cache_get(uv_loop_t* loop TSRMLS_DC) {
+  loop_wrap_t* wrap = loop_wrap_get(loop TSRMLS_CC);
+  mysql_cache_t* cache = wrap->mysql_cache;
+
+  if (cache == NULL) {
+    cache = (mysql_cache_t*) ecalloc(1, sizeof *cache);
+    cache->loop = wrap;
+    zend_hash_init(&cache->entries, 64, NULL, NULL, 0);
+    ev_init(&cache->timer, mysql_cache_timer_cb);
+    wrap->mysql_cache = cache;
+  }
+
+  return cache;
+}
+
+
+static void mysql_cache_entry_unref(mysql_cache_entry_t* entry) {
+  if (--entry->refs > 0) {
+    return;
+  }
+
+  if (entry->tags) {
+    efree(entry->tags);
+  }
+
+  if (entry->data) {
+    efree(entry->data);
+  }
+
+  efree(entry->columns);
+  efree(entry->names);
+  efree(entry->key);
+  efree(entry);
+}
+
+
+static void mysql_cache_unlink(mysql_cache_t* cache, mysql_cache_entry_t* entry) {
+  if (entry->prev) {
+    entry->prev->next = entry->next;
+  } else {
+    cache->head = entry->next;
+  }
+
+  if (entry->next) {
+    entry->next->prev = entry->prev;
+  } else {
+    cache->tail = entry->prev;
+  }
+
+  entry->prev = NULL;
+  entry->next = NULL;
+}
+
+
+static void mysql_cache_link(mysql_cache_t* cache, mysql_cache_entry_t* entry) {
+  entry->next = cache->head;
+  if (cache->head) {
+    cache->head->prev = entry;
+  } else {
+    cache->tail = entry;
+  }
+  cache->head = entry;
+}
+
+
+static void mysql_cache_drop(mysql_cache_t* cache, mysql_cache_entry_t* entry) {
+  mysql_cache_unlink(cache, entry);
+  zend_hash_del(&cache->entries, entry->key, entry->key_len);
+  cache->size -= entry->size;
+  mysql_cache_entry_unref(entry);
+}
+
+
+/* Expired entries are dropped when they're next asked for, or when */
+/* the space is needed. */
+static mysql_cache_entry_t* mysql_cache_find(mysql_cache_t* cache, const char* key, uint key_len) {
+  mysql_cache_entry_t** found;
+  mysql_cache_entry_t* entry;
+
+  if (zend_hash_find(&cache->entries, key, key_len, (void**) &found) == FAILURE) {
+    return NULL;
+  }
+
+  entry = *found;
+
+  if (entry->expires <= ev_now(cache->loop->loop->ev)) {
+    mysql_cache_drop(cache, entry);
+    return NULL;
+  }
+
+  mysql_cache_unlink(cache, entry);
+  mysql_cache_link(cache, entry);
+
+  return entry;
+}
+
+
+/* The connection's user, host, port and database, then the SQL with */
+/* runs of whitespace outside quotes folded into one space, so that */
+/* differently formatted copies of a query share an entry. Values are */
+/* spliced into the SQL, so they are part of the key too. */
+static char* mysql_cache_key(mysql_wrap_t* wrap, const char* sql, int sql_len, uint* key_len) {
+  drizzle_con_st* con = &wrap->cons[0].con;
+  mysql_buf_t key = { NULL, 0, 0 };
+  char port[16];
+  char* p;
+  char* end;
+  char* out;
+  char quote = 0;
+  int space = 0;
+  size_t start;
+
+  snprintf(port, sizeof port, ":%u/", (unsigned) drizzle_con_port(con));
+
+  mysql_buf_append(&key, drizzle_con_user(con), strlen(drizzle_con_user(con)));
+  mysql_buf_append(&key, "@", 1);
+  mysql_buf_append(&key, wrap->host, strlen(wrap->host));
+  mysql_buf_append(&key, port, strlen(port));
+  mysql_buf_append(&key, drizzle_con_db(con), strlen(drizzle_con_db(con)));
+  mysql_buf_append(&key, "", 1);
+
+  start = key.len;
+  mysql_buf_append(&key, sql, sql_len);
+
+  /* In place; the output never gets ahead of the input. */
+  end = key.base + key.len;
+  out = key.base + start;
+
+  for (p = out; p < end; p++) {
+    if (quote) {
+      *out++ = *p;
+      if (*p == '\\' && p + 1 < end) {
+        *out++ = *++p;
+      } else if (*p == quote) {
+        quote = 0;
+      }
+      continue;
+    }
+
+    if (isspace((unsigned char) *p)) {
+      space = 1;
+      continue;
+    }
+
+    if (space && out > key.base + start) {
+      *out++ = ' ';
+    }
+    space = 0;
+
+    if (*p == '\'' || *p == '"' || *p == '`') {
+      quote = *p;
+    }
+    *out++ = *p;
+  }
+
+  *key_len = out - key.base;
+  return key.base;
+}
+
+
+/* Takes a table name or an array of them. */
+static void mysql_cache_tags(zval* tags, mysql_buf_t* buf) {
+  HashPosition pos;
+  zval** entry;
+  zval copy;
+
+  if (Z_TYPE_P(tags) != IS_ARRAY) {
+    copy = *tags;
+    zval_copy_ctor(&copy);
+    convert_to_string(&copy);
+    mysql_buf_append(buf, Z_STRVAL(copy), Z_STRLEN(copy));
+    mysql_buf_append(buf, "", 1);
+    zval_dtor(&copy);
+    return;
+  }
+
+  for (zend_hash_internal_pointer_reset_ex(Z_ARRVAL_P(tags), &pos);
+       zend_hash_get_current_data_ex(Z_ARRVAL_P(tags), (void**) &entry, &pos) == SUCCESS;
+       zend_hash_move_forward_ex(Z_ARRVAL_P(tags), &pos)) {
+    mysql_cache_tags(*entry, buf);
+  }
+}
+
+
+static int mysql_cache_tagged(mysql_cache_entry_t* entry, const char* tag, size_t len) {
+  const char* p = entry->tags;
+  const char* end = p + entry->tags_len;
+  size_t n;
+
+  while (p < end) {
+    n = strlen(p);
+    if (n == len && memcmp(p, tag, len) == 0) {
+      return 1;
+    }
+    p += n + 1;
+  }
+
+  return 0;
+}
+
+
+/* Drops the entries tagged with any of the NUL-terminated names in */
+/* tags, or all of them if tags is NULL. */
+static long mysql_cache_invalidate(mysql_cache_t* cache, const char* tags, size_t tags_len) {
+  mysql_cache_entry_t* entry;
+  mysql_cache_entry_t* next;
+  const char* p;
+  long count = 0;
+
+  cache->generation++;
+
+  for (entry = cache->head; entry; entry = next) {
+    next = entry->next;
+
+    for (p = tags; p && p < tags + tags_len; p += strlen(p) + 1) {
+      if (mysql_cache_tagged(entry, p, strlen(p))) {
+        break;
+      }
+    }
+
+    if (tags == NULL || p < tags + tags_len) {
+      mysql_cache_drop(cache, entry);
+      count++;
+    }
+  }
+
+  return count;
+}
+
+
+static void mysql_cache_row(mysql_query_t* query, drizzle_row_t row) {
+  mysql_cache_fill_t* fill = query->fill;
+  size_t* sizes = drizzle_row_field_sizes(&query->result);
+  uint32_t len;
+  uint16_t i;
+
+  if (fill->skip) {
+    return;
+  }
+
+  for (i = 0; i < query->column_count; i++) {
+    len = row[i] ? (uint32_t) sizes[i] : MYSQL_CACHE_NULL;
+    mysql_buf_append(&fill->data, (const char*) &len, sizeof len);
+
+    if (row[i]) {
+      mysql_buf_append(&fill->data, row[i], sizes[i]);
+      mysql_buf_append(&fill->data, "", 1);
+    }
+  }
+
+  fill->row_count++;
+
+  if (fill->data.len > MYSQL_CACHE_MAX_ENTRY) {
+    mysql_buf_free(&fill->data);
+    fill->skip = 1;
+  }
+}
+
+
+/* Keeps a successful miss's result, making room as needed. Results */
+/* without columns come from writes and aren't kept. */
+static void mysql_cache_store(mysql_wrap_t* wrap, mysql_query_t* query TSRMLS_DC) {
+  mysql_cache_t* cache = mysql_cache_get(wrap->loop TSRMLS_CC);
+  mysql_cache_fill_t* fill = query->fill;
+  mysql_cache_entry_t* entry;
+  mysql_cache_entry_t** found;
+  size_t names_len = 0;
+  size_t off = 0;
+  uint16_t i;
+
+  if (fill->skip || query->columns == NULL || fill->generation != cache->generation) {
+    return;
+  }
+
+  entry = (mysql_cache_entry_t*) ecalloc(1, sizeof *entry);
+
+  entry->key = fill->key;
+  entry->key_len = fill->key_len;
+  fill->key = NULL;
+
+  entry->tags = fill->tags.base;
+  entry->tags_len = fill->tags.len;
+  fill->tags.base = NULL;
+  fill->tags.len = 0;
+  fill->tags.size = 0;
+
+  for (i = 0; i < query->column_count; i++) {
+    names_len += query->columns[i].name_len;
+  }
+
+  entry->column_count = query->column_count;
+  entry->columns = (mysql_column_t*) safe_emalloc(query->column_count, sizeof(mysql_column_t), 0);
+  entry->names = (char*) emalloc(names_len + 1);
+
+  for (i = 0; i < query->column_count; i++) {
+    entry->columns[i] = query->columns[i];
+    entry->columns[i].name = entry->names + off;
+    entry->columns[i].values = NULL;
+    memcpy(entry->names + off, query->columns[i].name, query->columns[i].name_len);
+    off += query->columns[i].name_len;
+  }
+
+  /* Give back what the buffer grew by in advance. */
+  if (fill->data.base) {
+    entry->data = (char*) erealloc(fill->data.base, fill->data.len + 1);
+  }
+  fill->data.base = NULL;
+
+  entry->row_count = fill->row_count;
+  entry->affected_rows = (long) drizzle_result_affected_rows(&query->result);
+  entry->insert_id = (long) drizzle_result_insert_id(&query->result);
+  entry->warning_count = drizzle_result_warning_count(&query->result);
+  entry->expires = ev_now(wrap->loop->ev) + fill->ttl;
+  entry->size = sizeof *entry + entry->key_len + entry->tags_len + names_len
+              + entry->column_count * sizeof(mysql_column_t) + fill->data.len;
+  entry->refs = 1;
+
+  /* A miss that ran alongside this one got there first. */
+  if (zend_hash_find(&cache->entries, entry->key, entry->key_len, (void**) &found) == SUCCESS) {
+    mysql_cache_drop(cache, *found);
+  }
+
+  zend_hash_add(&cache->entries, entry->key, entry->key_len, (void*) &entry, sizeof entry, NULL);
+  mysql_cache_link(cache, entry);
+  cache->size += entry->size;
+
+  while (cache->size > MYSQL_CACHE_MAX_BYTES && cache->tail != entry) {
+    mysql_cache_drop(cache, cache->tail);
+  }
+}
+
+
+static void mysql_cache_hit(mysql_cache_t* cache, mysql_cache_entry_t* entry, zval* callback) {
+  mysql_cache_hit_t* hit;
+
+  hit = (mysql_cache_hit_t*) emalloc(sizeof *hit);
+  hit->next = NULL;
+  hit->entry = entry;
+  entry->refs++;
+  hit->callback = callback;
+  Z_ADDREF_P(callback);
+
+  if (cache->hits_tail) {
+    cache->hits_tail->next = hit;
+  } else {
+    cache->hits_head = hit;
+  }
+  cache->hits_tail = hit;
+
+  if (!ev_is_active(&cache->timer)) {
+    ev_timer_set(&cache->timer, 0, 0);
+    ev_timer_start(cache->loop->loop->ev, &cache->timer);
+  }
+}
+
+
+static void mysql_cache_fill_free(mysql_cache_fill_t* fill) {
+  if (fill->key) {
+    efree(fill->key);
+  }
+
+  mysql_buf_free(&fill->tags);
+  mysql_buf_free(&fill->data);
+  efree(fill);
+}
+
+
+/* Called with the loop's other per-loop state. */
+void mysql_cache_free(loop_wrap_t* loop) {
+  mysql_cache_t* cache = loop->mysql_cache;
+  mysql_cache_hit_t* hit;
+
+  if (cache == NULL) {
+    return;
+  }
+
+  ev_timer_stop(loop->loop->ev, &cache->timer);
+
+  while ((hit = cache->hits_head) != NULL) {
+    cache->hits_head = hit->next;
+    mysql_cache_entry_unref(hit->entry);
+    zval_ptr_dtor(&hit->callback);
+    efree(hit);
+  }
+
+  while (cache->head) {
+    mysql_cache_drop(cache, cache->head);
+  }
+
+  zend_hash_destroy(&cache->entries);
+  efree(cache);
+  loop->mysql_cache = NULL;
+}
+
+
+static void mysql_query_free(mysql_query_t* query TSRMLS_DC) {
+  mysql_stream_t* stream;
+  uint16_t i;
+
+  if (query->stream) {
+    stream = (mysql_stream_t*) zend_object_store_get_object(query->stream TSRMLS_CC);
+    stream->query = NULL;
+    zval_ptr_dtor(&query->stream);
+  }
+
+  if (query->row_cb) {
+    zval_ptr_dtor(&query->row_cb);
+  }
+
+  if (query->json) {
+    mysql_json_free(query TSRMLS_CC);
+  }
+
+  if (query->fill) {
+    mysql_cache_fill_free(query->fill);
+  }
+
+  if (query->result_init) {
+    drizzle_result_free(&query->result);
+  }
+
+  if (query->rows) {
+    zval_ptr_dtor(&query->rows);
+  }
+
+  if (query->columns) {
+    for (i = 0; i < query->column_count; i++) {
+      if (query->columns[i].values) {
+        zval_ptr_dtor(&query->columns[i].values);
+      }
+    }
+    efree(query->columns);
+  }
+
+  if (query->callback) {
+    zval_ptr_dtor(&query->callback);
+  }
+
+  efree(query->sql);
+  efree(query);
+}
+
+
+static mysql_batch_t* mysql_batch_new(zval* callback) {
+  mysql_batch_t* batch;
+
+  batch = (mysql_batch_t*) emalloc(sizeof *batch);
+  batch->callback = callback;
+  Z_ADDREF_P(callback);
+  batch->pending = 0;
+
+  MAKE_STD_ZVAL(batch->errors);
+  array_init(batch->errors);
+  MAKE_STD_ZVAL(batch->results);
+  array_init(batch->results);
+  MAKE_STD_ZVAL(batch->infos);
+  array_init(batch->infos);
+
+  return batch;
+}
+
+
+/* Calls back with ($errors, $results, $infos), each indexed like the */
+/* SQL array that was passed in. */
+static void mysql_batch_done(mysql_batch_t* batch TSRMLS_DC) {
+  zval* args[3];
+
+  args[0] = batch->errors;
+  args[1] = batch->results;
+  args[2] = batch->infos;
+
+  call_callback(batch->callback, 3, args TSRMLS_CC);
+
+  zval_ptr_dtor(&batch->errors);
+  zval_ptr_dtor(&batch->results);
+  zval_ptr_dtor(&batch->infos);
+  zval_ptr_dtor(&batch->callback);
+  efree(batch);
+}
+
+
+/* Takes over the references in args. */
+static void mysql_batch_add(mysql_batch_t* batch, ulong index, zval** args TSRMLS_DC) {
+  add_index_zval(batch->errors, index, args[0]);
+  add_index_zval(batch->results, index, args[1]);
+  add_index_zval(batch->infos, index, args[2]);
+
+  if (--batch->pending == 0) {
+    mysql_batch_done(batch TSRMLS_CC);
+  }
+}
+
+
+/* Calls back with ($error, $rows, $info). $rows is null for streaming */
+/* queries. Internal queries have nobody to tell. */
+static void mysql_query_notify(mysql_wrap_t* wrap, mysql_query_t* query, const char* error) {
+  zval* args[3];
+  TSRMLS_D_GET(wrap);
+
+  if (query->done_cb) {
+    query->done_cb(query, error);
+    return;
+  }
+
+  if (query->json) {
+    error = mysql_json_end(query, error TSRMLS_CC);
+  }
+
+  if (query->fill && error == NULL) {
+    mysql_cache_store(wrap, query TSRMLS_CC);
+  }
+
+  if (query->callback == NULL && query->batch == NULL) {
+    return;
+  }
+
+  MAKE_STD_ZVAL(args[0]);
+  MAKE_STD_ZVAL(args[2]);
+
+  if (error) {
+    ZVAL_STRING(args[0], (char*) error, 1);
+    MAKE_STD_ZVAL(args[1]);
+    ZVAL_NULL(args[1]);
+    ZVAL_NULL(args[2]);
+  } else {
+    ZVAL_NULL(args[0]);
+
+    if (query->rows) {
+      args[1] = query->rows;
+      query->rows = NULL;
+    } else if (query->json) {
+      MAKE_STD_ZVAL(args[1]);
+      ZVAL_LONG(args[1], query->json->rows);
+    } else if (query->row_cb) {
+      MAKE_STD_ZVAL(args[1]);
+      ZVAL_NULL(args[1]);
+    } else {
+      MAKE_STD_ZVAL(args[1]);
+      array_init(args[1]);
+    }
+
+    array_init(args[2]);
+    add_assoc_long(args[2], "affected_rows", (long) drizzle_result_affected_rows(&query->result));
+    add_assoc_long(args[2], "insert_id", (long) drizzle_result_insert_id(&query->result));
+    add_assoc_long(args[2], "warning_count", drizzle_result_warning_count(&query->result));
+  }
+
+  if (query->batch) {
+    mysql_batch_add(query->batch, query->index, args TSRMLS_CC);
+  } else {
+    call_callback(query->callback, 3, args TSRMLS_CC);
+
+    zval_ptr_dtor(&args[0]);
+    zval_ptr_dtor(&args[1]);
+    zval_ptr_dtor(&args[2]);
+  }
+}
+
+
+static void mysql_query_done(mysql_wrap_t* wrap, mysql_query_t* query, const char* error) {
+  TSRMLS_D_GET(wrap);
+
+  if (!query->timed_out) {
+    mysql_query_notify(wrap, query, error);
+  }
+
+  mysql_query_free(query TSRMLS_CC);
+}
+
+
+static int mysql_busy(mysql_wrap_t* wrap) {
+  int i;
+
+  if (wrap->head) {
+    return 1;
+  }
+
+  for (i = 0; i < wrap->con_count; i++) {
+    if (wrap->cons[i].running || wrap->cons[i].query) {
+      return 1;
+    }
+  }
+
+  if (wrap->side.running || wrap->side.query || wrap->side.head) {
+    return 1;
+  }
+
+  return 0;
+}
+
+
+/* Drops our self reference once nothing is pending. */
+static void mysql_release(mysql_wrap_t* wrap) {
+  zval* self = wrap->self;
+
+  if (self == NULL || mysql_busy(wrap)) {
+    return;
+  }
+
+  ev_timer_stop(wrap->loop->ev, &wrap->queue_timer);
+
+  wrap->self = NULL;
+  zval_ptr_dtor(&self);
+}
+
+
+static void mysql_con_watch(mysql_con_t* c, short events) {
+  struct ev_loop* ev = c->owner->loop->ev;
+  int fd = drizzle_con_fd(&c->con);
+  int mask = 0;
+
+  if (events & POLLIN) {
+    mask |= EV_READ;
+  }
+
+  if (events & POLLOUT) {
+    mask |= EV_WRITE;
+  }
+
+  if (fd == -1) {
+    mask = 0;
+  }
+
+  if (ev_is_active(&c->watcher)) {
+    if (c->watcher.fd == fd && (c->watcher.events & (EV_READ | EV_WRITE)) == mask) {
+      return;
+    }
+    ev_io_stop(ev, &c->watcher);
+  }
+
+  if (mask) {
+    ev_io_set(&c->watcher, fd, mask);
+    ev_io_start(ev, &c->watcher);
+  }
+}
+
+
+/* libdrizzle's hook for registering interest in the socket; this is */
+/* what replaces the poll() in drizzle_con_wait(). */
+static drizzle_return_t mysql_event_watch_cb(drizzle_con_st* con, short events, void* context) {
+  mysql_con_watch((mysql_con_t*) drizzle_con_context(con), events);
+  return DRIZZLE_RETURN_OK;
+}
+
+
+static int mysql_column_php_type(drizzle_column_st* column) {
+  switch (drizzle_column_type(column)) {
+    case DRIZZLE_COLUMN_TYPE_TINY:
+    case DRIZZLE_COLUMN_TYPE_SHORT:
+    case DRIZZLE_COLUMN_TYPE_INT24:
+    case DRIZZLE_COLUMN_TYPE_LONG:
+    case DRIZZLE_COLUMN_TYPE_LONGLONG:
+    case DRIZZLE_COLUMN_TYPE_YEAR:
+      return MYSQL_LONG;
+
+    case DRIZZLE_COLUMN_TYPE_FLOAT:
+    case DRIZZLE_COLUMN_TYPE_DOUBLE:
+      return MYSQL_DOUBLE;
+
+    /* DECIMAL would lose precision as a double, and dates and times */
+    /* carry no time zone to turn them into timestamps. */
+    default:
+      return MYSQL_STRING;
+  }
+}
+
+
+static void mysql_columns_init(mysql_query_t* query) {
+  drizzle_column_st* column;
+  mysql_column_t* c;
+  uint16_t count = drizzle_result_column_count(&query->result);
+
+  query->columns = (mysql_column_t*) ecalloc(count, sizeof(mysql_column_t));
+  query->column_count = count;
+
+  for (c = query->columns; c < query->columns + count && (column = drizzle_column_next(&query->result)) != NULL; c++) {
+    c->name = drizzle_column_name(column);
+    c->name_len = strlen(c->name) + 1;
+    c->hash = zend_get_hash_value(c->name, c->name_len);
+    c->type = mysql_column_php_type(column);
+  }
+}
+
+
+/* Decodes a field according to its column's type. Integers that don't */
+/* fit a long stay strings. */
+static zval* mysql_value_zval(mysql_column_t* c, const char* data, size_t size) {
+  zval* value;
+  char* end;
+  long l;
+
+  MAKE_STD_ZVAL(value);
+
+  if (data == NULL) {
+    ZVAL_NULL(value);
+    return value;
+  }
+
+  switch (c->type) {
+    case MYSQL_LONG:
+      errno = 0;
+      l = strtol(data, &end, 10);
+      if (errno == 0 && end == data + size && size > 0) {
+        ZVAL_LONG(value, l);
+        return value;
+      }
+      break;
+
+    case MYSQL_DOUBLE:
+      ZVAL_DOUBLE(value, strtod(data, NULL));
+      return value;
+  }
+
+  ZVAL_STRINGL(value, data, size, 1);
+  return value;
+}
+
+
+static zval* mysql_row_zval(mysql_query_t* query, drizzle_row_t row) {
+  size_t* sizes = drizzle_row_field_sizes(&query->result);
+  mysql_column_t* c;
+  zval* value;
+  zval* array;
+  uint16_t i;
+
+  MAKE_STD_ZVAL(array);
+  array_init_size(array, query->column_count);
+
+  for (i = 0; i < query->column_count; i++) {
+    c = &query->columns[i];
+    value = mysql_value_zval(c, row[i], sizes[i]);
+
+    zend_hash_quick_update(Z_ARRVAL_P(array), c->name, c->name_len, c->hash,
+                           (void*) &value, sizeof(zval*), NULL);
+  }
+
+  return array;
+}
+
+
+/* Turns a cache entry back into the rows query() would have made. */
+static zval* mysql_cache_rows(mysql_cache_entry_t* entry) {
+  const char* p = entry->data;
+  mysql_column_t* c;
+  zval* rows;
+  zval* row;
+  zval* value;
+  uint32_t len;
+  uint16_t i;
+  long n;
+
+  MAKE_STD_ZVAL(rows);
+  array_init_size(rows, (uint) entry->row_count);
+
+  for (n = 0; n < entry->row_count; n++) {
+    MAKE_STD_ZVAL(row);
+    array_init_size(row, entry->column_count);
+
+    for (i = 0; i < entry->column_count; i++) {
+      c = &entry->columns[i];
+      memcpy(&len, p, sizeof len);
+      p += sizeof len;
+
+      if (len == MYSQL_CACHE_NULL) {
+        value = mysql_value_zval(c, NULL, 0);
+      } else {
+        value = mysql_value_zval(c, p, len);
+        p += len + 1;
+      }
+
+      zend_hash_quick_update(Z_ARRVAL_P(row), c->name, c->name_len, c->hash,
+                             (void*) &value, sizeof(zval*), NULL);
+    }
+
+    add_next_index_zval(rows, row);
+  }
+
+  return rows;
+}
+
+
+/* Calls back the hits queued so far with ($error, $rows, $info), */
+/* the same as query() would. */
+static void mysql_cache_timer_cb(struct ev_loop* ev, ev_timer* timer, int revents) {
+  mysql_cache_t* cache = container_of(timer, mysql_cache_t, timer);
+  mysql_cache_hit_t* hit = cache->hits_head;
+  mysql_cache_hit_t* next;
+  mysql_cache_entry_t* entry;
+  zval* args[3];
+  TSRMLS_D_GET(cache->loop);
+
+  /* Hits the callbacks cause wait for the next round. */
+  cache->hits_head = NULL;
+  cache->hits_tail = NULL;
+
+  for (; hit; hit = next) {
+    next = hit->next;
+    entry = hit->entry;
+
+    MAKE_STD_ZVAL(args[0]);
+    ZVAL_NULL(args[0]);
+    args[1] = mysql_cache_rows(entry);
+    MAKE_STD_ZVAL(args[2]);
+    array_init(args[2]);
+    add_assoc_long(args[2], "affected_rows", entry->affected_rows);
+    add_assoc_long(args[2], "insert_id", entry->insert_id);
+    add_assoc_long(args[2], "warning_count", entry->warning_count);
+
+    call_callback(hit->callback, 3, args TSRMLS_CC);
+
+    zval_ptr_dtor(&args[0]);
+    zval_ptr_dtor(&args[1]);
+    zval_ptr_dtor(&args[2]);
+    zval_ptr_dtor(&hit->callback);
+    mysql_cache_entry_unref(entry);
+    efree(hit);
+  }
+}
+
+
+/* Columnar results are one packed array per column, keyed by the */
+/* column name, rather than a hash per row. */
+static void mysql_columnar_init(mysql_query_t* query) {
+  mysql_column_t* c;
+  uint16_t i;
+
+  for (i = 0; i < query->column_count; i++) {
+    c = &query->columns[i];
+
+    MAKE_STD_ZVAL(c->values);
+    array_init(c->values);
+
+    /* A later column with the same name replaces this one in the */
+    /* result, like it does in a row; keep our own reference. */
+    Z_ADDREF_P(c->values);
+    zend_hash_quick_update(Z_ARRVAL_P(query->rows), c->name, c->name_len, c->hash,
+                           (void*) &c->values, sizeof(zval*), NULL);
+  }
+}
+
+
+static void mysql_columnar_add(mysql_query_t* query, drizzle_row_t row) {
+  size_t* sizes = drizzle_row_field_sizes(&query->result);
+  uint16_t i;
+
+  for (i = 0; i < query->column_count; i++) {
+    add_next_index_zval(query->columns[i].values,
+                        mysql_value_zval(&query->columns[i], row[i], sizes[i]));
+  }
+}
+
+
+/* Hands a row to a streaming query's row callback as ($row, $stream). */
+static void mysql_row_emit(mysql_wrap_t* wrap, mysql_query_t* query, zval* row) {
+  zval* args[2];
+  TSRMLS_D_GET(wrap);
+
+  args[0] = row;
+  args[1] = query->stream;
+
+  /* The callback may close the connection and free the query. */
+  Z_ADDREF_P(args[1]);
+  call_callback(query->row_cb, 2, args TSRMLS_CC);
+  zval_ptr_dtor(&args[1]);
+  zval_ptr_dtor(&args[0]);
+}
+
+
+static void mysql_resolve_cb(void* data, dns_addr_t* addr, const char* error TSRMLS_DC);
+
+
+static void mysql_con_set_addr(mysql_con_t* c, dns_addr_t* addr) {
+  char ip[INET6_ADDRSTRLEN];
+
+  if (addr->family == AF_INET6) {
+    inet_ntop(AF_INET6, &addr->v6, ip, sizeof ip);
+  } else {
+    inet_ntop(AF_INET, &addr->v4, ip, sizeof ip);
+  }
+
+  drizzle_con_set_tcp(&c->con, ip, c->owner->port);
+}
+
+
+/* Looks the host up on the loop ahead of every new connection, so */
+/* that libdrizzle's blocking getaddrinfo() only ever sees an address. */
+/* Returns 1 while the lookup is in flight. */
+static int mysql_con_resolve(mysql_con_t* c) {
+  mysql_wrap_t* wrap = c->owner;
+  dns_addr_t addr;
+  TSRMLS_D_GET(wrap);
+
+  if (c->resolve) {
+    return 1;
+  }
+
+  if (drizzle_con_fd(&c->con) != -1) {
+    return 0;
+  }
+
+  /* Used up by the connect that follows */
+  if (c->resolved) {
+    c->resolved = 0;
+    return 0;
+  }
+
+  if (dns_resolve_local(wrap->loop, wrap->host, &addr TSRMLS_CC) == 0) {
+    mysql_con_set_addr(c, &addr);
+    return 0;
+  }
+
+  c->resolve = (mysql_resolve_t*) emalloc(sizeof *c->resolve);
+  c->resolve->con = c;
+  dns_resolve(wrap->loop, wrap->host, mysql_resolve_cb, c->resolve TSRMLS_CC);
+
+  return 1;
+}
+
+
+/* Drives the connection's state machine until libdrizzle has to wait */
+/* for the socket or there's nothing left to do. */
+static void mysql_con_loop(mysql_con_t* c) {
+  mysql_wrap_t* wrap = c->owner;
+  mysql_query_t* query;
+  drizzle_return_t ret;
+  drizzle_row_t row;
+  const char* error;
+  zval* value;
+  TSRMLS_D_GET(wrap);
+
+  while (!wrap->closed) {
+    query = c->query;
+    error = NULL;
+
+    switch (c->state) {
+      case MYSQL_IDLE:
+        if (c->side) {
+          if (c->head == NULL) {
+            return;
+          }
+
+          query = c->head;
+          c->head = query->next;
+          if (c->head == NULL) {
+            c->tail = NULL;
+          }
+        } else {
+          if (wrap->head == NULL) {
+            return;
+          }
+
+          query = wrap->head;
+          wrap->head = query->next;
+          if (wrap->head == NULL) {
+            wrap->tail = NULL;
+          }
+          wrap->queue_length--;
+        }
+
+        query->next = NULL;
+        query->con = c;
+        c->query = query;
+        c->served++;
+        c->state = MYSQL_SEND;
+
+        if (query->timeout > 0) {
+          ev_timer_set(&c->timer, query->timeout, 0);
+          ev_timer_start(wrap->loop->ev, &c->timer);
+        }
+        continue;
+
+      case MYSQL_CONNECT:
+        if (mysql_con_resolve(c)) {
+          return;
+        }
+
+        ret = drizzle_con_connect(&c->con);
+        if (ret == DRIZZLE_RETURN_IO_WAIT) {
+          return;
+        }
+
+        /* A failed handshake is retried by the next query. */
+        if (ret != DRIZZLE_RETURN_OK) {
+          mysql_con_watch(c, 0);
+        }
+
+        c->state = MYSQL_IDLE;
+        continue;
+
+      case MYSQL_SEND:
+        if (mysql_con_resolve(c)) {
+          return;
+        }
+
+        /* Connects first if needed. */
+        drizzle_query(&c->con, &query->result, query->sql, query->sql_len, &ret);
+        if (ret == DRIZZLE_RETURN_IO_WAIT) {
+          return;
+        }
+
+        if (ret == DRIZZLE_RETURN_ERROR_CODE) {
+          query->result_init = 1;
+          error = drizzle_result_error(&query->result);
+          break;
+        }
+
+        if (ret != DRIZZLE_RETURN_OK) {
+          error = drizzle_error(&wrap->drizzle);
+          break;
+        }
+
+        query->result_init = 1;
+
+        if (drizzle_result_column_count(&query->result) == 0) {
+          break;
+        }
+
+        c->state = MYSQL_COLUMNS;
+        continue;
+
+      case MYSQL_COLUMNS:
+        ret = drizzle_column_buffer(&query->result);
+        if (ret == DRIZZLE_RETURN_IO_WAIT) {
+          return;
+        }
+
+        if (ret != DRIZZLE_RETURN_OK) {
+          error = drizzle_error(&wrap->drizzle);
+          break;
+        }
+
+        mysql_columns_init(query);
+        if (query->json) {
+          mysql_json_columns(query);
+        } else if (query->row_cb == NULL) {
+          MAKE_STD_ZVAL(query->rows);
+          array_init(query->rows);
+        }
+        if (query->columnar) {
+          mysql_columnar_init(query);
+        }
+        c->state = MYSQL_ROWS;
+        continue;
+
+      case MYSQL_ROWS:
+        /* Not reading leaves the rows in the socket and, once its */
+        /* buffers fill up, stalls the server. */
+        if (query->paused) {
+          mysql_con_watch(c, 0);
+          return;
+        }
+
+        row = drizzle_row_buffer(&query->result, &ret);
+        if (ret == DRIZZLE_RETURN_IO_WAIT) {
+          return;
+        }
+
+        if (ret != DRIZZLE_RETURN_OK) {
+          error = drizzle_error(&wrap->drizzle);
+          break;
+        }
+
+        if (row == NULL) {
+          break;
+        }
+
+        /* Nobody wants these any more. */
+        if (query->timed_out) {
+          drizzle_row_free(&query->result, row);
+          continue;
+        }
+
+        if (query->columnar) {
+          mysql_columnar_add(query, row);
+          drizzle_row_free(&query->result, row);
+          continue;
+        }
+
+        if (query->json) {
+          mysql_json_row(query, row TSRMLS_CC);
+          drizzle_row_free(&query->result, row);
+          continue;
+        }
+
+        if (query->fill) {
+          mysql_cache_row(query, row);
+        }
+
+        value = mysql_row_zval(query, row);
+        drizzle_row_free(&query->result, row);
+
+        if (query->row_cb) {
+          mysql_row_emit(wrap, query, value);
+        } else {
+          add_next_index_zval(query->rows, value);
+        }
+        continue;
+    }
+
+    /* The query is done, one way or another. libdrizzle closes the */
+    /* socket on connection errors; the next query reconnects. */
+    if (drizzle_con_fd(&c->con) == -1) {
+      mysql_con_watch(c, 0);
+    }
+
+    ev_timer_stop(wrap->loop->ev, &c->timer);
+    c->query = NULL;
+    c->state = MYSQL_IDLE;
+    mysql_query_done(wrap, query, error);
+  }
+}
+
+
+static void mysql_con_run(mysql_con_t* c) {
+  /* Callbacks that queue more work land here again. */
+  if (c->running) {
+    return;
+  }
+
+  c->running = 1;
+  mysql_con_loop(c);
+  c->running = 0;
+
+  mysql_release(c->owner);
+}
+
+
+static void mysql_con_stop(mysql_con_t* c) {
+  mysql_con_watch(c, 0);
+  ev_timer_stop(c->owner->loop->ev, &c->timer);
+}
+
+
+static void mysql_io_cb(struct ev_loop* ev, ev_io* watcher, int revents);
+static void mysql_con_timeout_cb(struct ev_loop* ev, ev_timer* timer, int revents);
+
+
+static void mysql_con_init(mysql_wrap_t* wrap, mysql_con_t* c) {
+  c->owner = wrap;
+  ev_init(&c->watcher, mysql_io_cb);
+  ev_init(&c->timer, mysql_con_timeout_cb);
+  drizzle_con_set_context(&c->con, c);
+  /* Whatever the server defaults to, rows come back as UTF-8. */
+  drizzle_con_set_charset(&c->con, MYSQL_CHARSET_UTF8);
+}
+
+
+/* Drops the connection along with whatever it was in the middle of, */
+/* which fails with error; the next query reconnects. */
+static void mysql_con_reset(mysql_con_t* c, const char* error) {
+  mysql_query_t* query = c->query;
+
+  mysql_con_stop(c);
+  drizzle_con_close(&c->con);
+
+  c->query = NULL;
+  c->state = MYSQL_IDLE;
+
+  if (query) {
+    /* drizzle_query() attaches the result before it first waits on */
+    /* the socket, unless it was still connecting. */
+    if (query->result.con != NULL) {
+      query->result_init = 1;
+    }
+    mysql_query_done(c->owner, query, error);
+  }
+}
+
+
+static void mysql_resolve_cb(void* data, dns_addr_t* addr, const char* error TSRMLS_DC) {
+  mysql_resolve_t* resolve = (mysql_resolve_t*) data;
+  mysql_con_t* c = resolve->con;
+  mysql_wrap_t* wrap;
+  zval* self;
+
+  efree(resolve);
+
+  if (c == NULL) {
+    return;
+  }
+
+  c->resolve = NULL;
+  wrap = c->owner;
+  self = wrap->self;
+
+  /* Cancelled; the loop is going away */
+  if (addr == NULL && error == NULL) {
+    return;
+  }
+
+  /* Callbacks may drop the last reference. */
+  if (self) {
+    Z_ADDREF_P(self);
+  }
+
+  if (addr) {
+    mysql_con_set_addr(c, addr);
+    c->resolved = 1;
+  } else {
+    /* A pool warming up has nobody to tell */
+    mysql_con_reset(c, error);
+  }
+
+  if (!wrap->closed) {
+    mysql_con_run(c);
+  }
+
+  if (self) {
+    zval_ptr_dtor(&self);
+  }
+}
+
+
+/* Asks the server to stop a query, on a connection of its own. */
+static void mysql_kill(mysql_wrap_t* wrap, uint32_t thread_id) {
+  mysql_con_t* side = &wrap->side;
+  mysql_query_t* query;
+  char sql[32];
+
+  if (!wrap->side_init) {
+    drizzle_con_clone(&wrap->drizzle, &side->con, &wrap->cons[0].con);
+    mysql_con_init(wrap, side);
+    side->side = 1;
+    wrap->side_init = 1;
+  }
+
+  query = (mysql_query_t*) ecalloc(1, sizeof *query);
+  query->sql_len = snprintf(sql, sizeof sql, "KILL QUERY %u", thread_id);
+  query->sql = estrndup(sql, query->sql_len);
+
+  if (side->tail) {
+    side->tail->next = query;
+  } else {
+    side->head = query;
+  }
+  side->tail = query;
+
+  mysql_con_run(side);
+}
+
+
+/* Tells the caller about the timeout right away and kills the query */
+/* on the server, which makes it end with an error and frees up the */
+/* connection. If that takes too long, the connection is dropped. */
+static void mysql_con_timeout_cb(struct ev_loop* ev, ev_timer* timer, int revents) {
+  mysql_con_t* c = container_of(timer, mysql_con_t, timer);
+  mysql_wrap_t* wrap = c->owner;
+  mysql_query_t* query = c->query;
+  mysql_stream_t* stream;
+  zval* self = wrap->self;
+  TSRMLS_D_GET(wrap);
+
+  if (query == NULL || self == NULL) {
+    return;
+  }
+
+  /* Callbacks may drop the last reference. */
+  Z_ADDREF_P(self);
+
+  if (query->timed_out) {
+    mysql_con_reset(c, "Query timed out");
+  } else {
+    query->timed_out = 1;
+    query->paused = 0;
+
+    if (query->stream) {
+      stream = (mysql_stream_t*) zend_object_store_get_object(query->stream TSRMLS_CC);
+      stream->query = NULL;
+    }
+
+    mysql_query_notify(wrap, query, "Query timed out");
+
+    if (c->query != query || wrap->closed) {
+      /* The callback closed us. */
+    } else if (!(drizzle_con_options(&c->con) & DRIZZLE_CON_READY)) {
+      /* Still connecting; there's nothing to kill on the server. */
+      mysql_con_reset(c, "Query timed out");
+    } else {
+      mysql_kill(wrap, drizzle_con_thread_id(&c->con));
+      ev_timer_set(&c->timer, MYSQL_KILL_GRACE, 0);
+      ev_timer_start(ev, &c->timer);
+
+      /* A paused stream has to drain now. */
+      mysql_con_watch(c, c->con.events);
+    }
+  }
+
+  mysql_con_run(c);
+  zval_ptr_dtor(&self);
+}
+
+
+/* Finds the idle connection that has run the fewest queries. */
+/* Connected ones win over ones that still have to connect. */
+static mysql_con_t* mysql_con_pick(mysql_wrap_t* wrap) {
+  mysql_con_t* best = NULL;
+  mysql_con_t* c;
+  int i;
+
+  for (i = 0; i < wrap->con_count; i++) {
+    c = &wrap->cons[i];
+
+    if (c->state != MYSQL_IDLE || c->running) {
+      continue;
+    }
+
+    if (best == NULL) {
+      best = c;
+    } else if ((drizzle_con_fd(&c->con) == -1) != (drizzle_con_fd(&best->con) == -1)) {
+      if (drizzle_con_fd(&c->con) != -1) {
+        best = c;
+      }
+    } else if (c->served < best->served) {
+      best = c;
+    }
+  }
+
+  return best;
+}
+
+
+static void mysql_queue_timer_start(mysql_wrap_t* wrap) {
+  struct ev_loop* ev = wrap->loop->ev;
+  ev_tstamp after;
+
+  if (wrap->head == NULL || wrap->head->deadline == 0 || ev_is_active(&wrap->queue_timer)) {
+    return;
+  }
+
+  after = wrap->head->deadline - ev_now(ev);
+  ev_timer_set(&wrap->queue_timer, after > 0 ? after : 0, 0);
+  ev_timer_start(ev, &wrap->queue_timer);
+}
+
+
+/* Fails the queries that waited too long for a connection. */
+static void mysql_queue_timer_cb(struct ev_loop* ev, ev_timer* timer, int revents) {
+  mysql_wrap_t* wrap = container_of(timer, mysql_wrap_t, queue_timer);
+  mysql_query_t* query;
+  zval* self = wrap->self;
+
+  if (self == NULL) {
+    return;
+  }
+
+  /* Callbacks may drop the last reference. */
+  Z_ADDREF_P(self);
+
+  while ((query = wrap->head) != NULL && query->deadline <= ev_now(ev)) {
+    wrap->head = query->next;
+    if (wrap->head == NULL) {
+      wrap->tail = NULL;
+    }
+    wrap->queue_length--;
+
+    mysql_query_done(wrap, query, "Timed out waiting for a connection");
+  }
+
+  mysql_queue_timer_start(wrap);
+  mysql_release(wrap);
+  zval_ptr_dtor(&self);
+}
+
+
+static void mysql_io_cb(struct ev_loop* ev, ev_io* watcher, int revents) {
+  mysql_con_t* c = container_of(watcher, mysql_con_t, watcher);
+  short events = 0;
+
+  if (revents & EV_READ) {
+    events |= POLLIN;
+  }
+
+  if (revents & EV_WRITE) {
+    events |= POLLOUT;
+  }
+
+  drizzle_con_set_revents(&c->con, events);
+
+  /* Only keep watching for what libdrizzle still waits for; it asks */
+  /* again when it runs into EAGAIN. An idle connection isn't watched. */
+  mysql_con_watch(c, c->con.events);
+
+  mysql_con_run(c);
+}
+
+
+/* Fails everything that's queued or in flight. */
+static void mysql_fail_all(mysql_wrap_t* wrap, const char* error) {
+  mysql_query_t* query;
+  mysql_con_t* c;
+  int i;
+
+  for (i = 0; i < wrap->con_count; i++) {
+    c = &wrap->cons[i];
+    c->state = MYSQL_IDLE;
+
+    if (c->query) {
+      query = c->query;
+      c->query = NULL;
+      mysql_query_done(wrap, query, error);
+    }
+  }
+
+  while ((query = wrap->head) != NULL) {
+    wrap->head = query->next;
+    wrap->queue_length--;
+    mysql_query_done(wrap, query, error);
+  }
+
+  wrap->tail = NULL;
+
+  /* Only internal queries live here; nobody to call back. */
+  if (wrap->side.query) {
+    query = wrap->side.query;
+    wrap->side.query = NULL;
+    wrap->side.state = MYSQL_IDLE;
+    mysql_query_done(wrap, query, error);
+  }
+
+  while ((query = wrap->side.head) != NULL) {
+    wrap->side.head = query->next;
+    mysql_query_done(wrap, query, error);
+  }
+
+  wrap->side.tail = NULL;
+}
+
+
+static void mysql_wrap_free(void* object TSRMLS_DC) {
+  mysql_wrap_t* wrap = (mysql_wrap_t*) object;
+  mysql_query_t* query;
+  int i;
+
+  for (i = 0; i < wrap->con_count; i++) {
+    mysql_con_stop(&wrap->cons[i]);
+    if (wrap->cons[i].resolve) {
+      wrap->cons[i].resolve->con = NULL;
+    }
+  }
+
+  if (wrap->side_init) {
+    mysql_con_stop(&wrap->side);
+    if (wrap->side.resolve) {
+      wrap->side.resolve->con = NULL;
+    }
+  }
+
+  if (wrap->host) {
+    efree(wrap->host);
+  }
+
+  ev_timer_stop(wrap->loop->ev, &wrap->queue_timer);
+
+  /* Closes the sockets and frees results still attached to them. */
+  drizzle_free(&wrap->drizzle);
+
+  for (i = 0; i < wrap->con_count; i++) {
+    if (wrap->cons[i].query) {
+      wrap->cons[i].query->result_init = 0;
+      mysql_query_free(wrap->cons[i].query TSRMLS_CC);
+    }
+  }
+
+  if (wrap->cons) {
+    efree(wrap->cons);
+  }
+
+  if (wrap->side.query) {
+    wrap->side.query->result_init = 0;
+    mysql_query_free(wrap->side.query TSRMLS_CC);
+  }
+
+  while ((query = wrap->side.head) != NULL) {
+    wrap->side.head = query->next;
+    mysql_query_free(query TSRMLS_CC);
+  }
+
+  while ((query = wrap->head) != NULL) {
+    wrap->head = query->next;
+    mysql_query_free(query TSRMLS_CC);
+  }
+
+  zend_object_std_dtor(&wrap->obj TSRMLS_CC);
+  efree(wrap);
+}
+
+
+static zend_object_value mysql_new(zend_class_entry* class_type TSRMLS_DC) {
+  zend_object_value instance;
+  mysql_wrap_t* wrap;
+
+  wrap = (mysql_wrap_t*) ecalloc(1, sizeof *wrap);
+
+  zend_object_std_init(&wrap->obj, class_type TSRMLS_CC);
+  init_properties(&wrap->obj, class_type);
+
+  TSRMLS_SET(wrap);
+
+  wrap->loop = phode_loop(TSRMLS_C);
+
+  drizzle_create(&wrap->drizzle);
+  drizzle_add_options(&wrap->drizzle, DRIZZLE_NON_BLOCKING);
+  drizzle_set_event_watch_fn(&wrap->drizzle, mysql_event_watch_cb, NULL);
+
+  ev_init(&wrap->queue_timer, mysql_queue_timer_cb);
+
+  instance.handle = zend_objects_store_put((void*) wrap,
+                                           (zend_objects_store_dtor_t) zend_objects_destroy_object,
+                                           mysql_wrap_free,
+                                           NULL
+                                           TSRMLS_CC);
+  instance.handlers = zend_get_std_object_handlers();
+
+  return instance;
+}
+
+
+static void mysql_stream_free(void* object TSRMLS_DC) {
+  mysql_stream_t* stream = (mysql_stream_t*) object;
+
+  zend_object_std_dtor(&stream->obj TSRMLS_CC);
+  efree(stream);
+}
+
+
+static zend_object_value mysql_stream_new(zend_class_entry* class_type TSRMLS_DC) {
+  zend_object_value instance;
+  mysql_stream_t* stream;
+
+  stream = (mysql_stream_t*) ecalloc(1, sizeof *stream);
+
+  zend_object_std_init(&stream->obj, class_type TSRMLS_CC);
+  init_properties(&stream->obj, class_type);
+
+  instance.handle = zend_objects_store_put((void*) stream,
+                                           (zend_objects_store_dtor_t) zend_objects_destroy_object,
+                                           mysql_stream_free,
+                                           NULL
+                                           TSRMLS_CC);
+  instance.handlers = zend_get_std_object_handlers();
+
+  return instance;
+}
+
+
+/* Nothing goes over the wire until a connection is needed, nor is */
+/* the host looked up. */
+static void mysql_cons_init(mysql_wrap_t* wrap, int count, const char* host, long port, const char* user, const char* password, const char* db) {
+  mysql_con_t* c;
+  int i;
+
+  wrap->host = estrdup(host);
+  wrap->port = (in_port_t) port;
+
+  wrap->cons = (mysql_con_t*) safe_emalloc(count, sizeof(mysql_con_t), 0);
+  memset(wrap->cons, 0, count * sizeof(mysql_con_t));
+  wrap->con_count = count;
+
+  for (i = 0; i < count; i++) {
+    c = &wrap->cons[i];
+
+    drizzle_con_create(&wrap->drizzle, &c->con);
+    mysql_con_init(wrap, c);
+    drizzle_con_set_auth(&c->con, user, password);
+    drizzle_con_set_db(&c->con, db);
+  }
+}
+
+
+static long mysql_option_long(zval* options, const char* name, long value) {
+  zval** entry;
+  zval copy;
+
+  if (options && zend_hash_find(Z_ARRVAL_P(options), name, strlen(name) + 1, (void**) &entry) == SUCCESS) {
+    copy = **entry;
+    zval_copy_ctor(&copy);
+    convert_to_long(&copy);
+    value = Z_LVAL_P(&copy);
+  }
+
+  return value;
+}
+
+
+/* Options shared by MySQL and MySQLPool, all in milliseconds: */
+/* "queue_timeout" is how long a query may wait for a connection, */
+/* "query_timeout" how long it may run once sent; "max_queue" bounds */
+/* how many may wait. */
+static void mysql_options_init(mysql_wrap_t* wrap, zval* options) {
+  wrap->max_queue = mysql_option_long(options, "max_queue", 0);
+  wrap->queue_timeout = mysql_option_long(options, "queue_timeout", 0) / 1000.0;
+  wrap->query_timeout = mysql_option_long(options, "query_timeout", 0) / 1000.0;
+}
+
+
+PHP_METHOD(MySQL, __construct) {
+  mysql_wrap_t* self;
+  char* host = "127.0.0.1";
+  int host_length;
+  char* user = "";
+  int user_length;
+  char* password = "";
+  int password_length;
+  char* db = "";
+  int db_length;
+  long port = 3306;
+  zval* options = NULL;
+
+  if (zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "|ssssla!", &host, &host_length, &user, &user_length, &password, &password_length, &db, &db_length, &port, &options) == FAILURE) {
+    return;
+  }
+
+  self = (mysql_wrap_t*) zend_object_store_get_object(getThis() TSRMLS_CC);
+
+  if (self->cons) {
+    THROW_ERROR("Already constructed");
+    RETURN_NULL();
+  }
+
+  mysql_options_init(self, options);
+  mysql_cons_init(self, 1, host, port, user, password, db);
+}
+
+
+/* MySQLPool($size, $host, $user, $password, $db, $port, $options) keeps */
+/* $size connections open. Queries go to the least-loaded idle one, or */
+/* wait in line for one. */
+PHP_METHOD(MySQLPool, __construct) {
+  mysql_wrap_t* self;
+  long size;
+  char* host = "127.0.0.1";
+  int host_length;
+  char* user = "";
+  int user_length;
+  char* password = "";
+  int password_length;
+  char* db = "";
+  int db_length;
+  long port = 3306;
+  zval* options = NULL;
+  int i;
+
+  if (zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "l|ssssla!", &size, &host, &host_length, &user, &user_length, &password, &password_length, &db, &db_length, &port, &options) == FAILURE) {
+    return;
+  }
+
+  self = (mysql_wrap_t*) zend_object_store_get_object(getThis() TSRMLS_CC);
+
+  if (self->cons) {
+    THROW_ERROR("Already constructed");
+    RETURN_NULL();
+  }
+
+  if (size < 1 || size > 1024) {
+    THROW_ERROR("Pool size out of range");
+    RETURN_NULL();
+  }
+
+  mysql_options_init(self, options);
+  mysql_cons_init(self, size, host, port, user, password, db);
+
+  /* Warm up: handshake and auth happen now instead of on the first */
+  /* queries. */
+  for (i = 0; i < self->con_count; i++) {
+    self->cons[i].state = MYSQL_CONNECT;
+    mysql_con_run(&self->cons[i]);
+  }
+}
+
+
+/* Throws and returns 0 unless count more queries can be taken: idle */
+/* connections take one each, the rest must fit in the queue. */
+static int mysql_query_room(mysql_wrap_t* self, long count TSRMLS_DC) {
+  int i;
+
+  if (self->closed || self->cons == NULL) {
+    THROW_ERROR("Connection closed");
+    return 0;
+  }
+
+  if (self->max_queue == 0) {
+    return 1;
+  }
+
+  for (i = 0; i < self->con_count; i++) {
+    if (self->cons[i].state == MYSQL_IDLE && !self->cons[i].running) {
+      count--;
+    }
+  }
+
+  if (self->queue_length + count > self->max_queue) {
+    THROW_ERROR("Too many queued queries");
+    return 0;
+  }
+
+  return 1;
+}
+
+
+/* Queues a query; mysql_dispatch() hands it to a connection. */
+static void mysql_query_push(mysql_wrap_t* self, zval* this_ptr, mysql_query_t* query) {
+  if (self->queue_timeout > 0) {
+    query->deadline = ev_now(self->loop->ev) + self->queue_timeout;
+  }
+
+  query->timeout = self->query_timeout;
+
+  if (self->tail) {
+    self->tail->next = query;
+  } else {
+    self->head = query;
+  }
+  self->tail = query;
+  self->queue_length++;
+
+  if (self->self == NULL) {
+    self->self = this_ptr;
+    Z_ADDREF_P(self->self);
+  }
+}
+
+
+static mysql_query_t* mysql_query_add(mysql_wrap_t* self, zval* this_ptr, char* sql, int sql_length, zval* callback) {
+  mysql_query_t* query;
+
+  query = (mysql_query_t*) ecalloc(1, sizeof *query);
+  query->sql = estrndup(sql, sql_length);
+  query->sql_len = sql_length;
+
+  if (callback) {
+    query->callback = callback;
+    Z_ADDREF_P(callback);
+  }
+
+  mysql_query_push(self, this_ptr, query);
+
+  return query;
+}
+
+
+/* Starts the queries mysql_query_add() queued on as many idle */
+/* connections as it takes. */
+static void mysql_dispatch(mysql_wrap_t* self) {
+  mysql_con_t* c;
+
+  while (self->head && !self->closed && (c = mysql_con_pick(self)) != NULL) {
+    mysql_con_run(c);
+  }
+
+  mysql_queue_timer_start(self);
+}
+
+
+/* query($sql, $cb, $timeout) calls $cb($error, $rows, $info). $timeout */
+/* (ms) overrides the query_timeout option; once it passes, the query */
+/* is killed and $cb gets "Query timed out". */
+PHP_METHOD(MySQL, query) {
+  mysql_wrap_t* self;
+  mysql_query_t* query;
+  char* sql;
+  int sql_length;
+  zval* callback;
+  long timeout = -1;
+
+  if (zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "sz|l", &sql, &sql_length, &callback, &timeout) == FAILURE) {
+    return;
+  }
+
+  self = (mysql_wrap_t*) zend_object_store_get_object(getThis() TSRMLS_CC);
+
+  if (!mysql_query_room(self, 1 TSRMLS_CC)) {
+    RETURN_NULL();
+  }
+
+  query = mysql_query_add(self, getThis(), sql, sql_length, callback);
+  if (timeout >= 0) {
+    query->timeout = timeout / 1000.0;
+  }
+
+  mysql_dispatch(self);
+
+  RETURN_TRUE;
+}
+
+
+/* queryAll(array $sqls, $cb, $timeout) runs the queries concurrently, spread */
+/* over the idle connections of a pool, and calls $cb($errors, $results, */
+/* $infos) once all of them are done. The arrays are in the order of */
+/* $sqls; $errors[$i] is null for the queries that succeeded. */
+PHP_METHOD(MySQL, queryAll) {
+  mysql_wrap_t* self;
+  mysql_query_t* query;
+  mysql_batch_t* batch;
+  zval* sqls;
+  zval* callback;
+  zval** entry;
+  zval copy;
+  HashPosition pos;
+  ulong index = 0;
+  int count;
+  long timeout = -1;
+
+  if (zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "az|l", &sqls, &callback, &timeout) == FAILURE) {
+    return;
+  }
+
+  self = (mysql_wrap_t*) zend_object_store_get_object(getThis() TSRMLS_CC);
+  count = zend_hash_num_elements(Z_ARRVAL_P(sqls));
+
+  if (!mysql_query_room(self, count TSRMLS_CC)) {
+    RETURN_NULL();
+  }
+
+  batch = mysql_batch_new(callback);
+
+  /* Holds the batch open until every query is queued. */
+  batch->pending = 1;
+
+  for (zend_hash_internal_pointer_reset_ex(Z_ARRVAL_P(sqls), &pos);
+       zend_hash_get_current_data_ex(Z_ARRVAL_P(sqls), (void**) &entry, &pos) == SUCCESS;
+       zend_hash_move_forward_ex(Z_ARRVAL_P(sqls), &pos)) {
+    copy = **entry;
+    zval_copy_ctor(&copy);
+    convert_to_string(&copy);
+
+    query = mysql_query_add(self, getThis(), Z_STRVAL(copy), Z_STRLEN(copy), NULL);
+    query->batch = batch;
+    query->index = index++;
+    batch->pending++;
+
+    if (timeout >= 0) {
+      query->timeout = timeout / 1000.0;
+    }
+
+    zval_dtor(&copy);
+  }
+
+  mysql_dispatch(self);
+
+  /* Either all queries are already done or the last one finishes it. */
+  if (--batch->pending == 0) {
+    mysql_batch_done(batch TSRMLS_CC);
+  }
+
+  RETURN_TRUE;
+}
+
+
+/* Like query(), but $rows maps each column name to a packed array */
+/* of that column's values, which is far cheaper for wide results. */
+PHP_METHOD(MySQL, queryColumns) {
+  mysql_wrap_t* self;
+  mysql_query_t* query;
+  char* sql;
+  int sql_length;
+  zval* callback;
+  long timeout = -1;
+
+  if (zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "sz|l", &sql, &sql_length, &callback, &timeout) == FAILURE) {
+    return;
+  }
+
+  self = (mysql_wrap_t*) zend_object_store_get_object(getThis() TSRMLS_CC);
+
+  if (!mysql_query_room(self, 1 TSRMLS_CC)) {
+    RETURN_NULL();
+  }
+
+  query = mysql_query_add(self, getThis(), sql, sql_length, callback);
+  if (timeout >= 0) {
+    query->timeout = timeout / 1000.0;
+  }
+
+  query->columnar = 1;
+  mysql_dispatch(self);
+
+  RETURN_TRUE;
+}
+
+
+/* stream($sql, $onRow, $onEnd) calls $onRow($row, $stream) for every */
+/* row as it arrives and $onEnd($error, null, $info) at the end. The */
+/* returned MySQLStream can pause the result, e.g. while a socket that */
+/* the rows go to is backed up. */
+PHP_METHOD(MySQL, stream) {
+  mysql_wrap_t* self;
+  mysql_query_t* query;
+  mysql_stream_t* stream;
+  char* sql;
+  int sql_length;
+  zval* row_cb;
+  zval* callback;
+
+  if (zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "szz", &sql, &sql_length, &row_cb, &callback) == FAILURE) {
+    return;
+  }
+
+  self = (mysql_wrap_t*) zend_object_store_get_object(getThis() TSRMLS_CC);
+
+  if (!mysql_query_room(self, 1 TSRMLS_CC)) {
+    RETURN_NULL();
+  }
+
+  query = mysql_query_add(self, getThis(), sql, sql_length, callback);
+
+  query->row_cb = row_cb;
+  Z_ADDREF_P(row_cb);
+
+  /* A stream runs as long as its consumer keeps up; query_timeout is */
+  /* meant for ordinary queries. */
+  query->timeout = 0;
+
+  MAKE_STD_ZVAL(query->stream);
+  object_init_ex(query->stream, mysql_stream_ce);
+  stream = (mysql_stream_t*) zend_object_store_get_object(query->stream TSRMLS_CC);
+  stream->query = query;
+
+  RETVAL_ZVAL(query->stream, 1, 0);
+
+  mysql_dispatch(self);
+}
+
+
+/* queryJSON($sql, $out, $cb, $timeout) writes the rows to $out, a TCP */
+/* or an HttpResponse, as a JSON array of objects. Rows are encoded */
+/* in C straight from the result, and reading them stops while $out */
+/* is backed up. $cb($error, $count) runs once the last byte has been */
+/* handed to $out; an HttpResponse is ended by then. Like stream(), */
+/* there's no time limit unless $timeout (ms) sets one. */
+PHP_METHOD(MySQL, queryJSON) {
+  mysql_wrap_t* self;
+  mysql_query_t* query;
+  mysql_json_t* json;
+  char* sql;
+  int sql_length;
+  zval* out;
+  zval* socket;
+  zval* callback = NULL;
+  long timeout = -1;
+  int response;
+
+  if (zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "so|z!l", &sql, &sql_length, &out, &callback, &timeout) == FAILURE) {
+    return;
+  }
+
+  self = (mysql_wrap_t*) zend_object_store_get_object(getThis() TSRMLS_CC);
+
+  response = instanceof_function(Z_OBJCE_P(out), http_response_ce TSRMLS_CC);
+  if (!response && !instanceof_function(Z_OBJCE_P(out), tcp_ce TSRMLS_CC)) {
+    THROW_ERROR("Output must be a TCP or HttpResponse");
+    RETURN_NULL();
+  }
+
+  socket = response ? http_response_socket(out TSRMLS_CC) : out;
+  if (socket == NULL || ((tcp_wrap_t*) zend_object_store_get_object(socket TSRMLS_CC))->dead) {
+    THROW_ERROR("Output closed");
+    RETURN_NULL();
+  }
+
+  if (!mysql_query_room(self, 1 TSRMLS_CC)) {
+    RETURN_NULL();
+  }
+
+  query = mysql_query_add(self, getThis(), sql, sql_length, callback);
+  query->timeout = timeout >= 0 ? timeout / 1000.0 : 0;
+
+  json = (mysql_json_t*) ecalloc(1, sizeof *json);
+  json->out = out;
+  Z_ADDREF_P(out);
+  json->socket = socket;
+  Z_ADDREF_P(socket);
+  json->response = response;
+  query->json = json;
+
+  mysql_dispatch(self);
+
+  RETURN_TRUE;
+}
+
+
+/* queryCached($sql, $ttl, $tags, $cb, $timeout) is query() with a */
+/* result cache that all connections on the loop share. A result is */
+/* kept for $ttl ms, or until invalidate() is called with one of */
+/* $tags, the table names it depends on. Hits don't go to the server */
+/* and call back on the next loop iteration. */
+PHP_METHOD(MySQL, queryCached) {
+  mysql_wrap_t* self;
+  mysql_query_t* query;
+  mysql_cache_t* cache;
+  mysql_cache_entry_t* entry;
+  mysql_cache_fill_t* fill;
+  char* sql;
+  int sql_length;
+  long ttl;
+  zval* tags;
+  zval* callback;
+  long timeout = -1;
+  char* key;
+  uint key_len;
+
+  if (zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "slzz|l", &sql, &sql_length, &ttl, &tags, &callback, &timeout) == FAILURE) {
+    return;
+  }
+
+  self = (mysql_wrap_t*) zend_object_store_get_object(getThis() TSRMLS_CC);
+
+  if (self->closed || self->cons == NULL) {
+    THROW_ERROR("Connection closed");
+    RETURN_NULL();
+  }
+
+  if (ttl <= 0) {
+    THROW_ERROR("TTL must be positive");
+    RETURN_NULL();
+  }
+
+  cache = mysql_cache_get(self->loop TSRMLS_CC);
+  key = mysql_cache_key(self, sql, sql_length, &key_len);
+
+  if ((entry = mysql_cache_find(cache, key, key_len)) != NULL) {
+    efree(key);
+    mysql_cache_hit(cache, entry, callback);
+    RETURN_TRUE;
+  }
+
+  if (!mysql_query_room(self, 1 TSRMLS_CC)) {
+    efree(key);
+    RETURN_NULL();
+  }
+
+  query = mysql_query_add(self, getThis(), sql, sql_length, callback);
+  if (timeout >= 0) {
+    query->timeout = timeout / 1000.0;
+  }
+
+  fill = (mysql_cache_fill_t*) ecalloc(1, sizeof *fill);
+  fill->key = key;
+  fill->key_len = key_len;
+  mysql_cache_tags(tags, &fill->tags);
+  fill->ttl = ttl / 1000.0;
+  fill->generation = cache->generation;
+  query->fill = fill;
+
+  mysql_dispatch(self);
+
+  RETURN_TRUE;
+}
+
+
+/* invalidate($tags) drops the cached results that were tagged with */
+/* any of the table names in $tags, or all of them if $tags is null. */
+/* Returns how many were dropped. */
+PHP_METHOD(MySQL, invalidate) {
+  mysql_wrap_t* self;
+  mysql_cache_t* cache;
+  mysql_buf_t buf = { NULL, 0, 0 };
+  zval* tags = NULL;
+  long count;
+
+  if (zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "|z!", &tags) == FAILURE) {
+    return;
+  }
+
+  self = (mysql_wrap_t*) zend_object_store_get_object(getThis() TSRMLS_CC);
+  cache = mysql_cache_get(self->loop TSRMLS_CC);
+
+  if (tags == NULL) {
+    RETURN_LONG(mysql_cache_invalidate(cache, NULL, 0));
+  }
+
+  mysql_cache_tags(tags, &buf);
+  count = mysql_cache_invalidate(cache, buf.base ? buf.base : "", buf.len);
+  mysql_buf_free(&buf);
+
+  RETURN_LONG(count);
+}
+
+
+PHP_METHOD(MySQL, escape) {
+  char* string;
+  int string_length;
+  char* escaped;
+  size_t escaped_length;
+
+  if (zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "s", &string, &string_length) == FAILURE) {
+    return;
+  }
+
+  escaped = (char*) safe_emalloc(string_length, 2, 1);
+  escaped_length = drizzle_escape_string(escaped, string, string_length);
+
+  RETURN_STRINGL(escaped, escaped_length, 0);
+}
+
+
+PHP_METHOD(MySQL, close) {
+  mysql_wrap_t* self;
+  int i;
+
+  self = (mysql_wrap_t*) zend_object_store_get_object(getThis() TSRMLS_CC);
+
+  if (self->closed) {
+    RETURN_NULL();
+  }
+
+  for (i = 0; i < self->con_count; i++) {
+    mysql_con_stop(&self->cons[i]);
+    drizzle_con_close(&self->cons[i].con);
+  }
+
+  if (self->side_init) {
+    mysql_con_stop(&self->side);
+    drizzle_con_close(&self->side.con);
+  }
+
+  ev_timer_stop(self->loop->ev, &self->queue_timer);
+
+  /* Callbacks may queue more work, which fails right away. */
+  self->closed = 1;
+  mysql_fail_all(self, "Connection closed");
+  mysql_release(self);
+
+  RETURN_NULL();
+}
+
+
+PHP_METHOD(MySQLStream, pause) {
+  mysql_stream_t* self;
+
+  self = (mysql_stream_t*) zend_object_store_get_object(getThis() TSRMLS_CC);
+
+  if (self->query) {
+    self->query->paused = 1;
+  }
+
+  RETURN_NULL();
+}
+
+
+PHP_METHOD(MySQLStream, resume) {
+  mysql_stream_t* self;
+  mysql_query_t* query;
+  mysql_con_t* c;
+
+  self = (mysql_stream_t*) zend_object_store_get_object(getThis() TSRMLS_CC);
+  query = self->query;
+
+  if (query == NULL || !query->paused) {
+    RETURN_NULL();
+  }
+
+  query->paused = 0;
+  c = query->con;
+
+  /* Still queued or not yet at the rows; nothing to wake up. */
+  if (c == NULL || c->state != MYSQL_ROWS) {
+    RETURN_NULL();
+  }
+
+  mysql_con_watch(c, c->con.events);
+  mysql_con_run(c);
+
+  RETURN_NULL();
+}
+
+
+PHP_METHOD(MySQLStream, isPaused) {
+  mysql_stream_t* self;
+
+  self = (mysql_stream_t*) zend_object_store_get_object(getThis() TSRMLS_CC);
+
+  RETURN_BOOL(self->query && self->query->paused);
+}
+
+
+/* Quotes an identifier; "db.table" becomes `db`.`table`. */
+static void mysql_buf_append_name(mysql_buf_t* buf, const char* name, size_t len, int dotted) {
+  size_t i;
+
+  mysql_buf_append(buf, "`", 1);
+
+  for (i = 0; i < len; i++) {
+    if (name[i] == '`') {
+      mysql_buf_append(buf, "``", 2);
+    } else if (name[i] == '.' && dotted) {
+      mysql_buf_append(buf, "`.`", 3);
+    } else {
+      mysql_buf_append(buf, name + i, 1);
+    }
+  }
+
+  mysql_buf_append(buf, "`", 1);
+}
+
+
+static void mysql_buf_append_value(mysql_buf_t* buf, zval* value) {
+  char tmp[64];
+  size_t escaped_len;
+  zval copy;
+  int n;
+
+  switch (Z_TYPE_P(value)) {
+    case IS_NULL:
+      mysql_buf_append(buf, "NULL", 4);
+      return;
+
+    case IS_BOOL:
+      mysql_buf_append(buf, Z_BVAL_P(value) ? "1" : "0", 1);
+      return;
+
+    case IS_LONG:
+      n = snprintf(tmp, sizeof tmp, "%ld", Z_LVAL_P(value));
+      mysql_buf_append(buf, tmp, n);
+      return;
+
+    case IS_DOUBLE:
+      if (isfinite(Z_DVAL_P(value))) {
+        n = snprintf(tmp, sizeof tmp, "%.17g", Z_DVAL_P(value));
+        mysql_buf_append(buf, tmp, n);
+      } else {
+        mysql_buf_append(buf, "NULL", 4);
+      }
+      return;
+  }
+
+  copy = *value;
+  zval_copy_ctor(&copy);
+  convert_to_string(&copy);
+
+  /* Escaping at most doubles the length. */
+  if (buf->len + 2 * Z_STRLEN(copy) + 3 > buf->size) {
+    buf->size = 2 * (buf->len + 2 * Z_STRLEN(copy) + 3);
+    buf->base = (char*) erealloc(buf->base, buf->size);
+  }
+
+  buf->base[buf->len++] = '\'';
+  escaped_len = drizzle_escape_string(buf->base + buf->len, Z_STRVAL(copy), Z_STRLEN(copy));
+  buf->len += escaped_len;
+  buf->base[buf->len++] = '\'';
+  buf->base[buf->len] = '\0';
+
+  zval_dtor(&copy);
+}
+
+
+static void mysql_table_free(mysql_table_t* table) {
+  int i;
+
+  for (i = 0; i < table->column_count; i++) {
+    efree(table->columns[i]);
+  }
+
+  if (table->columns) {
+    efree(table->columns);
+    efree(table->column_lens);
+  }
+
+  mysql_buf_free(&table->sql);
+  efree(table->name);
+  efree(table);
+}
+
+
+/* Starts the INSERT statement with the first row's keys as columns. */
+/* Returns -1 if the row has no string keys. */
+static int mysql_table_init(mysql_table_t* table, zval* row) {
+  HashPosition pos;
+  zval** entry;
+  char* key;
+  uint key_length;
+  ulong index;
+  int count = zend_hash_num_elements(Z_ARRVAL_P(row));
+  int i = 0;
+
+  if (count == 0) {
+    return -1;
+  }
+
+  table->columns = (char**) safe_emalloc(count, sizeof(char*), 0);
+  table->column_lens = (uint*) safe_emalloc(count, sizeof(uint), 0);
+
+  mysql_buf_append(&table->sql, "INSERT INTO ", 12);
+  mysql_buf_append_name(&table->sql, table->name, strlen(table->name), 1);
+  mysql_buf_append(&table->sql, " (", 2);
+
+  for (zend_hash_internal_pointer_reset_ex(Z_ARRVAL_P(row), &pos);
+       zend_hash_get_current_data_ex(Z_ARRVAL_P(row), (void**) &entry, &pos) == SUCCESS;
+       zend_hash_move_forward_ex(Z_ARRVAL_P(row), &pos)) {
+    if (zend_hash_get_current_key_ex(Z_ARRVAL_P(row), &key, &key_length, &index, 0, &pos) != HASH_KEY_IS_STRING) {
+      table->column_count = i;
+      return -1;
+    }
+
+    /* key_length includes the NUL, which zend_hash_find() wants too. */
+    table->columns[i] = estrndup(key, key_length - 1);
+    table->column_lens[i] = key_length;
+
+    if (i > 0) {
+      mysql_buf_append(&table->sql, ",", 1);
+    }
+    mysql_buf_append_name(&table->sql, key, key_length - 1, 0);
+    table->column_count = ++i;
+  }
+
+  mysql_buf_append(&table->sql, ") VALUES ", 9);
+
+  return 0;
+}
+
+
+/* Appends a row as a VALUES tuple, picking the table's columns by */
+/* name; missing ones get their DEFAULT. */
+static void mysql_table_add(mysql_table_t* table, zval* row) {
+  zval** entry;
+  int i;
+
+  if (table->rows > 0) {
+    mysql_buf_append(&table->sql, ",", 1);
+  }
+
+  mysql_buf_append(&table->sql, "(", 1);
+
+  for (i = 0; i < table->column_count; i++) {
+    if (i > 0) {
+      mysql_buf_append(&table->sql, ",", 1);
+    }
+
+    if (zend_hash_find(Z_ARRVAL_P(row), table->columns[i], table->column_lens[i], (void**) &entry) == SUCCESS) {
+      mysql_buf_append_value(&table->sql, *entry);
+    } else {
+      mysql_buf_append(&table->sql, "DEFAULT", 7);
+    }
+  }
+
+  mysql_buf_append(&table->sql, ")", 1);
+  table->rows++;
+}
+
+
+/* Drops our self reference once no rows are buffered and no flush is */
+/* running. */
+static void mysql_inserter_release(mysql_inserter_t* self) {
+  zval* ref = self->self;
+
+  if (ref == NULL || self->flushes > 0 || self->tables) {
+    return;
+  }
+
+  self->self = NULL;
+  zval_ptr_dtor(&ref);
+}
+
+
+static void mysql_inserter_error(mysql_inserter_t* self, const char* error, const char* table, long rows) {
+  zval* args[3];
+  TSRMLS_D_GET(self);
+
+  if (self->error_cb == NULL) {
+    php_error_docref(NULL TSRMLS_CC, E_WARNING, "Insert into %s failed: %s", table, error);
+    return;
+  }
+
+  MAKE_STD_ZVAL(args[0]);
+  ZVAL_STRING(args[0], (char*) error, 1);
+  MAKE_STD_ZVAL(args[1]);
+  ZVAL_STRING(args[1], (char*) table, 1);
+  MAKE_STD_ZVAL(args[2]);
+  ZVAL_LONG(args[2], rows);
+
+  call_callback(self->error_cb, 3, args TSRMLS_CC);
+
+  zval_ptr_dtor(&args[0]);
+  zval_ptr_dtor(&args[1]);
+  zval_ptr_dtor(&args[2]);
+}
+
+
+static void mysql_inserter_flush_cb(mysql_query_t* query, const char* error) {
+  mysql_flush_t* flush = (mysql_flush_t*) query->data;
+  mysql_inserter_t* self = flush->inserter;
+  zval* waiters;
+  zval** entry;
+  HashPosition pos;
+  zval* ref = self->self;
+  TSRMLS_D_GET(self);
+
+  /* Callbacks may drop the last reference. */
+  Z_ADDREF_P(ref);
+
+  self->flushes--;
+
+  if (error) {
+    mysql_inserter_error(self, error, flush->table, flush->rows);
+  }
+
+  efree(flush->table);
+  efree(flush);
+  query->data = NULL;
+
+  if (self->need_drain && self->flushes < self->max_flushes) {
+    self->need_drain = 0;
+    if (self->drain_cb) {
+      call_callback(self->drain_cb, 0, NULL TSRMLS_CC);
+    }
+  }
+
+  if (self->flushes == 0 && self->waiters) {
+    waiters = self->waiters;
+    self->waiters = NULL;
+
+    for (zend_hash_internal_pointer_reset_ex(Z_ARRVAL_P(waiters), &pos);
+         zend_hash_get_current_data_ex(Z_ARRVAL_P(waiters), (void**) &entry, &pos) == SUCCESS;
+         zend_hash_move_forward_ex(Z_ARRVAL_P(waiters), &pos)) {
+      call_callback(*entry, 0, NULL TSRMLS_CC);
+    }
+
+    zval_ptr_dtor(&waiters);
+  }
+
+  mysql_inserter_release(self);
+  zval_ptr_dtor(&ref);
+}
+
+
+/* Sends a table's rows as one INSERT and frees the table, which the */
+/* caller has unlinked. */
+static void mysql_inserter_flush_table(mysql_inserter_t* self, mysql_table_t* table) {
+  mysql_query_t* query;
+  mysql_flush_t* flush;
+
+  if (self->wrap->closed) {
+    mysql_inserter_error(self, "Connection closed", table->name, table->rows);
+    mysql_table_free(table);
+    return;
+  }
+
+  flush = (mysql_flush_t*) emalloc(sizeof *flush);
+  flush->inserter = self;
+  flush->table = estrdup(table->name);
+  flush->rows = table->rows;
+
+  /* The statement changes hands instead of being copied. */
+  query = (mysql_query_t*) ecalloc(1, sizeof *query);
+  query->sql = table->sql.base;
+  query->sql_len = table->sql.len;
+  query->done_cb = mysql_inserter_flush_cb;
+  query->data = flush;
+  table->sql.base = NULL;
+  mysql_table_free(table);
+
+  self->flushes++;
+  mysql_query_push(self->wrap, self->db, query);
+}
+
+
+static void mysql_inserter_flush_all(mysql_inserter_t* self) {
+  mysql_table_t* table;
+
+  ev_timer_stop(self->wrap->loop->ev, &self->timer);
+
+  while ((table = self->tables) != NULL) {
+    self->tables = table->next;
+    mysql_inserter_flush_table(self, table);
+  }
+
+  mysql_dispatch(self->wrap);
+}
+
+
+static void mysql_inserter_timer_cb(struct ev_loop* ev, ev_timer* timer, int revents) {
+  mysql_inserter_t* self = container_of(timer, mysql_inserter_t, timer);
+  zval* ref = self->self;
+
+  if (ref == NULL) {
+    return;
+  }
+
+  Z_ADDREF_P(ref);
+  mysql_inserter_flush_all(self);
+  mysql_inserter_release(self);
+  zval_ptr_dtor(&ref);
+}
+
+
+static void mysql_inserter_free(void* object TSRMLS_DC) {
+  mysql_inserter_t* self = (mysql_inserter_t*) object;
+  mysql_table_t* table;
+
+  while ((table = self->tables) != NULL) {
+    self->tables = table->next;
+    mysql_table_free(table);
+  }
+
+  if (self->db) {
+    ev_timer_stop(self->wrap->loop->ev, &self->timer);
+    zval_ptr_dtor(&self->db);
+  }
+
+  if (self->drain_cb) {
+    zval_ptr_dtor(&self->drain_cb);
+  }
+
+  if (self->error_cb) {
+    zval_ptr_dtor(&self->error_cb);
+  }
+
+  if (self->waiters) {
+    zval_ptr_dtor(&self->waiters);
+  }
+
+  zend_object_std_dtor(&self->obj TSRMLS_CC);
+  efree(self);
+}
+
+
+static zend_object_value mysql_inserter_new(zend_class_entry* class_type TSRMLS_DC) {
+  zend_object_value instance;
+  mysql_inserter_t* self;
+
+  self = (mysql_inserter_t*) ecalloc(1, sizeof *self);
+
+  zend_object_std_init(&self->obj, class_type TSRMLS_CC);
+  init_properties(&self->obj, class_type);
+
+  TSRMLS_SET(self);
+
+  ev_init(&self->timer, mysql_inserter_timer_cb);
+
+  instance.handle = zend_objects_store_put((void*) self,
+                                           (zend_objects_store_dtor_t) zend_objects_destroy_object,
+                                           mysql_inserter_free,
+                                           NULL
+                                           TSRMLS_CC);
+  instance.handlers = zend_get_std_object_handlers();
+
+  return instance;
+}
+
+
+/* MySQLInserter($db, $options) buffers rows per table and writes them */
+/* as multi-row INSERTs through $db, a MySQL or MySQLPool. A table is */
+/* flushed once it has $options["max_rows"] rows or its statement */
+/* reaches $options["max_bytes"], and everything is flushed */
+/* $options["flush_interval"] ms after the first buffered row. */
+PHP_METHOD(MySQLInserter, __construct) {
+  mysql_inserter_t* self;
+  zval* db;
+  zval* options = NULL;
+
+  if (zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "O|a!", &db, mysql_ce, &options) == FAILURE) {
+    return;
+  }
+
+  self = (mysql_inserter_t*) zend_object_store_get_object(getThis() TSRMLS_CC);
+
+  if (self->db) {
+    THROW_ERROR("Already constructed");
+    RETURN_NULL();
+  }
+
+  self->db = db;
+  Z_ADDREF_P(db);
+  self->wrap = (mysql_wrap_t*) zend_object_store_get_object(db TSRMLS_CC);
+
+  self->max_rows = mysql_option_long(options, "max_rows", MYSQL_INSERTER_MAX_ROWS);
+  self->max_bytes = (size_t) mysql_option_long(options, "max_bytes", MYSQL_INSERTER_MAX_BYTES);
+  self->max_flushes = mysql_option_long(options, "max_flushes", MYSQL_INSERTER_MAX_FLUSHES);
+  ev_timer_set(&self->timer, mysql_option_long(options, "flush_interval", MYSQL_INSERTER_INTERVAL) / 1000.0, 0);
+}
+
+
+/* insert($table, array $row) buffers a row. The first row for a table */
+/* fixes its columns. Returns false once max_flushes flushes are */
+/* running; the row is still taken, but the caller should wait for */
+/* onDrain(). */
+PHP_METHOD(MySQLInserter, insert) {
+  mysql_inserter_t* self;
+  mysql_table_t* table;
+  mysql_table_t** link;
+  char* name;
+  int name_length;
+  zval* row;
+
+  if (zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "sa", &name, &name_length, &row) == FAILURE) {
+    return;
+  }
+
+  self = (mysql_inserter_t*) zend_object_store_get_object(getThis() TSRMLS_CC);
+
+  if (self->db == NULL || self->wrap->closed) {
+    THROW_ERROR("Connection closed");
+    RETURN_NULL();
+  }
+
+  for (link = &self->tables; (table = *link) != NULL; link = &table->next) {
+    if (strcmp(table->name, name) == 0) {
+      break;
+    }
+  }
+
+  if (table == NULL) {
+    table = (mysql_table_t*) ecalloc(1, sizeof *table);
+    table->name = estrndup(name, name_length);
+
+    if (mysql_table_init(table, row) != 0) {
+      mysql_table_free(table);
+      THROW_ERROR("Rows need column names as keys");
+      RETURN_NULL();
+    }
+
+    *link = table;
+  }
+
+  mysql_table_add(table, row);
+
+  if (self->self == NULL) {
+    self->self = getThis();
+    Z_ADDREF_P(self->self);
+  }
+
+  if (!ev_is_active(&self->timer)) {
+    ev_timer_start(self->wrap->loop->ev, &self->timer);
+  }
+
+  if (table->rows >= self->max_rows || table->sql.len >= self->max_bytes) {
+    *link = table->next;
+    mysql_inserter_flush_table(self, table);
+
+    if (self->tables == NULL) {
+      ev_timer_stop(self->wrap->loop->ev, &self->timer);
+    }
+
+    mysql_dispatch(self->wrap);
+  }
+
+  if (self->flushes >= self->max_flushes) {
+    self->need_drain = 1;
+    RETURN_FALSE;
+  }
+
+  RETURN_TRUE;
+}
+
+
+/* Flushes everything now; $cb fires once no flush is running. */
+PHP_METHOD(MySQLInserter, flush) {
+  mysql_inserter_t* self;
+  zval* callback = NULL;
+
+  if (zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "|z", &callback) == FAILURE) {
+    return;
+  }
+
+  self = (mysql_inserter_t*) zend_object_store_get_object(getThis() TSRMLS_CC);
+
+  if (self->db == NULL) {
+    RETURN_NULL();
+  }
+
+  mysql_inserter_flush_all(self);
+
+  if (callback) {
+    if (self->flushes == 0) {
+      call_callback(callback, 0, NULL TSRMLS_CC);
+    } else {
+      if (self->waiters == NULL) {
+        MAKE_STD_ZVAL(self->waiters);
+        array_init(self->waiters);
+      }
+
+      Z_ADDREF_P(callback);
+      add_next_index_zval(self->waiters, callback);
+    }
+  }
+
+  mysql_inserter_release(self);
+
+  RETURN_NULL();
+}
+
+
+PHP_METHOD(MySQLInserter, onDrain) {
+  mysql_inserter_t* self;
+  zval* callback;
+
+  if (zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "z", &callback) == FAILURE) {
+    return;
+  }
+
+  self = (mysql_inserter_t*) zend_object_store_get_object(getThis() TSRMLS_CC);
+
+  if (self->drain_cb) {
+    zval_ptr_dtor(&self->drain_cb);
+  }
+
+  self->drain_cb = callback;
+  Z_ADDREF_P(callback);
+
+  RETURN_NULL();
+}
+
+
+/* $cb($error, $table, $rows) hears about failed flushes; without one */
+/* they raise a warning. */
+PHP_METHOD(MySQLInserter, onError) {
+  mysql_inserter_t* self;
+  zval* callback;
+
+  if (zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "z", &callback) == FAILURE) {
+    return;
+  }
+
+  self = (mysql_inserter_t*) zend_object_store_get_object(getThis() TSRMLS_CC);
+
+  if (self->error_cb) {
+    zval_ptr_dtor(&self->error_cb);
+  }
+
+  self->error_cb = callback;
+  Z_ADDREF_P(callback);
+
+  RETURN_NULL();
+}
+
+
+static zend_function_entry mysql_methods[] = {
+  PHP_ME(MySQL, __construct, NULL, ZEND_ACC_PUBLIC)
+  PHP_ME(MySQL, query, NULL, ZEND_ACC_PUBLIC)
+  PHP_ME(MySQL, queryColumns, NULL, ZEND_ACC_PUBLIC)
+  PHP_ME(MySQL, queryAll, NULL, ZEND_ACC_PUBLIC)
+  PHP_ME(MySQL, stream, NULL, ZEND_ACC_PUBLIC)
+  PHP_ME(MySQL, queryJSON, NULL, ZEND_ACC_PUBLIC)
+  PHP_ME(MySQL, queryCached, NULL, ZEND_ACC_PUBLIC)
+  PHP_ME(MySQL, invalidate, NULL, ZEND_ACC_PUBLIC)
+  PHP_ME(MySQL, escape, NULL, ZEND_ACC_PUBLIC)
+  PHP_ME(MySQL, close, NULL, ZEND_ACC_PUBLIC)
+  { NULL }
+};
+
+
+static zend_function_entry mysql_stream_methods[] = {
+  PHP_ME(MySQLStream, pause, NULL, ZEND_ACC_PUBLIC)
+  PHP_ME(MySQLStream, resume, NULL, ZEND_ACC_PUBLIC)
+  PHP_ME(MySQLStream, isPaused, NULL, ZEND_ACC_PUBLIC)
+  { NULL }
+};
+
+
+static zend_function_entry mysql_inserter_methods[] = {
+  PHP_ME(MySQLInserter, __construct, NULL, ZEND_ACC_PUBLIC)
+  PHP_ME(MySQLInserter, insert, NULL, ZEND_ACC_PUBLIC)
+  PHP_ME(MySQLInserter, flush, NULL, ZEND_ACC_PUBLIC)
+  PHP_ME(MySQLInserter, onDrain, NULL, ZEND_ACC_PUBLIC)
+  PHP_ME(MySQLInserter, onError, NULL, ZEND_ACC_PUBLIC)
+  { NULL }
+};
+
+
+static zend_function_entry mysql_pool_methods[] = {
+  PHP_ME(MySQLPool, __construct, NULL, ZEND_ACC_PUBLIC)
+  { NULL }
+};
+
+
+void mysql_init(TSRMLS_D) {
+  zend_class_entry ce;
+
+  INIT_CLASS_ENTRY(ce, "MySQL", mysql_methods);
+  ce.create_object = mysql_new;
+  mysql_ce = zend_register_internal_class(&ce TSRMLS_CC);
+
+  INIT_CLASS_ENTRY(ce, "MySQLPool", mysql_pool_methods);
+  ce.create_object = mysql_new;
+  mysql_pool_ce = zend_register_internal_class_ex(&ce, mysql_ce, NULL TSRMLS_CC);
+
+  INIT_CLASS_ENTRY(ce, "MySQLStream", mysql_stream_methods);
+  ce.create_object = mysql_stream_new;
+  mysql_stream_ce = zend_register_internal_class(&ce TSRMLS_CC);
+
+  INIT_CLASS_ENTRY(ce, "MySQLInserter", mysql_inserter_methods);
+  ce.create_object = mysql_inserter_new;
+  mysql_inserter_ce = zend_register_internal_class(&ce TSRMLS_CC);
+}
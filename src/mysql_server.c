@@ -0,0 +1,1228 @@
+/*
+ * Copyright (c) 2011, Ben Noordhuis <info@bnoordhuis.nl>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/* The server side of the MySQL protocol: MySQLServer accepts clients */
+/* and hands their queries to PHP, which answers through the */
+/* MySQLServerConnection it is given, now or later. */
+
+#include "phode.h"
+
+#include <libdrizzle/drizzle_server.h>
+#include <libdrizzle/sha1.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+
+#define MYSQL_SERVER_VERSION "5.1.0-phode"
+
+/* utf8_general_ci and binary */
+#define MYSQL_CHARSET_UTF8 33
+#define MYSQL_CHARSET_BINARY 63
+
+
+typedef struct mysql_server_s mysql_server_t;
+typedef struct mysql_session_s mysql_session_t;
+
+
+struct mysql_server_s {
+  zend_object obj;
+  drizzle_st drizzle;
+  uv_loop_t* loop;
+  /* The TCP object that listens, made by listen() or setOptions() */
+  zval* socket;
+  /* Scrambles for the auth handshake come from here */
+  int random_fd;
+  zval* query_cb;
+  /* user => password; NULL lets everybody in */
+  zval* users;
+  char version[DRIZZLE_MAX_SERVER_VERSION_SIZE];
+  uint32_t thread_id;
+  /* Held while listening */
+  zval* self;
+  TSRMLS_D;
+};
+
+
+enum {
+  SESSION_HANDSHAKE,
+  SESSION_AUTH,
+  /* Sending the OK, error or final EOF packet of a reply */
+  SESSION_REPLY,
+  SESSION_COMMAND,
+  /* onQuery hasn't answered yet */
+  SESSION_QUERY,
+  /* Sending a result set: the column count, the columns, the rows */
+  SESSION_HEADER,
+  SESSION_COLUMNS,
+  SESSION_COLUMNS_EOF,
+  SESSION_ROWS,
+  SESSION_FIELDS,
+  SESSION_CLOSED
+};
+
+
+struct mysql_session_s {
+  /* obj must be the first member */
+  zend_object obj;
+  drizzle_con_st con;
+  ev_io watcher;
+  mysql_server_t* server;
+  zval* server_zv;
+  int state;
+  /* What we sent in the greeting; libdrizzle overwrites its copy with */
+  /* the client's reply. */
+  uint8_t scramble[DRIZZLE_MAX_SCRAMBLE_SIZE];
+  drizzle_result_st result;
+  drizzle_column_st column;
+  /* The result set being sent; rows is pinned until it's out. */
+  zval* rows;
+  HashPosition row_pos;
+  char** names;
+  drizzle_column_type_t* types;
+  uint16_t column_count;
+  uint16_t column_index;
+  uint16_t field_index;
+  /* The current row, with string copies of its non-string values */
+  drizzle_field_t* fields;
+  size_t* sizes;
+  zval* values;
+  /* Held until the connection is closed */
+  zval* self;
+  unsigned result_init:1;
+  unsigned column_init:1;
+  unsigned row_init:1;
+  unsigned running:1;
+  /* Close once the reply is out */
+  unsigned quit:1;
+  TSRMLS_D;
+};
+
+
+static zend_class_entry* mysql_server_ce;
+static zend_class_entry* mysql_session_ce;
+
+
+static void mysql_session_run(mysql_session_t* s);
+
+
+static void mysql_session_watch(mysql_session_t* s, short events) {
+  struct ev_loop* ev = s->server->loop->ev;
+  int fd = drizzle_con_fd(&s->con);
+  int mask = 0;
+
+  if (events & POLLIN) {
+    mask |= EV_READ;
+  }
+
+  if (events & POLLOUT) {
+    mask |= EV_WRITE;
+  }
+
+  if (fd == -1) {
+    mask = 0;
+  }
+
+  if (ev_is_active(&s->watcher)) {
+    if (s->watcher.fd == fd && (s->watcher.events & (EV_READ | EV_WRITE)) == mask) {
+      return;
+    }
+    ev_io_stop(ev, &s->watcher);
+  }
+
+  if (mask) {
+    ev_io_set(&s->watcher, fd, mask);
+    ev_io_start(ev, &s->watcher);
+  }
+}
+
+
+static drizzle_return_t mysql_server_watch_cb(drizzle_con_st* con, short events, void* context) {
+  mysql_session_watch((mysql_session_t*) drizzle_con_context(con), events);
+  return DRIZZLE_RETURN_OK;
+}
+
+
+static void mysql_session_row_free(mysql_session_t* s) {
+  int i;
+
+  for (i = 0; i < s->column_count; i++) {
+    if (Z_TYPE(s->values[i]) != IS_NULL) {
+      zval_dtor(&s->values[i]);
+      ZVAL_NULL(&s->values[i]);
+    }
+  }
+
+  s->row_init = 0;
+}
+
+
+static void mysql_session_result_free(mysql_session_t* s) {
+  int i;
+
+  mysql_session_row_free(s);
+
+  if (s->column_init) {
+    drizzle_column_free(&s->column);
+    s->column_init = 0;
+  }
+
+  if (s->result_init) {
+    drizzle_result_free(&s->result);
+    s->result_init = 0;
+  }
+
+  if (s->names) {
+    for (i = 0; i < s->column_count; i++) {
+      efree(s->names[i]);
+    }
+    efree(s->names);
+    efree(s->types);
+    efree(s->fields);
+    efree(s->sizes);
+    efree(s->values);
+    s->names = NULL;
+  }
+
+  s->column_count = 0;
+
+  if (s->rows) {
+    zval_ptr_dtor(&s->rows);
+    s->rows = NULL;
+  }
+}
+
+
+static void mysql_session_result_init(mysql_session_t* s) {
+  mysql_session_result_free(s);
+  drizzle_result_create(&s->con, &s->result);
+  s->result_init = 1;
+}
+
+
+static void mysql_session_error(mysql_session_t* s, const char* message, long code, const char* sqlstate) {
+  drizzle_result_set_error_code(&s->result, (uint16_t) code);
+  drizzle_result_set_sqlstate(&s->result, sqlstate);
+  drizzle_result_set_error(&s->result, message);
+}
+
+
+static void mysql_session_close(mysql_session_t* s) {
+  if (s->state == SESSION_CLOSED) {
+    return;
+  }
+
+  s->state = SESSION_CLOSED;
+  mysql_session_watch(s, 0);
+  mysql_session_result_free(s);
+  drizzle_con_close(&s->con);
+}
+
+
+/* Drops our self reference once the connection is closed. */
+static void mysql_session_release(mysql_session_t* s) {
+  zval* self = s->self;
+
+  if (self == NULL || s->running || s->state != SESSION_CLOSED) {
+    return;
+  }
+
+  s->self = NULL;
+  zval_ptr_dtor(&self);
+}
+
+
+/* Checks the client's reply to the scramble against the password: */
+/* SHA1(password) XOR SHA1(scramble + SHA1(SHA1(password))). */
+static int mysql_session_auth(mysql_session_t* s) {
+  zval* users = s->server->users;
+  zval** password;
+  const char* user = drizzle_con_user(&s->con);
+  const uint8_t* reply = drizzle_con_scramble(&s->con);
+  uint8_t hash[SHA1_DIGEST_LENGTH];
+  uint8_t hash2[SHA1_DIGEST_LENGTH];
+  uint8_t expected[SHA1_DIGEST_LENGTH];
+  uint8_t diff = 0;
+  SHA1_CTX ctx;
+  int i;
+
+  if (users == NULL) {
+    return 1;
+  }
+
+  if (zend_symtable_find(Z_ARRVAL_P(users), user, strlen(user) + 1, (void**) &password) == FAILURE ||
+      Z_TYPE_PP(password) != IS_STRING) {
+    return 0;
+  }
+
+  if (Z_STRLEN_PP(password) == 0) {
+    return reply == NULL;
+  }
+
+  if (reply == NULL) {
+    return 0;
+  }
+
+  SHA1Init(&ctx);
+  SHA1Update(&ctx, (uint8_t*) Z_STRVAL_PP(password), Z_STRLEN_PP(password));
+  SHA1Final(hash, &ctx);
+
+  SHA1Init(&ctx);
+  SHA1Update(&ctx, hash, SHA1_DIGEST_LENGTH);
+  SHA1Final(hash2, &ctx);
+
+  SHA1Init(&ctx);
+  SHA1Update(&ctx, s->scramble, DRIZZLE_MAX_SCRAMBLE_SIZE);
+  SHA1Update(&ctx, hash2, SHA1_DIGEST_LENGTH);
+  SHA1Final(expected, &ctx);
+
+  for (i = 0; i < SHA1_DIGEST_LENGTH; i++) {
+    diff |= (expected[i] ^ hash[i]) ^ reply[i];
+  }
+
+  return diff == 0;
+}
+
+
+static void mysql_session_query(mysql_session_t* s, const char* sql, size_t len) {
+  zval* args[2];
+  TSRMLS_D_GET(s);
+
+  s->state = SESSION_QUERY;
+
+  args[0] = s->self;
+  Z_ADDREF_P(args[0]);
+
+  MAKE_STD_ZVAL(args[1]);
+  ZVAL_STRINGL(args[1], sql ? sql : "", len, 1);
+
+  call_callback(s->server->query_cb, 2, args TSRMLS_CC);
+
+  zval_ptr_dtor(&args[0]);
+  zval_ptr_dtor(&args[1]);
+}
+
+
+/* Everything but queries is answered here; a session has no state */
+/* beyond its default database. */
+static void mysql_session_command(mysql_session_t* s, drizzle_command_t command, const char* data, size_t len) {
+  mysql_session_result_init(s);
+  s->state = SESSION_REPLY;
+
+  switch (command) {
+    case DRIZZLE_COMMAND_QUERY:
+      mysql_session_query(s, data, len);
+      break;
+
+    case DRIZZLE_COMMAND_INIT_DB:
+      drizzle_con_set_db(&s->con, data ? data : "");
+      break;
+
+    case DRIZZLE_COMMAND_PING:
+      break;
+
+    default:
+      mysql_session_error(s, "Unsupported command", 1047, "08S01");
+      break;
+  }
+}
+
+
+/* Picks the current row's fields; returns 0 when there are no rows left. */
+static int mysql_session_row_init(mysql_session_t* s) {
+  HashTable* rows = Z_ARRVAL_P(s->rows);
+  HashPosition pos;
+  zval** row;
+  zval** value;
+  zval* copy;
+  int i;
+
+  if (zend_hash_get_current_data_ex(rows, (void**) &row, &s->row_pos) == FAILURE) {
+    return 0;
+  }
+
+  zend_hash_move_forward_ex(rows, &s->row_pos);
+
+  for (i = 0; i < s->column_count; i++) {
+    s->fields[i] = NULL;
+    s->sizes[i] = 0;
+  }
+
+  if (Z_TYPE_PP(row) != IS_ARRAY) {
+    s->row_init = 1;
+    return 1;
+  }
+
+  /* Values go by position; missing ones are sent as NULL. */
+  for (i = 0, zend_hash_internal_pointer_reset_ex(Z_ARRVAL_PP(row), &pos);
+       i < s->column_count &&
+       zend_hash_get_current_data_ex(Z_ARRVAL_PP(row), (void**) &value, &pos) == SUCCESS;
+       i++, zend_hash_move_forward_ex(Z_ARRVAL_PP(row), &pos)) {
+    switch (Z_TYPE_PP(value)) {
+      case IS_NULL:
+        break;
+
+      case IS_STRING:
+        s->fields[i] = (drizzle_field_t) Z_STRVAL_PP(value);
+        s->sizes[i] = Z_STRLEN_PP(value);
+        break;
+
+      default:
+        copy = &s->values[i];
+        *copy = **value;
+        zval_copy_ctor(copy);
+        convert_to_string(copy);
+        s->fields[i] = (drizzle_field_t) Z_STRVAL_P(copy);
+        s->sizes[i] = Z_STRLEN_P(copy);
+        break;
+    }
+  }
+
+  s->row_init = 1;
+
+  return 1;
+}
+
+
+static void mysql_session_column_init(mysql_session_t* s) {
+  drizzle_column_st* column = &s->column;
+  drizzle_column_type_t type = s->types[s->column_index];
+  const char* name = s->names[s->column_index];
+
+  drizzle_column_create(&s->result, column);
+  s->column_init = 1;
+
+  drizzle_column_set_catalog(column, "def");
+  drizzle_column_set_db(column, drizzle_con_db(&s->con));
+  drizzle_column_set_name(column, name);
+  drizzle_column_set_orig_name(column, name);
+  drizzle_column_set_type(column, type);
+
+  if (type == DRIZZLE_COLUMN_TYPE_VAR_STRING) {
+    drizzle_column_set_charset(column, MYSQL_CHARSET_UTF8);
+    drizzle_column_set_size(column, 255);
+  } else {
+    drizzle_column_set_charset(column, MYSQL_CHARSET_BINARY);
+    drizzle_column_set_flags(column, DRIZZLE_COLUMN_FLAGS_NUM | DRIZZLE_COLUMN_FLAGS_BINARY);
+    drizzle_column_set_size(column, type == DRIZZLE_COLUMN_TYPE_DOUBLE ? 22 : 20);
+
+    if (type == DRIZZLE_COLUMN_TYPE_DOUBLE) {
+      drizzle_column_set_decimals(column, 31);
+    }
+  }
+}
+
+
+static void mysql_session_loop(mysql_session_t* s) {
+  drizzle_command_t command;
+  drizzle_return_t ret;
+  char message[DRIZZLE_MAX_USER_SIZE + 64];
+  size_t total;
+  char* data;
+  int i;
+
+  for (;;) {
+    switch (s->state) {
+      case SESSION_HANDSHAKE:
+        ret = drizzle_handshake_server_write(&s->con);
+        if (ret == DRIZZLE_RETURN_IO_WAIT) {
+          return;
+        }
+        if (ret != DRIZZLE_RETURN_OK) {
+          goto fail;
+        }
+
+        s->state = SESSION_AUTH;
+        break;
+
+      case SESSION_AUTH:
+        ret = drizzle_handshake_client_read(&s->con);
+        if (ret == DRIZZLE_RETURN_IO_WAIT) {
+          return;
+        }
+        if (ret != DRIZZLE_RETURN_OK) {
+          goto fail;
+        }
+
+        mysql_session_result_init(s);
+
+        if (!mysql_session_auth(s)) {
+          snprintf(message, sizeof message, "Access denied for user '%s'", drizzle_con_user(&s->con));
+          mysql_session_error(s, message, 1045, "28000");
+          s->quit = 1;
+        }
+
+        s->state = SESSION_REPLY;
+        break;
+
+      case SESSION_REPLY:
+        ret = drizzle_result_write(&s->con, &s->result, 1);
+        if (ret == DRIZZLE_RETURN_IO_WAIT) {
+          return;
+        }
+        if (ret != DRIZZLE_RETURN_OK || s->quit) {
+          goto fail;
+        }
+
+        mysql_session_result_free(s);
+        s->state = SESSION_COMMAND;
+        break;
+
+      case SESSION_COMMAND:
+        data = (char*) drizzle_con_command_buffer(&s->con, &command, &total, &ret);
+        if (ret == DRIZZLE_RETURN_IO_WAIT) {
+          return;
+        }
+        if (ret != DRIZZLE_RETURN_OK || command == DRIZZLE_COMMAND_QUIT) {
+          free(data);
+          goto fail;
+        }
+
+        /* Queries that are answered right away carry on from here. */
+        mysql_session_command(s, command, data, total);
+        free(data);
+        break;
+
+      case SESSION_QUERY:
+      case SESSION_CLOSED:
+        return;
+
+      case SESSION_HEADER:
+        ret = drizzle_result_write(&s->con, &s->result, 0);
+        if (ret == DRIZZLE_RETURN_IO_WAIT) {
+          return;
+        }
+        if (ret != DRIZZLE_RETURN_OK) {
+          goto fail;
+        }
+
+        s->column_index = 0;
+        s->state = SESSION_COLUMNS;
+        break;
+
+      case SESSION_COLUMNS:
+        if (s->column_index == s->column_count) {
+          drizzle_result_set_eof(&s->result, 1);
+          s->state = SESSION_COLUMNS_EOF;
+          break;
+        }
+
+        if (!s->column_init) {
+          mysql_session_column_init(s);
+        }
+
+        ret = drizzle_column_write(&s->result, &s->column);
+        if (ret == DRIZZLE_RETURN_IO_WAIT) {
+          return;
+        }
+        if (ret != DRIZZLE_RETURN_OK) {
+          goto fail;
+        }
+
+        drizzle_column_free(&s->column);
+        s->column_init = 0;
+        s->column_index++;
+        break;
+
+      case SESSION_COLUMNS_EOF:
+        ret = drizzle_result_write(&s->con, &s->result, 0);
+        if (ret == DRIZZLE_RETURN_IO_WAIT) {
+          return;
+        }
+        if (ret != DRIZZLE_RETURN_OK) {
+          goto fail;
+        }
+
+        s->state = SESSION_ROWS;
+        break;
+
+      case SESSION_ROWS:
+        if (!s->row_init) {
+          if (!mysql_session_row_init(s)) {
+            /* The result's EOF flag is still set, so this writes the */
+            /* closing EOF packet. */
+            s->state = SESSION_REPLY;
+            break;
+          }
+
+          drizzle_result_calc_row_size(&s->result, s->fields, s->sizes);
+        }
+
+        ret = drizzle_row_write(&s->result);
+        if (ret == DRIZZLE_RETURN_IO_WAIT) {
+          return;
+        }
+        if (ret != DRIZZLE_RETURN_OK) {
+          goto fail;
+        }
+
+        s->field_index = 0;
+        s->state = SESSION_FIELDS;
+        break;
+
+      case SESSION_FIELDS:
+        if (s->field_index == s->column_count) {
+          mysql_session_row_free(s);
+          s->state = SESSION_ROWS;
+          break;
+        }
+
+        i = s->field_index;
+        ret = drizzle_field_write(&s->result, s->fields[i], s->sizes[i], s->sizes[i]);
+        if (ret == DRIZZLE_RETURN_IO_WAIT) {
+          return;
+        }
+        if (ret != DRIZZLE_RETURN_OK) {
+          goto fail;
+        }
+
+        s->field_index++;
+        break;
+    }
+  }
+
+fail:
+  mysql_session_close(s);
+}
+
+
+static void mysql_session_run(mysql_session_t* s) {
+  /* Answers given from inside onQuery land here again. */
+  if (s->running) {
+    return;
+  }
+
+  s->running = 1;
+  mysql_session_loop(s);
+  s->running = 0;
+
+  mysql_session_release(s);
+}
+
+
+static void mysql_session_io_cb(struct ev_loop* ev, ev_io* watcher, int revents) {
+  mysql_session_t* s = container_of(watcher, mysql_session_t, watcher);
+  short events = 0;
+
+  if (revents & EV_READ) {
+    events |= POLLIN;
+  }
+
+  if (revents & EV_WRITE) {
+    events |= POLLOUT;
+  }
+
+  drizzle_con_set_revents(&s->con, events);
+  mysql_session_watch(s, s->con.events);
+
+  mysql_session_run(s);
+}
+
+
+static void mysql_session_free(void* object TSRMLS_DC) {
+  mysql_session_t* s = (mysql_session_t*) object;
+
+  if (s->server) {
+    mysql_session_watch(s, 0);
+    mysql_session_result_free(s);
+    drizzle_con_free(&s->con);
+    zval_ptr_dtor(&s->server_zv);
+  }
+
+  zend_object_std_dtor(&s->obj TSRMLS_CC);
+  efree(s);
+}
+
+
+static zend_object_value mysql_session_new(zend_class_entry* class_type TSRMLS_DC) {
+  zend_object_value instance;
+  mysql_session_t* s;
+
+  s = (mysql_session_t*) ecalloc(1, sizeof *s);
+
+  zend_object_std_init(&s->obj, class_type TSRMLS_CC);
+  init_properties(&s->obj, class_type);
+
+  TSRMLS_SET(s);
+
+  s->state = SESSION_CLOSED;
+  ev_init(&s->watcher, mysql_session_io_cb);
+
+  instance.handle = zend_objects_store_put((void*) s,
+                                           (zend_objects_store_dtor_t) zend_objects_destroy_object,
+                                           mysql_session_free,
+                                           NULL
+                                           TSRMLS_CC);
+  instance.handlers = zend_get_std_object_handlers();
+
+  return instance;
+}
+
+
+/* Printable, so clients that treat the scramble as a C string are fine. */
+/* Returns -1 if /dev/urandom came up short. */
+static int mysql_server_scramble(mysql_server_t* server, uint8_t* scramble) {
+  int i;
+
+  if (read(server->random_fd, scramble, DRIZZLE_MAX_SCRAMBLE_SIZE) != DRIZZLE_MAX_SCRAMBLE_SIZE) {
+    return -1;
+  }
+
+  for (i = 0; i < DRIZZLE_MAX_SCRAMBLE_SIZE; i++) {
+    scramble[i] = 33 + scramble[i] % 94;
+  }
+
+  return 0;
+}
+
+
+static void mysql_server_accept(mysql_server_t* server, int fd) {
+  mysql_session_t* s;
+  zval* zv;
+  TSRMLS_D_GET(server);
+
+  MAKE_STD_ZVAL(zv);
+  object_init_ex(zv, mysql_session_ce);
+
+  s = (mysql_session_t*) zend_object_store_get_object(zv TSRMLS_CC);
+  s->self = zv;
+  s->server = server;
+  s->server_zv = server->self;
+  Z_ADDREF_P(s->server_zv);
+
+  drizzle_con_create(&server->drizzle, &s->con);
+  drizzle_con_add_options(&s->con, DRIZZLE_CON_MYSQL);
+  drizzle_con_set_context(&s->con, s);
+
+  if (drizzle_con_set_fd(&s->con, fd) != DRIZZLE_RETURN_OK ||
+      mysql_server_scramble(server, s->scramble) != 0) {
+    drizzle_con_close(&s->con);
+    mysql_session_release(s);
+    return;
+  }
+
+  drizzle_con_set_protocol_version(&s->con, 10);
+  drizzle_con_set_server_version(&s->con, server->version);
+  drizzle_con_set_thread_id(&s->con, ++server->thread_id);
+  drizzle_con_set_scramble(&s->con, s->scramble);
+  drizzle_con_set_capabilities(&s->con, DRIZZLE_CAPABILITIES_CLIENT);
+  drizzle_con_set_charset(&s->con, MYSQL_CHARSET_UTF8);
+  drizzle_con_set_status(&s->con, DRIZZLE_CON_STATUS_AUTOCOMMIT);
+  drizzle_con_set_max_packet_size(&s->con, DRIZZLE_MAX_PACKET_SIZE);
+
+  s->state = SESSION_HANDSHAKE;
+  mysql_session_run(s);
+}
+
+
+/* Drops the TCP object that native points to once its handle is closed */
+static void mysql_server_socket_close_cb(tcp_wrap_t* tcp TSRMLS_DC) {
+  zval* socket = (zval*) tcp->native;
+
+  tcp->native = NULL;
+  tcp->native_close_cb = NULL;
+  zval_ptr_dtor(&socket);
+}
+
+
+/* Clients come in on TCP objects, but drizzle wants a bare fd: it */
+/* gets a copy and the TCP object is closed. */
+static void mysql_server_connection_cb(tcp_wrap_t* listener, zval* client TSRMLS_DC) {
+  mysql_server_t* server = (mysql_server_t*) listener->native;
+  tcp_wrap_t* tcp = (tcp_wrap_t*) zend_object_store_get_object(client TSRMLS_CC);
+  int fd;
+
+  fd = dup(tcp->handle.fd);
+
+  tcp->native = (void*) client;
+  tcp->native_close_cb = mysql_server_socket_close_cb;
+  tcp_close(tcp TSRMLS_CC);
+
+  if (fd != -1) {
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+    mysql_server_accept(server, fd);
+  }
+}
+
+
+/* The listening TCP object, made on first use */
+static tcp_wrap_t* mysql_server_socket(mysql_server_t* server) {
+  tcp_wrap_t* tcp;
+  TSRMLS_D_GET(server);
+
+  if (server->socket == NULL) {
+    MAKE_STD_ZVAL(server->socket);
+    object_init_ex(server->socket, tcp_ce);
+
+    tcp = (tcp_wrap_t*) zend_object_store_get_object(server->socket TSRMLS_CC);
+    tcp->native = (void*) server;
+    tcp->native_connection_cb = mysql_server_connection_cb;
+  }
+
+  return (tcp_wrap_t*) zend_object_store_get_object(server->socket TSRMLS_CC);
+}
+
+
+static void mysql_server_stop(mysql_server_t* server) {
+  tcp_wrap_t* tcp;
+  TSRMLS_D_GET(server);
+
+  if (server->socket == NULL) {
+    return;
+  }
+
+  /* The socket outlives the server until its handle is closed */
+  tcp = (tcp_wrap_t*) zend_object_store_get_object(server->socket TSRMLS_CC);
+  tcp->native = (void*) server->socket;
+  tcp->native_connection_cb = NULL;
+  tcp->native_close_cb = mysql_server_socket_close_cb;
+  server->socket = NULL;
+
+  tcp_close(tcp TSRMLS_CC);
+}
+
+
+static void mysql_server_free(void* object TSRMLS_DC) {
+  mysql_server_t* server = (mysql_server_t*) object;
+
+  mysql_server_stop(server);
+
+  if (server->random_fd != -1) {
+    close(server->random_fd);
+  }
+
+  /* Sessions pin the server, so none are left at this point. */
+  drizzle_free(&server->drizzle);
+
+  if (server->query_cb) {
+    zval_ptr_dtor(&server->query_cb);
+  }
+
+  if (server->users) {
+    zval_ptr_dtor(&server->users);
+  }
+
+  zend_object_std_dtor(&server->obj TSRMLS_CC);
+  efree(server);
+}
+
+
+static zend_object_value mysql_server_new(zend_class_entry* class_type TSRMLS_DC) {
+  zend_object_value instance;
+  mysql_server_t* server;
+
+  server = (mysql_server_t*) ecalloc(1, sizeof *server);
+
+  zend_object_std_init(&server->obj, class_type TSRMLS_CC);
+  init_properties(&server->obj, class_type);
+
+  TSRMLS_SET(server);
+
+  server->loop = phode_loop(TSRMLS_C);
+  server->random_fd = -1;
+  strcpy(server->version, MYSQL_SERVER_VERSION);
+
+  drizzle_create(&server->drizzle);
+  drizzle_add_options(&server->drizzle, DRIZZLE_NON_BLOCKING);
+  drizzle_set_event_watch_fn(&server->drizzle, mysql_server_watch_cb, NULL);
+
+  instance.handle = zend_objects_store_put((void*) server,
+                                           (zend_objects_store_dtor_t) zend_objects_destroy_object,
+                                           mysql_server_free,
+                                           NULL
+                                           TSRMLS_CC);
+  instance.handlers = zend_get_std_object_handlers();
+
+  return instance;
+}
+
+
+/* MySQLServer($onQuery, $options) calls $onQuery($conn, $sql) for */
+/* every query; $conn answers with result(), ok() or error(). Options: */
+/* "users" maps user names to passwords, "version" is the server */
+/* version clients see. Everybody gets in without "users", so such a */
+/* server listens on 127.0.0.1 unless it is given a host. */
+PHP_METHOD(MySQLServer, __construct) {
+  mysql_server_t* self;
+  zval* callback;
+  zval* options = NULL;
+  zval** entry;
+
+  if (zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "z|a!", &callback, &options) == FAILURE) {
+    return;
+  }
+
+  self = (mysql_server_t*) zend_object_store_get_object(getThis() TSRMLS_CC);
+
+  if (self->query_cb) {
+    THROW_ERROR("Already constructed");
+    RETURN_NULL();
+  }
+
+  self->query_cb = callback;
+  Z_ADDREF_P(callback);
+
+  if (options == NULL) {
+    return;
+  }
+
+  if (zend_hash_find(Z_ARRVAL_P(options), "users", sizeof("users"), (void**) &entry) == SUCCESS &&
+      Z_TYPE_PP(entry) == IS_ARRAY) {
+    self->users = *entry;
+    Z_ADDREF_P(self->users);
+  }
+
+  if (zend_hash_find(Z_ARRVAL_P(options), "version", sizeof("version"), (void**) &entry) == SUCCESS &&
+      Z_TYPE_PP(entry) == IS_STRING) {
+    snprintf(self->version, sizeof self->version, "%s", Z_STRVAL_PP(entry));
+  }
+}
+
+
+/* listen($port, $host = "0.0.0.0", $onError) takes the same host names */
+/* and setOptions() as TCP::listen(), and shares the port under */
+/* uv_cluster. $onError($error) hears about a looked up $host that */
+/* couldn't be bound. $host defaults to 127.0.0.1 without "users". */
+PHP_METHOD(MySQLServer, listen) {
+  mysql_server_t* self;
+  char* host = NULL;
+  int host_length;
+  long port;
+  zval* error_cb = NULL;
+  const char* error;
+
+  if (zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "l|s!z!", &port, &host, &host_length, &error_cb) == FAILURE) {
+    return;
+  }
+
+  self = (mysql_server_t*) zend_object_store_get_object(getThis() TSRMLS_CC);
+
+  /* No handshake without a proper scramble */
+  if (self->random_fd == -1) {
+    self->random_fd = open("/dev/urandom", O_RDONLY);
+    if (self->random_fd == -1) {
+      THROW_ERROR(strerror(errno));
+      RETURN_NULL();
+    }
+  }
+
+  /* Not open to the world without passwords */
+  if (host == NULL && self->users == NULL) {
+    host = "127.0.0.1";
+  }
+
+  mysql_server_socket(self);
+
+  error = tcp_listen(self->socket, host, port, error_cb TSRMLS_CC);
+  if (error != NULL) {
+    THROW_ERROR((char*) error);
+    RETURN_NULL();
+  }
+
+  if (self->self == NULL) {
+    self->self = getThis();
+    Z_ADDREF_P(self->self);
+  }
+
+  RETURN_NULL();
+}
+
+
+/* setOptions($options) is TCP::setOptions() for the listening socket; */
+/* the per-connection options go on to every client. */
+PHP_METHOD(MySQLServer, setOptions) {
+  mysql_server_t* self;
+  zval* options;
+  const char* error;
+
+  if (zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "a", &options) == FAILURE) {
+    return;
+  }
+
+  self = (mysql_server_t*) zend_object_store_get_object(getThis() TSRMLS_CC);
+
+  error = tcp_set_options(mysql_server_socket(self), options TSRMLS_CC);
+  if (error != NULL) {
+    THROW_ERROR((char*) error);
+    RETURN_NULL();
+  }
+
+  RETURN_NULL();
+}
+
+
+/* Stops accepting clients; connected ones stay until they hang up. */
+PHP_METHOD(MySQLServer, close) {
+  mysql_server_t* self;
+  zval* zv;
+
+  self = (mysql_server_t*) zend_object_store_get_object(getThis() TSRMLS_CC);
+
+  mysql_server_stop(self);
+
+  if (self->self) {
+    zv = self->self;
+    self->self = NULL;
+    zval_ptr_dtor(&zv);
+  }
+
+  RETURN_NULL();
+}
+
+
+static void mysql_session_columns_init(mysql_session_t* s, zval* rows, zval* columns) {
+  HashTable* first = NULL;
+  HashTable* names;
+  HashPosition pos;
+  HashPosition value_pos;
+  zval** row;
+  zval** entry;
+  zval** value;
+  zval copy;
+  char* key;
+  uint key_length;
+  ulong index;
+  char tmp[32];
+  int count;
+  int i;
+
+  zend_hash_internal_pointer_reset_ex(Z_ARRVAL_P(rows), &pos);
+  if (zend_hash_get_current_data_ex(Z_ARRVAL_P(rows), (void**) &row, &pos) == SUCCESS &&
+      Z_TYPE_PP(row) == IS_ARRAY) {
+    first = Z_ARRVAL_PP(row);
+  }
+
+  names = columns ? Z_ARRVAL_P(columns) : first;
+  count = names ? zend_hash_num_elements(names) : 0;
+
+  if (count == 0) {
+    return;
+  }
+
+  if (count > 4096) {
+    count = 4096;
+  }
+
+  s->column_count = count;
+  s->names = (char**) safe_emalloc(count, sizeof(char*), 0);
+  s->types = (drizzle_column_type_t*) safe_emalloc(count, sizeof(drizzle_column_type_t), 0);
+  s->fields = (drizzle_field_t*) ecalloc(count, sizeof(drizzle_field_t));
+  s->sizes = (size_t*) ecalloc(count, sizeof(size_t));
+  s->values = (zval*) safe_emalloc(count, sizeof(zval), 0);
+
+  /* Names are the values of $columns or else the keys of the first */
+  /* row; types follow the first row's values. */
+  if (first) {
+    zend_hash_internal_pointer_reset_ex(first, &value_pos);
+  }
+
+  for (i = 0, zend_hash_internal_pointer_reset_ex(names, &pos);
+       i < count && zend_hash_get_current_data_ex(names, (void**) &entry, &pos) == SUCCESS;
+       i++, zend_hash_move_forward_ex(names, &pos)) {
+    if (columns) {
+      copy = **entry;
+      zval_copy_ctor(&copy);
+      convert_to_string(&copy);
+      s->names[i] = estrndup(Z_STRVAL(copy), Z_STRLEN(copy));
+      zval_dtor(&copy);
+    } else if (zend_hash_get_current_key_ex(names, &key, &key_length, &index, 0, &pos) == HASH_KEY_IS_STRING) {
+      s->names[i] = estrndup(key, key_length - 1);
+    } else {
+      snprintf(tmp, sizeof tmp, "%lu", index);
+      s->names[i] = estrdup(tmp);
+    }
+
+    s->types[i] = DRIZZLE_COLUMN_TYPE_VAR_STRING;
+
+    if (first && zend_hash_get_current_data_ex(first, (void**) &value, &value_pos) == SUCCESS) {
+      if (Z_TYPE_PP(value) == IS_LONG || Z_TYPE_PP(value) == IS_BOOL) {
+        s->types[i] = DRIZZLE_COLUMN_TYPE_LONGLONG;
+      } else if (Z_TYPE_PP(value) == IS_DOUBLE) {
+        s->types[i] = DRIZZLE_COLUMN_TYPE_DOUBLE;
+      }
+      zend_hash_move_forward_ex(first, &value_pos);
+    }
+
+    ZVAL_NULL(&s->values[i]);
+  }
+
+  s->column_count = i;
+  drizzle_result_set_column_count(&s->result, s->column_count);
+
+  s->rows = rows;
+  Z_ADDREF_P(rows);
+  zend_hash_internal_pointer_reset_ex(Z_ARRVAL_P(rows), &s->row_pos);
+}
+
+
+static mysql_session_t* mysql_session_get(zval* this_ptr TSRMLS_DC) {
+  mysql_session_t* s = (mysql_session_t*) zend_object_store_get_object(this_ptr TSRMLS_CC);
+
+  if (s->state != SESSION_QUERY) {
+    THROW_ERROR("No query to answer");
+    return NULL;
+  }
+
+  return s;
+}
+
+
+/* result(array $rows, array $columns = null) sends a result set. */
+/* Column names default to the keys of the first row; without rows */
+/* or columns the reply is a plain OK. */
+PHP_METHOD(MySQLServerConnection, result) {
+  mysql_session_t* self;
+  zval* rows;
+  zval* columns = NULL;
+
+  if (zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "a|a!", &rows, &columns) == FAILURE) {
+    return;
+  }
+
+  if ((self = mysql_session_get(getThis() TSRMLS_CC)) == NULL) {
+    RETURN_NULL();
+  }
+
+  mysql_session_columns_init(self, rows, columns);
+  self->state = self->column_count ? SESSION_HEADER : SESSION_REPLY;
+  mysql_session_run(self);
+
+  RETURN_NULL();
+}
+
+
+/* ok($affectedRows = 0, $insertId = 0, $info = null) */
+PHP_METHOD(MySQLServerConnection, ok) {
+  mysql_session_t* self;
+  long affected_rows = 0;
+  long insert_id = 0;
+  char* info = NULL;
+  int info_length;
+
+  if (zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "|lls!", &affected_rows, &insert_id, &info, &info_length) == FAILURE) {
+    return;
+  }
+
+  if ((self = mysql_session_get(getThis() TSRMLS_CC)) == NULL) {
+    RETURN_NULL();
+  }
+
+  drizzle_result_set_affected_rows(&self->result, (uint64_t) affected_rows);
+  drizzle_result_set_insert_id(&self->result, (uint64_t) insert_id);
+  if (info) {
+    drizzle_result_set_info(&self->result, info);
+  }
+
+  self->state = SESSION_REPLY;
+  mysql_session_run(self);
+
+  RETURN_NULL();
+}
+
+
+/* error($message, $code = 1105, $sqlState = "HY000") */
+PHP_METHOD(MySQLServerConnection, error) {
+  mysql_session_t* self;
+  char* message;
+  int message_length;
+  long code = 1105;
+  char* sqlstate = "HY000";
+  int sqlstate_length;
+
+  if (zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "s|ls", &message, &message_length, &code, &sqlstate, &sqlstate_length) == FAILURE) {
+    return;
+  }
+
+  if ((self = mysql_session_get(getThis() TSRMLS_CC)) == NULL) {
+    RETURN_NULL();
+  }
+
+  mysql_session_error(self, message, code, sqlstate);
+
+  self->state = SESSION_REPLY;
+  mysql_session_run(self);
+
+  RETURN_NULL();
+}
+
+
+PHP_METHOD(MySQLServerConnection, getUser) {
+  mysql_session_t* self = (mysql_session_t*) zend_object_store_get_object(getThis() TSRMLS_CC);
+
+  if (self->server == NULL) {
+    RETURN_NULL();
+  }
+
+  RETURN_STRING((char*) drizzle_con_user(&self->con), 1);
+}
+
+
+PHP_METHOD(MySQLServerConnection, getDb) {
+  mysql_session_t* self = (mysql_session_t*) zend_object_store_get_object(getThis() TSRMLS_CC);
+
+  if (self->server == NULL) {
+    RETURN_NULL();
+  }
+
+  RETURN_STRING((char*) drizzle_con_db(&self->con), 1);
+}
+
+
+PHP_METHOD(MySQLServerConnection, close) {
+  mysql_session_t* self = (mysql_session_t*) zend_object_store_get_object(getThis() TSRMLS_CC);
+
+  mysql_session_close(self);
+  mysql_session_release(self);
+
+  RETURN_NULL();
+}
+
+
+static zend_function_entry mysql_server_methods[] = {
+  PHP_ME(MySQLServer, __construct, NULL, ZEND_ACC_PUBLIC)
+  PHP_ME(MySQLServer, listen, NULL, ZEND_ACC_PUBLIC)
+  PHP_ME(MySQLServer, setOptions, NULL, ZEND_ACC_PUBLIC)
+  PHP_ME(MySQLServer, close, NULL, ZEND_ACC_PUBLIC)
+  { NULL }
+};
+
+
+static zend_function_entry mysql_session_methods[] = {
+  PHP_ME(MySQLServerConnection, result, NULL, ZEND_ACC_PUBLIC)
+  PHP_ME(MySQLServerConnection, ok, NULL, ZEND_ACC_PUBLIC)
+  PHP_ME(MySQLServerConnection, error, NULL, ZEND_ACC_PUBLIC)
+  PHP_ME(MySQLServerConnection, getUser, NULL, ZEND_ACC_PUBLIC)
+  PHP_ME(MySQLServerConnection, getDb, NULL, ZEND_ACC_PUBLIC)
+  PHP_ME(MySQLServerConnection, close, NULL, ZEND_ACC_PUBLIC)
+  { NULL }
+};
+
+
+void mysql_server_init(TSRMLS_D) {
+  zend_class_entry ce;
+
+  INIT_CLASS_ENTRY(ce, "MySQLServer", mysql_server_methods);
+  ce.create_object = mysql_server_new;
+  mysql_server_ce = zend_register_internal_class(&ce TSRMLS_CC);
+
+  INIT_CLASS_ENTRY(ce, "MySQLServerConnection", mysql_session_methods);
+  ce.create_object = mysql_session_new;
+  mysql_session_ce = zend_register_internal_class(&ce TSRMLS_CC);
+}
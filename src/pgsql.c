@@ -0,0 +1,1741 @@
+/*
+ * Copyright (c) 2011, Ben Noordhuis <info@bnoordhuis.nl>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/* A PostgreSQL client that speaks the v3 wire protocol itself, on a TCP */
+/* object of its own. Queries are written as soon as the connection is */
+/* up, without waiting for the ones before them; the server answers in */
+/* order, each query's answer ending with a ReadyForQuery. */
+
+#include "phode.h"
+
+#include "ext/hash/php_hash_sha.h"
+#include "ext/standard/base64.h"
+#include "ext/standard/md5.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+
+#define PGSQL_PROTOCOL_VERSION 196608
+
+#define PGSQL_AUTH_OK 0
+#define PGSQL_AUTH_CLEARTEXT 3
+#define PGSQL_AUTH_MD5 5
+#define PGSQL_AUTH_SASL 10
+#define PGSQL_AUTH_SASL_CONTINUE 11
+#define PGSQL_AUTH_SASL_FINAL 12
+
+/* Type OIDs that decode to something other than a string */
+#define PGSQL_OID_BOOL 16
+#define PGSQL_OID_INT8 20
+#define PGSQL_OID_INT2 21
+#define PGSQL_OID_INT4 23
+#define PGSQL_OID_OID 26
+#define PGSQL_OID_FLOAT4 700
+#define PGSQL_OID_FLOAT8 701
+
+/* Random bytes in a SCRAM client nonce; 18 make 24 base64 characters */
+/* without padding. */
+#define PGSQL_SCRAM_NONCE 18
+#define PGSQL_SHA256_LENGTH 32
+
+/* PBKDF2 runs on the loop; the server picks the count (4096 by default) */
+/* so it can't be trusted with an unbounded one. */
+#define PGSQL_SCRAM_MAX_ITERATIONS 65536
+
+/* How far a SCRAM exchange has got */
+enum {
+  PGSQL_SCRAM_NONE,
+  PGSQL_SCRAM_FIRST,
+  PGSQL_SCRAM_FINAL
+};
+
+
+typedef struct {
+  char* base;
+  size_t len;
+  size_t size;
+} pgsql_buf_t;
+
+
+enum {
+  PGSQL_STRING,
+  PGSQL_LONG,
+  PGSQL_DOUBLE,
+  PGSQL_BOOL
+};
+
+
+/* Column names with their hashes, worked out once per result. */
+typedef struct {
+  const char* name;
+  uint name_len;
+  ulong hash;
+  int type;
+} pgsql_column_t;
+
+
+typedef struct pgsql_query_s {
+  struct pgsql_query_s* next;
+  /* Query, or Parse/Bind/Describe/Execute/Sync, ready for the write */
+  /* queue. NULL once written. */
+  zval* msg;
+  zval* callback;
+  pgsql_column_t* columns;
+  int column_count;
+  char* names;
+  zval* rows;
+  /* Tag of the last CommandComplete, e.g. "INSERT 0 1" */
+  char* command;
+  long affected_rows;
+  /* The first ErrorResponse; reported once the query is over */
+  char* error;
+  char sqlstate[6];
+} pgsql_query_t;
+
+
+enum {
+  PGSQL_CLOSED,
+  PGSQL_CONNECTING,
+  PGSQL_AUTH,
+  PGSQL_READY
+};
+
+
+typedef struct {
+  /* obj must be the first member, because it must be safe to cast */
+  /* pgsql_t* to zend_object */
+  zend_object obj;
+  uv_loop_t* loop;
+  char* host;
+  long port;
+  char* user;
+  char* password;
+  char* db;
+  /* The TCP object the connection runs on; NULL while closed */
+  zval* socket;
+  tcp_wrap_t* tcp;
+  /* The host name lookup ahead of the connect, if one is running */
+  struct pgsql_resolve_s* resolve;
+  uv_connect_t connect_req;
+  int state;
+  /* Oldest first. The ones from unsent on haven't been written yet. */
+  pgsql_query_t* head;
+  pgsql_query_t* tail;
+  pgsql_query_t* unsent;
+  /* A message that didn't arrive in one piece */
+  pgsql_buf_t in;
+  /* SCRAM: our nonce, our first message without the GS2 header, and */
+  /* the signature the server has to come back with. */
+  char scram_nonce[PGSQL_SCRAM_NONCE * 2];
+  pgsql_buf_t scram_first;
+  unsigned char scram_signature[PGSQL_SHA256_LENGTH];
+  /* Back to PGSQL_SCRAM_NONE only once the server proved itself */
+  int scram_state;
+  /* Keeps us alive while there is work in flight */
+  zval* self;
+  /* Connected, but neither reading nor holding the loop open */
+  unsigned idle:1;
+  unsigned closed:1;
+  /* AuthenticationOk came in; ReadyForQuery doesn't count before it */
+  unsigned authenticated:1;
+  TSRMLS_D;
+} pgsql_t;
+
+
+/* Outlives the connection attempt if that's called off; pg is NULL */
+/* then. */
+typedef struct pgsql_resolve_s {
+  pgsql_t* pg;
+} pgsql_resolve_t;
+
+
+/* HMAC-SHA-256 with the key's pads hashed once, so that PBKDF2 only */
+/* pays for the message in each round. */
+typedef struct {
+  PHP_SHA256_CTX inner;
+  PHP_SHA256_CTX outer;
+} pgsql_hmac_t;
+
+
+zend_class_entry* pgsql_ce;
+
+
+static void pgsql_buf_append(pgsql_buf_t* buf, const char* data, size_t len) {
+  /* Always leave room for a NUL terminator. */
+  if (buf->len + len + 1 > buf->size) {
+    buf->size = 2 * (buf->len + len + 1);
+    buf->base = (char*) erealloc(buf->base, buf->size);
+  }
+
+  memcpy(buf->base + buf->len, data, len);
+  buf->len += len;
+  buf->base[buf->len] = '\0';
+}
+
+
+static void pgsql_buf_free(pgsql_buf_t* buf) {
+  if (buf->base) {
+    efree(buf->base);
+  }
+
+  buf->base = NULL;
+  buf->len = 0;
+  buf->size = 0;
+}
+
+
+static void pgsql_put_int32(pgsql_buf_t* buf, int32_t value) {
+  uint32_t n = htonl((uint32_t) value);
+  pgsql_buf_append(buf, (const char*) &n, 4);
+}
+
+
+static void pgsql_put_int16(pgsql_buf_t* buf, int16_t value) {
+  uint16_t n = htons((uint16_t) value);
+  pgsql_buf_append(buf, (const char*) &n, 2);
+}
+
+
+static void pgsql_put_string(pgsql_buf_t* buf, const char* s) {
+  pgsql_buf_append(buf, s, strlen(s) + 1);
+}
+
+
+static int32_t pgsql_get_int32(const char* p) {
+  uint32_t n;
+  memcpy(&n, p, 4);
+  return (int32_t) ntohl(n);
+}
+
+
+static int16_t pgsql_get_int16(const char* p) {
+  uint16_t n;
+  memcpy(&n, p, 2);
+  return (int16_t) ntohs(n);
+}
+
+
+/* Length of a string field that may run up to the end of the message */
+static size_t pgsql_string_len(const char* p, const char* end) {
+  const char* nul = memchr(p, '\0', end - p);
+  return nul ? (size_t) (nul - p) : (size_t) (end - p);
+}
+
+
+/* Starts a message; pgsql_msg_end() fills in the length. Returns */
+/* where the length goes. */
+static size_t pgsql_msg_begin(pgsql_buf_t* buf, char type) {
+  size_t start;
+
+  pgsql_buf_append(buf, &type, 1);
+  start = buf->len;
+  pgsql_put_int32(buf, 0);
+
+  return start;
+}
+
+
+static void pgsql_msg_end(pgsql_buf_t* buf, size_t start) {
+  uint32_t n = htonl((uint32_t) (buf->len - start));
+  memcpy(buf->base + start, &n, 4);
+}
+
+
+static void pgsql_hmac_init(pgsql_hmac_t* h, const unsigned char* key, size_t len) {
+  unsigned char digest[PGSQL_SHA256_LENGTH];
+  unsigned char pad[64];
+  PHP_SHA256_CTX ctx;
+  size_t i;
+
+  if (len > sizeof pad) {
+    PHP_SHA256Init(&ctx);
+    PHP_SHA256Update(&ctx, key, len);
+    PHP_SHA256Final(digest, &ctx);
+    key = digest;
+    len = sizeof digest;
+  }
+
+  memset(pad, 0x36, sizeof pad);
+  for (i = 0; i < len; i++) {
+    pad[i] ^= key[i];
+  }
+  PHP_SHA256Init(&h->inner);
+  PHP_SHA256Update(&h->inner, pad, sizeof pad);
+
+  memset(pad, 0x5c, sizeof pad);
+  for (i = 0; i < len; i++) {
+    pad[i] ^= key[i];
+  }
+  PHP_SHA256Init(&h->outer);
+  PHP_SHA256Update(&h->outer, pad, sizeof pad);
+}
+
+
+static void pgsql_hmac(const pgsql_hmac_t* h, const unsigned char* msg, size_t len, unsigned char* out) {
+  unsigned char digest[PGSQL_SHA256_LENGTH];
+  PHP_SHA256_CTX ctx;
+
+  ctx = h->inner;
+  PHP_SHA256Update(&ctx, msg, len);
+  PHP_SHA256Final(digest, &ctx);
+
+  ctx = h->outer;
+  PHP_SHA256Update(&ctx, digest, sizeof digest);
+  PHP_SHA256Final(out, &ctx);
+}
+
+
+/* PBKDF2-HMAC-SHA-256 with a single block of output, which is all */
+/* SCRAM-SHA-256 needs. */
+static void pgsql_pbkdf2(const char* password, const unsigned char* salt, size_t salt_len, long iterations, unsigned char* out) {
+  unsigned char u[PGSQL_SHA256_LENGTH];
+  unsigned char* block;
+  pgsql_hmac_t h;
+  long i;
+  int j;
+
+  pgsql_hmac_init(&h, (const unsigned char*) password, strlen(password));
+
+  block = (unsigned char*) emalloc(salt_len + 4);
+  memcpy(block, salt, salt_len);
+  memcpy(block + salt_len, "\0\0\0\1", 4);
+  pgsql_hmac(&h, block, salt_len + 4, u);
+  efree(block);
+
+  memcpy(out, u, sizeof u);
+
+  for (i = 1; i < iterations; i++) {
+    pgsql_hmac(&h, u, sizeof u, u);
+    for (j = 0; j < PGSQL_SHA256_LENGTH; j++) {
+      out[j] ^= u[j];
+    }
+  }
+}
+
+
+static void pgsql_query_free(pgsql_query_t* query) {
+  if (query->msg) {
+    zval_ptr_dtor(&query->msg);
+  }
+
+  if (query->callback) {
+    zval_ptr_dtor(&query->callback);
+  }
+
+  if (query->rows) {
+    zval_ptr_dtor(&query->rows);
+  }
+
+  if (query->columns) {
+    efree(query->columns);
+    efree(query->names);
+  }
+
+  if (query->command) {
+    efree(query->command);
+  }
+
+  if (query->error) {
+    efree(query->error);
+  }
+
+  efree(query);
+}
+
+
+/* Calls back with ($error, $rows, $info), like MySQL::query(). $info */
+/* has the command tag and affected_rows, or the SQLSTATE on errors. */
+static void pgsql_query_notify(pgsql_t* pg, pgsql_query_t* query, const char* error) {
+  zval* args[3];
+  TSRMLS_D_GET(pg);
+
+  if (query->callback == NULL) {
+    return;
+  }
+
+  if (error == NULL) {
+    error = query->error;
+  }
+
+  MAKE_STD_ZVAL(args[0]);
+  MAKE_STD_ZVAL(args[2]);
+  array_init(args[2]);
+
+  if (error) {
+    ZVAL_STRING(args[0], (char*) error, 1);
+    MAKE_STD_ZVAL(args[1]);
+    ZVAL_NULL(args[1]);
+    if (query->sqlstate[0]) {
+      add_assoc_string(args[2], "sqlstate", query->sqlstate, 1);
+    }
+  } else {
+    ZVAL_NULL(args[0]);
+
+    if (query->rows) {
+      args[1] = query->rows;
+      query->rows = NULL;
+    } else {
+      MAKE_STD_ZVAL(args[1]);
+      array_init(args[1]);
+    }
+
+    add_assoc_string(args[2], "command", query->command ? query->command : "", 1);
+    add_assoc_long(args[2], "affected_rows", query->affected_rows);
+  }
+
+  call_callback(query->callback, 3, args TSRMLS_CC);
+
+  zval_ptr_dtor(&args[0]);
+  zval_ptr_dtor(&args[1]);
+  zval_ptr_dtor(&args[2]);
+}
+
+
+/* Drops our self reference once nothing is pending. An open but idle */
+/* connection stops reading and lets the loop exit. */
+static void pgsql_release(pgsql_t* pg) {
+  zval* self = pg->self;
+
+  if (pg->head) {
+    return;
+  }
+
+  if (pg->state == PGSQL_READY && !pg->idle) {
+    uv_read_stop((uv_stream_t*) &pg->tcp->handle);
+    uv_unref(pg->loop);
+    pg->idle = 1;
+  }
+
+  if (self) {
+    pg->self = NULL;
+    zval_ptr_dtor(&self);
+  }
+}
+
+
+static void pgsql_read_cb(uv_stream_t* stream, ssize_t nread, uv_buf_t buf);
+
+
+/* Takes the connection out of the idle state for new work. */
+static void pgsql_wake(pgsql_t* pg) {
+  if (!pg->idle) {
+    return;
+  }
+
+  pg->idle = 0;
+  uv_ref(pg->loop);
+  uv_read_start((uv_stream_t*) &pg->tcp->handle, tcp_alloc_cb, pgsql_read_cb);
+}
+
+
+/* Closes the connection and fails everything that was queued on it. */
+/* The next query reconnects. */
+static void pgsql_disconnect(pgsql_t* pg, const char* error) {
+  pgsql_query_t* query;
+  pgsql_query_t* next;
+  zval* socket = pg->socket;
+  TSRMLS_D_GET(pg);
+
+  if (pg->resolve) {
+    pg->resolve->pg = NULL;
+    pg->resolve = NULL;
+  }
+
+  if (socket) {
+    /* The handle's own reference goes when it's closed. */
+    if (pg->idle) {
+      uv_ref(pg->loop);
+    }
+
+    pg->tcp->native = NULL;
+    pg->tcp->native_close_cb = NULL;
+    tcp_close(pg->tcp TSRMLS_CC);
+
+    pg->socket = NULL;
+    pg->tcp = NULL;
+    zval_ptr_dtor(&socket);
+  }
+
+  pg->state = PGSQL_CLOSED;
+  pg->idle = 0;
+  pg->authenticated = 0;
+  pg->in.len = 0;
+  pgsql_buf_free(&pg->scram_first);
+  pg->scram_state = PGSQL_SCRAM_NONE;
+
+  /* Callbacks may queue more; those go on a new connection. */
+  query = pg->head;
+  pg->head = NULL;
+  pg->tail = NULL;
+  pg->unsent = NULL;
+
+  for (; query; query = next) {
+    next = query->next;
+    pgsql_query_notify(pg, query, error);
+    pgsql_query_free(query);
+  }
+}
+
+
+/* The socket went away under us. */
+static void pgsql_close_cb(tcp_wrap_t* tcp TSRMLS_DC) {
+  pgsql_t* pg = (pgsql_t*) tcp->native;
+  zval* self = pg->self;
+
+  if (self) {
+    Z_ADDREF_P(self);
+  }
+
+  pgsql_disconnect(pg, "Connection lost");
+  pgsql_release(pg);
+
+  if (self) {
+    zval_ptr_dtor(&self);
+  }
+}
+
+
+/* Hands the queries that haven't been written yet to the socket, as */
+/* one write. */
+static void pgsql_flush(pgsql_t* pg) {
+  pgsql_query_t* query;
+  write_wrap_t* wrap;
+  TSRMLS_D_GET(pg);
+
+  if (pg->state != PGSQL_READY || pg->unsent == NULL) {
+    return;
+  }
+
+  pgsql_wake(pg);
+
+  wrap = tcp_write_begin(pg->tcp TSRMLS_CC);
+
+  for (query = pg->unsent; query; query = query->next) {
+    write_wrap_push_string(wrap, query->msg);
+    zval_ptr_dtor(&query->msg);
+    query->msg = NULL;
+  }
+
+  pg->unsent = NULL;
+
+  tcp_write_end(pg->tcp, wrap TSRMLS_CC);
+}
+
+
+static void pgsql_send(pgsql_t* pg, pgsql_buf_t* buf) {
+  write_wrap_t* wrap;
+  zval* chunk;
+  TSRMLS_D_GET(pg);
+
+  MAKE_STD_ZVAL(chunk);
+  ZVAL_STRINGL(chunk, buf->base, buf->len, 0);
+  buf->base = NULL;
+  buf->len = 0;
+  buf->size = 0;
+
+  wrap = tcp_write_begin(pg->tcp TSRMLS_CC);
+  write_wrap_push_string(wrap, chunk);
+  tcp_write_end(pg->tcp, wrap TSRMLS_CC);
+
+  zval_ptr_dtor(&chunk);
+}
+
+
+static void pgsql_send_password(pgsql_t* pg, const char* password) {
+  pgsql_buf_t buf = { NULL, 0, 0 };
+  size_t start;
+
+  start = pgsql_msg_begin(&buf, 'p');
+  pgsql_put_string(&buf, password);
+  pgsql_msg_end(&buf, start);
+
+  pgsql_send(pg, &buf);
+}
+
+
+/* "md5" + md5(md5(password + user) + salt), in hex. */
+static void pgsql_auth_md5(pgsql_t* pg, const char* salt) {
+  unsigned char digest[16];
+  char hex[33];
+  char reply[36];
+  PHP_MD5_CTX ctx;
+
+  PHP_MD5Init(&ctx);
+  PHP_MD5Update(&ctx, pg->password, strlen(pg->password));
+  PHP_MD5Update(&ctx, pg->user, strlen(pg->user));
+  PHP_MD5Final(digest, &ctx);
+  make_digest(hex, digest);
+
+  PHP_MD5Init(&ctx);
+  PHP_MD5Update(&ctx, hex, 32);
+  PHP_MD5Update(&ctx, salt, 4);
+  PHP_MD5Final(digest, &ctx);
+
+  memcpy(reply, "md5", 3);
+  make_digest(reply + 3, digest);
+
+  pgsql_send_password(pg, reply);
+}
+
+
+static int pgsql_scram_nonce(pgsql_t* pg) {
+  unsigned char bytes[PGSQL_SCRAM_NONCE];
+  unsigned char* encoded;
+  int len;
+  int fd;
+  ssize_t n;
+
+  fd = open("/dev/urandom", O_RDONLY);
+  if (fd == -1) {
+    return -1;
+  }
+
+  n = read(fd, bytes, sizeof bytes);
+  close(fd);
+
+  if (n != sizeof bytes) {
+    return -1;
+  }
+
+  encoded = php_base64_encode(bytes, sizeof bytes, &len);
+  memcpy(pg->scram_nonce, encoded, len);
+  pg->scram_nonce[len] = '\0';
+  efree(encoded);
+
+  return 0;
+}
+
+
+/* SASLInitialResponse. The user name is left out; the server goes by */
+/* the one in the startup message. */
+static const char* pgsql_scram_first(pgsql_t* pg, const char* data, size_t len) {
+  pgsql_buf_t buf = { NULL, 0, 0 };
+  const char* p = data;
+  const char* end = data + len;
+  const char* nul;
+  size_t start;
+  int found = 0;
+
+  /* A list of mechanisms, each NUL-terminated, then an empty one */
+  while (p < end && *p) {
+    nul = memchr(p, '\0', end - p);
+    if (nul == NULL) {
+      return "Malformed authentication request";
+    }
+    if (nul - p == sizeof("SCRAM-SHA-256") - 1 && memcmp(p, "SCRAM-SHA-256", nul - p) == 0) {
+      found = 1;
+    }
+    p = nul + 1;
+  }
+
+  if (!found) {
+    return "No supported SASL mechanism";
+  }
+
+  if (pgsql_scram_nonce(pg) != 0) {
+    return "Can't read /dev/urandom";
+  }
+
+  pgsql_buf_free(&pg->scram_first);
+  pgsql_buf_append(&pg->scram_first, "n=,r=", 5);
+  pgsql_buf_append(&pg->scram_first, pg->scram_nonce, strlen(pg->scram_nonce));
+
+  start = pgsql_msg_begin(&buf, 'p');
+  pgsql_put_string(&buf, "SCRAM-SHA-256");
+  pgsql_put_int32(&buf, (int32_t) (3 + pg->scram_first.len));
+  pgsql_buf_append(&buf, "n,,", 3);
+  pgsql_buf_append(&buf, pg->scram_first.base, pg->scram_first.len);
+  pgsql_msg_end(&buf, start);
+
+  pgsql_send(pg, &buf);
+  pg->scram_state = PGSQL_SCRAM_FIRST;
+
+  return NULL;
+}
+
+
+/* Finds attribute name in a SCRAM message like "r=...,s=...,i=...". */
+static const char* pgsql_scram_attr(const char* data, size_t len, char name, size_t* value_len) {
+  const char* p = data;
+  const char* end = data + len;
+  const char* comma;
+
+  while (p < end) {
+    comma = memchr(p, ',', end - p);
+    if (comma == NULL) {
+      comma = end;
+    }
+
+    if (comma - p >= 2 && p[0] == name && p[1] == '=') {
+      *value_len = comma - p - 2;
+      return p + 2;
+    }
+
+    p = comma + 1;
+  }
+
+  return NULL;
+}
+
+
+/* Answers the server's challenge with the client proof and works out */
+/* the signature the server has to send back. The password is used */
+/* as is, without SASLprep; that is only a problem for non-ASCII ones. */
+static const char* pgsql_scram_final(pgsql_t* pg, const char* data, size_t len) {
+  unsigned char salted[PGSQL_SHA256_LENGTH];
+  unsigned char client_key[PGSQL_SHA256_LENGTH];
+  unsigned char stored_key[PGSQL_SHA256_LENGTH];
+  unsigned char signature[PGSQL_SHA256_LENGTH];
+  unsigned char server_key[PGSQL_SHA256_LENGTH];
+  pgsql_buf_t auth = { NULL, 0, 0 };
+  pgsql_buf_t buf = { NULL, 0, 0 };
+  PHP_SHA256_CTX ctx;
+  pgsql_hmac_t h;
+  const char* nonce;
+  const char* salt64;
+  const char* iter;
+  size_t nonce_len;
+  size_t salt64_len;
+  size_t iter_len;
+  unsigned char* salt;
+  unsigned char* proof;
+  int salt_len;
+  int proof_len;
+  long iterations;
+  size_t start;
+  int i;
+
+  nonce = pgsql_scram_attr(data, len, 'r', &nonce_len);
+  salt64 = pgsql_scram_attr(data, len, 's', &salt64_len);
+  iter = pgsql_scram_attr(data, len, 'i', &iter_len);
+
+  if (pg->scram_state != PGSQL_SCRAM_FIRST) {
+    return "Unexpected SCRAM challenge";
+  }
+
+  if (nonce == NULL || salt64 == NULL || iter == NULL || iter_len == 0) {
+    return "Malformed SCRAM challenge";
+  }
+
+  /* The server's nonce has to extend ours. */
+  if (nonce_len <= strlen(pg->scram_nonce) ||
+      memcmp(nonce, pg->scram_nonce, strlen(pg->scram_nonce)) != 0) {
+    return "SCRAM nonce mismatch";
+  }
+
+  /* Not NUL-terminated, and strtol() would read past it */
+  iterations = 0;
+  for (i = 0; i < (int) iter_len; i++) {
+    if (iter[i] < '0' || iter[i] > '9') {
+      return "Malformed SCRAM challenge";
+    }
+    iterations = iterations * 10 + (iter[i] - '0');
+    if (iterations > PGSQL_SCRAM_MAX_ITERATIONS) {
+      return "SCRAM iteration count too high";
+    }
+  }
+
+  if (iterations < 1) {
+    return "Malformed SCRAM challenge";
+  }
+
+  salt = php_base64_decode((const unsigned char*) salt64, (int) salt64_len, &salt_len);
+  if (salt == NULL) {
+    return "Malformed SCRAM challenge";
+  }
+
+  pgsql_pbkdf2(pg->password, salt, salt_len, iterations, salted);
+  efree(salt);
+
+  pgsql_hmac_init(&h, salted, sizeof salted);
+  pgsql_hmac(&h, (const unsigned char*) "Client Key", 10, client_key);
+  pgsql_hmac(&h, (const unsigned char*) "Server Key", 10, server_key);
+
+  PHP_SHA256Init(&ctx);
+  PHP_SHA256Update(&ctx, client_key, sizeof client_key);
+  PHP_SHA256Final(stored_key, &ctx);
+
+  /* "c=biws" is the base64 of the "n,," header we sent. */
+  pgsql_buf_append(&buf, "c=biws,r=", 9);
+  pgsql_buf_append(&buf, nonce, nonce_len);
+
+  pgsql_buf_append(&auth, pg->scram_first.base, pg->scram_first.len);
+  pgsql_buf_append(&auth, ",", 1);
+  pgsql_buf_append(&auth, data, len);
+  pgsql_buf_append(&auth, ",", 1);
+  pgsql_buf_append(&auth, buf.base, buf.len);
+
+  pgsql_hmac_init(&h, stored_key, sizeof stored_key);
+  pgsql_hmac(&h, (const unsigned char*) auth.base, auth.len, signature);
+
+  for (i = 0; i < PGSQL_SHA256_LENGTH; i++) {
+    client_key[i] ^= signature[i];
+  }
+
+  pgsql_hmac_init(&h, server_key, sizeof server_key);
+  pgsql_hmac(&h, (const unsigned char*) auth.base, auth.len, pg->scram_signature);
+
+  proof = php_base64_encode(client_key, sizeof client_key, &proof_len);
+
+  /* The final message goes out as SASLResponse, after the proof */
+  /* without a NUL. */
+  pgsql_buf_free(&auth);
+  start = pgsql_msg_begin(&auth, 'p');
+  pgsql_buf_append(&auth, buf.base, buf.len);
+  pgsql_buf_append(&auth, ",p=", 3);
+  pgsql_buf_append(&auth, (const char*) proof, proof_len);
+  pgsql_msg_end(&auth, start);
+
+  efree(proof);
+  pgsql_buf_free(&buf);
+
+  pgsql_send(pg, &auth);
+  pg->scram_state = PGSQL_SCRAM_FINAL;
+
+  return NULL;
+}
+
+
+static const char* pgsql_scram_verify(pgsql_t* pg, const char* data, size_t len) {
+  unsigned char* signature;
+  const char* v;
+  size_t v_len;
+  int signature_len;
+  int ok;
+
+  if (pg->scram_state != PGSQL_SCRAM_FINAL) {
+    return "Unexpected SCRAM result";
+  }
+
+  v = pgsql_scram_attr(data, len, 'v', &v_len);
+  if (v == NULL) {
+    return "Malformed SCRAM result";
+  }
+
+  signature = php_base64_decode((const unsigned char*) v, (int) v_len, &signature_len);
+  if (signature == NULL) {
+    return "Malformed SCRAM result";
+  }
+
+  ok = signature_len == PGSQL_SHA256_LENGTH &&
+       memcmp(signature, pg->scram_signature, PGSQL_SHA256_LENGTH) == 0;
+  efree(signature);
+
+  pgsql_buf_free(&pg->scram_first);
+
+  if (!ok) {
+    return "SCRAM server signature mismatch";
+  }
+
+  pg->scram_state = PGSQL_SCRAM_NONE;
+
+  return NULL;
+}
+
+
+/* Returns an error that ends the connection, or NULL. */
+static const char* pgsql_auth(pgsql_t* pg, const char* data, size_t len) {
+  if (len < 4) {
+    return "Malformed authentication request";
+  }
+
+  switch (pgsql_get_int32(data)) {
+    case PGSQL_AUTH_OK:
+      /* Not before the server has shown it knows the password too */
+      if (pg->scram_state != PGSQL_SCRAM_NONE) {
+        return "SCRAM server signature missing";
+      }
+      pg->authenticated = 1;
+      return NULL;
+
+    case PGSQL_AUTH_CLEARTEXT:
+      pgsql_send_password(pg, pg->password);
+      return NULL;
+
+    case PGSQL_AUTH_MD5:
+      if (len < 8) {
+        return "Malformed authentication request";
+      }
+      pgsql_auth_md5(pg, data + 4);
+      return NULL;
+
+    case PGSQL_AUTH_SASL:
+      return pgsql_scram_first(pg, data + 4, len - 4);
+
+    case PGSQL_AUTH_SASL_CONTINUE:
+      return pgsql_scram_final(pg, data + 4, len - 4);
+
+    case PGSQL_AUTH_SASL_FINAL:
+      return pgsql_scram_verify(pg, data + 4, len - 4);
+  }
+
+  return "Unsupported authentication method";
+}
+
+
+/* Pulls the message (M) and SQLSTATE (C) out of an ErrorResponse. */
+/* Both are NUL-terminated within the message; a field that runs off */
+/* its end is ignored, along with anything after it. */
+static void pgsql_error_fields(const char* data, size_t len, const char** message, size_t* message_len, const char** sqlstate, size_t* sqlstate_len) {
+  const char* p = data;
+  const char* end = data + len;
+  size_t n;
+
+  *message = "Unknown error";
+  *message_len = sizeof("Unknown error") - 1;
+  *sqlstate = NULL;
+  *sqlstate_len = 0;
+
+  while (p < end && *p) {
+    n = pgsql_string_len(p + 1, end);
+    if (p + 1 + n >= end) {
+      break;
+    }
+
+    if (*p == 'M') {
+      *message = p + 1;
+      *message_len = n;
+    } else if (*p == 'C') {
+      *sqlstate = p + 1;
+      *sqlstate_len = n;
+    }
+    p += n + 2;
+  }
+}
+
+
+static int pgsql_column_php_type(int32_t oid) {
+  switch (oid) {
+    case PGSQL_OID_INT2:
+    case PGSQL_OID_INT4:
+    case PGSQL_OID_INT8:
+    case PGSQL_OID_OID:
+      return PGSQL_LONG;
+
+    case PGSQL_OID_FLOAT4:
+    case PGSQL_OID_FLOAT8:
+      return PGSQL_DOUBLE;
+
+    case PGSQL_OID_BOOL:
+      return PGSQL_BOOL;
+
+    /* numeric would lose precision as a double, and dates and times */
+    /* are left for PHP to parse. */
+    default:
+      return PGSQL_STRING;
+  }
+}
+
+
+/* RowDescription. A query string with several statements reports the */
+/* rows of the last one that returned any. */
+static int pgsql_columns_init(pgsql_query_t* query, const char* data, size_t len) {
+  const char* p = data + 2;
+  const char* end = data + len;
+  pgsql_column_t* c;
+  size_t names_len;
+  size_t n;
+  int count;
+  int i;
+
+  if (len < 2 || (count = pgsql_get_int16(data)) < 0) {
+    return -1;
+  }
+
+  if (query->columns) {
+    efree(query->columns);
+    efree(query->names);
+  }
+
+  if (query->rows) {
+    zval_ptr_dtor(&query->rows);
+  }
+
+  /* The names are copied as a block and pointed into. */
+  names_len = end - p;
+  query->names = (char*) emalloc(names_len + 1);
+  memcpy(query->names, p, names_len);
+  query->columns = (pgsql_column_t*) safe_emalloc(count ? count : 1, sizeof(pgsql_column_t), 0);
+  query->column_count = count;
+
+  MAKE_STD_ZVAL(query->rows);
+  array_init(query->rows);
+
+  for (i = 0; i < count; i++) {
+    c = &query->columns[i];
+    n = pgsql_string_len(p, end);
+
+    /* Name, table OID, column number, type OID, size, modifier, format */
+    if (p + n + 19 > end) {
+      return -1;
+    }
+
+    c->name = query->names + (p - (data + 2));
+    c->name_len = n + 1;
+    c->hash = zend_get_hash_value(c->name, c->name_len);
+    c->type = pgsql_column_php_type(pgsql_get_int32(p + n + 7));
+
+    p += n + 19;
+  }
+
+  return 0;
+}
+
+
+/* Decodes a text-format field according to its column's type. */
+/* Integers that don't fit a long stay strings. */
+static zval* pgsql_value_zval(pgsql_column_t* c, const char* data, int32_t size) {
+  char tmp[32];
+  zval* value;
+  char* end;
+  long l;
+
+  MAKE_STD_ZVAL(value);
+
+  if (size < 0) {
+    ZVAL_NULL(value);
+    return value;
+  }
+
+  switch (c->type) {
+    case PGSQL_LONG:
+      if (size > 0 && size < (int32_t) sizeof tmp) {
+        memcpy(tmp, data, size);
+        tmp[size] = '\0';
+        errno = 0;
+        l = strtol(tmp, &end, 10);
+        if (errno == 0 && end == tmp + size) {
+          ZVAL_LONG(value, l);
+          return value;
+        }
+      }
+      break;
+
+    case PGSQL_DOUBLE:
+      if (size < (int32_t) sizeof tmp) {
+        memcpy(tmp, data, size);
+        tmp[size] = '\0';
+        ZVAL_DOUBLE(value, strtod(tmp, NULL));
+        return value;
+      }
+      break;
+
+    case PGSQL_BOOL:
+      ZVAL_BOOL(value, size > 0 && data[0] == 't');
+      return value;
+  }
+
+  ZVAL_STRINGL(value, data, size, 1);
+  return value;
+}
+
+
+/* DataRow, straight into a PHP array keyed by column name. */
+static int pgsql_row_add(pgsql_query_t* query, const char* data, size_t len) {
+  const char* p = data + 2;
+  const char* end = data + len;
+  pgsql_column_t* c;
+  zval* value;
+  zval* row;
+  int32_t size;
+  int count;
+  int i;
+
+  if (query->rows == NULL || len < 2 || (count = pgsql_get_int16(data)) != query->column_count) {
+    return -1;
+  }
+
+  MAKE_STD_ZVAL(row);
+  array_init_size(row, count);
+
+  for (i = 0; i < count; i++) {
+    c = &query->columns[i];
+
+    if (p + 4 > end) {
+      zval_ptr_dtor(&row);
+      return -1;
+    }
+
+    size = pgsql_get_int32(p);
+    p += 4;
+
+    if (size > end - p) {
+      zval_ptr_dtor(&row);
+      return -1;
+    }
+
+    value = pgsql_value_zval(c, p, size);
+    if (size > 0) {
+      p += size;
+    }
+
+    zend_hash_quick_update(Z_ARRVAL_P(row), c->name, c->name_len, c->hash,
+                           (void*) &value, sizeof(zval*), NULL);
+  }
+
+  add_next_index_zval(query->rows, row);
+  return 0;
+}
+
+
+/* CommandComplete: "SELECT 3", "INSERT 0 1", "UPDATE 5"; the count */
+/* comes last. */
+static void pgsql_command_complete(pgsql_query_t* query, const char* data, size_t len) {
+  const char* space;
+
+  if (query->command) {
+    efree(query->command);
+  }
+
+  query->command = estrndup(data, pgsql_string_len(data, data + len));
+  space = strrchr(query->command, ' ');
+  query->affected_rows = space ? strtol(space + 1, NULL, 10) : 0;
+}
+
+
+static void pgsql_query_done(pgsql_t* pg) {
+  pgsql_query_t* query = pg->head;
+
+  pg->head = query->next;
+  if (pg->head == NULL) {
+    pg->tail = NULL;
+  }
+
+  pgsql_query_notify(pg, query, NULL);
+  pgsql_query_free(query);
+}
+
+
+/* Handles one message from the server. Returns an error that ends */
+/* the connection, or NULL. */
+static const char* pgsql_message(pgsql_t* pg, char type, const char* data, size_t len) {
+  pgsql_query_t* query = pg->head;
+  const char* message;
+  const char* sqlstate;
+  size_t message_len;
+  size_t sqlstate_len;
+
+  /* Answers belong to the oldest query that went out. */
+  if (pg->state == PGSQL_READY && (query == NULL || query == pg->unsent)) {
+    query = NULL;
+  }
+
+  switch (type) {
+    case 'R':
+      if (pg->state != PGSQL_AUTH) {
+        return "Unexpected authentication request";
+      }
+      return pgsql_auth(pg, data, len);
+
+    case 'E':
+      pgsql_error_fields(data, len, &message, &message_len, &sqlstate, &sqlstate_len);
+
+      /* Startup and auth errors end the connection. */
+      if (pg->state != PGSQL_READY) {
+        return message;
+      }
+
+      if (query && query->error == NULL) {
+        query->error = estrndup(message, message_len);
+        if (sqlstate) {
+          if (sqlstate_len > sizeof query->sqlstate - 1) {
+            sqlstate_len = sizeof query->sqlstate - 1;
+          }
+          memcpy(query->sqlstate, sqlstate, sqlstate_len);
+          query->sqlstate[sqlstate_len] = '\0';
+        }
+      }
+      return NULL;
+
+    case 'Z':
+      if (pg->state == PGSQL_AUTH) {
+        /* A server that skips AuthenticationOk, or SASLFinal, hasn't */
+        /* proven anything. */
+        if (!pg->authenticated || pg->scram_state != PGSQL_SCRAM_NONE) {
+          return "Authentication incomplete";
+        }
+        pg->state = PGSQL_READY;
+        pgsql_flush(pg);
+        return NULL;
+      }
+
+      if (query == NULL) {
+        return "Unexpected ReadyForQuery";
+      }
+
+      pgsql_query_done(pg);
+      return NULL;
+
+    case 'T':
+      if (query == NULL || pgsql_columns_init(query, data, len) != 0) {
+        return "Malformed RowDescription";
+      }
+      return NULL;
+
+    case 'D':
+      if (query == NULL || pgsql_row_add(query, data, len) != 0) {
+        return "Malformed DataRow";
+      }
+      return NULL;
+
+    case 'C':
+      if (query) {
+        pgsql_command_complete(query, data, len);
+      }
+      return NULL;
+  }
+
+  /* ParameterStatus, BackendKeyData, notices, notifications, and the */
+  /* acknowledgements of the extended protocol steps */
+  return NULL;
+}
+
+
+static void pgsql_read_cb(uv_stream_t* stream, ssize_t nread, uv_buf_t buf) {
+  tcp_wrap_t* tcp = (tcp_wrap_t*) stream->data;
+  pgsql_t* pg = (pgsql_t*) tcp->native;
+  loop_wrap_t* loop;
+  const char* error = NULL;
+  const char* p;
+  size_t len;
+  size_t off = 0;
+  int32_t msg_len;
+  zval* self;
+  TSRMLS_D_GET(tcp);
+
+  loop = loop_wrap_get(stream->loop TSRMLS_CC);
+
+  if (nread == 0 || pg == NULL) {
+    read_buf_put(loop, buf.base);
+    return;
+  }
+
+  if (nread < 0) {
+    read_buf_put(loop, buf.base);
+    pgsql_close_cb(tcp TSRMLS_CC);
+    return;
+  }
+
+  /* Whole messages are handled right in the read buffer; only a */
+  /* partial one at the end is copied. */
+  if (pg->in.len > 0) {
+    pgsql_buf_append(&pg->in, buf.base, nread);
+    read_buf_put(loop, buf.base);
+    buf.base = NULL;
+    p = pg->in.base;
+    len = pg->in.len;
+  } else {
+    p = buf.base;
+    len = nread;
+  }
+
+  /* Callbacks may drop the last reference. */
+  self = pg->self;
+  if (self) {
+    Z_ADDREF_P(self);
+  }
+
+  while (len - off >= 5) {
+    msg_len = pgsql_get_int32(p + off + 1);
+    if (msg_len < 4) {
+      error = "Malformed message";
+      break;
+    }
+
+    if (len - off - 1 < (size_t) msg_len) {
+      break;
+    }
+
+    error = pgsql_message(pg, p[off], p + off + 5, msg_len - 4);
+    off += 1 + msg_len;
+
+    /* A callback closed the connection, or opened a new one. */
+    if (error || pg->tcp != tcp) {
+      break;
+    }
+  }
+
+  if (error) {
+    pgsql_disconnect(pg, error);
+  } else if (pg->tcp == tcp) {
+    if (p == pg->in.base) {
+      memmove(pg->in.base, p + off, len - off);
+      pg->in.len = len - off;
+    } else {
+      pgsql_buf_append(&pg->in, p + off, len - off);
+    }
+  }
+
+  if (buf.base) {
+    read_buf_put(loop, buf.base);
+  }
+
+  pgsql_release(pg);
+
+  if (self) {
+    zval_ptr_dtor(&self);
+  }
+}
+
+
+static void pgsql_startup(pgsql_t* pg) {
+  pgsql_buf_t buf = { NULL, 0, 0 };
+  uint32_t n;
+
+  /* No type byte, just the length */
+  pgsql_put_int32(&buf, 0);
+  pgsql_put_int32(&buf, PGSQL_PROTOCOL_VERSION);
+  pgsql_put_string(&buf, "user");
+  pgsql_put_string(&buf, pg->user);
+  if (pg->db[0]) {
+    pgsql_put_string(&buf, "database");
+    pgsql_put_string(&buf, pg->db);
+  }
+  pgsql_put_string(&buf, "client_encoding");
+  pgsql_put_string(&buf, "UTF8");
+  pgsql_put_string(&buf, "application_name");
+  pgsql_put_string(&buf, "phode");
+  pgsql_buf_append(&buf, "", 1);
+
+  n = htonl((uint32_t) buf.len);
+  memcpy(buf.base, &n, 4);
+
+  pgsql_send(pg, &buf);
+}
+
+
+static void pgsql_connect_cb(uv_connect_t* req, int status) {
+  pgsql_t* pg = container_of(req, pgsql_t, connect_req);
+  zval* self = pg->self;
+
+  if (self) {
+    Z_ADDREF_P(self);
+  }
+
+  if (status != 0) {
+    pgsql_disconnect(pg, uv_strerror(uv_last_error(pg->loop)));
+  } else if (uv_read_start((uv_stream_t*) &pg->tcp->handle, tcp_alloc_cb, pgsql_read_cb) != 0) {
+    pgsql_disconnect(pg, uv_strerror(uv_last_error(pg->loop)));
+  } else {
+    pg->state = PGSQL_AUTH;
+    pgsql_startup(pg);
+  }
+
+  pgsql_release(pg);
+
+  if (self) {
+    zval_ptr_dtor(&self);
+  }
+}
+
+
+/* Opens a connection on a TCP object of our own. Writes are corked, */
+/* so queries made in the same loop iteration go out together. */
+static void pgsql_connect_addr(pgsql_t* pg, dns_addr_t* ip) {
+  tcp_wrap_t* tcp;
+  tcp_addr_t addr;
+  int r;
+  TSRMLS_D_GET(pg);
+
+  MAKE_STD_ZVAL(pg->socket);
+  object_init_ex(pg->socket, tcp_ce);
+
+  tcp = (tcp_wrap_t*) zend_object_store_get_object(pg->socket TSRMLS_CC);
+  tcp->native = (void*) pg;
+  tcp->native_close_cb = pgsql_close_cb;
+  tcp->auto_cork = 1;
+
+  pg->tcp = tcp;
+
+  tcp_addr_set(&addr, ip, pg->port);
+  r = ip->family == AF_INET6
+    ? uv_tcp_connect6(&pg->connect_req, &tcp->handle, addr.in6, pgsql_connect_cb)
+    : uv_tcp_connect(&pg->connect_req, &tcp->handle, addr.in, pgsql_connect_cb);
+
+  if (r != 0) {
+    pgsql_disconnect(pg, uv_strerror(uv_last_error(pg->loop)));
+  }
+}
+
+
+static void pgsql_resolve_cb(void* data, dns_addr_t* addr, const char* error TSRMLS_DC) {
+  pgsql_resolve_t* resolve = (pgsql_resolve_t*) data;
+  pgsql_t* pg = resolve->pg;
+  zval* self;
+
+  efree(resolve);
+
+  if (pg == NULL) {
+    return;
+  }
+
+  pg->resolve = NULL;
+
+  /* Cancelled; the loop is going away */
+  if (addr == NULL && error == NULL) {
+    return;
+  }
+
+  self = pg->self;
+
+  /* Callbacks may drop the last reference. */
+  if (self) {
+    Z_ADDREF_P(self);
+  }
+
+  if (addr) {
+    pgsql_connect_addr(pg, addr);
+  } else {
+    pgsql_disconnect(pg, error);
+  }
+
+  pgsql_release(pg);
+
+  if (self) {
+    zval_ptr_dtor(&self);
+  }
+}
+
+
+/* Looks the host up on the loop first, unless it's an address or in */
+/* /etc/hosts. */
+static void pgsql_connect(pgsql_t* pg) {
+  dns_addr_t addr;
+  TSRMLS_D_GET(pg);
+
+  pg->state = PGSQL_CONNECTING;
+
+  if (dns_resolve_local(pg->loop, pg->host, &addr TSRMLS_CC) == 0) {
+    pgsql_connect_addr(pg, &addr);
+    return;
+  }
+
+  pg->resolve = (pgsql_resolve_t*) emalloc(sizeof *pg->resolve);
+  pg->resolve->pg = pg;
+  dns_resolve(pg->loop, pg->host, pgsql_resolve_cb, pg->resolve TSRMLS_CC);
+}
+
+
+/* Queues a query; it goes out right away if the connection is up. */
+static void pgsql_query_push(pgsql_t* pg, zval* this_ptr, pgsql_query_t* query) {
+  if (pg->tail) {
+    pg->tail->next = query;
+  } else {
+    pg->head = query;
+  }
+  pg->tail = query;
+
+  if (pg->unsent == NULL) {
+    pg->unsent = query;
+  }
+
+  if (pg->self == NULL) {
+    pg->self = this_ptr;
+    Z_ADDREF_P(pg->self);
+  }
+
+  if (pg->state == PGSQL_CLOSED) {
+    pgsql_connect(pg);
+  } else {
+    pgsql_flush(pg);
+  }
+}
+
+
+static pgsql_query_t* pgsql_query_new(pgsql_buf_t* msg, zval* callback) {
+  pgsql_query_t* query;
+
+  query = (pgsql_query_t*) ecalloc(1, sizeof *query);
+
+  MAKE_STD_ZVAL(query->msg);
+  ZVAL_STRINGL(query->msg, msg->base, msg->len, 0);
+  msg->base = NULL;
+
+  query->callback = callback;
+  Z_ADDREF_P(callback);
+
+  return query;
+}
+
+
+/* Text format, which the server parses according to the parameter's */
+/* inferred type; null is SQL NULL and booleans are "t" and "f". */
+static void pgsql_put_param(pgsql_buf_t* buf, zval* value) {
+  zval copy;
+
+  switch (Z_TYPE_P(value)) {
+    case IS_NULL:
+      pgsql_put_int32(buf, -1);
+      return;
+
+    case IS_BOOL:
+      pgsql_put_int32(buf, 1);
+      pgsql_buf_append(buf, Z_BVAL_P(value) ? "t" : "f", 1);
+      return;
+  }
+
+  copy = *value;
+  zval_copy_ctor(&copy);
+  convert_to_string(&copy);
+  pgsql_put_int32(buf, Z_STRLEN(copy));
+  pgsql_buf_append(buf, Z_STRVAL(copy), Z_STRLEN(copy));
+  zval_dtor(&copy);
+}
+
+
+static void pgsql_free(void* object TSRMLS_DC) {
+  pgsql_t* pg = (pgsql_t*) object;
+  pgsql_query_t* query;
+
+  while ((query = pg->head) != NULL) {
+    pg->head = query->next;
+    pgsql_query_free(query);
+  }
+
+  pg->tail = NULL;
+  pg->unsent = NULL;
+
+  /* Nobody is left to call back. */
+  pgsql_disconnect(pg, NULL);
+
+  pgsql_buf_free(&pg->in);
+  pgsql_buf_free(&pg->scram_first);
+
+  if (pg->host) {
+    efree(pg->host);
+    efree(pg->user);
+    efree(pg->password);
+    efree(pg->db);
+  }
+
+  zend_object_std_dtor(&pg->obj TSRMLS_CC);
+  efree(pg);
+}
+
+
+static zend_object_value pgsql_new(zend_class_entry* class_type TSRMLS_DC) {
+  zend_object_value instance;
+  pgsql_t* pg;
+
+  pg = (pgsql_t*) ecalloc(1, sizeof *pg);
+
+  zend_object_std_init(&pg->obj, class_type TSRMLS_CC);
+  init_properties(&pg->obj, class_type);
+
+  TSRMLS_SET(pg);
+
+  pg->loop = phode_loop(TSRMLS_C);
+  pg->state = PGSQL_CLOSED;
+
+  instance.handle = zend_objects_store_put((void*) pg,
+                                           (zend_objects_store_dtor_t) zend_objects_destroy_object,
+                                           pgsql_free,
+                                           NULL
+                                           TSRMLS_CC);
+  instance.handlers = zend_get_std_object_handlers();
+
+  return instance;
+}
+
+
+/* PgSQL($host, $user, $password, $db, $port). Nothing goes over the */
+/* wire until the first query. $host is an address or a host name, */
+/* which is looked up on the loop. */
+PHP_METHOD(PgSQL, __construct) {
+  pgsql_t* self;
+  char* host = "127.0.0.1";
+  int host_length;
+  char* user = "";
+  int user_length;
+  char* password = "";
+  int password_length;
+  char* db = "";
+  int db_length;
+  long port = 5432;
+
+  if (zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "|ssssl", &host, &host_length, &user, &user_length, &password, &password_length, &db, &db_length, &port) == FAILURE) {
+    return;
+  }
+
+  self = (pgsql_t*) zend_object_store_get_object(getThis() TSRMLS_CC);
+
+  if (self->host) {
+    THROW_ERROR("Already constructed");
+    RETURN_NULL();
+  }
+
+  self->host = estrdup(host);
+  self->user = estrdup(user);
+  self->password = estrdup(password);
+  self->db = estrdup(db);
+  self->port = port;
+}
+
+
+/* query($sql, $cb) runs $sql with the simple query protocol and calls */
+/* $cb($error, $rows, $info). $sql may hold several statements. */
+PHP_METHOD(PgSQL, query) {
+  pgsql_t* self;
+  pgsql_buf_t msg = { NULL, 0, 0 };
+  char* sql;
+  int sql_length;
+  zval* callback;
+  size_t start;
+
+  if (zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "sz", &sql, &sql_length, &callback) == FAILURE) {
+    return;
+  }
+
+  self = (pgsql_t*) zend_object_store_get_object(getThis() TSRMLS_CC);
+
+  if (self->closed || self->host == NULL) {
+    THROW_ERROR("Connection closed");
+    RETURN_NULL();
+  }
+
+  start = pgsql_msg_begin(&msg, 'Q');
+  pgsql_buf_append(&msg, sql, sql_length);
+  pgsql_buf_append(&msg, "", 1);
+  pgsql_msg_end(&msg, start);
+
+  pgsql_query_push(self, getThis(), pgsql_query_new(&msg, callback));
+
+  RETURN_TRUE;
+}
+
+
+/* execute($sql, array $params, $cb) runs one statement with $1, $2, ... */
+/* bound to $params, through the extended protocol: Parse, Bind, */
+/* Describe, Execute and Sync go out in one piece, and like query() */
+/* they don't wait for the queries before them to finish. */
+PHP_METHOD(PgSQL, execute) {
+  pgsql_t* self;
+  pgsql_buf_t msg = { NULL, 0, 0 };
+  HashPosition pos;
+  char* sql;
+  int sql_length;
+  zval* params;
+  zval* callback;
+  zval** entry;
+  size_t start;
+
+  if (zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "saz", &sql, &sql_length, &params, &callback) == FAILURE) {
+    return;
+  }
+
+  self = (pgsql_t*) zend_object_store_get_object(getThis() TSRMLS_CC);
+
+  if (self->closed || self->host == NULL) {
+    THROW_ERROR("Connection closed");
+    RETURN_NULL();
+  }
+
+  if (zend_hash_num_elements(Z_ARRVAL_P(params)) > 32767) {
+    THROW_ERROR("Too many parameters");
+    RETURN_NULL();
+  }
+
+  /* The unnamed statement and portal, with the parameter types left */
+  /* to the server */
+  start = pgsql_msg_begin(&msg, 'P');
+  pgsql_buf_append(&msg, "", 1);
+  pgsql_buf_append(&msg, sql, sql_length);
+  pgsql_buf_append(&msg, "", 1);
+  pgsql_put_int16(&msg, 0);
+  pgsql_msg_end(&msg, start);
+
+  start = pgsql_msg_begin(&msg, 'B');
+  pgsql_buf_append(&msg, "\0", 2);
+  pgsql_put_int16(&msg, 0);
+  pgsql_put_int16(&msg, (int16_t) zend_hash_num_elements(Z_ARRVAL_P(params)));
+
+  for (zend_hash_internal_pointer_reset_ex(Z_ARRVAL_P(params), &pos);
+       zend_hash_get_current_data_ex(Z_ARRVAL_P(params), (void**) &entry, &pos) == SUCCESS;
+       zend_hash_move_forward_ex(Z_ARRVAL_P(params), &pos)) {
+    pgsql_put_param(&msg, *entry);
+  }
+
+  /* Results in text format */
+  pgsql_put_int16(&msg, 0);
+  pgsql_msg_end(&msg, start);
+
+  start = pgsql_msg_begin(&msg, 'D');
+  pgsql_buf_append(&msg, "P", 2);
+  pgsql_msg_end(&msg, start);
+
+  start = pgsql_msg_begin(&msg, 'E');
+  pgsql_buf_append(&msg, "", 1);
+  pgsql_put_int32(&msg, 0);
+  pgsql_msg_end(&msg, start);
+
+  start = pgsql_msg_begin(&msg, 'S');
+  pgsql_msg_end(&msg, start);
+
+  pgsql_query_push(self, getThis(), pgsql_query_new(&msg, callback));
+
+  RETURN_TRUE;
+}
+
+
+/* Fails whatever is pending with "Connection closed". */
+PHP_METHOD(PgSQL, close) {
+  pgsql_t* self;
+  pgsql_buf_t msg = { NULL, 0, 0 };
+  size_t start;
+
+  self = (pgsql_t*) zend_object_store_get_object(getThis() TSRMLS_CC);
+
+  if (self->closed) {
+    RETURN_NULL();
+  }
+
+  self->closed = 1;
+
+  /* Say goodbye, so the server doesn't log an unexpected EOF. */
+  if (self->state == PGSQL_READY) {
+    start = pgsql_msg_begin(&msg, 'X');
+    pgsql_msg_end(&msg, start);
+    pgsql_send(self, &msg);
+  }
+
+  pgsql_disconnect(self, "Connection closed");
+  pgsql_release(self);
+
+  RETURN_NULL();
+}
+
+
+static zend_function_entry pgsql_methods[] = {
+  PHP_ME(PgSQL, __construct, NULL, ZEND_ACC_PUBLIC)
+  PHP_ME(PgSQL, query, NULL, ZEND_ACC_PUBLIC)
+  PHP_ME(PgSQL, execute, NULL, ZEND_ACC_PUBLIC)
+  PHP_ME(PgSQL, close, NULL, ZEND_ACC_PUBLIC)
+  { NULL }
+};
+
+
+void pgsql_init(TSRMLS_D) {
+  zend_class_entry ce;
+
+  INIT_CLASS_ENTRY(ce, "PgSQL", pgsql_methods);
+  ce.create_object = pgsql_new;
+  pgsql_ce = zend_register_internal_class(&ce TSRMLS_CC);
+}
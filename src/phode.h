@@ -0,0 +1,354 @@
+/*
+ * Copyright (c) 2011, Ben Noordhuis <info@bnoordhuis.nl>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef PHODE_H_
+#define PHODE_H_
+
+#include "php.h"
+#include "php_ini.h"
+#include "ext/standard/info.h"
+#include "Zend/zend_exceptions.h"
+
+#include "uv.h"
+
+/* The event loop's libev internals, fork(), fd passing and raw socket */
+/* options are used throughout; there is no Windows port. */
+#ifdef _WIN32
+# error "phode only builds on unix"
+#endif
+
+#include <assert.h>
+#include <stddef.h> /* offsetof */
+
+#define container_of(ptr, type, member) \
+  ((type *) ((char *) (ptr) - offsetof(type, member)))
+
+
+#ifdef __GNUC__
+# define MAYBE_UNUSED __attribute__ ((unused))
+#else
+# define MAYBE_UNUSED /* TODO */
+#endif
+
+
+/* Oh man! we're fucked. We have to do the same bullshit as php does! */
+#ifdef ZTS
+# define TSRMLS_SET(o)    (o)->TSRMLS_C = TSRMLS_C
+# define TSRMLS_GET(o)    TSRMLS_C = (o)->TSRMLS_C
+# define TSRMLS_D_GET(o)  TSRMLS_D = (o)->TSRMLS_C
+
+#else /* ZTS not defined */
+# define TSRMLS_SET(o)    /* empty */
+# define TSRMLS_GET(o)    /* empty */
+# define TSRMLS_D_GET(o)  /* empty */
+
+#endif /* ZTS not defined */
+
+
+#define WRITE_WRAP_SML_SIZE 4
+
+typedef struct {
+  uv_write_t req;
+  /* Strings and callbacks are pinned (refcount bumped) until the write */
+  /* completes. Both lists start out in the inline *_sml arrays. */
+  zval** strings;
+  int strings_count;
+  int strings_size;
+  zval** callbacks;
+  int callbacks_count;
+  int callbacks_size;
+  size_t bytes;
+  zval* strings_sml[WRITE_WRAP_SML_SIZE];
+  zval* callbacks_sml[WRITE_WRAP_SML_SIZE];
+  TSRMLS_D;
+} write_wrap_t;
+
+
+struct sendfile_wrap_s;
+
+
+/* Options of setOptions(), as a mask of the ones to apply */
+enum {
+  TCP_OPT_NODELAY = 1,
+  TCP_OPT_KEEPALIVE = 2,
+  TCP_OPT_KEEPALIVE_IDLE = 4,
+  TCP_OPT_SNDBUF = 8,
+  TCP_OPT_RCVBUF = 16,
+  TCP_OPT_BACKLOG = 32,
+  TCP_OPT_DEFER_ACCEPT = 64,
+  TCP_OPT_CORK = 128,
+  TCP_OPT_REUSEPORT = 256,
+  TCP_OPT_ALL = 511
+};
+
+
+typedef struct tcp_wrap_s {
+  /* obj must be the first member, because it must be safe to cast */
+  /* tcp_wrap* to zend_object */
+  zend_object obj;
+  /* Pipe objects are the same thing on a uv_pipe_t */
+  union {
+    uv_tcp_t handle;
+    uv_pipe_t pipe;
+  };
+  zval* close_cb;
+  zval* connection_cb;
+  zval* read_cb;
+  /* Keeps the object alive for as long as read_cb may be called */
+  zval* read_ref;
+  zval* drain_cb;
+  /* write() reports backpressure once the queue reaches high_water; */
+  /* drain_cb fires when it has dropped back to low_water. */
+  size_t high_water;
+  size_t low_water;
+  /* In auto-cork mode writes accumulate here until the loop is about */
+  /* to block, then go out as a single writev(). */
+  write_wrap_t* corked_write;
+  struct tcp_wrap_s* next_corked;
+  /* Hooks for protocols implemented in C on top of a TCP handle. When */
+  /* native_connection_cb is set, accepted clients are handed to it */
+  /* instead of to connection_cb; native is the protocol's own state. */
+  void (*native_connection_cb)(struct tcp_wrap_s* server, zval* client TSRMLS_DC);
+  void (*native_close_cb)(struct tcp_wrap_s* self TSRMLS_DC);
+  void* native;
+  /* One-shot hook for a writer in C that was told to back off; called */
+  /* once the queue has drained or the handle is closed (dead is set). */
+  void (*native_drain_cb)(struct tcp_wrap_s* self, void* data TSRMLS_DC);
+  void* native_drain_data;
+  /* File being pushed with sendfile(). Writes made meanwhile are held */
+  /* in corked_write so they can't overtake it. */
+  struct sendfile_wrap_s* sendfile;
+  /* setOptions(), -1 where the system default stands. They wait for */
+  /* the socket if there is none yet; a listener passes the ones that */
+  /* are per connection on to the clients it accepts. */
+  int backlog;
+  int opt_nodelay;
+  int opt_keepalive;
+  int opt_keepalive_idle;
+  int opt_sndbuf;
+  int opt_rcvbuf;
+  int opt_defer_accept;
+  int opt_cork;
+  int opt_reuseport;
+  unsigned dead:1;
+  unsigned listening:1;
+  unsigned auto_cork:1;
+  unsigned cork_queued:1;
+  unsigned need_drain:1;
+  unsigned end_pending:1;
+  unsigned close_pending:1;
+  TSRMLS_D;
+} tcp_wrap_t;
+
+
+/* Streams a file to a socket: opened and fstat()ed on the thread pool, */
+/* then sent with uv_fs_sendfile() without passing through php memory. */
+typedef struct sendfile_wrap_s {
+  uv_fs_t req;
+  /* Waits for room in a full socket buffer */
+  ev_io writable;
+  tcp_wrap_t* tcp;
+  /* Keep the socket and the owner of the native callbacks alive */
+  zval* socket;
+  zval* owner;
+  uv_file fd;
+  off_t offset;
+  size_t length;
+  uv_err_code error;
+  /* Called once the file is open, with st == NULL on failure */
+  void (*stat_cb)(struct sendfile_wrap_s* wrap, struct stat* st TSRMLS_DC);
+  /* Called when the transfer is over; status is 0 on success */
+  void (*done_cb)(struct sendfile_wrap_s* wrap, int status TSRMLS_DC);
+  void* data;
+  zval* callback;
+  /* Waiting for earlier writes to leave the libuv queue */
+  unsigned waiting:1;
+  /* A thread pool request is in flight */
+  unsigned busy:1;
+  TSRMLS_D;
+} sendfile_wrap_t;
+
+/* sendfile_open() off the main thread */
+#define SENDFILE_NOT_MAIN_THREAD -2
+
+
+typedef struct {
+  uv_connect_t req;
+  zval* callback;
+  /* Kept alive until the callback, through any host name lookup */
+  zval* socket;
+  long port;
+  TSRMLS_D;
+} connect_wrap_t;
+
+
+#define CALLBACK_MAX_ARGS   8
+
+#define DEFAULT_HIGH_WATER  (64 * 1024)
+#define DEFAULT_LOW_WATER   (16 * 1024)
+
+
+/* Receive buffers are recycled through a small per-loop free list so that */
+/* a busy connection doesn't hit the allocator for every chunk it reads. */
+#define READ_BUF_SIZE       (64 * 1024)
+#define READ_BUF_POOL_SIZE  16
+
+typedef struct {
+  uv_loop_t* loop;
+  char* read_bufs[READ_BUF_POOL_SIZE];
+  int read_bufs_count;
+  /* Handles with corked writes, flushed by cork_prepare. */
+  uv_prepare_t cork_prepare;
+  tcp_wrap_t* corked_head;
+  /* "Date: ...\r\n" for HTTP responses, valid until uv_now() passes */
+  /* http_date_expires. */
+  char http_date[64];
+  size_t http_date_len;
+  int64_t http_date_expires;
+  /* MySQL::queryCached() results */
+  struct mysql_cache_s* mysql_cache;
+  /* Resolved host names */
+  struct dns_cache_s* dns_cache;
+  TSRMLS_D;
+} loop_wrap_t;
+
+extern zend_class_entry* tcp_ce;
+extern zend_class_entry* pipe_ce;
+
+
+ZEND_BEGIN_MODULE_GLOBALS(phode)
+  /* This thread's loop; NULL means uv_default_loop(). The threads */
+  /* that uv_threads() starts have one of their own. */
+  uv_loop_t* loop;
+  /* 0 on the main thread */
+  long thread_index;
+ZEND_END_MODULE_GLOBALS(phode)
+
+ZEND_EXTERN_MODULE_GLOBALS(phode)
+
+#ifdef ZTS
+# define PHODE_G(v) TSRMG(phode_globals_id, zend_phode_globals*, v)
+#else
+# define PHODE_G(v) (phode_globals.v)
+#endif
+
+
+/* Shamelessly nicked from mongo-php-driver */
+#if ZEND_MODULE_API_NO >= 20100525
+#define init_properties(obj, class_type) \
+  object_properties_init((obj), class_type)
+#else
+#define init_properties(obj, class_type)                      \
+  do {                                                        \
+    zval *tmp;                                                \
+    zend_hash_copy((obj)->properties,                         \
+                   &class_type->default_properties,           \
+                   (copy_ctor_func_t) zval_add_ref,           \
+                   (void *) &tmp,                             \
+                   sizeof(zval*));                            \
+  }                                                           \
+  while (0)
+#endif
+
+
+#define HEALTHCHECK(handle)                                       \
+  if ((handle)->dead) {                                           \
+    zend_throw_exception(zend_exception_get_default(TSRMLS_C),    \
+                         "cannot call methods on a dead handle",  \
+                         0                                        \
+                         TSRMLS_CC);                              \
+    RETURN_NULL();                                                \
+  }
+
+#define THROW_ERROR(message)                                      \
+  zend_throw_exception(zend_exception_get_default(TSRMLS_C),      \
+                       message,                                   \
+                       0                                          \
+                       TSRMLS_CC);                                \
+
+
+/* What dns_resolve() finds */
+typedef struct {
+  int family;
+  union {
+    struct in_addr v4;
+    struct in6_addr v6;
+  };
+} dns_addr_t;
+
+/* An IPv4 or IPv6 address to connect to or listen on */
+typedef union {
+  struct sockaddr sa;
+  struct sockaddr_in in;
+  struct sockaddr_in6 in6;
+} tcp_addr_t;
+
+
+/* ext.c */
+uv_loop_t* phode_loop(TSRMLS_D);
+loop_wrap_t* loop_wrap_get(uv_loop_t* loop TSRMLS_DC);
+void read_buf_put(loop_wrap_t* loop, char* base);
+zend_object_value tcp_new(zend_class_entry *class_type TSRMLS_DC);
+zend_object_value pipe_new(zend_class_entry *class_type TSRMLS_DC);
+int call_callback(zval* callback, int argc, zval* argv[] TSRMLS_DC);
+write_wrap_t* tcp_write_begin(tcp_wrap_t* self TSRMLS_DC);
+int tcp_write_end(tcp_wrap_t* self, write_wrap_t* wrap TSRMLS_DC);
+void write_wrap_push_string(write_wrap_t* wrap, zval* value);
+void write_wrap_push_callback(write_wrap_t* wrap, zval* callback);
+void zval_list_push(zval*** list, int* count, int* size, zval** sml, zval* value);
+uv_buf_t tcp_alloc_cb(uv_handle_t* handle, size_t suggested_size);
+void tcp_close(tcp_wrap_t* self TSRMLS_DC);
+void tcp_end(tcp_wrap_t* self TSRMLS_DC);
+const char* tcp_listen(zval* socket, const char* host, long port, zval* error_cb TSRMLS_DC);
+const char* tcp_set_options(tcp_wrap_t* self, zval* options TSRMLS_DC);
+void tcp_addr_set(tcp_addr_t* addr, dns_addr_t* ip, int port);
+sendfile_wrap_t* sendfile_wrap_new(zval* socket TSRMLS_DC);
+void sendfile_wrap_free(sendfile_wrap_t* wrap);
+int sendfile_open(sendfile_wrap_t* wrap, const char* path);
+void sendfile_start(sendfile_wrap_t* wrap, off_t offset, size_t length);
+
+/* http.c */
+extern zend_class_entry* http_response_ce;
+void http_init(TSRMLS_D);
+int http_response_write_native(zval* response, zval* data, int last TSRMLS_DC);
+zval* http_response_socket(zval* response TSRMLS_DC);
+
+/* mysql.c */
+void mysql_init(TSRMLS_D);
+void mysql_cache_free(loop_wrap_t* loop);
+
+/* pgsql.c */
+void pgsql_init(TSRMLS_D);
+
+/* dns.c */
+typedef struct dns_cache_s dns_cache_t;
+
+/* addr is NULL on failure. With error NULL as well the lookup was */
+/* cancelled; free data, but don't call into php. */
+typedef void (*dns_cb)(void* data, dns_addr_t* addr, const char* error TSRMLS_DC);
+
+int dns_parse_ip(const char* host, dns_addr_t* addr);
+int dns_resolve_local(uv_loop_t* loop, const char* host, dns_addr_t* addr TSRMLS_DC);
+void dns_resolve(uv_loop_t* loop, const char* host, dns_cb cb, void* data TSRMLS_DC);
+void dns_cache_free(loop_wrap_t* loop);
+
+/* ipc.c */
+void ipc_init(TSRMLS_D);
+
+/* mysql_server.c */
+void mysql_server_init(TSRMLS_D);
+
+#endif /* PHODE_H_ */
@@ -10,15 +10,194 @@ $t->connect("127.0.0.1", 5432, function () use ($t) {
 });
 */
 
+/*
+$db = new MySQL("127.0.0.1", "root", "", "test");
+$db->query("SELECT 1 AS one", function ($error, $rows, $info) {
+  var_dump($error, $rows, $info);
+});
+
+$pool = new MySQLPool(4, "127.0.0.1", "root", "", "test", 3306,
+                      array("max_queue" => 64, "queue_timeout" => 1000));
+$pool->query("SELECT NOW() AS now", function ($error, $rows) {
+  var_dump($error, $rows);
+});
+
+// Dumps the table to whoever connects to port 8001.
+$dump = new TCP();
+$dump->listen(8001, function ($out) use ($pool) {
+  $pool->stream("SELECT * FROM big", function ($row, $stream) use ($out) {
+    if (!$out->write(implode("\t", $row) . "\n")) {
+      $stream->pause();
+      $out->onDrain(function () use ($stream) { $stream->resume(); });
+    }
+  }, function ($error) use ($out) {
+    $out->close(function () {});
+  });
+});
+
+// Dashboard numbers come from memory for up to 5 s, or until orders change.
+$pool->queryCached("SELECT COUNT(*) AS n FROM orders", 5000, array("orders"),
+                   function ($error, $rows) {
+  var_dump($error, $rows);
+});
+$pool->query("INSERT INTO orders (total) VALUES (10)", function ($error) use ($pool) {
+  $pool->invalidate("orders");
+});
+
+$pg = new PgSQL("127.0.0.1", "postgres", "secret", "test");
+$pg->query("SELECT 1 AS one, true AS yes", function ($error, $rows, $info) {
+  var_dump($error, $rows, $info);
+});
+// Goes out right behind the first one, without waiting for its result.
+$pg->execute("SELECT name FROM users WHERE id = $1", array(42), function ($error, $rows) {
+  var_dump($error, $rows);
+});
+
+// Caching proxy: reads are served from memory, the rest goes through.
+$cache = array();
+$proxy = new MySQLServer(function ($conn, $sql) use ($pool, &$cache) {
+  if (isset($cache[$sql])) {
+    return $conn->result($cache[$sql]);
+  }
+  $pool->query($sql, function ($error, $rows, $info) use ($conn, $sql, &$cache) {
+    if ($error !== null) {
+      $conn->error($error);
+    } else if (stripos($sql, "SELECT") === 0) {
+      $conn->result($cache[$sql] = $rows);
+    } else {
+      $conn->ok($info["affected_rows"], $info["insert_id"]);
+    }
+  });
+}, array("users" => array("app" => "secret")));
+$proxy->setOptions(array("nodelay" => true));
+$proxy->listen(3307, "localhost");
+
+// Rows go to the client as JSON without passing through PHP.
+$api = new HttpServer(function ($request, $response) use ($pool) {
+  $response->writeHead(200, array("Content-Type" => "application/json"));
+  $pool->queryJSON("SELECT id, name FROM users", $response, function ($error, $count) use ($response) {
+    if ($error !== null) {
+      $response->end("{\"error\":true}");
+    }
+  });
+});
+$api->listen(8081);
+
+// Four threads run this script, each with its own loop, and share port 8082.
+$thread = uv_threads(4);
+$hello = new HttpServer(function ($request, $response) use ($thread) {
+  $response->end("Hello from thread $thread!");
+});
+$hello->listen(8082);
+
+// Bind once, then fork a worker per core; the master restarts any that crash.
+$site = new HttpServer(function ($request, $response) {
+  $response->end("Hello from " . getmypid() . "!");
+});
+$site->setOptions(array("reuseport" => true));
+$site->listen(8083);
+$worker = uv_cluster(4);
+if ($worker < 0) {
+  exit; // the master, after its workers have gone
+}
+
+// A front process reads enough to route, then hands the socket over.
+$owner = new IPC();
+$owner->listen("/tmp/phode-worker-1.sock", function ($client, $head) {
+  $client->write("HTTP/1.0 200 OK\r\n\r\nSession owned by " . getmypid() . "\n",
+                 function () use ($client) { $client->close(); });
+});
+$front = new IPC();
+$front->connect("/tmp/phode-worker-1.sock");
+$router = new TCP();
+$router->listen(8084, function ($client) use ($front) {
+  $client->read(function ($data) use ($client, $front) {
+    $client->readStop();
+    $front->send($client, $data, function ($error) {
+      if ($error !== null) {
+        echo "handover failed: $error\n";
+      }
+    });
+  });
+});
+
+// nginx -> app over a unix socket, skipping the TCP/IP stack.
+$local = new Pipe();
+$local->listen("/tmp/phode.sock", function ($client) {
+  $client->read(function ($data) use ($client) {
+    if ($data === null) {
+      $client->close();
+      return;
+    }
+    $client->write($data);
+  });
+});
+$sidecar = new Pipe();
+$sidecar->connect("/tmp/sidecar.sock", function ($error) use ($sidecar) {
+  if ($error === null) {
+    $sidecar->write("ping\n");
+  }
+});
+
+// Names are resolved on the loop and cached for their TTL.
+$upstream = new TCP();
+$upstream->connect("api.example.com", 443, function ($error) use ($upstream) {
+  echo $error === null ? "connected\n" : "connect failed: $error\n";
+});
+$v6 = new TCP();
+$v6->listen(8085, "::1", function ($client) {
+  $client->write("Hello over IPv6!\n");
+});
+$internal = new TCP();
+$internal->listen(8087, "intranet.example.com", function ($client) {
+  $client->write("Hello, neighbour!\n");
+}, function ($error) {
+  echo "internal listener is down: $error\n";
+});
+
+// Socket tuning; a listener hands nodelay, keepalive and the buffer
+// sizes on to every client it accepts.
+$tuned = new TCP();
+$tuned->setOptions(array("backlog" => 4096, "defer_accept" => 5,
+                         "nodelay" => true, "keepalive" => true,
+                         "keepalive_idle" => 60));
+$tuned->listen(8086, function ($client) {
+  $client->setOptions(array("cork" => true));
+  $client->write("HTTP/1.1 200 OK\r\nContent-Length: 6\r\n\r\n");
+  $client->write("Hello\n");
+  $client->setOptions(array("cork" => false));
+});
+*/
+
 $server = new TCP();
 $server->listen(80, function ($client) {
   echo "connected!\n";
   var_dump($client);
+  $client->read(function ($data) use ($client) {
+    if ($data === null) {
+      echo "eof!\n";
+      $client->readStop();
+      return;
+    }
+    echo "read ", strlen($data), " bytes\n";
+  });
   $client->write("HTTP 1.0 500 OK\r\n\r\nHello world!", function() use ($client) {
     echo "written!\n";
   });
 });
 
+$http = new HttpServer(function ($request, $response) {
+  echo $request->getMethod(), " ", $request->getUrl(), "\n";
+  if ($request->getUrl() === "/test.php") {
+    $response->setHeader("Content-Type", "text/plain");
+    $response->sendFile(__FILE__);
+    return;
+  }
+  $response->writeHead(200, array("Content-Type" => "text/plain"));
+  $response->end("Hello world!");
+});
+$http->listen(8080);
+
 uv_run();
 
 ?>
\ No newline at end of file